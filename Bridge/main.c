@@ -1,14 +1,24 @@
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <poll.h>
 #include <errno.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <netinet/if_ether.h>
+#include <linux/if_packet.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include "netutil.h"
+#include "../common/uring.h"
+
+#define BATCH_DEFAULT 32 // recvmmsgで一度に受信する数（既定値）
+#define BATCH_MAX 1024
+#define FRAME_SIZE 2048
+#define DRAIN_BUDGET 256 // 1回のwakeupで1つのデバイスから受信するフレーム数の上限
 
 // 動作パラメータを保持するPARAM
 typedef struct
@@ -16,9 +26,12 @@ typedef struct
     char *Device1;
     char *Device2;
     int DebugOut;
+    int Batch;   // recvmmsgで一度に受信する数
+    int StatOut; // 終了時に統計情報を出力する
+    int Uring;   // io_uringで受信・送信する
 } PARAM;
 
-PARAM Param = {"eth0", "eth3", 0};
+PARAM Param = {"eth0", "eth3", 0, BATCH_DEFAULT, 0, 0};
 
 // ２つのネットワークインターフェイスのソケットディスクリプタを保持する
 typedef struct
@@ -29,14 +42,31 @@ typedef struct
 // Device = [DEVICE[0],DEVICE[1]];
 DEVICE Device[2];
 
+URING *Uring; // io_uringを使う場合（使わない場合NULL）
+
+// recvmmsgで受信したフレームをそのままsendmmsgで反対側へ送る
+struct
+{
+    struct mmsghdr msg[BATCH_MAX];
+    struct iovec iov[BATCH_MAX];
+    struct sockaddr_ll from[BATCH_MAX];
+    struct mmsghdr out[BATCH_MAX]; // 転送するフレームだけを並べる
+    struct iovec outIov[BATCH_MAX];
+    __u_char buf[BATCH_MAX][FRAME_SIZE];
+    unsigned long packets; // 受信したフレーム数
+    unsigned long calls;   // recvmmsgを呼んだ回数
+    unsigned long wakeups; // epoll_waitから戻った回数
+} Batch;
+
 // 終了シグナルの状態用グローバル変数
 int EndFlag = 0;
+int EndFd = -1; // 終了を知らせるeventfd（シグナルハンドラから書き、epollで待つ）
 
 void ParseCommandLine(int argc, char *argv[], PARAM *param)
 {
     int opt;
     // getoptを使用してコマンドライン引数を解析する
-    while ((opt = getopt(argc, argv, "d")) != -1)
+    while ((opt = getopt(argc, argv, "dsB:U")) != -1)
     {
         switch (opt)
         {
@@ -44,27 +74,37 @@ void ParseCommandLine(int argc, char *argv[], PARAM *param)
             //-dオプションが指定された場合、 debugOutを有効にする
             param->DebugOut = 1;
             break;
+        case 's':
+            // 終了時に受信の統計を出力する
+            param->StatOut = 1;
+            break;
+        case 'B':
+            // recvmmsgで一度に受信する数
+            param->Batch = atoi(optarg);
+            if (param->Batch < 1 || param->Batch > BATCH_MAX)
+            {
+                fprintf(stderr, "batch must be 1..%d\n", BATCH_MAX);
+                _exit(1);
+            }
+            break;
+        case 'U':
+            // io_uringのmultishot受信とまとめた送信を使う（使えなければepoll）
+            param->Uring = 1;
+            break;
         default:
-            fprintf(stderr, "Usage: %s [-d] [device1] [device2]\n", argv[0]);
+            fprintf(stderr, "Usage: %s [-d] [-s] [-B batch] [-U] [device1] [device2]\n", argv[0]);
             break;
         }
     }
 
-    if (argc > 3)
-    {
-        param->Device1 = argv[2];
-        param->Device2 = argv[3];
-    }
-    else if (argc < 3)
+    // オプションの後ろの2つをデバイスとする
+    if (argc - optind < 2)
     {
         fprintf(stderr, "デバイスを２つ渡してください\n");
         _exit(1);
     }
-    else
-    {
-        param->Device1 = argv[1];
-        param->Device2 = argv[2];
-    }
+    param->Device1 = argv[optind];
+    param->Device2 = argv[optind + 1];
 }
 
 int DebugPrintf(char *fmt, ...)
@@ -128,53 +168,200 @@ int AnalyzePacket(int deviceNo, __u_char *data, int size)
 }
 
 // ブリッジの処理、受信したインターフェイスから違うインターフェイスに書き出す　
+// 1つのデバイスにたまっているフレームを最大Param.Batch個受信し、反対側へまとめて書き出す
+// 受信した数を返す（受信できなければ0、エラーなら-1）
+int BridgeBatch(int deviceNo)
+{
+    int i, n, recv, out, sent;
+
+    for (i = 0; i < Param.Batch; i++)
+    {
+        Batch.msg[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_ll);
+    }
+    if ((recv = recvmmsg(Device[deviceNo].soc, Batch.msg, Param.Batch, MSG_DONTWAIT, NULL)) <= 0)
+    {
+        if (recv < 0 && errno != EAGAIN && errno != EINTR)
+        {
+            perror("recvmmsg");
+        }
+        return (recv < 0 && errno == EAGAIN ? 0 : recv);
+    }
+    Batch.calls++;
+    Batch.packets += recv;
+
+    out = 0;
+    for (i = 0; i < recv; i++)
+    {
+        // 自分が書き出したフレームは転送しない
+        if (Batch.from[i].sll_pkttype == PACKET_OUTGOING)
+        {
+            continue;
+        }
+        if (AnalyzePacket(deviceNo, Batch.buf[i], Batch.msg[i].msg_len) != -1)
+        {
+            Batch.outIov[out].iov_base = Batch.buf[i];
+            Batch.outIov[out].iov_len = Batch.msg[i].msg_len;
+            out++;
+        }
+    }
+
+    for (sent = 0; sent < out;)
+    {
+        if ((n = sendmmsg(Device[(!deviceNo)].soc, &Batch.out[sent], out - sent, 0)) <= 0)
+        {
+            perror("sendmmsg");
+            // 送れなかったフレームを飛ばして続ける
+            sent++;
+            continue;
+        }
+        sent += n;
+    }
+
+    return (recv);
+}
+
+// 1つのデバイスの受信キューを読み切る
+// edge-triggeredなので空にするまで読まないと次の通知が来ない（recvmmsgが一杯にならなければ空になっている）
+// 反対側を待たせないよう DRAIN_BUDGET 個で打ち切り、残っていれば1を返す
+int BridgeDrain(int deviceNo)
+{
+    int count, n;
+
+    for (count = 0; count < DRAIN_BUDGET; count += n)
+    {
+        if ((n = BridgeBatch(deviceNo)) < 0)
+        {
+            // EINTRなら残っているかもしれない
+            return (errno == EINTR);
+        }
+        if (n < Param.Batch)
+        {
+            return (0);
+        }
+    }
+
+    return (1);
+}
+
+// 2つのソケットをedge-triggeredで、終了用のEndFdをlevel-triggeredでepollに登録して待つ
+// 終了はEndFdで起こされるので、タイムアウトで見に行く必要はない
 int Bridge()
 {
-    struct pollfd targets[2];
-    int nready, i, size;
-    __u_char buf[2048];
+    struct epoll_event ev, events[3];
+    int epfd, nready, e, i, more[2], ready[2];
 
-    targets[0].fd = Device[0].soc;
-    targets[0].events = POLLIN | POLLERR;
-    targets[1].fd = Device[1].soc;
-    targets[1].events = POLLIN | POLLERR;
+    for (i = 0; i < BATCH_MAX; i++)
+    {
+        Batch.iov[i].iov_base = Batch.buf[i];
+        Batch.iov[i].iov_len = FRAME_SIZE;
+        Batch.msg[i].msg_hdr.msg_iov = &Batch.iov[i];
+        Batch.msg[i].msg_hdr.msg_iovlen = 1;
+        Batch.msg[i].msg_hdr.msg_name = &Batch.from[i];
+        Batch.out[i].msg_hdr.msg_iov = &Batch.outIov[i];
+        Batch.out[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    if ((epfd = epoll_create1(0)) == -1)
+    {
+        perror("epoll_create1");
+        return (-1);
+    }
+    for (i = 0; i < 2; i++)
+    {
+        ev.events = EPOLLIN | EPOLLERR | EPOLLET;
+        ev.data.u32 = i;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, Device[i].soc, &ev) == -1)
+        {
+            perror("epoll_ctl");
+            close(epfd);
+            return (-1);
+        }
+    }
+    ev.events = EPOLLIN;
+    ev.data.u32 = 2;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, EndFd, &ev);
 
+    more[0] = more[1] = 0;
     while (EndFlag == 0)
     {
-        switch (nready = poll(targets, 2, 100))
+        // 読み残しがあれば待たずに続きを読む
+        if ((nready = epoll_wait(epfd, events, 3, (more[0] || more[1]) ? 0 : -1)) == -1)
         {
-        case -1:
             if (errno != EINTR)
             {
-                perror("poll");
+                perror("epoll_wait");
             }
-            break;
-        case 0:
-            break;
-        default:
-            for (i = 0; i < 2; i++)
+            nready = 0;
+        }
+        Batch.wakeups++;
+        ready[0] = more[0];
+        ready[1] = more[1];
+        for (e = 0; e < nready; e++)
+        {
+            if (events[e].data.u32 < 2)
             {
-                if (targets[i].revents & (POLLIN | POLLERR))
-                {
-                    if ((size = read(Device[i].soc, buf, sizeof(buf))) <= 0)
-                    {
-                        perror("read");
-                    }
-                    else
-                    {
-                        if (AnalyzePacket(i, buf, size) != -1)
-                        {
-                            if ((size = write(Device[(!i)].soc, buf, size)) <= 0)
-                            {
-                                perror("write");
-                            }
-                        }
-                    }
-                }
+                ready[events[e].data.u32] = 1;
             }
-            break;
+        }
+        for (i = 0; i < 2; i++)
+        {
+            more[i] = ready[i] ? BridgeDrain(i) : 0;
+        }
+    }
+    close(epfd);
+
+    return (0);
+}
+
+// io_uringの完了ごとに呼ばれる（tagはデバイスの番号）
+void BridgeUringEvent(void *arg, int type, int tag, __u_char *data, int res)
+{
+    switch (type)
+    {
+    case URING_RECV:
+        Batch.packets++;
+        if (AnalyzePacket(tag, data, res) != -1)
+        {
+            UringSend(Uring, Device[(!tag)].soc, data, res, !tag);
+        }
+        break;
+    case URING_SEND:
+        if (res < 0)
+        {
+            DebugPrintf("send:%s\n", strerror(-res));
+        }
+        break;
+    }
+}
+
+// io_uringを使うブリッジの処理
+// 2つのソケットのmultishot受信とEndFdのpollを登録しておき、io_uring_enter 1回で
+// 前回までに積んだ送信を渡すのと、次の完了を待つのを同時に行う
+int BridgeUring()
+{
+    int i, ignore;
+
+    for (i = 0; i < 2; i++)
+    {
+        // 自分が書き出したフレームを受信バッファに入れないようにする
+        ignore = 1;
+        setsockopt(Device[i].soc, SOL_PACKET, PACKET_IGNORE_OUTGOING, &ignore, sizeof(ignore));
+        if (UringRecv(Uring, Device[i].soc, i) == -1)
+        {
+            return (-1);
+        }
+    }
+    UringPoll(Uring, EndFd, 2);
+
+    while (EndFlag == 0)
+    {
+        UringWait(Uring, 1);
+        if (UringRun(Uring, BridgeUringEvent, NULL) > 0)
+        {
+            Batch.wakeups++;
         }
     }
+    UringWait(Uring, 0);
 
     return (0);
 }
@@ -199,7 +386,10 @@ int DisableIpForward()
 // bridgeのループを抜ける
 void EndSignal(int sig)
 {
+    u_int64_t one = 1;
+
     EndFlag = 1;
+    write(EndFd, &one, sizeof(one));
 }
 
 int main(int argc, char *argv[], char *envp[])
@@ -229,6 +419,11 @@ int main(int argc, char *argv[], char *envp[])
 
     DisableIpForward();
 
+    if ((EndFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+    {
+        perror("eventfd");
+        return (-1);
+    }
     signal(SIGINT, EndSignal);
     signal(SIGTERM, EndSignal);
     signal(SIGQUIT, EndSignal);
@@ -237,12 +432,40 @@ int main(int argc, char *argv[], char *envp[])
     signal(SIGTTIN, SIG_IGN);
     signal(SIGTTOU, SIG_IGN);
 
+    if (Param.Uring && (Uring = UringOpen(URING_ENTRIES, URING_RX_BUF_NUM, URING_TX_BUF_NUM, URING_BUF_SIZE)) == NULL)
+    {
+        DebugPrintf("io_uring not available, use epoll\n");
+    }
+
     DebugPrintf("bridge start\n");
-    Bridge();
+    if (Uring != NULL)
+    {
+        BridgeUring();
+    }
+    else
+    {
+        Bridge();
+    }
     DebugPrintf("bridge end\n");
 
+    if (Param.StatOut && Uring != NULL)
+    {
+        fprintf(stderr, "rx:io_uring %lu packets, %.2f packets/wakeup\n",
+                Batch.packets, Batch.wakeups ? (double)Batch.packets / Batch.wakeups : 0.0);
+        UringStat(Uring, "bridge", stderr);
+    }
+    else if (Param.StatOut)
+    {
+        fprintf(stderr, "rx:%lu packets, batch %d, %lu recvmmsg, %.2f packets/recvmmsg (fill %.1f%%), %.2f packets/wakeup\n",
+                Batch.packets, Param.Batch, Batch.calls, Batch.calls ? (double)Batch.packets / Batch.calls : 0.0,
+                Batch.calls ? 100.0 * Batch.packets / Batch.calls / Param.Batch : 0.0,
+                Batch.wakeups ? (double)Batch.packets / Batch.wakeups : 0.0);
+    }
+
     close(Device[0].soc);
     close(Device[1].soc);
+    close(EndFd);
+    UringClose(Uring);
 
     return (0);
 }
\ No newline at end of file
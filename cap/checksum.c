@@ -14,6 +14,7 @@
 #include	<netinet/icmp6.h>
 #include	<netinet/tcp.h>
 #include	<netinet/udp.h>
+#include	"../common/cksum.h"
 
 struct pseudo_ip{
         struct in_addr  ip_src;
@@ -32,85 +33,6 @@ struct pseudo_ip6_hdr{
         unsigned char   nxt;
 };
 
-u_int16_t checksum(__u_char *data,int len)
-{
-register u_int32_t       sum;
-register u_int16_t       *ptr;
-register int     c;
-
-        sum=0;
-        ptr=(u_int16_t *)data;
-
-        for(c=len;c>1;c-=2){
-                sum+=(*ptr);
-                if(sum&0x80000000){
-                        sum=(sum&0xFFFF)+(sum>>16);
-                }
-                ptr++;
-        }
-        if(c==1){
-                u_int16_t       val;
-                val=0;
-                memcpy(&val,ptr,sizeof(u_int8_t));
-                sum+=val;
-        }
-
-        while(sum>>16){
-                sum=(sum&0xFFFF)+(sum>>16);
-        }
-
-	return(~sum);
-}
-
-u_int16_t checksum2(__u_char *data1,int len1,__u_char *data2,int len2)
-{
-register u_int32_t       sum;
-register u_int16_t       *ptr;
-register int     c;
-
-        sum=0;
-        ptr=(u_int16_t *)data1;
-        for(c=len1;c>1;c-=2){
-                sum+=(*ptr);
-                if(sum&0x80000000){
-                        sum=(sum&0xFFFF)+(sum>>16);
-                }
-                ptr++;
-        }
-        if(c==1){
-                u_int16_t       val;
-                val=((*ptr)<<8)+(*data2);
-                sum+=val;
-                if(sum&0x80000000){
-                        sum=(sum&0xFFFF)+(sum>>16);
-                }
-                ptr=(u_int16_t *)(data2+1);
-                len2--;
-        }
-        else{
-                ptr=(u_int16_t *)data2;
-        }
-        for(c=len2;c>1;c-=2){
-                sum+=(*ptr);
-                if(sum&0x80000000){
-                        sum=(sum&0xFFFF)+(sum>>16);
-                }
-                ptr++;
-        }
-        if(c==1){
-                u_int16_t       val;
-                val=0;
-                memcpy(&val,ptr,sizeof(u_int8_t));
-                sum+=val;
-        }
-
-        while(sum>>16){
-                sum=(sum&0xFFFF)+(sum>>16);
-        }
-
-	return(~sum);
-}
-
 int checkIPchecksum(struct iphdr *iphdr,__u_char *option,int optionLen)
 {
 unsigned short	sum;
@@ -0,0 +1,211 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include "cksum.h"
+
+// このファイルではインターネットチェックサムの計算を扱う
+// 1の補数和は 2^16 ≡ 1 (mod 0xFFFF) なので、32bitずつ64bitの変数に足してから最後に16bitへたたみ込んでも同じ値になる
+// 値はメモリ上の16bit単位（ネイティブのバイトオーダー）で足すので、結果はそのままヘッダに書ける
+
+static u_int64_t CksumScalar(const unsigned char *data, int len)
+{
+    u_int64_t sum;
+    u_int32_t v;
+
+    sum = 0;
+    for (; len >= 4; len -= 4, data += 4)
+    {
+        memcpy(&v, data, 4);
+        sum += v;
+    }
+    if (len >= 2)
+    {
+        u_int16_t w;
+
+        memcpy(&w, data, 2);
+        sum += w;
+        data += 2;
+        len -= 2;
+    }
+    if (len == 1)
+    {
+        // 奇数長の最後の1バイトは後ろに0を補った16bitとして足す
+        u_int16_t w;
+
+        w = 0;
+        memcpy(&w, data, 1);
+        sum += w;
+    }
+
+    return (sum);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// 16バイトずつ読み、32bit×4を64bit×2の2組に広げて足す
+__attribute__((target("sse2"))) static u_int64_t CksumSse2(const unsigned char *data, int len)
+{
+    __m128i zero, v, acc0, acc1;
+    u_int64_t lane[2];
+
+    zero = _mm_setzero_si128();
+    acc0 = acc1 = zero;
+    for (; len >= 16; len -= 16, data += 16)
+    {
+        v = _mm_loadu_si128((const __m128i *)data);
+        acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(v, zero));
+        acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(v, zero));
+    }
+    _mm_storeu_si128((__m128i *)lane, _mm_add_epi64(acc0, acc1));
+
+    return (lane[0] + lane[1] + CksumScalar(data, len));
+}
+
+// 32バイトずつ2本並べて読む（ジャンボフレームのペイロードで効く）
+__attribute__((target("avx2"))) static u_int64_t CksumAvx2(const unsigned char *data, int len)
+{
+    __m256i zero, v0, v1, acc0, acc1, acc2, acc3;
+    u_int64_t lane[4];
+
+    zero = _mm256_setzero_si256();
+    acc0 = acc1 = acc2 = acc3 = zero;
+    for (; len >= 64; len -= 64, data += 64)
+    {
+        v0 = _mm256_loadu_si256((const __m256i *)data);
+        v1 = _mm256_loadu_si256((const __m256i *)(data + 32));
+        acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(v0, zero));
+        acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(v0, zero));
+        acc2 = _mm256_add_epi64(acc2, _mm256_unpacklo_epi32(v1, zero));
+        acc3 = _mm256_add_epi64(acc3, _mm256_unpackhi_epi32(v1, zero));
+    }
+    acc0 = _mm256_add_epi64(_mm256_add_epi64(acc0, acc1), _mm256_add_epi64(acc2, acc3));
+    _mm256_storeu_si256((__m256i *)lane, acc0);
+
+    return (lane[0] + lane[1] + lane[2] + lane[3] + CksumSse2(data, len));
+}
+
+#endif
+
+// 短いヘッダはベクトル化しても速くならないのでスカラーで足す
+#define CKSUM_SIMD_MIN 64
+
+static u_int64_t (*CksumLong)(const unsigned char *data, int len) = NULL;
+static const char *CksumName = "scalar";
+
+static void CksumSelect()
+{
+    CksumLong = CksumScalar;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        CksumLong = CksumAvx2;
+        CksumName = "avx2";
+    }
+    else if (__builtin_cpu_supports("sse2"))
+    {
+        CksumLong = CksumSse2;
+        CksumName = "sse2";
+    }
+#endif
+}
+
+// 使っている実装の名前
+const char *CksumImpl()
+{
+    if (CksumLong == NULL)
+    {
+        CksumSelect();
+    }
+
+    return (CksumName);
+}
+
+static u_int32_t CksumFold32(u_int64_t sum)
+{
+    sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+    sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+
+    return ((u_int32_t)sum);
+}
+
+// dataの1の補数和を sum に足して返す（まだ反転していない途中の値）
+// dataは偶数バイト目から始まるものとして足す
+u_int32_t CksumPartial(const unsigned char *data, int len, u_int32_t sum)
+{
+    u_int64_t s;
+
+    if (len < CKSUM_SIMD_MIN)
+    {
+        s = CksumScalar(data, len);
+    }
+    else
+    {
+        if (CksumLong == NULL)
+        {
+            CksumSelect();
+        }
+        s = CksumLong(data, len);
+    }
+
+    return (CksumFold32(s + sum));
+}
+
+// 途中の値を16bitにたたみ込んで反転する
+u_int16_t CksumFold(u_int32_t sum)
+{
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+
+    return ((u_int16_t)~sum);
+}
+
+// 複数の領域を続けた1つのデータとして計算する
+// 奇数バイト目から始まる領域は16bitの上下が入れ替わるので、その領域の和をバイトスワップして足す
+u_int16_t CksumV(const struct iovec *iov, int iovcnt)
+{
+    u_int32_t sum, part;
+    int i, odd;
+
+    sum = 0;
+    odd = 0;
+    for (i = 0; i < iovcnt; i++)
+    {
+        if (iov[i].iov_len == 0)
+        {
+            continue;
+        }
+        part = CksumPartial((const unsigned char *)iov[i].iov_base, iov[i].iov_len, 0);
+        part = (part & 0xFFFF) + (part >> 16);
+        part = (part & 0xFFFF) + (part >> 16);
+        if (odd)
+        {
+            part = ((part & 0xFF) << 8) | (part >> 8);
+        }
+        sum += part;
+        odd ^= iov[i].iov_len & 1;
+    }
+
+    return (CksumFold(sum));
+}
+
+u_int16_t checksum(unsigned char *data, int len)
+{
+    return (CksumFold(CksumPartial(data, len, 0)));
+}
+
+u_int16_t checksum2(unsigned char *data1, int len1, unsigned char *data2, int len2)
+{
+    struct iovec iov[2];
+
+    iov[0].iov_base = data1;
+    iov[0].iov_len = len1;
+    iov[1].iov_base = data2;
+    iov[1].iov_len = len2;
+
+    return (CksumV(iov, 2));
+}
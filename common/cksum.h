@@ -0,0 +1,11 @@
+//インターネットチェックサム（1の補数和）の共通実装（router、capから使う）
+//CPUに合わせてAVX2/SSE2/スカラーの実装を起動時に選ぶ
+
+struct iovec;
+
+u_int32_t CksumPartial(const unsigned char *data,int len,u_int32_t sum);
+u_int16_t CksumFold(u_int32_t sum);
+u_int16_t CksumV(const struct iovec *iov,int iovcnt);
+const char *CksumImpl();
+u_int16_t checksum(unsigned char *data,int len);
+u_int16_t checksum2(unsigned char *data1,int len1,unsigned char *data2,int len2);
@@ -0,0 +1,262 @@
+#include <stdlib.h>
+#include <time.h>
+#include "cksum.c"
+
+// このファイルではチェックサムの各実装をスカラーの実装と突き合わせ、長さごとの速さを測る
+// 実装の関数はstaticなので、cksum.cをそのまま取り込んで呼ぶ
+// make -C common test で作って動かす（食い違いがあれば1で終わる）
+// 引数: [-q]（速さを測らない） [seed]
+
+#define TEST_ROUND 200000 //突き合わせる回数
+#define TEST_LEN_MAX 9000 //ジャンボフレームの大きさまで
+#define TEST_OFFSET_MAX 64 //読み始めの位置をずらす範囲（アラインしていない読み込みを試す）
+#define BENCH_BYTES (1ULL << 30) //1つの長さで計算するバイト数
+
+typedef struct
+{
+    const char *name;
+    u_int64_t (*func)(const unsigned char *data, int len);
+    int ok; //このCPUで使えるか
+} KERNEL;
+
+static KERNEL Kernel[] = {
+    {"scalar", CksumScalar, 1},
+#if defined(__x86_64__) || defined(__i386__)
+    {"sse2", CksumSse2, 0},
+    {"avx2", CksumAvx2, 0},
+#endif
+};
+#define KERNEL_NUM (int)(sizeof(Kernel) / sizeof(Kernel[0]))
+
+// 16bitずつ足すだけの素直な実装（比べる基準）
+static u_int16_t CksumRef(const unsigned char *data, int len)
+{
+    u_int32_t sum;
+    u_int16_t w;
+    int i;
+
+    sum = 0;
+    for (i = 0; i + 1 < len; i += 2)
+    {
+        memcpy(&w, data + i, 2);
+        sum += w;
+    }
+    if (i < len)
+    {
+        w = 0;
+        memcpy(&w, data + i, 1);
+        sum += w;
+    }
+    while (sum >> 16)
+    {
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    }
+
+    return ((u_int16_t)~sum);
+}
+
+// 長さは短いヘッダの範囲を多めに選ぶ
+static int TestLen()
+{
+    switch (rand() % 4)
+    {
+    case 0:
+        return (rand() % 64);
+    case 1:
+        return (rand() % 256);
+    default:
+        return (rand() % (TEST_LEN_MAX + 1));
+    }
+}
+
+static int TestKernels(unsigned char *buf)
+{
+    unsigned char *data;
+    int r, k, len, off, err;
+    u_int16_t ref, got;
+
+    err = 0;
+    for (r = 0; r < TEST_ROUND; r++)
+    {
+        len = TestLen();
+        off = rand() % TEST_OFFSET_MAX;
+        data = buf + off;
+        ref = CksumRef(data, len);
+        for (k = 0; k < KERNEL_NUM; k++)
+        {
+            if (!Kernel[k].ok)
+            {
+                continue;
+            }
+            got = CksumFold(CksumFold32(Kernel[k].func(data, len)));
+            if (got != ref)
+            {
+                fprintf(stderr, "NG:%s len=%d off=%d %04x!=%04x\n", Kernel[k].name, len, off, got, ref);
+                err++;
+            }
+        }
+        if ((got = checksum(data, len)) != ref)
+        {
+            fprintf(stderr, "NG:checksum len=%d off=%d %04x!=%04x\n", len, off, got, ref);
+            err++;
+        }
+    }
+    printf("kernels:%d rounds, %d errors\n", TEST_ROUND, err);
+
+    return (err);
+}
+
+// 1つのデータを奇数の位置も含めて2つか3つに分けても同じ値になるか
+static int TestSplit(unsigned char *buf)
+{
+    struct iovec iov[3];
+    unsigned char *data;
+    int r, len, a, b, err;
+    u_int16_t ref, got;
+
+    err = 0;
+    for (r = 0; r < TEST_ROUND; r++)
+    {
+        len = TestLen();
+        data = buf + rand() % TEST_OFFSET_MAX;
+        ref = CksumRef(data, len);
+        a = len ? rand() % (len + 1) : 0;
+        b = a + (len - a ? rand() % (len - a + 1) : 0);
+
+        if ((got = checksum2(data, a, data + a, len - a)) != ref)
+        {
+            fprintf(stderr, "NG:checksum2 len=%d split=%d %04x!=%04x\n", len, a, got, ref);
+            err++;
+        }
+        iov[0].iov_base = data;
+        iov[0].iov_len = a;
+        iov[1].iov_base = data + a;
+        iov[1].iov_len = b - a;
+        iov[2].iov_base = data + b;
+        iov[2].iov_len = len - b;
+        if ((got = CksumV(iov, 3)) != ref)
+        {
+            fprintf(stderr, "NG:CksumV len=%d split=%d,%d %04x!=%04x\n", len, a, b, got, ref);
+            err++;
+        }
+    }
+    printf("split:%d rounds, %d errors\n", TEST_ROUND, err);
+
+    return (err);
+}
+
+static double Now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+// 長さごとに各実装の速さ（GB/s）を表示する
+static void Bench(unsigned char *buf)
+{
+    static int size[] = {20, 40, 64, 128, 256, 576, 1500, 4096, 9000};
+    volatile u_int64_t sink;
+    u_int64_t s, n, i;
+    double t;
+    int j, k;
+
+    printf("%6s", "bytes");
+    for (k = 0; k < KERNEL_NUM; k++)
+    {
+        if (Kernel[k].ok)
+        {
+            printf(" %9s", Kernel[k].name);
+        }
+    }
+    printf(" %9s\n", "checksum");
+
+    for (j = 0; j < sizeof(size) / sizeof(size[0]); j++)
+    {
+        n = BENCH_BYTES / size[j];
+        printf("%6d", size[j]);
+        for (k = 0; k <= KERNEL_NUM; k++)
+        {
+            if (k < KERNEL_NUM && !Kernel[k].ok)
+            {
+                continue;
+            }
+            s = 0;
+            t = Now();
+            for (i = 0; i < n; i++)
+            {
+                // 毎回1バイト書き換えて、計算を外に出されないようにする
+                buf[0] = i;
+                s += (k < KERNEL_NUM) ? Kernel[k].func(buf, size[j]) : checksum(buf, size[j]);
+            }
+            t = Now() - t;
+            sink = s;
+            printf(" %9.2f", (double)n * size[j] / t / 1e9);
+        }
+        printf("\n");
+    }
+    (void)sink;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned char *buf;
+    unsigned int seed;
+    int i, err, quiet;
+
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    Kernel[1].ok = __builtin_cpu_supports("sse2");
+    Kernel[2].ok = __builtin_cpu_supports("avx2");
+#endif
+    if ((buf = malloc(TEST_LEN_MAX + TEST_OFFSET_MAX)) == NULL)
+    {
+        perror("malloc");
+        return (1);
+    }
+    quiet = 0;
+    seed = time(NULL);
+    for (i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-q") == 0)
+        {
+            quiet = 1;
+        }
+        else
+        {
+            seed = atoi(argv[i]);
+        }
+    }
+    printf("seed:%u\n", seed);
+    srand(seed);
+    for (i = 0; i < TEST_LEN_MAX + TEST_OFFSET_MAX; i++)
+    {
+        buf[i] = rand();
+    }
+
+    printf("impl:%s\n", CksumImpl());
+    err = TestKernels(buf);
+    // 和が桁あふれしやすいよう、全部0xFFでも確かめる
+    memset(buf, 0xFF, TEST_LEN_MAX + TEST_OFFSET_MAX);
+    err += TestKernels(buf);
+    for (i = 0; i < TEST_LEN_MAX + TEST_OFFSET_MAX; i++)
+    {
+        buf[i] = rand();
+    }
+    err += TestSplit(buf);
+    if (err != 0)
+    {
+        printf("NG\n");
+        return (1);
+    }
+    printf("OK\n");
+
+    if (!quiet)
+    {
+        Bench(buf);
+    }
+    free(buf);
+
+    return (0);
+}
@@ -0,0 +1,401 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "uring.h"
+
+extern int DebugPrintf(char *fmt, ...);
+extern int DebugPerror(char *msg);
+
+// このファイルではio_uringでのパケットの受信・送信を扱う
+// 受信はソケットごとにmultishotのrecvを1つ登録し、カーネルが登録済みのバッファ（provided buffer ring）に次々と書き込む
+// 送信はフレームを送信用バッファにコピーしてSQEに積み、イベントループのio_uring_enter 1回でまとめて渡す
+// したがってwakeupごとのシステムコールは、受信と送信の数によらずio_uring_enterの1回になる
+
+#define URING_BGID 0 //provided buffer ringのグループ番号
+
+// user_dataの上位8bitに種類、次の24bitにfd（受信）か送信バッファの番号（送信）、下位32bitにtagを入れる
+#define URING_UD(type, x, tag) (((u_int64_t)(type) << 56) | ((u_int64_t)((x) & 0xFFFFFF) << 32) | (u_int32_t)(tag))
+#define URING_UD_TYPE(ud) ((int)((ud) >> 56))
+#define URING_UD_X(ud) ((int)(((ud) >> 32) & 0xFFFFFF))
+#define URING_UD_TAG(ud) ((int)(u_int32_t)(ud))
+
+struct _uring_
+{
+    int fd;
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+    struct io_uring_sqe *sqes;
+    unsigned sqEntries;
+    unsigned sqPending; //まだカーネルに渡していないSQEの数
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_cqe *cqes;
+    void *sqMap, *cqMap;
+    size_t sqMapSize, cqMapSize, sqeMapSize;
+    struct io_uring_buf_ring *br; //受信バッファを渡すリング
+    size_t brSize;
+    unsigned char *rxBuf;
+    int rxNum;
+    unsigned short rxTail;
+    unsigned char *txBuf;
+    int *txFree; //空いている送信バッファの番号
+    int txNum, txFreeNum;
+    int bufSize;
+    unsigned long enters, completions, rearms, noBufs, txFull;
+};
+
+void UringClose(URING *u)
+{
+    if (u == NULL)
+    {
+        return;
+    }
+    if (u->fd >= 0)
+    {
+        close(u->fd);
+    }
+    if (u->sqes != NULL)
+    {
+        munmap(u->sqes, u->sqeMapSize);
+    }
+    if (u->cqMap != NULL && u->cqMap != u->sqMap)
+    {
+        munmap(u->cqMap, u->cqMapSize);
+    }
+    if (u->sqMap != NULL)
+    {
+        munmap(u->sqMap, u->sqMapSize);
+    }
+    if (u->br != NULL)
+    {
+        munmap(u->br, u->brSize);
+    }
+    free(u->rxBuf);
+    free(u->txBuf);
+    free(u->txFree);
+    free(u);
+}
+
+// 受信バッファを1つカーネルに返す（まとめてtailを進めるのはUringBufPublish）
+static void UringBufAdd(URING *u, int bid)
+{
+    struct io_uring_buf *b;
+
+    b = &u->br->bufs[u->rxTail & (u->rxNum - 1)];
+    b->addr = (u_int64_t)(unsigned long)(u->rxBuf + (size_t)bid * u->bufSize);
+    b->len = u->bufSize;
+    b->bid = bid;
+    u->rxTail++;
+}
+
+static void UringBufPublish(URING *u)
+{
+    __atomic_store_n(&u->br->tail, u->rxTail, __ATOMIC_RELEASE);
+}
+
+// 使えなければNULLを返す（古いカーネルやio_uringが無効の環境では呼び出し側で従来の方法にする）
+URING *UringOpen(int entries, int rxNum, int txNum, int bufSize)
+{
+    struct io_uring_params p;
+    struct io_uring_buf_reg reg;
+    URING *u;
+    int i;
+
+    if ((u = (URING *)calloc(1, sizeof(URING))) == NULL)
+    {
+        DebugPerror("calloc");
+        return (NULL);
+    }
+    u->fd = -1;
+
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = entries * 4;
+    if ((u->fd = syscall(__NR_io_uring_setup, entries, &p)) < 0)
+    {
+        DebugPerror("io_uring_setup");
+        UringClose(u);
+        return (NULL);
+    }
+    u->sqEntries = p.sq_entries;
+    u->sqMapSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cqMapSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (u->cqMapSize > u->sqMapSize)
+        {
+            u->sqMapSize = u->cqMapSize;
+        }
+        u->cqMapSize = u->sqMapSize;
+    }
+    if ((u->sqMap = mmap(NULL, u->sqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING)) == MAP_FAILED)
+    {
+        DebugPerror("mmap:sq");
+        u->sqMap = NULL;
+        UringClose(u);
+        return (NULL);
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        u->cqMap = u->sqMap;
+    }
+    else if ((u->cqMap = mmap(NULL, u->cqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING)) == MAP_FAILED)
+    {
+        DebugPerror("mmap:cq");
+        u->cqMap = NULL;
+        UringClose(u);
+        return (NULL);
+    }
+    u->sqeMapSize = p.sq_entries * sizeof(struct io_uring_sqe);
+    if ((u->sqes = mmap(NULL, u->sqeMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES)) == MAP_FAILED)
+    {
+        DebugPerror("mmap:sqes");
+        u->sqes = NULL;
+        UringClose(u);
+        return (NULL);
+    }
+    u->sqHead = (unsigned *)((char *)u->sqMap + p.sq_off.head);
+    u->sqTail = (unsigned *)((char *)u->sqMap + p.sq_off.tail);
+    u->sqMask = (unsigned *)((char *)u->sqMap + p.sq_off.ring_mask);
+    u->sqArray = (unsigned *)((char *)u->sqMap + p.sq_off.array);
+    u->cqHead = (unsigned *)((char *)u->cqMap + p.cq_off.head);
+    u->cqTail = (unsigned *)((char *)u->cqMap + p.cq_off.tail);
+    u->cqMask = (unsigned *)((char *)u->cqMap + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)((char *)u->cqMap + p.cq_off.cqes);
+
+    // 受信バッファのリングはページ境界に置く必要があるのでmmapで確保する
+    u->rxNum = rxNum;
+    u->bufSize = bufSize;
+    u->brSize = (size_t)rxNum * sizeof(struct io_uring_buf);
+    if ((u->br = mmap(NULL, u->brSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+    {
+        DebugPerror("mmap:buf ring");
+        u->br = NULL;
+        UringClose(u);
+        return (NULL);
+    }
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (u_int64_t)(unsigned long)u->br;
+    reg.ring_entries = rxNum;
+    reg.bgid = URING_BGID;
+    if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    {
+        DebugPerror("io_uring_register:PBUF_RING");
+        UringClose(u);
+        return (NULL);
+    }
+
+    u->txNum = txNum;
+    u->rxBuf = (unsigned char *)malloc((size_t)rxNum * bufSize);
+    u->txBuf = (unsigned char *)malloc((size_t)txNum * bufSize);
+    u->txFree = (int *)malloc(txNum * sizeof(int));
+    if (u->rxBuf == NULL || u->txBuf == NULL || u->txFree == NULL)
+    {
+        DebugPerror("malloc");
+        UringClose(u);
+        return (NULL);
+    }
+    for (i = 0; i < rxNum; i++)
+    {
+        UringBufAdd(u, i);
+    }
+    UringBufPublish(u);
+    for (i = 0; i < txNum; i++)
+    {
+        u->txFree[i] = txNum - 1 - i;
+    }
+    u->txFreeNum = txNum;
+
+    return (u);
+}
+
+// 積んであるSQEを渡し、waitなら完了が1つ以上そろうまで待つ
+int UringWait(URING *u, int wait)
+{
+    int n;
+
+    // 完了が残っていれば待たない
+    if (wait && __atomic_load_n(u->cqTail, __ATOMIC_ACQUIRE) != *u->cqHead)
+    {
+        wait = 0;
+    }
+    if (!wait && u->sqPending == 0)
+    {
+        return (0);
+    }
+    u->enters++;
+    if ((n = syscall(__NR_io_uring_enter, u->fd, u->sqPending, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0)) < 0)
+    {
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+        {
+            DebugPerror("io_uring_enter");
+        }
+        return (-1);
+    }
+    u->sqPending -= n;
+
+    return (0);
+}
+
+// 空いているSQEを1つ取る（一杯なら積んであるものを先に渡す）
+static struct io_uring_sqe *UringSqe(URING *u)
+{
+    struct io_uring_sqe *sqe;
+    unsigned tail, idx;
+
+    tail = *u->sqTail;
+    if (tail - __atomic_load_n(u->sqHead, __ATOMIC_ACQUIRE) >= u->sqEntries)
+    {
+        UringWait(u, 0);
+        if (tail - __atomic_load_n(u->sqHead, __ATOMIC_ACQUIRE) >= u->sqEntries)
+        {
+            return (NULL);
+        }
+    }
+    idx = tail & *u->sqMask;
+    sqe = &u->sqes[idx];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    u->sqArray[idx] = idx;
+    __atomic_store_n(u->sqTail, tail + 1, __ATOMIC_RELEASE);
+    u->sqPending++;
+
+    return (sqe);
+}
+
+// socにmultishotのrecvを登録する（1フレームごとにtag付きでURING_RECVが届く）
+int UringRecv(URING *u, int soc, int tag)
+{
+    struct io_uring_sqe *sqe;
+
+    if ((sqe = UringSqe(u)) == NULL)
+    {
+        DebugPrintf("UringRecv:sq full\n");
+        return (-1);
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = soc;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->user_data = URING_UD(URING_RECV, soc, tag);
+
+    return (0);
+}
+
+// fdが読めるようになったらURING_POLLを1回届ける（終了通知のeventfdなど）
+int UringPoll(URING *u, int fd, int tag)
+{
+    struct io_uring_sqe *sqe;
+
+    if ((sqe = UringSqe(u)) == NULL)
+    {
+        DebugPrintf("UringPoll:sq full\n");
+        return (-1);
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = URING_UD(URING_POLL, 0, tag);
+
+    return (0);
+}
+
+// フレームをコピーして送信のSQEを積む（dataは呼び出し側で再利用してよい）
+// 実際に渡すのは次のUringWaitで、送れたかどうかはURING_SENDで届く
+int UringSend(URING *u, int soc, unsigned char *data, int size, int tag)
+{
+    struct io_uring_sqe *sqe;
+    unsigned char *buf;
+    int slot;
+
+    if (size > u->bufSize || u->txFreeNum == 0 || (sqe = UringSqe(u)) == NULL)
+    {
+        u->txFull++;
+        return (-1);
+    }
+    slot = u->txFree[--u->txFreeNum];
+    buf = u->txBuf + (size_t)slot * u->bufSize;
+    memcpy(buf, data, size);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = soc;
+    sqe->addr = (u_int64_t)(unsigned long)buf;
+    sqe->len = size;
+    sqe->user_data = URING_UD(URING_SEND, slot, tag);
+
+    return (0);
+}
+
+// 届いている完了を最大URING_RUN_BUDGET個処理し、funcを呼ぶ
+// 受信バッファはfuncから戻ったらカーネルに返すので、funcの中でコピーせずに使ってよい
+int UringRun(URING *u, URING_FUNC func, void *arg)
+{
+    struct io_uring_cqe *cqe;
+    unsigned head, tail;
+    int n, bid, recycled;
+
+    head = *u->cqHead;
+    tail = __atomic_load_n(u->cqTail, __ATOMIC_ACQUIRE);
+    recycled = 0;
+    for (n = 0; head != tail && n < URING_RUN_BUDGET; head++, n++)
+    {
+        cqe = &u->cqes[head & *u->cqMask];
+        switch (URING_UD_TYPE(cqe->user_data))
+        {
+        case URING_RECV:
+            if (cqe->flags & IORING_CQE_F_BUFFER)
+            {
+                bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+                if (cqe->res > 0)
+                {
+                    func(arg, URING_RECV, URING_UD_TAG(cqe->user_data), u->rxBuf + (size_t)bid * u->bufSize, cqe->res);
+                }
+                UringBufAdd(u, bid);
+                recycled = 1;
+            }
+            else if (cqe->res == -ENOBUFS)
+            {
+                // 受信バッファを使い切ると止まるので、返してから登録し直す
+                u->noBufs++;
+            }
+            else if (cqe->res < 0)
+            {
+                DebugPrintf("UringRun:recv:%s\n", strerror(-cqe->res));
+            }
+            if (!(cqe->flags & IORING_CQE_F_MORE))
+            {
+                u->rearms++;
+                UringRecv(u, URING_UD_X(cqe->user_data), URING_UD_TAG(cqe->user_data));
+            }
+            break;
+        case URING_SEND:
+            u->txFree[u->txFreeNum++] = URING_UD_X(cqe->user_data);
+            func(arg, URING_SEND, URING_UD_TAG(cqe->user_data), NULL, cqe->res);
+            break;
+        case URING_POLL:
+            func(arg, URING_POLL, URING_UD_TAG(cqe->user_data), NULL, cqe->res);
+            break;
+        }
+    }
+    __atomic_store_n(u->cqHead, head, __ATOMIC_RELEASE);
+    if (recycled)
+    {
+        UringBufPublish(u);
+    }
+    u->completions += n;
+
+    return (n);
+}
+
+int UringStat(URING *u, char *name, FILE *fp)
+{
+    fprintf(fp, "uring:%s io_uring_enter=%lu completions=%lu (%.2f completions/enter) rearm=%lu nobufs=%lu txfull=%lu\n",
+            name, u->enters, u->completions, u->enters ? (double)u->completions / u->enters : 0.0, u->rearms, u->noBufs, u->txFull);
+
+    return (0);
+}
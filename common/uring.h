@@ -0,0 +1,24 @@
+//io_uringによるパケットソケットの受信・送信（router、Bridgeから使う）
+//liburingは使わず、io_uring_setup/io_uring_enter/io_uring_registerを直接呼ぶ
+
+#define URING_ENTRIES 1024 //SQのエントリ数（CQはその4倍）
+#define URING_RX_BUF_NUM 1024 //受信に使うバッファの数（2のべき乗）
+#define URING_TX_BUF_NUM 2048 //送信に使うバッファの数
+#define URING_BUF_SIZE 2048 //バッファ1つの大きさ
+#define URING_RUN_BUDGET 512 //UringRunで1回に処理する完了の数
+
+#define URING_RECV 1 //multishot受信で1フレーム届いた（dataは呼び出しの間だけ有効）
+#define URING_SEND 2 //送信が終わった（resは送ったバイト数か-errno）
+#define URING_POLL 3 //UringPollで登録したfdが読めるようになった
+
+typedef struct _uring_ URING;
+typedef void (*URING_FUNC)(void *arg,int type,int tag,unsigned char *data,int res);
+
+URING *UringOpen(int entries,int rxNum,int txNum,int bufSize);
+void UringClose(URING *u);
+int UringRecv(URING *u,int soc,int tag);
+int UringPoll(URING *u,int fd,int tag);
+int UringSend(URING *u,int soc,unsigned char *data,int size,int tag);
+int UringWait(URING *u,int wait);
+int UringRun(URING *u,URING_FUNC func,void *arg);
+int UringStat(URING *u,char *name,FILE *fp);
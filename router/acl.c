@@ -0,0 +1,223 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <pthread.h>
+#include "base.h"
+#include "acl.h"
+#include "policy.h"
+#include "epoch.h"
+
+extern int DebugPrintf(char *fmt, ...);
+extern int DebugPerror(char *msg);
+
+// このファイルでは転送の前にパケットを許可・破棄するACLを扱う
+// ルールは上から順に優先し、ポリシールーティングと同じビットベクタの分類器に作り直して引く
+// どのルールにも一致しなければ許可する（すべて破棄するなら最後に"deny"だけの行を書く）
+// 一致の数は転送スレッドごとに別のキャッシュラインに数え、表示するときに足す
+// 読み直すと一致の数は0から数え直す
+
+static ACL *AclCur; // 使っているACL
+static ACL *AclOld; // 解放待ちのACL
+static int AclWorkers; // hitsを持つ転送スレッドの数
+
+ACL *AclGet()
+{
+    return (__atomic_load_n(&AclCur, __ATOMIC_ACQUIRE));
+}
+
+// 許可ならACL_PERMIT、破棄ならACL_DENYを返す
+int AclCheck(ACL *acl, int worker, u_int32_t key[POLICY_FIELDS])
+{
+    int no;
+
+    if (acl->cls == NULL || (no = PolicyMatch(acl->cls, key)) == -1)
+    {
+        acl->hits[worker * acl->stride + (acl->cls ? acl->cls->ruleNum : 0)]++;
+        return (ACL_PERMIT);
+    }
+    acl->hits[worker * acl->stride + no]++;
+
+    return (acl->cls->rule[no].action);
+}
+
+static void AclFree(ACL *acl)
+{
+    if (acl->cls != NULL)
+    {
+        PolicyFree(acl->cls);
+    }
+    free(acl->hits);
+    free(acl);
+}
+
+// 1行に1ルール（上ほど優先）
+// (permit | deny) [一致の条件 ...]
+static int AclParse(char *line, POLICY_RULE *r)
+{
+    char *tok, *arg, *save;
+
+    PolicyRuleInit(r);
+    if ((tok = strtok_r(line, " \t\r\n", &save)) == NULL)
+    {
+        return (-1);
+    }
+    if (strcmp(tok, "permit") == 0)
+    {
+        r->action = ACL_PERMIT;
+    }
+    else if (strcmp(tok, "deny") == 0)
+    {
+        r->action = ACL_DENY;
+    }
+    else
+    {
+        return (-1);
+    }
+    while ((tok = strtok_r(NULL, " \t\r\n", &save)) != NULL)
+    {
+        if ((arg = strtok_r(NULL, " \t\r\n", &save)) == NULL || PolicyParseMatch(tok, arg, r) != 1)
+        {
+            return (-1);
+        }
+    }
+
+    return (0);
+}
+
+// ACLファイルを読んで分類器を作り直し、差し替える（メインスレッドから呼ぶ）
+// 1行でも読めなければファイル全体を使わず、今のACLのまま-1を返す（一部のルールだけで通すことはしない）
+int AclLoadFile(char *fname, int workers)
+{
+    FILE *fp;
+    char line[256], *p;
+    POLICY_RULE *rule;
+    ACL *acl, *old;
+    int num, lineNo;
+
+    if ((fp = fopen(fname, "r")) == NULL)
+    {
+        DebugPerror("fopen");
+        return (-1);
+    }
+    if ((rule = (POLICY_RULE *)malloc(POLICY_RULE_MAX * sizeof(POLICY_RULE))) == NULL)
+    {
+        DebugPerror("malloc");
+        fclose(fp);
+        return (-1);
+    }
+    num = 0;
+    lineNo = 0;
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        lineNo++;
+        if ((p = strchr(line, '#')) != NULL)
+        {
+            *p = '\0';
+        }
+        if (strspn(line, " \t\r\n") == strlen(line))
+        {
+            continue;
+        }
+        if (num >= POLICY_RULE_MAX || AclParse(line, &rule[num]) == -1)
+        {
+            fprintf(stderr, "%s:%d:%s\n", fname, lineNo, num >= POLICY_RULE_MAX ? "too many acls" : "bad acl");
+            fclose(fp);
+            free(rule);
+            return (-1);
+        }
+        num++;
+    }
+    fclose(fp);
+
+    if ((acl = (ACL *)calloc(1, sizeof(ACL))) == NULL)
+    {
+        DebugPerror("calloc");
+        free(rule);
+        return (-1);
+    }
+    // 転送スレッドどうしで同じキャッシュラインに書かないよう、64バイトに揃える
+    acl->stride = (num + 1 + 7) & ~7;
+    if ((num > 0 && (acl->cls = PolicyBuild(rule, num)) == NULL) ||
+        (acl->hits = (unsigned long *)calloc((size_t)workers * acl->stride, sizeof(unsigned long))) == NULL)
+    {
+        free(rule);
+        AclFree(acl);
+        return (-1);
+    }
+    free(rule);
+    AclWorkers = workers;
+
+    old = AclCur;
+    __atomic_store_n(&AclCur, acl, __ATOMIC_RELEASE);
+    if (old != NULL)
+    {
+        old->retire = EpochRetire();
+        old->next = AclOld;
+        AclOld = old;
+    }
+    DebugPrintf("AclLoadFile:%s %d rules\n", fname, num);
+
+    return (num);
+}
+
+// 待ち合わせの済んだ古いACLを解放する（メインスレッドからtickごとに呼ぶ）
+int AclReclaim()
+{
+    ACL **pp, *acl;
+    int count;
+
+    count = 0;
+    for (pp = &AclOld; *pp != NULL;)
+    {
+        acl = *pp;
+        if (!EpochPassed(acl->retire))
+        {
+            pp = &acl->next;
+            continue;
+        }
+        *pp = acl->next;
+        AclFree(acl);
+        count++;
+    }
+
+    return (count);
+}
+
+// 一致したルールごとの数を出力する（一致のなかったルールは出さない）
+int AclStat(FILE *fp)
+{
+    ACL *acl;
+    unsigned long hits;
+    int num, r, k;
+
+    if ((acl = AclCur) == NULL)
+    {
+        return (0);
+    }
+    num = 0;
+    if (acl->cls != NULL)
+    {
+        PolicyPrint(acl->cls, "acl", fp);
+        num = acl->cls->ruleNum;
+    }
+    for (r = 0; r <= num; r++)
+    {
+        for (hits = 0, k = 0; k < AclWorkers; k++)
+        {
+            hits += acl->hits[k * acl->stride + r];
+        }
+        if (r == num)
+        {
+            fprintf(fp, "acl:default permit hits=%lu\n", hits);
+        }
+        else if (hits > 0)
+        {
+            fprintf(fp, "acl:rule %d %s hits=%lu\n", r + 1, acl->cls->rule[r].action == ACL_PERMIT ? "permit" : "deny", hits);
+        }
+    }
+
+    return (0);
+}
@@ -0,0 +1,8 @@
+#define ACL_DENY 0
+#define ACL_PERMIT 1
+
+ACL *AclGet();
+int AclCheck(ACL *acl,int worker,u_int32_t key[POLICY_FIELDS]);
+int AclLoadFile(char *fname,int workers);
+int AclReclaim();
+int AclStat(FILE *fp);
@@ -1,19 +1,189 @@
+//TPACKET_V3の受信リング
 typedef struct
 {
+    unsigned char *map; //mmapした領域
+    size_t mapSize;
+    int blockSize; //ブロックの大きさ
+    int blockNum; //ブロック数
+    int cur; //処理中のブロック
+    int left; //処理中のブロックに残っているフレーム数
+    unsigned char *pkt; //次のフレームのヘッダ
+    u_int64_t stamp; //最後に返したフレームの受信時刻（ns、CLOCK_REALTIME）
+} RX_RING;
+
+//recvmmsgでまとめて受信するためのバッファ
+typedef struct
+{
+    struct mmsghdr *msg;
+    struct iovec *iov;
+    struct sockaddr_ll *from; //受信したフレームの種類を見るため
+    unsigned char *buf; //PKT_BUF_SIZE * max
+    unsigned char *ctrl; //SO_TIMESTAMPNSの受信時刻が入る制御メッセージ
+    int max; //一度に受信する最大数
+} RX_BATCH;
+
+#define LAT_BUCKET_NUM 320 //遅延のヒストグラムの区間の数（ns、2^42まで）
+
+//遅延のヒストグラム
+typedef struct
+{
+    unsigned long count[LAT_BUCKET_NUM];
+    unsigned long total;
+    u_int64_t max;
+} LAT_HIST;
+
+//AF_XDPソケットのリング1つ（カーネルと共有するproducer/consumerとディスクリプタの配列）
+typedef struct
+{
+    u_int32_t *producer;
+    u_int32_t *consumer;
+    u_int32_t *flags;
+    void *desc; //fill/completionはu_int64_t、rx/txはstruct xdp_desc
+    u_int32_t mask;
+    u_int32_t size;
+    u_int32_t cached; //こちら側の位置（producerなら次に書く位置、consumerなら次に読む位置）
+    void *map;
+    size_t mapSize;
+} XSK_RING;
+
+//AF_XDPソケット（デバイスの1つのキューに1つ、UMEMもソケットごとに持つ）
+typedef struct
+{
+    int fd;
+    unsigned char *umem; //フレームを置く領域（使わない場合NULL）
+    size_t umemSize;
+    XSK_RING fill, comp, rx, tx;
+    u_int64_t *txFrame; //送信に使える空きフレームのアドレス
+    int txFrameNum;
+    int zeroCopy; //ゼロコピーでbindできたか
+    u_int32_t rxTaken, rxLeft; //rxリングから取り出した数と、そのうちまだ渡していない数
+    unsigned long txPending; //txに書いてまだカーネルに知らせていない数
+    unsigned long kicks; //sendto/recvfromでカーネルを起こした回数
+} XSK;
+
+#define TX_BATCH 64 //まとめて送信するフレーム数
+
+#define DEVICE_MAX 16 //扱えるネットワークデバイスの最大数
+
+//送信待ちのフレームがある送信キューの一覧（wakeupの終わりにこれだけflushする）
+typedef struct
+{
+    struct _tx_queue_ *q[DEVICE_MAX];
+    int num;
+} TX_DIRTY;
+
+//デバイスごとの送信キュー（PACKET_TX_RING か sendmmsg でまとめて送る）
+typedef struct _tx_queue_
+{
+    int soc; //送信に使うソケット
+    int ring; //TX_RINGを使っているか
+    unsigned char *map; //TX_RINGをmmapした領域
+    size_t mapSize;
+    int frameNum;
+    int cur; //次に使うフレーム
+    unsigned char *buf; //sendmmsg用のバッファ（TX_BATCH個）
+    struct mmsghdr *msg;
+    struct iovec *iov;
+    int head; //送信待ちの先頭
+    int num; //送信待ちの末尾
+    TX_DIRTY *dirty; //送信待ちになったら載せる一覧（NULLなら載せない）
+    int listed; //一覧に載っているか
+    struct _uring_ *uring; //io_uringで送る場合（SQEに積むだけでflushしない）
+    int tag; //io_uringの完了で返ってくる番号
+    XSK *xsk; //AF_XDPで送る場合（txリングに書き、flushでカーネルに知らせる）
+    unsigned long sent, bytes, dropped, again, flushes, calls;
+} TX_QUEUE;
+
+typedef struct
+{
+    char *name; //デバイス名
     int soc; //ソケット
     u_char hwaddr[6];//アドレス
     struct in_addr addr, subnet, netmask; //
 } DEVICE;
 
+//フローキャッシュのエントリ（宛先ごと、ECMPがあれば宛先とフローのハッシュごとに送信先と書き換えるMACアドレスを覚える）
+typedef struct
+{
+    in_addr_t daddr; //宛先（0は空き）
+    u_int32_t hash; //フローのハッシュ（ECMPのグループがなければ0）
+    int policy; //一致したポリシールールの番号+1（なければ0）
+    u_int32_t routeGen; //作ったときの経路表の世代
+    u_int32_t seq; //作ったときの近隣エントリのseq（MACアドレスが変わるか外されると変わる）
+    int deviceNo; //送信先デバイス
+    struct _ip2mac_ *ip2mac; //近隣エントリ（期限の延長に使う）
+    unsigned char mac[12]; //イーサヘッダの宛先・送信元MACアドレス
+} FLOW_ENTRY;
+
+//転送スレッドごとのフローキャッシュ（ダイレクトマップ、使わない場合entry==NULL）
+typedef struct
+{
+    FLOW_ENTRY *entry;
+    u_int32_t mask;
+    unsigned long hits, misses, stale; //staleは宛先は一致したが世代が変わっていた数
+    unsigned long hitCycles, missCycles, missTimed; //転送にかかったサイクル数（-sのときだけ数える）
+} FLOW_CACHE;
+
+#define WORKER_MAX 32 //転送スレッドの最大数
+#define LAT_PEND_MAX 1024 //1回のwakeupで遅延を記録するフレームの数
+
+//転送スレッドごとの状態（受信ソケット・受信バッファ・送信キュー・統計をスレッドごとに持ち、共有しない）
+typedef struct
+{
+    int no; //スレッドの番号
+    pthread_t tid;
+    int epoch; //EpochRegisterの番号
+    int epfd; //受信ソケットを登録したepoll
+    int soc[DEVICE_MAX]; //デバイスごとの受信ソケット（PACKET_FANOUTのグループに入れる）
+    RX_RING rxRing[DEVICE_MAX]; //受信リング（使わない場合map==NULL）
+    RX_BATCH rxBatch; //recvmmsgの受信バッファ
+    TX_QUEUE txQueue[DEVICE_MAX]; //送信キュー
+    TX_DIRTY txDirty; //送信待ちのある送信キュー
+    u_int32_t rxMore; //読み残しのあるデバイス（ビット、DEVICE_MAXは32まで）
+    struct _uring_ *uring; //io_uringで受信・送信する（使わない場合NULL）
+    XSK xsk[DEVICE_MAX]; //AF_XDPで受信・送信する（使わない場合umem==NULL）
+    unsigned long packets, bytes, wakeups, calls; //受信の統計
+    u_int64_t rxStamp; //処理中のフレームの受信時刻（わからなければ0）
+    u_int64_t latPend[LAT_PEND_MAX]; //このwakeupで転送したフレームの受信時刻（送信したところで遅延にする）
+    int latNum;
+    LAT_HIST lat; //受信から送信までの遅延
+    FLOW_CACHE flow; //宛先ごとの転送先のキャッシュ
+    unsigned long idle; //busy-pollで続けて空だった回数
+    unsigned long spins; //busy-pollで見て回った回数
+    u_int64_t cycles; //受信を始めたときに読んだTSC（ポリサーはパケットごとに読まずにこれを使う）
+    struct _sched_ *sched; //送信スケジューラ（使わない場合NULL）
+} WORKER;
+
+//タイマーホイールに登録するタイマー
+typedef struct _timer_ {
+        struct _timer_  *next;
+        struct _timer_  *before;
+        u_int64_t       expire; //期限（tick）
+        void    (*func)(struct _timer_ *timer); //期限切れで呼ぶ関数
+        int     armed; //登録中かどうか
+}TIMER;
+
 #define FLAG_FREE 0
 #define FLAG_OK 1
 #define FLAG_NG -1
 
-//双方向データの格納をする
+//近隣エントリの状態（RFC 4861の近隣到達性の確認をARPに当てはめたもの）
+//INCOMPLETEとFAILEDはFLAG_NG、それ以外はMACアドレスが使えるのでFLAG_OK
+#define NEIGH_INCOMPLETE 0 //ブロードキャストで問い合わせ中
+#define NEIGH_REACHABLE 1 //最近ARPで確かめた
+#define NEIGH_STALE 2 //しばらく確かめていない（使われたらPROBEにする）
+#define NEIGH_PROBE 3 //知っているMACアドレスへユニキャストで確かめ中
+#define NEIGH_FAILED 4 //応答がなかった（しばらくはすぐに捨ててICMPを返す）
+
+#define PKT_BUF_SIZE 2048 //パケットバッファ1つの大きさ
+
+//双方向データの格納をする（パケットバッファのプールから取り出す）
 typedef struct  _data_buf_{
         struct _data_buf_       *next;
         struct _data_buf_       *before;
         time_t  t;
+        int     deviceNo; //受け取ったデバイス（解決できなかったときにICMPを返す）
+        u_int64_t       stamp; //入れたときのTSC（滞留時間で捨てるのに使う）
         int     size;
         unsigned char   *data;
 }DATA_BUF;
@@ -27,12 +197,197 @@ typedef struct  {
         pthread_mutex_t mutex;
 }SEND_DATA;
 
-typedef struct  {
+typedef struct _ip2mac_ {
         int     flag; // 使用されているかどうかのフラグ
         int     deviceNo; //デバイスの番号
         in_addr_t       addr; //IP アドレス
         unsigned char   hwaddr[6]; //MACアドレス
         time_t  lastTime; //最後に更新された時間
+        int     state; //近隣の状態（NEIGH_*）
+        int     probes; //この状態で送ったARPリクエストの数
+        time_t  confirmed; //最後にARPで確かめた時間
+        time_t  stateTime; //今の状態になった時間
         SEND_DATA       sd;// 送信データ
+        TIMER   timer; //期限切れ用タイマー
+        int     sendReq; //送信要求をキューに入れ済みか
+        u_int32_t       seq; //flagとhwaddrを書き換えている間は奇数
+        u_int64_t       retire; //表から外したときのエポック
 }IP2MAC;
 //IPアドレスとMACアドレスの関連付け
+
+//経路の次ホップ
+typedef struct {
+        int     deviceNo; //送信先デバイスの番号
+        in_addr_t       gateway; //ゲートウェイのIPアドレス（0なら直結）
+        int     refCnt; //参照している経路の数
+        int     group; //ECMPグループの番号（-1なら1つの次ホップ）
+        u_int64_t       retire; //参照がなくなったときのエポック（過ぎるまで番号を使い回さない）
+}NEXTHOP;
+
+#define NH_GROUP_BUCKETS 256 //ECMPグループのハッシュの振り分け先の数
+#define NH_GROUP_MEMBER_MAX 16 //ECMPグループのメンバーの最大数
+
+//ECMPの次ホップグループ
+//フローのハッシュでbucketを選び、bucketに入っている次ホップへ送る（メンバーが変わっても動くのはそのメンバーのbucketだけ）
+typedef struct {
+        int     member[NH_GROUP_MEMBER_MAX]; //メンバーの次ホップの番号
+        int     memberNum;
+        int     bucket[NH_GROUP_BUCKETS]; //次ホップの番号（転送スレッドはロックを取らずに読む）
+        u_int64_t       retire; //使われなくなったときのエポック
+}NH_GROUP;
+
+//経路（プレフィックスと次ホップの対応）
+typedef struct  {
+        in_addr_t       prefix; //プレフィックス（ホストバイトオーダ）
+        int     depth; //プレフィックス長（-1なら空き）
+        int     nhNo; //次ホップの番号
+}ROUTE_RULE;
+
+//DIR-24-8形式の経路表
+typedef struct  {
+        u_int32_t       *tbl24; //上位24ビットで引く表
+        u_int32_t       *tbl8; //24ビットより長いプレフィックス用の256エントリのグループ
+        u_int32_t       tbl8Max; //確保したグループ数
+        u_int32_t       tbl8Num; //これまでに切り出したグループ数
+        u_int32_t       *tbl8Free; //解放されたグループの番号
+        u_int32_t       tbl8FreeNum;
+        u_int64_t       *tbl8Retire; //グループを解放したときのエポック（グループの番号で引く）
+        ROUTE_RULE      *rules; //経路のハッシュ表（追加・削除用）
+        u_int32_t       ruleSize;
+        u_int32_t       ruleNum;
+}FIB;
+
+#define POLICY_FIELDS 6 //送信元アドレス、宛先アドレス、プロトコル、送信元ポート、宛先ポート、DSCP
+
+//ポリシー・ACLのルール（各フィールドは範囲 lo〜hi で一致する）
+typedef struct {
+        u_int32_t       lo[POLICY_FIELDS];
+        u_int32_t       hi[POLICY_FIELDS];
+        int     table; //引く経路表の番号（-1ならnhNoへ送る）
+        int     nhNo; //次ホップの番号
+        int     action; //ACLではACL_PERMITかACL_DENY
+}POLICY_RULE;
+
+//ルールをビットベクタの分類器にしたもの（ポリシールーティングとACLで使う）
+//フィールドごとに値の区間を二分探索し、区間ごとの「一致するルールのビット列」をANDした最初のビットのルールを使う
+//sumはbitsの64語ごとに0でない語を表すビット列で、先にこれをANDして見る語を絞る
+typedef struct _policy_ {
+        struct _policy_ *next; //解放待ちのリスト
+        u_int64_t       retire; //差し替えたときのエポック
+        int     ruleNum;
+        int     words; //ビット列の長さ（64ビット単位）
+        int     sumWords; //sumの長さ（64ビット単位）
+        POLICY_RULE     *rule;
+        struct {
+                u_int32_t       *bound; //区間の始まり（昇順、bound[0]は0）
+                int     num;
+                u_int64_t       *bits; //区間ごとのビット列（num * words）
+                u_int64_t       *sum; //区間ごとのbitsの要約（num * sumWords）
+        } field[POLICY_FIELDS];
+}POLICY;
+
+//ACL（分類器と、転送スレッドごとのルールの一致数）
+typedef struct _acl_ {
+        struct _acl_    *next; //解放待ちのリスト
+        u_int64_t       retire;
+        POLICY  *cls; //ルールがなければNULL（すべて許可）
+        int     stride; //転送スレッド1つ分のhitsの長さ（ruleNum+1をキャッシュラインに揃える）
+        unsigned long   *hits; //hits[worker * stride + rule]、rule==ruleNumはどれにも一致しなかった数
+}ACL;
+
+//NAPTの変換エントリ（アドレスとポートはネットワークバイトオーダー、ICMPはポートの代わりにecho のid）
+typedef struct _nat_entry_ {
+        int     flag; //使用されているかどうかのフラグ
+        u_int8_t        proto;
+        u_int8_t        state; //TCPの状態（NAT_TCP_*）
+        u_int16_t       inPort; //内側の送信元ポート
+        u_int16_t       extPort; //外側で使うポート
+        u_int16_t       remPort; //相手のポート
+        in_addr_t       inAddr; //内側の送信元アドレス
+        in_addr_t       remAddr; //相手のアドレス
+        time_t  lastTime; //最後に使われた時間
+        TIMER   timer; //期限切れ用タイマー
+        u_int64_t       retire; //表から外したときのエポック
+}NAT_ENTRY;
+
+//トークンバケツのポリサー（srTCM RFC 2697 / trTCM RFC 2698、color-blind）
+//時間で満ちるバケツはトークン数の代わりに「空になる仮想時刻」で持ち、CASだけで更新する
+typedef struct {
+        u_int64_t       tc; //認定バケツ（CIR/CBS）が空になる仮想時刻
+        u_int64_t       te; //ピークバケツ（trTCMのPIR/PBS）が空になる仮想時刻、srTCMでは超過バケツ（EBS）のトークン（仮想時間）
+        unsigned long   green, yellow, red, marked;
+        int     type; //POLICE_SRTCMかPOLICE_TRTCM
+        int     dscp; //yellowに付け直すDSCP（-1なら付け直さない）
+        u_int64_t       cCost, eCost; //1バイトあたりの仮想時間（<<POLICE_FRAC）
+        u_int64_t       cDepth, eDepth; //バケツの深さ（仮想時間）
+        char    name[40]; //表示用（dev eth1 / from 10.1.0.0/24）
+} __attribute__((aligned(64))) POLICER;
+
+//ポリサーの設定（読み直すときは丸ごと差し替える）
+typedef struct _police_set_ {
+        struct _police_set_     *next; //解放待ちのリスト
+        u_int64_t       retire;
+        POLICER *policer;
+        int     num;
+        int     device[DEVICE_MAX]; //受信デバイスごとのポリサーの番号（-1ならなし）
+        u_int32_t       *bound; //送信元アドレスの区間の始まり（昇順）
+        int     *prefix; //区間ごとのポリサーの番号（最も長いプレフィックス、-1ならなし）
+        int     boundNum; //0ならプレフィックスのポリサーはない
+        u_int64_t       base; //仮想時刻0のTSC
+}POLICE_SET;
+
+//CoDel（RFC 8289）のキューごとの状態（時刻はns）
+typedef struct {
+        u_int64_t       firstAbove; //滞留時間が目標を超え続けて捨ててよくなる時刻（0なら目標以下）
+        u_int64_t       dropNext; //次に捨てる時刻
+        u_int32_t       count, lastCount; //捨てた数（間隔をinterval/sqrt(count)で縮める）
+        int     dropping; //捨てている最中か
+} CODEL;
+
+#define SCHED_CLASS_MAX 8 //送信スケジューラのクラスの最大数（2のべき乗）
+
+//送信スケジューラのキューに入れたフレーム（転送スレッドごとのプールから取る）
+typedef struct {
+        int     next; //キューの次のフレーム（-1なら末尾、空きリストでも使う）
+        int     len;
+        u_int64_t       stamp; //キューに入れたときのTSC
+        unsigned char   data[PKT_BUF_SIZE];
+} SCHED_PKT;
+
+//クラスの中のフローキュー（FQ-CoDelでなければクラスに1つだけ）
+typedef struct {
+        int     head, tail, num, qbytes; //キューにあるフレームとバイト数
+        int     deficit; //送れる残りのバイト数（0以下なら次のフローに回す）
+        int     next; //new/oldリストの次（-1なら末尾）
+        int     list; //載っているリスト（0:なし 1:new 2:old）
+        CODEL   codel;
+} SCHED_FLOW;
+
+//送信デバイスごと・クラスごとのキュー
+typedef struct {
+        int     num, qbytes; //キューにあるフレームとバイト数（フローキューの合計）
+        int     deficit; //DRRで送れる残りのバイト数（0以下なら次のクラスに回す）
+        SCHED_FLOW      *flow;
+        int     newHead, newTail, oldHead, oldTail; //フローキューのリスト（-1なら空）
+        unsigned long   enq, sent, bytes, drops, aqmDrops, marks; //dropsはキューが一杯で捨てた数
+        LAT_HIST        delay; //キューに入れてから送信キューに渡すまでの時間
+} SCHED_QUEUE;
+
+//送信デバイスごとのスケジューラ
+typedef struct {
+        SCHED_QUEUE     q[SCHED_CLASS_MAX];
+        u_int32_t       ready; //フレームのあるクラス（ビット）
+        int     active[SCHED_CLASS_MAX]; //DRRで回すクラス（先頭の番が来ている）
+        int     activeHead, activeNum;
+        int     backlog; //キューにあるフレームの数
+        int     batch; //1回に送信キューに渡す数（送れなかったら半分、送れたら倍、TX_BATCHまで）
+} SCHED_PORT;
+
+//転送スレッドごとの送信スケジューラ（デバイスごとのキューとフレームのプール）
+typedef struct _sched_ {
+        SCHED_PORT      port[DEVICE_MAX];
+        u_int32_t       busy; //キューにフレームのあるデバイス（ビット）
+        SCHED_PKT       *pkt;
+        int     free; //空きフレームの先頭（-1なら空きなし）
+} SCHED;
+
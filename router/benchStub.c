@@ -0,0 +1,22 @@
+#include <stdio.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <net/if.h>
+#include "base.h"
+
+// このファイルでは測定用のプログラム（*_bench.c）をmain.cなしでリンクするため、main.cの変数と関数の代わりを置く
+
+DEVICE Device[DEVICE_MAX];
+int DeviceNum;
+int EndFlag = 0;
+
+int DebugPrintf(char *fmt, ...)
+{
+    return (0);
+}
+
+int DebugPerror(char *msg)
+{
+    return (0);
+}
@@ -0,0 +1,130 @@
+#include <stdio.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <pthread.h>
+#include "base.h"
+#include "codel.h"
+#include "hdrRewrite.h"
+
+extern int DebugPrintf(char *fmt, ...);
+
+// このファイルではCoDel（RFC 8289）の取り出すときの判定を扱う
+// キューに入れた時刻からの滞留時間が target を interval の間ずっと超えていたら、取り出すフレームを捨て始め、
+// 捨てる間隔を interval/sqrt(捨てた数) で縮めていく。滞留時間が target を下回れば捨てるのをやめる
+// 状態はキューごとに持ち、キューを持つスレッドだけが触るのでロックは取らない
+
+static u_int64_t CodelTarget = CODEL_TARGET_NS;
+static u_int64_t CodelIntervalNs = CODEL_INTERVAL_NS;
+
+// targetとintervalを変える（転送スレッドを作る前に呼ぶ）
+int CodelParam(double targetMs, double intervalMs)
+{
+    if (targetMs <= 0 || intervalMs < targetMs)
+    {
+        return (-1);
+    }
+    CodelTarget = targetMs * 1e6;
+    CodelIntervalNs = intervalMs * 1e6;
+    DebugPrintf("CodelParam:target=%.1fms interval=%.1fms\n", targetMs, intervalMs);
+
+    return (0);
+}
+
+u_int64_t CodelInterval()
+{
+    return (CodelIntervalNs);
+}
+
+// sqrt(n) * 256 の整数部
+static u_int64_t CodelSqrt256(u_int64_t n)
+{
+    u_int64_t x, y;
+
+    n <<= 16;
+    for (x = n, y = (n + 1) / 2; y < x; y = (x + n / x) / 2)
+    {
+        x = y;
+    }
+
+    return (x);
+}
+
+// 次に捨てる時刻
+static u_int64_t CodelControlLaw(u_int64_t t, u_int32_t count)
+{
+    return (t + CodelIntervalNs * 256 / CodelSqrt256(count));
+}
+
+// 取り出したフレームを捨てる（ECNならマークする）なら1
+// nowは取り出した時刻、sojournはそのフレームの滞留時間、backlogは取り出した後にキューに残っているバイト数
+int CodelDrop(CODEL *c, u_int64_t now, u_int64_t sojourn, int backlog)
+{
+    int ok;
+    u_int32_t delta;
+
+    ok = 0;
+    if (sojourn < CodelTarget || backlog <= CODEL_MTU)
+    {
+        c->firstAbove = 0;
+    }
+    else if (c->firstAbove == 0)
+    {
+        c->firstAbove = now + CodelIntervalNs;
+    }
+    else if (now >= c->firstAbove)
+    {
+        ok = 1;
+    }
+
+    if (c->dropping)
+    {
+        if (!ok)
+        {
+            c->dropping = 0;
+            return (0);
+        }
+        if (now >= c->dropNext)
+        {
+            c->count++;
+            c->dropNext = CodelControlLaw(c->dropNext, c->count);
+            return (1);
+        }
+        return (0);
+    }
+    if (ok)
+    {
+        // 少し前まで捨てていたなら、そのときの間隔の近くから始める
+        // dropNextはまだ先のこともあるので、差は符号付きで比べる（Linuxの codel_time_before と同じ）
+        c->dropping = 1;
+        delta = c->count - c->lastCount;
+        c->count = (delta > 1 && (int64_t)(now - c->dropNext) < (int64_t)(16 * CodelIntervalNs)) ? delta : 1;
+        c->dropNext = CodelControlLaw(now, c->count);
+        c->lastCount = c->count;
+        return (1);
+    }
+
+    return (0);
+}
+
+// キューが空になったら呼ぶ（捨てた数は次に捨て始めるときのために残す）
+void CodelReset(CODEL *c)
+{
+    c->firstAbove = 0;
+    c->dropping = 0;
+}
+
+// ECN対応（ECT(0)/ECT(1)）ならCEにして1を返す（捨てずに送る）
+int CodelMark(struct iphdr *iphdr)
+{
+    if ((iphdr->tos & 3) == 0)
+    {
+        return (0);
+    }
+    if ((iphdr->tos & 3) != 3)
+    {
+        IpSetTos(iphdr, iphdr->tos | 3);
+    }
+
+    return (1);
+}
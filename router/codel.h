@@ -0,0 +1,9 @@
+#define CODEL_TARGET_NS 5000000ULL //滞留時間の目標（5ms）
+#define CODEL_INTERVAL_NS 100000000ULL //目標を超え続けたら捨て始めるまでの時間（100ms）
+#define CODEL_MTU 1514 //キューに残りがこれ以下なら目標を超えていても捨てない
+
+int CodelParam(double targetMs,double intervalMs);
+u_int64_t CodelInterval();
+int CodelDrop(CODEL *c,u_int64_t now,u_int64_t sojourn,int backlog);
+void CodelReset(CODEL *c);
+int CodelMark(struct iphdr *iphdr);
@@ -0,0 +1,82 @@
+#include <stdio.h>
+#include <sys/types.h>
+#include "epoch.h"
+
+extern int DebugPrintf(char *fmt, ...);
+
+// このファイルでは共有の表をロックなしで読むスレッドのための待ち合わせ（quiescent state）を扱う
+// 読む側は1回の処理（wakeup）の間だけポインタを持ち、処理の区切りで EpochQuiescent を呼ぶ
+// 表から外したものは EpochRetire の値を付けておき、EpochPassed が真になってから再利用・解放する
+
+#define EPOCH_OFFLINE ((u_int64_t)-1) // 共有の表を読んでいない
+
+struct
+{
+    struct
+    {
+        volatile u_int64_t qs; // 最後に区切りを通ったときのエポック
+        char pad[64 - sizeof(u_int64_t)];
+    } slot[EPOCH_MAX];
+    int num;
+    u_int64_t now;
+} Epoch = {.now = 1};
+
+// 読む側のスレッドを登録して番号を返す（起動時に呼ぶ）
+int EpochRegister()
+{
+    int no;
+
+    if ((no = __atomic_fetch_add(&Epoch.num, 1, __ATOMIC_SEQ_CST)) >= EPOCH_MAX)
+    {
+        DebugPrintf("EpochRegister:too many threads\n");
+        return (-1);
+    }
+    EpochOnline(no);
+
+    return (no);
+}
+
+// 処理の区切り（これより前に読んだポインタはもう使わない）
+void EpochQuiescent(int no)
+{
+    __atomic_store_n(&Epoch.slot[no].qs, __atomic_load_n(&Epoch.now, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+}
+
+// pollで待つ間などは区切りを通らないので、外しておく
+void EpochOffline(int no)
+{
+    __atomic_store_n(&Epoch.slot[no].qs, EPOCH_OFFLINE, __ATOMIC_RELEASE);
+}
+
+void EpochOnline(int no)
+{
+    __atomic_store_n(&Epoch.slot[no].qs, __atomic_load_n(&Epoch.now, __ATOMIC_ACQUIRE), __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+// 表から外した後に呼び、返した値を外したものに付けておく
+u_int64_t EpochRetire()
+{
+    return (__atomic_add_fetch(&Epoch.now, 1, __ATOMIC_SEQ_CST));
+}
+
+// epoch より前に読み始めたスレッドがすべて区切りを通ったか
+int EpochPassed(u_int64_t epoch)
+{
+    int i, num;
+
+    num = __atomic_load_n(&Epoch.num, __ATOMIC_ACQUIRE);
+    if (num > EPOCH_MAX)
+    {
+        num = EPOCH_MAX;
+    }
+    for (i = 0; i < num; i++)
+    {
+        if (__atomic_load_n(&Epoch.slot[i].qs, __ATOMIC_ACQUIRE) < epoch)
+        {
+            return (0);
+        }
+    }
+
+    return (1);
+}
@@ -0,0 +1,8 @@
+#define EPOCH_MAX 64 //登録できるスレッドの数
+
+int EpochRegister();
+void EpochQuiescent(int no);
+void EpochOffline(int no);
+void EpochOnline(int no);
+u_int64_t EpochRetire();
+int EpochPassed(u_int64_t epoch);
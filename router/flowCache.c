@@ -0,0 +1,115 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include "base.h"
+#include "flowCache.h"
+
+extern int DebugPrintf(char *fmt, ...);
+extern int DebugPerror(char *msg);
+
+// このファイルでは転送スレッドごとのフローキャッシュを扱う
+// 宛先アドレスで1回引けば、送信先デバイスと書き換えるMACアドレスがわかる（経路表と近隣表を引かない）
+// ECMPのグループがあるときは、フローごとに行き先が違うのでフローのハッシュもキーに入れる
+// ポリシールーティングでは同じ宛先でもルールごとに行き先が違うので、一致したルールの番号もキーに入れる
+// 経路が変わったかは経路の世代(RouteGen)、MACアドレスが変わったか外されたかは近隣エントリのseqで確かめる
+// どちらかが変わっていれば使わずに引き直して上書きするので、消して回る必要はない
+// 近隣エントリは待ち合わせの後でなければ再利用されないので、世代を確かめるまでの間はポインタを使ってよい
+
+static u_int32_t FlowHash(in_addr_t addr)
+{
+    u_int32_t h;
+
+    h = addr * 0x9E3779B1;
+    return (h ^ (h >> 16));
+}
+
+int FlowCacheInit(FLOW_CACHE *c, int size)
+{
+    u_int32_t n;
+
+    memset(c, 0, sizeof(FLOW_CACHE));
+    if (size <= 0)
+    {
+        return (0);
+    }
+    for (n = 1; n < (u_int32_t)size; n <<= 1)
+        ;
+    if ((c->entry = (FLOW_ENTRY *)calloc(n, sizeof(FLOW_ENTRY))) == NULL)
+    {
+        DebugPerror("calloc");
+        return (-1);
+    }
+    c->mask = n - 1;
+
+    return (0);
+}
+
+// 使えるエントリを返す（なければNULL）
+FLOW_ENTRY *FlowCacheLookup(FLOW_CACHE *c, in_addr_t daddr, u_int32_t hash, int policy, u_int32_t routeGen)
+{
+    FLOW_ENTRY *e;
+
+    if (c->entry == NULL)
+    {
+        return (NULL);
+    }
+    e = &c->entry[FlowHash(daddr ^ hash ^ (u_int32_t)policy) & c->mask];
+    if (e->daddr != daddr || e->hash != hash || e->policy != policy)
+    {
+        c->misses++;
+        return (NULL);
+    }
+    // 送信待ちのパケットを送っている間は、追い越さないように近隣表の側に回す
+    if (e->routeGen != routeGen || __atomic_load_n(&e->ip2mac->seq, __ATOMIC_ACQUIRE) != e->seq || e->ip2mac->sd.dno != 0)
+    {
+        c->stale++;
+        c->misses++;
+        return (NULL);
+    }
+    c->hits++;
+
+    return (e);
+}
+
+void FlowCacheInsert(FLOW_CACHE *c, in_addr_t daddr, u_int32_t hash, int policy, u_int32_t routeGen, int deviceNo, IP2MAC *ip2mac, u_int32_t seq, u_char dhost[6], u_char shost[6])
+{
+    FLOW_ENTRY *e;
+
+    if (c->entry == NULL)
+    {
+        return;
+    }
+    e = &c->entry[FlowHash(daddr ^ hash ^ (u_int32_t)policy) & c->mask];
+    e->daddr = daddr;
+    e->hash = hash;
+    e->policy = policy;
+    e->routeGen = routeGen;
+    e->seq = seq;
+    e->deviceNo = deviceNo;
+    e->ip2mac = ip2mac;
+    memcpy(e->mac, dhost, 6);
+    memcpy(e->mac + 6, shost, 6);
+}
+
+int FlowCacheStat(FLOW_CACHE *c, char *name, FILE *fp)
+{
+    unsigned long total;
+
+    // 使わないときも比べられるように、サイクル数は表示する
+    total = c->hits + c->misses;
+    if (c->entry != NULL)
+    {
+        fprintf(fp, "flow:%s %u entries, hits=%lu misses=%lu stale=%lu (hit %.1f%%)\n",
+                name, c->mask + 1, c->hits, c->misses, c->stale, total ? 100.0 * c->hits / total : 0.0);
+    }
+    if (c->hitCycles + c->missCycles > 0)
+    {
+        fprintf(fp, "flow:%s cycles/packet hit=%.0f miss=%.0f\n", name,
+                c->hits ? (double)c->hitCycles / c->hits : 0.0, c->missTimed ? (double)c->missCycles / c->missTimed : 0.0);
+    }
+
+    return (0);
+}
@@ -0,0 +1,6 @@
+#define FLOW_CACHE_SIZE 4096 //転送スレッドごとのフローキャッシュのエントリ数（既定値、2のべき乗に切り上げる）
+
+int FlowCacheInit(FLOW_CACHE *c,int size);
+FLOW_ENTRY *FlowCacheLookup(FLOW_CACHE *c,in_addr_t daddr,u_int32_t hash,int policy,u_int32_t routeGen);
+void FlowCacheInsert(FLOW_CACHE *c,in_addr_t daddr,u_int32_t hash,int policy,u_int32_t routeGen,int deviceNo,IP2MAC *ip2mac,u_int32_t seq,unsigned char dhost[6],unsigned char shost[6]);
+int FlowCacheStat(FLOW_CACHE *c,char *name,FILE *fp);
@@ -0,0 +1,83 @@
+#include <stdio.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include "hdrRewrite.h"
+
+// このファイルではヘッダの書き換えとチェックサムの差分更新（RFC 1624）を扱う
+// 書き換える16bitの古い値と新しい値だけからチェックサムを直すので、ヘッダ全体を足し直さない
+// 値はすべてネットワークバイトオーダーのまま渡す（1の補数和はバイトオーダーによらない）
+
+// HC' = ~(~HC + ~m + m')
+u_int16_t CksumAdjust16(u_int16_t check, u_int16_t old, u_int16_t new)
+{
+    u_int32_t sum;
+
+    sum = (u_int16_t)~check + (u_int16_t)~old + new;
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+
+    return ((u_int16_t)~sum);
+}
+
+u_int16_t CksumAdjust32(u_int16_t check, u_int32_t old, u_int32_t new)
+{
+    u_int32_t sum;
+
+    sum = (u_int16_t)~check + (u_int16_t)~(old >> 16) + (u_int16_t)~(old & 0xFFFF) + (new >> 16) + (new & 0xFFFF);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+
+    return ((u_int16_t)~sum);
+}
+
+// TTLを1減らす（TTLはprotocolと同じ16bitの上位バイト）
+void IpDecTtl(struct iphdr *iphdr)
+{
+    u_int16_t old;
+
+    old = htons((u_int16_t)iphdr->ttl << 8);
+    iphdr->ttl--;
+    iphdr->check = CksumAdjust16(iphdr->check, old, htons((u_int16_t)iphdr->ttl << 8));
+}
+
+// TOS（DSCPとECN）を書き換える（TOSはversion/ihlと同じ16bitの下位バイト）
+void IpSetTos(struct iphdr *iphdr, u_int8_t tos)
+{
+    u_int16_t old;
+
+    old = *(u_int16_t *)iphdr;
+    iphdr->tos = tos;
+    iphdr->check = CksumAdjust16(iphdr->check, old, *(u_int16_t *)iphdr);
+}
+
+// iphdrの送信元か宛先のアドレス（addr）を書き換える
+// l4checkはTCP/UDPのチェックサム（疑似ヘッダにアドレスを含むため、NULLなら直さない）
+void IpRewriteAddr(struct iphdr *iphdr, in_addr_t *addr, in_addr_t new, u_int16_t *l4check, int udp)
+{
+    iphdr->check = CksumAdjust32(iphdr->check, *addr, new);
+    if (l4check != NULL && !(udp && *l4check == 0))
+    {
+        // UDPの0はチェックサムなしなので直さず、計算結果の0は0xFFFFで表す
+        *l4check = CksumAdjust32(*l4check, *addr, new);
+        if (udp && *l4check == 0)
+        {
+            *l4check = 0xFFFF;
+        }
+    }
+    *addr = new;
+}
+
+// TCP/UDPのポートを書き換える
+void L4RewritePort(u_int16_t *port, u_int16_t new, u_int16_t *l4check, int udp)
+{
+    if (l4check != NULL && !(udp && *l4check == 0))
+    {
+        *l4check = CksumAdjust16(*l4check, *port, new);
+        if (udp && *l4check == 0)
+        {
+            *l4check = 0xFFFF;
+        }
+    }
+    *port = new;
+}
@@ -0,0 +1,6 @@
+u_int16_t CksumAdjust16(u_int16_t check,u_int16_t old,u_int16_t new);
+u_int16_t CksumAdjust32(u_int16_t check,u_int32_t old,u_int32_t new);
+void IpDecTtl(struct iphdr *iphdr);
+void IpSetTos(struct iphdr *iphdr,u_int8_t tos);
+void IpRewriteAddr(struct iphdr *iphdr,in_addr_t *addr,in_addr_t new,u_int16_t *l4check,int udp);
+void L4RewritePort(u_int16_t *port,u_int16_t new,u_int16_t *l4check,int udp);
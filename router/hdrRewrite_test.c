@@ -0,0 +1,182 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
+#include "hdrRewrite.h"
+#include "../common/cksum.h"
+
+// このファイルではチェックサムの差分更新（hdrRewrite.c）を、書き換えた後に全体を足し直した値と突き合わせる
+// ヘッダとペイロードは乱数で作り、UDPのチェックサムなし（0）も混ぜる
+// make test で作って動かす（食い違いがあれば1で終わる）
+
+#define TEST_ROUND 1000000
+#define TEST_PAYLOAD_MAX 64
+
+typedef struct
+{
+    u_int32_t saddr;
+    u_int32_t daddr;
+    u_int8_t zero;
+    u_int8_t proto;
+    u_int16_t len;
+} PSEUDO_HDR;
+
+static int Err;
+
+// IPヘッダのチェックサムを足し直した値
+static u_int16_t IpFull(struct iphdr *iphdr)
+{
+    u_char buf[60];
+
+    memcpy(buf, iphdr, iphdr->ihl * 4);
+    ((struct iphdr *)buf)->check = 0;
+    return (checksum(buf, iphdr->ihl * 4));
+}
+
+// TCP/UDPのチェックサムを疑似ヘッダから足し直した値（UDPで0になったら0xFFFF）
+static u_int16_t L4Full(struct iphdr *iphdr, u_char *l4, int l4len, u_int16_t *check)
+{
+    PSEUDO_HDR ph;
+    u_int16_t save, sum;
+
+    ph.saddr = iphdr->saddr;
+    ph.daddr = iphdr->daddr;
+    ph.zero = 0;
+    ph.proto = iphdr->protocol;
+    ph.len = htons(l4len);
+    save = *check;
+    *check = 0;
+    sum = checksum2((u_char *)&ph, sizeof(ph), l4, l4len);
+    *check = save;
+    if (iphdr->protocol == IPPROTO_UDP && sum == 0)
+    {
+        sum = 0xFFFF;
+    }
+
+    return (sum);
+}
+
+static void Check(const char *what, int round, u_int16_t got, u_int16_t want)
+{
+    if (got != want)
+    {
+        fprintf(stderr, "NG:%s round=%d %04x!=%04x\n", what, round, ntohs(got), ntohs(want));
+        Err++;
+    }
+}
+
+// 乱数でIPヘッダ（オプション付きもある）とTCPかUDPを作り、チェックサムを正しく入れる
+static int MakePacket(u_char *pkt, struct iphdr **iphdrp, u_char **l4p, u_int16_t **checkp, u_int16_t **sportp, u_int16_t **dportp, int *udp)
+{
+    struct iphdr *iphdr;
+    struct tcphdr *tcp;
+    struct udphdr *uh;
+    u_char *l4;
+    int i, hlen, l4len;
+
+    hlen = 20 + 4 * (rand() % 11);
+    for (i = 0; i < hlen + sizeof(struct tcphdr) + TEST_PAYLOAD_MAX; i++)
+    {
+        pkt[i] = rand();
+    }
+    iphdr = (struct iphdr *)pkt;
+    iphdr->version = 4;
+    iphdr->ihl = hlen / 4;
+    iphdr->ttl = 1 + rand() % 255;
+    *udp = rand() & 1;
+    iphdr->protocol = *udp ? IPPROTO_UDP : IPPROTO_TCP;
+    l4 = pkt + hlen;
+    l4len = (*udp ? sizeof(struct udphdr) : sizeof(struct tcphdr)) + rand() % (TEST_PAYLOAD_MAX + 1);
+    iphdr->tot_len = htons(hlen + l4len);
+    iphdr->check = IpFull(iphdr);
+
+    if (*udp)
+    {
+        uh = (struct udphdr *)l4;
+        uh->len = htons(l4len);
+        *checkp = &uh->check;
+        *sportp = &uh->source;
+        *dportp = &uh->dest;
+    }
+    else
+    {
+        tcp = (struct tcphdr *)l4;
+        *checkp = &tcp->check;
+        *sportp = &tcp->source;
+        *dportp = &tcp->dest;
+    }
+    // UDPの1/4はチェックサムなしにする
+    **checkp = (*udp && rand() % 4 == 0) ? 0 : L4Full(iphdr, l4, l4len, *checkp);
+
+    *iphdrp = iphdr;
+    *l4p = l4;
+    return (l4len);
+}
+
+// UDPのチェックサムなしは0のまま、それ以外は足し直した値と一致するか
+static void CheckL4(const char *what, int round, struct iphdr *iphdr, u_char *l4, int l4len, u_int16_t *check, int nocheck)
+{
+    if (nocheck)
+    {
+        Check(what, round, *check, 0);
+    }
+    else
+    {
+        Check(what, round, *check, L4Full(iphdr, l4, l4len, check));
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    u_char pkt[60 + sizeof(struct tcphdr) + TEST_PAYLOAD_MAX];
+    struct iphdr *iphdr;
+    u_char *l4;
+    u_int16_t *check, *sport, *dport;
+    unsigned int seed;
+    int r, l4len, udp, nocheck;
+
+    seed = argc > 1 ? atoi(argv[1]) : time(NULL);
+    printf("seed:%u\n", seed);
+    srand(seed);
+
+    for (r = 0; r < TEST_ROUND; r++)
+    {
+        l4len = MakePacket(pkt, &iphdr, &l4, &check, &sport, &dport, &udp);
+        nocheck = udp && *check == 0;
+
+        IpDecTtl(iphdr);
+        Check("IpDecTtl", r, iphdr->check, IpFull(iphdr));
+
+        IpSetTos(iphdr, rand());
+        Check("IpSetTos", r, iphdr->check, IpFull(iphdr));
+
+        IpRewriteAddr(iphdr, &iphdr->saddr, rand() ^ (rand() << 16), check, udp);
+        Check("IpRewriteAddr(saddr) ip", r, iphdr->check, IpFull(iphdr));
+        CheckL4("IpRewriteAddr(saddr) l4", r, iphdr, l4, l4len, check, nocheck);
+
+        IpRewriteAddr(iphdr, &iphdr->daddr, rand() ^ (rand() << 16), check, udp);
+        Check("IpRewriteAddr(daddr) ip", r, iphdr->check, IpFull(iphdr));
+        CheckL4("IpRewriteAddr(daddr) l4", r, iphdr, l4, l4len, check, nocheck);
+
+        L4RewritePort(sport, rand(), check, udp);
+        CheckL4("L4RewritePort(sport)", r, iphdr, l4, l4len, check, nocheck);
+
+        L4RewritePort(dport, rand(), check, udp);
+        CheckL4("L4RewritePort(dport)", r, iphdr, l4, l4len, check, nocheck);
+    }
+
+    printf("hdrRewrite:%d rounds, %d errors\n", TEST_ROUND, Err);
+    if (Err != 0)
+    {
+        printf("NG\n");
+        return (1);
+    }
+    printf("OK\n");
+
+    return (0);
+}
@@ -4,222 +4,729 @@
 #include <string.h>
 #include <errno.h>
 #include <time.h>
+#include <stddef.h>
 #include <sys/time.h>
 #include <sys/socket.h>
 #include <net/ethernet.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
+#include <netinet/ip_icmp.h>
+#include <poll.h>
+#include <sys/eventfd.h>
 #include <pthread.h>
-#include "netutil.h"
 #include "base.h"
+#include "netutil.h"
 #include "ip2mac.h"
 #include "sendBuf.h"
+#include "timer.h"
+#include "pool.h"
+#include "txQueue.h"
+#include "epoch.h"
+#include "hdrRewrite.h"
+#include "nat.h"
 
 extern int DebugPrintf(char *fmt, ...);
+extern int DebugPerror(char *msg);
+
+#define IP2MAC_TIMEOUT_SEC 60 //使われなくなったエントリを消すまでの時間
+#define SEND_DATA_TIMEOUT_SEC 3 //送信待ちパケットを保持する時間
 
-#define IP2MAC_TIMEOUT_SEC 60
-#define IP2MAC_NG_TIMEOUT_SEC 1
+#define ARP_RETRANS_MS 250 //最初のARPリクエストの応答を待つ時間（送り直すたびに倍にする）
+#define ARP_MAX_PROBES 3 //応答がなければ諦めるまでに送るARPリクエストの数
+#define ARP_REACHABLE_SEC 30 //ARPで確かめたMACアドレスをそのまま使う時間
+#define ARP_DELAY_SEC 5 //STALEのエントリが使われたかを見る間隔
+#define ARP_FAILED_SEC 3 //解決できなかった宛先へのパケットをすぐに捨てる時間
 
 //このファイルではMACアドレスとIPアドレスの関連付けを行う
 
-//
+#define IP2MAC_CHUNK_SIZE 1024 //まとめて確保するエントリ数
+#define IP2MAC_CHUNK_MAX 1024 //デバイスあたりの最大かたまり数
+
+//ハッシュ表（エントリ番号+1、0は空き）
+//転送スレッドはロックを取らずに読むので、大きくするときは作り直して差し替え、古いものは待ち合わせの後に解放する
+typedef struct _ip2mac_index_
+{
+    struct _ip2mac_index_ *next; //解放待ちのリスト
+    u_int64_t retire; //差し替えたときのエポック
+    u_int32_t size;
+    u_int32_t slot[];
+} IP2MAC_INDEX;
+
+//エントリはかたまり単位で確保し、reallocしないのでアドレスが変わらない
+//検索は addr をキーにしたオープンアドレス法のハッシュ表で行う
+//書き換え（追加・削除・MACアドレスの更新）は mutex を取り、読むだけならロックを取らない
 struct
 {
-    IP2MAC *data; //IPアドレスとMACアドレスの関連付け
-    int size; //データの大きさ
-    int no; //deviceの識別子
-} Ip2Macs[2];
+    IP2MAC *chunk[IP2MAC_CHUNK_MAX]; //IPアドレスとMACアドレスの関連付け
+    int size; //確保したエントリ数
+    int no; //一度でも使ったエントリ数
+    int *freeNo; //空きエントリの番号
+    int freeNum;
+    int *retireNo; //表から外して待ち合わせ中のエントリの番号
+    int retireNum;
+    IP2MAC_INDEX *index;
+    IP2MAC_INDEX *oldIndex; //解放待ちのハッシュ表
+    int count; //使用中のエントリ数
+    pthread_mutex_t mutex;
+} Ip2Macs[DEVICE_MAX] = {[0 ... DEVICE_MAX - 1] = {.mutex = PTHREAD_MUTEX_INITIALIZER}};
 
-extern DEVICE Device[2];
-extern int ArpSoc[2];
+extern DEVICE Device[DEVICE_MAX];
+extern int DeviceNum;
 
 extern int EndFlag;
+extern int NatDeviceNo;
 
-IP2MAC *Ip2MacSearch(int deviceNo, in_addr_t addr, u_char *hwaddr)
+unsigned long NeighDrops; //近隣を解決できずに捨てたパケットの数
+
+//近隣の解決の統計（-sで表示する）
+struct
 {
-    register int i;
-    int freeNo, no;
-    time_t now;
-    char buf[80];
+    unsigned long request; //ブロードキャストで送ったARPリクエスト
+    unsigned long probe; //ユニキャストで送ったARPリクエスト
+    unsigned long failed; //解決できなかった回数
+} ArpStat;
+
+extern u_int64_t SendDataSojourn; // 送信待ちの滞留時間の上限（0なら捨てない）
+extern unsigned long SendDataAqmDrops;
+
+TX_QUEUE BufTxQ[DEVICE_MAX]; //BufThreadの送信キュー（転送スレッドのものとは別に持つ）
+TX_DIRTY BufTxDirty; //BufThreadの送信待ちのある送信キュー
+
+IP2MAC *Ip2MacGet(int deviceNo, int no)
+{
+    return (&Ip2Macs[deviceNo].chunk[no / IP2MAC_CHUNK_SIZE][no % IP2MAC_CHUNK_SIZE]);
+}
+
+static u_int32_t Ip2MacHash(in_addr_t addr)
+{
+    u_int32_t h;
+
+    h = addr;
+    h ^= h >> 16;
+    h *= 0x85EBCA6B;
+    h ^= h >> 13;
+    h *= 0xC2B2AE35;
+    return (h ^ (h >> 16));
+}
+
+//flagとMACアドレスを書き換える（ロックを取った状態で呼ぶ）
+//seqが奇数の間は書き換え中なので、読む側は Ip2MacRead で読み直す
+static void Ip2MacSet(IP2MAC *ip2mac, int flag, u_char *hwaddr)
+{
+    u_int32_t seq;
+
+    seq = ip2mac->seq;
+    __atomic_store_n(&ip2mac->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    ip2mac->flag = flag;
+    if (hwaddr == NULL)
+    {
+        memset(ip2mac->hwaddr, 0, 6);
+    }
+    else
+    {
+        memcpy(ip2mac->hwaddr, hwaddr, 6);
+    }
+    __atomic_store_n(&ip2mac->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+//flagとMACアドレスをそろった状態で読む（ロックは取らない）
+int Ip2MacRead(IP2MAC *ip2mac, u_char hwaddr[6])
+{
+    u_int32_t seq;
+
+    return (Ip2MacReadSeq(ip2mac, hwaddr, &seq));
+}
+
+//Ip2MacReadと同じだが、読んだときのseqも返す（変わったかどうかを後で確かめるため）
+int Ip2MacReadSeq(IP2MAC *ip2mac, u_char hwaddr[6], u_int32_t *seqp)
+{
+    u_int32_t seq;
+    int flag;
+
+    while (1)
+    {
+        if ((seq = __atomic_load_n(&ip2mac->seq, __ATOMIC_ACQUIRE)) & 1)
+        {
+            continue;
+        }
+        flag = ip2mac->flag;
+        memcpy(hwaddr, ip2mac->hwaddr, 6);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&ip2mac->seq, __ATOMIC_RELAXED) == seq)
+        {
+            *seqp = seq;
+            return (flag);
+        }
+    }
+}
+
+//ハッシュ表の位置を返す（見つからなければ空きの位置、ロックを取った状態で呼ぶ）
+static u_int32_t Ip2MacIndexSearch(int deviceNo, IP2MAC_INDEX *index, in_addr_t addr)
+{
+    u_int32_t i, mask, no;
+
+    mask = index->size - 1;
+    for (i = Ip2MacHash(addr) & mask;; i = (i + 1) & mask)
+    {
+        no = index->slot[i];
+        if (no == 0 || Ip2MacGet(deviceNo, no - 1)->addr == addr)
+        {
+            return (i);
+        }
+    }
+}
+
+//ロックを取らずに探す
+//削除で詰め直している最中は見落とすことがあるので、見つからなければロックを取って探し直す
+static IP2MAC *Ip2MacLookup(int deviceNo, in_addr_t addr)
+{
+    IP2MAC_INDEX *index;
     IP2MAC *ip2mac;
+    u_int32_t i, n, mask, no;
+
+    if ((index = __atomic_load_n(&Ip2Macs[deviceNo].index, __ATOMIC_ACQUIRE)) == NULL)
+    {
+        return (NULL);
+    }
+    mask = index->size - 1;
+    for (i = Ip2MacHash(addr) & mask, n = 0; n <= mask; i = (i + 1) & mask, n++)
+    {
+        if ((no = __atomic_load_n(&index->slot[i], __ATOMIC_ACQUIRE)) == 0)
+        {
+            break;
+        }
+        ip2mac = Ip2MacGet(deviceNo, no - 1);
+        if (ip2mac->addr == addr && __atomic_load_n(&ip2mac->flag, __ATOMIC_RELAXED) != FLAG_FREE)
+        {
+            return (ip2mac);
+        }
+    }
+
+    return (NULL);
+}
+
+static int Ip2MacIndexGrow(int deviceNo)
+{
+    IP2MAC_INDEX *old, *index;
+    u_int32_t size, i;
 
-    freeNo = -1;
-    now = time(NULL);
-    for (i = 0; i < Ip2Macs[deviceNo].no; i++)
+    old = Ip2Macs[deviceNo].index;
+    size = (old == NULL) ? 2048 : old->size * 2;
+    if ((index = (IP2MAC_INDEX *)calloc(1, sizeof(IP2MAC_INDEX) + size * sizeof(u_int32_t))) == NULL)
     {
-        ip2mac = &Ip2Macs[deviceNo].data[i];
-        if (ip2mac->flag == FLAG_FREE)
+        DebugPrintf("Ip2MacIndexGrow:calloc:%s\n", strerror(errno));
+        return (-1);
+    }
+    index->size = size;
+    if (old != NULL)
+    {
+        for (i = 0; i < old->size; i++)
         {
-            if (freeNo == -1)
+            if (old->slot[i] != 0)
             {
-                freeNo = i;
+                index->slot[Ip2MacIndexSearch(deviceNo, index, Ip2MacGet(deviceNo, old->slot[i] - 1)->addr)] = old->slot[i];
             }
+        }
+    }
+    __atomic_store_n(&Ip2Macs[deviceNo].index, index, __ATOMIC_RELEASE);
+
+    //古い表はまだ読んでいるスレッドがあるかもしれないので、待ち合わせの後に解放する
+    if (old != NULL)
+    {
+        old->retire = EpochRetire();
+        old->next = Ip2Macs[deviceNo].oldIndex;
+        Ip2Macs[deviceNo].oldIndex = old;
+    }
+
+    return (0);
+}
+
+//線形探索のハッシュ表から消し、後ろに続くエントリを詰め直す
+static void Ip2MacIndexRemove(int deviceNo, u_int32_t i)
+{
+    IP2MAC_INDEX *index;
+    u_int32_t j, k, mask;
+
+    index = Ip2Macs[deviceNo].index;
+    mask = index->size - 1;
+    j = i;
+    while (1)
+    {
+        j = (j + 1) & mask;
+        if (index->slot[j] == 0)
+        {
+            break;
+        }
+        k = Ip2MacHash(Ip2MacGet(deviceNo, index->slot[j] - 1)->addr) & mask;
+        if ((i <= j) ? (i < k && k <= j) : (i < k || k <= j))
+        {
             continue;
         }
-        if (ip2mac->addr == addr)
+        __atomic_store_n(&index->slot[i], index->slot[j], __ATOMIC_RELEASE);
+        i = j;
+    }
+    __atomic_store_n(&index->slot[i], 0, __ATOMIC_RELEASE);
+}
+
+//空きエントリを取り出す（足りなければかたまりを1つ追加する）
+static int Ip2MacAlloc(int deviceNo)
+{
+    int c, *p, *r;
+    IP2MAC *ip2mac;
+
+    if (Ip2Macs[deviceNo].freeNum > 0)
+    {
+        return (Ip2Macs[deviceNo].freeNo[--Ip2Macs[deviceNo].freeNum]);
+    }
+    if (Ip2Macs[deviceNo].no >= Ip2Macs[deviceNo].size)
+    {
+        c = Ip2Macs[deviceNo].size / IP2MAC_CHUNK_SIZE;
+        if (c >= IP2MAC_CHUNK_MAX)
         {
-            if (ip2mac->flag == FLAG_OK)
-            {
-                ip2mac->lastTime = now;
-            }
-            if (hwaddr != NULL)
+            DebugPrintf("Ip2MacAlloc:[%d] table full\n", deviceNo);
+            return (-1);
+        }
+        if ((p = (int *)realloc(Ip2Macs[deviceNo].freeNo, (Ip2Macs[deviceNo].size + IP2MAC_CHUNK_SIZE) * sizeof(int))) == NULL)
+        {
+            DebugPrintf("Ip2MacAlloc:realloc:%s\n", strerror(errno));
+            return (-1);
+        }
+        Ip2Macs[deviceNo].freeNo = p;
+        if ((r = (int *)realloc(Ip2Macs[deviceNo].retireNo, (Ip2Macs[deviceNo].size + IP2MAC_CHUNK_SIZE) * sizeof(int))) == NULL)
+        {
+            DebugPrintf("Ip2MacAlloc:realloc:%s\n", strerror(errno));
+            return (-1);
+        }
+        Ip2Macs[deviceNo].retireNo = r;
+        if ((Ip2Macs[deviceNo].chunk[c] = (IP2MAC *)calloc(IP2MAC_CHUNK_SIZE, sizeof(IP2MAC))) == NULL)
+        {
+            DebugPrintf("Ip2MacAlloc:calloc:%s\n", strerror(errno));
+            return (-1);
+        }
+        Ip2Macs[deviceNo].size += IP2MAC_CHUNK_SIZE;
+    }
+
+    //初めて使うエントリだけ送信待ちのロックを作る（再利用するエントリはBufThreadが使っていることがある）
+    ip2mac = Ip2MacGet(deviceNo, Ip2Macs[deviceNo].no);
+    pthread_mutex_init(&ip2mac->sd.mutex, NULL);
+
+    return (Ip2Macs[deviceNo].no++);
+}
+
+//表から外す（ロックを取った状態で呼ぶ）
+//エントリは転送スレッドがまだ持っているかもしれないので、Ip2MacReclaim で待ち合わせてから空きに戻す
+static void Ip2MacFree(IP2MAC *ip2mac)
+{
+    int deviceNo;
+    u_int32_t i;
+
+    deviceNo = ip2mac->deviceNo;
+    TimerDel(&ip2mac->timer);
+    Ip2MacSet(ip2mac, FLAG_FREE, NULL);
+    FreeSendData(ip2mac);
+    i = Ip2MacIndexSearch(deviceNo, Ip2Macs[deviceNo].index, ip2mac->addr);
+    ip2mac->retire = EpochRetire();
+    Ip2Macs[deviceNo].retireNo[Ip2Macs[deviceNo].retireNum++] = Ip2Macs[deviceNo].index->slot[i] - 1;
+    Ip2MacIndexRemove(deviceNo, i);
+    Ip2Macs[deviceNo].count--;
+}
+
+//待ち合わせの済んだエントリと古いハッシュ表を解放する（メインスレッドからtickごとに呼ぶ）
+int Ip2MacReclaim()
+{
+    IP2MAC_INDEX **pp, *index;
+    IP2MAC *ip2mac;
+    int deviceNo, i, n, count;
+
+    count = 0;
+    for (deviceNo = 0; deviceNo < DeviceNum; deviceNo++)
+    {
+        pthread_mutex_lock(&Ip2Macs[deviceNo].mutex);
+        for (i = n = 0; i < Ip2Macs[deviceNo].retireNum; i++)
+        {
+            ip2mac = Ip2MacGet(deviceNo, Ip2Macs[deviceNo].retireNo[i]);
+            if (!EpochPassed(ip2mac->retire))
             {
-                memcpy(ip2mac->hwaddr, hwaddr, 6);
-                ip2mac->flag = FLAG_OK;
-                if (ip2mac->sd.top != NULL)
-                {
-                    AppendSendReqData(deviceNo, i);
-                }
-                // DebugPrintf("Ip2Mac EXIST [%d] %s = %d\n",deviceNo,in_addr_t2str(addr,buf,sizeof(buf)),i);
-                return (ip2mac);
+                Ip2Macs[deviceNo].retireNo[n++] = Ip2Macs[deviceNo].retireNo[i];
+                continue;
             }
-            else
+            //外した後に入れられたパケットも捨てる
+            FreeSendData(ip2mac);
+            Ip2Macs[deviceNo].freeNo[Ip2Macs[deviceNo].freeNum++] = Ip2Macs[deviceNo].retireNo[i];
+            count++;
+        }
+        Ip2Macs[deviceNo].retireNum = n;
+
+        for (pp = &Ip2Macs[deviceNo].oldIndex; *pp != NULL;)
+        {
+            index = *pp;
+            if (EpochPassed(index->retire))
             {
-                if ((ip2mac->flag == FLAG_OK && now - ip2mac->lastTime > IP2MAC_TIMEOUT_SEC) ||
-                    (ip2mac->flag == FLAG_NG && now - ip2mac->lastTime > IP2MAC_NG_TIMEOUT_SEC))
-                {
-                    FreeSendData(ip2mac);
-                    ip2mac->flag = FLAG_FREE;
-                    // DebugPrintf("Ip2Mac FREE [%d] %s = %d\n",deviceNo,in_addr_t2str(ip2mac->addr,buf,sizeof(buf)),i);
-                    if (freeNo == -1)
-                    {
-                        freeNo = i;
-                    }
-                }
-                else
-                {
-                    // DebugPrintf("Ip2Mac EXIST [%d] %s = %d\n",deviceNo,in_addr_t2str(addr,buf,sizeof(buf)),i);
-                    return (ip2mac);
-                }
+                *pp = index->next;
+                free(index);
+                continue;
             }
+            pp = &index->next;
+        }
+        pthread_mutex_unlock(&Ip2Macs[deviceNo].mutex);
+    }
+
+    return (count);
+}
+
+//状態を変える（ロックを取った状態で呼ぶ）
+static void Ip2MacState(IP2MAC *ip2mac, int state)
+{
+    char buf[80];
+
+    DebugPrintf("Ip2Mac [%d] %s state %d->%d\n", ip2mac->deviceNo, in_addr_t2str(ip2mac->addr, buf, sizeof(buf)), ip2mac->state, state);
+    __atomic_store_n(&ip2mac->state, state, __ATOMIC_RELAXED);
+    ip2mac->stateTime = NowSec;
+    ip2mac->probes = 0;
+}
+
+//ARPリクエストを1つ送り、応答を待つ時間だけタイマーを入れる（ロックを取った状態で呼ぶ）
+//INCOMPLETEはブロードキャスト、PROBEは知っているMACアドレスへ送り、待つ時間は送るたびに倍にする
+//問い合わせはエントリごとにこれ1つだけで、パケットが来るたびには送らない
+static void Ip2MacSolicit(IP2MAC *ip2mac)
+{
+    static u_char bcast[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+    int deviceNo;
+    char buf[80];
+
+    deviceNo = ip2mac->deviceNo;
+    DebugPrintf("Ip2Mac(%s):Send Arp Request %d/%d\n", in_addr_t2str(ip2mac->addr, buf, sizeof(buf)), ip2mac->probes + 1, ARP_MAX_PROBES);
+    if (ip2mac->state == NEIGH_PROBE)
+    {
+        SendArpRequestB(Device[deviceNo].soc, ip2mac->addr, ip2mac->hwaddr, Device[deviceNo].addr.s_addr, Device[deviceNo].hwaddr);
+        __atomic_add_fetch(&ArpStat.probe, 1, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        SendArpRequestB(Device[deviceNo].soc, ip2mac->addr, bcast, Device[deviceNo].addr.s_addr, Device[deviceNo].hwaddr);
+        __atomic_add_fetch(&ArpStat.request, 1, __ATOMIC_RELAXED);
+    }
+    TimerAdd(&ip2mac->timer, (u_int64_t)ARP_RETRANS_MS << ip2mac->probes);
+    ip2mac->probes++;
+}
+
+//送信待ちのパケットを捨て、送信元へICMP host unreachableを返す（メインスレッドから呼ぶ）
+//転送スレッドの送信キューは使えないので、受け取ったデバイスのソケットへ直接書く（ICMPエラーの流量制限はかかる）
+static void Ip2MacUnreach(IP2MAC *ip2mac)
+{
+    DATA_BUF *d;
+    u_char buf[ICMP_ERROR_MAX];
+    int len;
+
+    while (GetSendData(ip2mac, &d) == 0)
+    {
+        if ((len = IcmpErrorBuild(buf, d->data, d->size, Device[d->deviceNo].hwaddr, Device[d->deviceNo].addr.s_addr, ICMP_DEST_UNREACH, ICMP_HOST_UNREACH)) > 0)
+        {
+            write(Device[d->deviceNo].soc, buf, len);
+        }
+        __atomic_add_fetch(&NeighDrops, 1, __ATOMIC_RELAXED);
+        PoolFree(d);
+    }
+}
+
+//sec秒後にタイマーを入れる（送信待ちのパケットがあれば、それを捨てる時刻より後にはしない）
+static void Ip2MacRearm(IP2MAC *ip2mac, time_t sec, time_t head)
+{
+    if (head != 0 && head + SEND_DATA_TIMEOUT_SEC - NowSec < sec)
+    {
+        sec = head + SEND_DATA_TIMEOUT_SEC - NowSec;
+    }
+    TimerAdd(&ip2mac->timer, (sec > 0 ? sec : 0) * 1000);
+}
+
+//タイマーホイールから呼ばれ、近隣の状態を進める
+//lastTime（使われた時間）と confirmed（確かめた時間）はロックを取らずに更新されるだけなので、ここで見て決める
+//ARPを受け取って状態が変わった直後に古いタイマーで呼ばれることもあるので、どの状態も時刻を確かめてから進める
+static void Ip2MacTimeout(TIMER *timer)
+{
+    IP2MAC *ip2mac;
+    time_t head, now, expire;
+    char buf[80];
+    int deviceNo, failed;
+
+    ip2mac = (IP2MAC *)((char *)timer - offsetof(IP2MAC, timer));
+    deviceNo = ip2mac->deviceNo;
+
+    //古い送信待ちパケットを先頭から捨てる
+    head = ExpireSendData(ip2mac, NowSec - SEND_DATA_TIMEOUT_SEC);
+
+    failed = 0;
+    pthread_mutex_lock(&Ip2Macs[deviceNo].mutex);
+    now = NowSec;
+    switch (ip2mac->state)
+    {
+    case NEIGH_INCOMPLETE:
+    case NEIGH_PROBE:
+        if (ip2mac->probes < ARP_MAX_PROBES)
+        {
+            Ip2MacSolicit(ip2mac);
+            break;
+        }
+        //応答がなかった：MACアドレスを消し、しばらくは問い合わせずにすぐ捨てる
+        DebugPrintf("Ip2Mac FAILED [%d] %s\n", deviceNo, in_addr_t2str(ip2mac->addr, buf, sizeof(buf)));
+        Ip2MacSet(ip2mac, FLAG_NG, NULL);
+        Ip2MacState(ip2mac, NEIGH_FAILED);
+        __atomic_add_fetch(&ArpStat.failed, 1, __ATOMIC_RELAXED);
+        TimerAdd(timer, ARP_FAILED_SEC * 1000);
+        failed = 1;
+        break;
+    case NEIGH_REACHABLE:
+        if ((expire = ip2mac->confirmed + ARP_REACHABLE_SEC) > now)
+        {
+            Ip2MacRearm(ip2mac, expire - now, head);
+        }
+        else if (ip2mac->lastTime + ARP_DELAY_SEC > now)
+        {
+            //使われているので、知っているMACアドレスへ確かめに行く（その間もそのまま送る）
+            Ip2MacState(ip2mac, NEIGH_PROBE);
+            Ip2MacSolicit(ip2mac);
         }
         else
         {
-            if ((ip2mac->flag == FLAG_OK && now - ip2mac->lastTime > IP2MAC_TIMEOUT_SEC) ||
-                (ip2mac->flag == FLAG_NG && now - ip2mac->lastTime > IP2MAC_NG_TIMEOUT_SEC))
-            {
-                FreeSendData(ip2mac);
-                ip2mac->flag = FLAG_FREE;
-                // DebugPrintf("Ip2Mac FREE [%d] %s = %d\n",deviceNo,in_addr_t2str(ip2mac->addr,buf,sizeof(buf)),i);
-                if (freeNo == -1)
-                {
-                    freeNo = i;
-                }
-            }
+            Ip2MacState(ip2mac, NEIGH_STALE);
+            Ip2MacRearm(ip2mac, ARP_DELAY_SEC, head);
         }
+        break;
+    case NEIGH_STALE:
+        if (ip2mac->lastTime + IP2MAC_TIMEOUT_SEC <= now)
+        {
+            DebugPrintf("Ip2Mac FREE [%d] %s\n", deviceNo, in_addr_t2str(ip2mac->addr, buf, sizeof(buf)));
+            Ip2MacFree(ip2mac);
+        }
+        else if (ip2mac->lastTime > ip2mac->stateTime)
+        {
+            Ip2MacState(ip2mac, NEIGH_PROBE);
+            Ip2MacSolicit(ip2mac);
+        }
+        else
+        {
+            Ip2MacRearm(ip2mac, ARP_DELAY_SEC, head);
+        }
+        break;
+    case NEIGH_FAILED:
+        //次に使われたらINCOMPLETEから問い合わせ直す
+        DebugPrintf("Ip2Mac FREE [%d] %s\n", deviceNo, in_addr_t2str(ip2mac->addr, buf, sizeof(buf)));
+        Ip2MacFree(ip2mac);
+        break;
+    }
+    pthread_mutex_unlock(&Ip2Macs[deviceNo].mutex);
+
+    if (failed)
+    {
+        Ip2MacUnreach(ip2mac);
+    }
+}
+
+//ロックを取った状態で探し、なければ追加する
+static IP2MAC *Ip2MacSearchLocked(int deviceNo, in_addr_t addr, u_char *hwaddr, time_t now)
+{
+    u_int32_t i;
+    int no;
+    char buf[80];
+    IP2MAC *ip2mac;
+
+    if (Ip2Macs[deviceNo].index == NULL && Ip2MacIndexGrow(deviceNo) == -1)
+    {
+        return (NULL);
     }
 
-    if (freeNo == -1)
+    i = Ip2MacIndexSearch(deviceNo, Ip2Macs[deviceNo].index, addr);
+    if (Ip2Macs[deviceNo].index->slot[i] != 0)
     {
-        no = Ip2Macs[deviceNo].no;
-        if (no >= Ip2Macs[deviceNo].size)
+        no = Ip2Macs[deviceNo].index->slot[i] - 1;
+        ip2mac = Ip2MacGet(deviceNo, no);
+        if (ip2mac->flag == FLAG_OK)
+        {
+            ip2mac->lastTime = now;
+        }
+        if (hwaddr != NULL)
         {
-            if (Ip2Macs[deviceNo].size == 0)
+            //ARPを受け取った：どの状態からでもREACHABLEにして、待っていたパケットを送る
+            if (ip2mac->flag != FLAG_OK || memcmp(ip2mac->hwaddr, hwaddr, 6) != 0)
             {
-                Ip2Macs[deviceNo].size = 1024;
-                Ip2Macs[deviceNo].data = (IP2MAC *)malloc(Ip2Macs[deviceNo].size * sizeof(IP2MAC));
+                Ip2MacSet(ip2mac, FLAG_OK, hwaddr);
             }
-            else
+            ip2mac->lastTime = now;
+            ip2mac->confirmed = now;
+            if (ip2mac->state != NEIGH_REACHABLE)
             {
-                Ip2Macs[deviceNo].size += 1024;
-                Ip2Macs[deviceNo].data = (IP2MAC *)realloc(Ip2Macs[deviceNo].data, Ip2Macs[deviceNo].size * sizeof(IP2MAC));
+                Ip2MacState(ip2mac, NEIGH_REACHABLE);
+                TimerAdd(&ip2mac->timer, ARP_REACHABLE_SEC * 1000);
+            }
+            if (ip2mac->sd.top != NULL)
+            {
+                AppendSendReqData(ip2mac);
             }
         }
-        Ip2Macs[deviceNo].no++;
+        return (ip2mac);
     }
-    else
+
+    if ((Ip2Macs[deviceNo].count + 1) * 2 > Ip2Macs[deviceNo].index->size && Ip2MacIndexGrow(deviceNo) == -1)
     {
-        no = freeNo;
+        return (NULL);
+    }
+    if ((no = Ip2MacAlloc(deviceNo)) == -1)
+    {
+        return (NULL);
     }
 
-    ip2mac = &Ip2Macs[deviceNo].data[no];
-
+    //まだ表に入っていないので、そのまま書き換えてよい
+    ip2mac = Ip2MacGet(deviceNo, no);
     ip2mac->deviceNo = deviceNo;
     ip2mac->addr = addr;
+    Ip2MacSet(ip2mac, hwaddr == NULL ? FLAG_NG : FLAG_OK, hwaddr);
+    ip2mac->lastTime = now;
+    ip2mac->confirmed = now;
+    ip2mac->timer.func = Ip2MacTimeout;
     if (hwaddr == NULL)
     {
-        ip2mac->flag = FLAG_NG;
-        memset(ip2mac->hwaddr, 0, 6);
+        //最初のパケットで1回だけ問い合わせ、後はタイマーで送り直す
+        Ip2MacState(ip2mac, NEIGH_INCOMPLETE);
+        Ip2MacSolicit(ip2mac);
     }
     else
     {
-        ip2mac->flag = FLAG_OK;
-        memcpy(ip2mac->hwaddr, hwaddr, 6);
+        Ip2MacState(ip2mac, NEIGH_REACHABLE);
+        TimerAdd(&ip2mac->timer, ARP_REACHABLE_SEC * 1000);
     }
-    ip2mac->lastTime = now;
-    memset(&ip2mac->sd, 0, sizeof(SEND_DATA));
-    pthread_mutex_init(&ip2mac->sd.mutex, NULL);
+
+    __atomic_store_n(&Ip2Macs[deviceNo].index->slot[Ip2MacIndexSearch(deviceNo, Ip2Macs[deviceNo].index, addr)], no + 1, __ATOMIC_RELEASE);
+    Ip2Macs[deviceNo].count++;
 
     DebugPrintf("Ip2Mac ADD [%d] %s = %d\n", deviceNo, in_addr_t2str(ip2mac->addr, buf, sizeof(buf)), no);
 
     return (ip2mac);
 }
 
+//使われているエントリの期限を延ばす（ロックは取らない、フローキャッシュに当たったときも呼ぶ）
+void Ip2MacTouch(IP2MAC *ip2mac)
+{
+    time_t now;
+
+    //同じ値なら書かず、キャッシュラインを各コアで取り合わないようにする
+    now = NowSec;
+    if (ip2mac->flag == FLAG_OK && ip2mac->lastTime != now)
+    {
+        __atomic_store_n(&ip2mac->lastTime, now, __ATOMIC_RELAXED);
+    }
+}
+
+//返したエントリは、呼んだスレッドが次に EpochQuiescent を呼ぶまで使ってよい
+IP2MAC *Ip2MacSearch(int deviceNo, in_addr_t addr, u_char *hwaddr)
+{
+    IP2MAC *ip2mac;
+    u_char mac[6];
+    time_t now;
+
+    now = NowSec;
+
+    //よくある場合（既知の宛先への転送、REACHABLEのエントリと同じMACアドレスのARP）はロックを取らない
+    if ((ip2mac = Ip2MacLookup(deviceNo, addr)) != NULL)
+    {
+        if (hwaddr == NULL)
+        {
+            Ip2MacTouch(ip2mac);
+            return (ip2mac);
+        }
+        if (__atomic_load_n(&ip2mac->state, __ATOMIC_RELAXED) == NEIGH_REACHABLE && Ip2MacRead(ip2mac, mac) == FLAG_OK && memcmp(mac, hwaddr, 6) == 0)
+        {
+            Ip2MacTouch(ip2mac);
+            if (ip2mac->confirmed != now)
+            {
+                __atomic_store_n(&ip2mac->confirmed, now, __ATOMIC_RELAXED);
+            }
+            if (ip2mac->sd.top != NULL)
+            {
+                AppendSendReqData(ip2mac);
+            }
+            return (ip2mac);
+        }
+    }
+
+    pthread_mutex_lock(&Ip2Macs[deviceNo].mutex);
+    ip2mac = Ip2MacSearchLocked(deviceNo, addr, hwaddr, now);
+    pthread_mutex_unlock(&Ip2Macs[deviceNo].mutex);
+
+    return (ip2mac);
+}
+
+//宛先のエントリを返す（なければ作ってARPで問い合わせる）
+//hwaddrを渡すのはARPを受け取ったとき
 IP2MAC *Ip2Mac(int deviceNo, in_addr_t addr, u_char *hwaddr)
 {
     IP2MAC *ip2mac;
-    static u_char bcast[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
     char buf[80];
 
-    ip2mac = Ip2MacSearch(deviceNo, addr, hwaddr);
+    if ((ip2mac = Ip2MacSearch(deviceNo, addr, hwaddr)) == NULL)
+    {
+        DebugPrintf("Ip2Mac(%s):no entry\n", in_addr_t2str(addr, buf, sizeof(buf)));
+        return (NULL);
+    }
     if (ip2mac->flag == FLAG_OK)
     {
         DebugPrintf("Ip2Mac(%s):OK\n", in_addr_t2str(addr, buf, sizeof(buf)));
-        return (ip2mac);
     }
     else
     {
-        DebugPrintf("Ip2Mac(%s):NG\n", in_addr_t2str(addr, buf, sizeof(buf)));
-        DebugPrintf("Ip2Mac(%s):Send Arp Request\n", in_addr_t2str(addr, buf, sizeof(buf)));
-        SendArpRequestB(Device[deviceNo].soc, addr, bcast, Device[deviceNo].addr.s_addr, Device[deviceNo].hwaddr);
-        return (ip2mac);
+        DebugPrintf("Ip2Mac(%s):NG state=%d\n", in_addr_t2str(addr, buf, sizeof(buf)), ip2mac->state);
     }
+
+    return (ip2mac);
 }
 
 int BufferSendOne(int deviceNo, IP2MAC *ip2mac)
 {
-    struct ether_header eh;
-    struct iphdr iphdr;
-    u_char option[1500];
-    int optionLen;
+    struct ether_header *eh;
+    struct iphdr *iphdr;
     int size;
     u_char *data;
-    u_char *ptr;
+    u_char hwaddr[6];
+    DATA_BUF *d;
+
+    //エントリは解放されて別の宛先に使われていることもあるので、その時点のMACアドレスで送る
+    if (Ip2MacRead(ip2mac, hwaddr) != FLAG_OK)
+    {
+        return (0);
+    }
 
     while (1)
     {
-        if (GetSendData(ip2mac, &size, &data) == -1)
+        if (GetSendData(ip2mac, &d) == -1)
         {
             break;
         }
 
-        ptr = data;
-
-        memcpy(&eh, ptr, sizeof(struct ether_header));
-        ptr += sizeof(struct ether_header);
+        data = d->data;
+        size = d->size;
 
-        memcpy(&iphdr, ptr, sizeof(struct iphdr));
-        ptr += sizeof(struct iphdr);
+        // バッファの中のヘッダをそのまま書き換える
+        eh = (struct ether_header *)data;
+        iphdr = (struct iphdr *)(data + sizeof(struct ether_header));
 
-        optionLen = iphdr.ihl * 4 - sizeof(struct iphdr);
-        if (optionLen > 0)
+        // 外側のデバイスへ出ていくなら、送り出すここで送信元を変換する
+        if (deviceNo == NatDeviceNo && d->deviceNo != NatDeviceNo &&
+            NatOutbound(iphdr, (u_char *)iphdr + iphdr->ihl * 4, size - sizeof(struct ether_header) - iphdr->ihl * 4) == -1)
         {
-            memcpy(option, ptr, optionLen);
-            ptr += optionLen;
+            DebugPrintf("BufferSendOne:[%d] nat out:error\n", deviceNo);
+            PoolFree(d);
+            continue;
         }
 
-        memcpy(eh.ether_dhost, ip2mac->hwaddr, 6);
-        memcpy(data, &eh, sizeof(struct ether_header));
-
-        DebugPrintf("iphdr.ttl %d->%d\n", iphdr.ttl, iphdr.ttl - 1);
-        iphdr.ttl--;
+        memcpy(eh->ether_dhost, hwaddr, 6);
+        memcpy(eh->ether_shost, Device[deviceNo].hwaddr, 6);
 
-        iphdr.check = 0;
-        iphdr.check = checksum2((u_char *)&iphdr, sizeof(struct iphdr), option, optionLen);
-        memcpy(data + sizeof(struct ether_header), &iphdr, sizeof(struct iphdr));
+        DebugPrintf("iphdr.ttl %d->%d\n", iphdr->ttl, iphdr->ttl - 1);
+        IpDecTtl(iphdr);
 
         DebugPrintf("write:BufferSendOne:[%d] %dbytes\n", deviceNo, size);
-        write(Device[deviceNo].soc, data, size);
+        TxQueueSend(&BufTxQ[deviceNo], data, size);
+        PoolFree(d);
 
         /*
                 DebugPrintf("*************************************[%d]\n",deviceNo);
@@ -232,137 +739,208 @@ int BufferSendOne(int deviceNo, IP2MAC *ip2mac)
     return (0);
 }
 
-typedef struct _send_req_data_
+//送信要求のキュー（複数の転送スレッドが入れ、BufThreadだけが取り出す固定長のリング）
+//各スロットの seq で書き込み完了を知らせるので、入れる側はロックを取らない
+#define SEND_REQ_SIZE 4096 //2のべき乗
+#define SEND_REQ_BATCH 64 //BufThreadが一度に取り出す数
+
+typedef struct
 {
-    struct _send_req_data_ *next;
-    struct _send_req_data_ *before;
-    int deviceNo;
-    int ip2macNo;
+    u_int32_t seq;
+    IP2MAC *ip2mac; //エントリのアドレスは変わらないのでそのまま持つ
 } SEND_REQ_DATA;
 
 struct
 {
-    SEND_REQ_DATA *top;
-    SEND_REQ_DATA *bottom;
-    pthread_mutex_t mutex;
-    pthread_cond_t cond;
-} SendReq = {NULL, NULL, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
-
-int AppendSendReqData(int deviceNo, int ip2macNo)
+    SEND_REQ_DATA slot[SEND_REQ_SIZE];
+    u_int32_t head; //次に入れる位置
+    u_int32_t tail; //次に取り出す位置
+    int efd; //BufThreadを起こすeventfd
+    int sleeping; //BufThreadがeventfdで待っているか
+    unsigned long overflow;
+} SendReq;
+
+int SendReqInit(int useTxRing)
 {
-    SEND_REQ_DATA *d;
-    int status;
+    u_int32_t i;
 
-    if ((status = pthread_mutex_lock(&SendReq.mutex)) != 0)
+    for (i = 0; i < SEND_REQ_SIZE; i++)
     {
-        DebugPrintf("AppendSendReqData:pthread_mutex_lock:%s\n", strerror(status));
+        SendReq.slot[i].seq = i;
+    }
+    SendReq.head = SendReq.tail = 0;
+    if ((SendReq.efd = eventfd(0, EFD_NONBLOCK)) == -1)
+    {
+        DebugPerror("eventfd");
         return (-1);
     }
-
-    for (d = SendReq.top; d != NULL; d = d->next)
+    for (i = 0; i < DeviceNum; i++)
     {
-        if (d->deviceNo == deviceNo && d->ip2macNo == ip2macNo)
+        if (TxQueueInit(&BufTxQ[i], Device[i].name, Device[i].soc, useTxRing, &BufTxDirty) == -1)
         {
-            pthread_mutex_unlock(&SendReq.mutex);
-            return (1);
+            return (-1);
         }
     }
 
-    d = (SEND_REQ_DATA *)malloc(sizeof(SEND_REQ_DATA));
-    if (d == NULL)
+    return (0);
+}
+
+void SendReqWakeup()
+{
+    u_int64_t one = 1;
+
+    write(SendReq.efd, &one, sizeof(one));
+}
+
+//同じ宛先の要求がキューにあれば入れない（sendReqビット）
+//キューが一杯でも待たずに -1 を返す
+int AppendSendReqData(IP2MAC *ip2mac)
+{
+    SEND_REQ_DATA *d;
+    u_int32_t pos, seq;
+    char buf[80];
+
+    if (__atomic_exchange_n(&ip2mac->sendReq, 1, __ATOMIC_ACQ_REL) != 0)
     {
-        DebugPrintf("AppendSendReqData:malloc");
-        pthread_mutex_unlock(&SendReq.mutex);
-        return (-1);
+        return (1);
     }
-    d->next = d->before = NULL;
-    d->deviceNo = deviceNo;
-    d->ip2macNo = ip2macNo;
 
-    if (SendReq.bottom == NULL)
+    pos = __atomic_load_n(&SendReq.head, __ATOMIC_RELAXED);
+    while (1)
     {
-        SendReq.top = SendReq.bottom = d;
+        d = &SendReq.slot[pos & (SEND_REQ_SIZE - 1)];
+        seq = __atomic_load_n(&d->seq, __ATOMIC_ACQUIRE);
+        if (seq == pos)
+        {
+            if (__atomic_compare_exchange_n(&SendReq.head, &pos, pos + 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                break;
+            }
+        }
+        else if ((int32_t)(seq - pos) < 0)
+        {
+            __atomic_store_n(&ip2mac->sendReq, 0, __ATOMIC_RELEASE);
+            __atomic_fetch_add(&SendReq.overflow, 1, __ATOMIC_RELAXED);
+            DebugPrintf("AppendSendReqData:queue full\n");
+            return (-1);
+        }
+        else
+        {
+            pos = __atomic_load_n(&SendReq.head, __ATOMIC_RELAXED);
+        }
     }
-    else
+    d->ip2mac = ip2mac;
+    __atomic_store_n(&d->seq, pos + 1, __ATOMIC_RELEASE);
+
+    //BufThreadが寝ているときだけ起こす
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&SendReq.sleeping, __ATOMIC_RELAXED))
     {
-        SendReq.bottom->next = d;
-        d->before = SendReq.bottom;
-        SendReq.bottom = d;
+        SendReqWakeup();
     }
-    pthread_cond_signal(&SendReq.cond);
-    pthread_mutex_unlock(&SendReq.mutex);
 
-    DebugPrintf("AppendSendReqData:[%d] %d\n", deviceNo, ip2macNo);
+    DebugPrintf("AppendSendReqData:[%d] %s\n", ip2mac->deviceNo, in_addr_t2str(ip2mac->addr, buf, sizeof(buf)));
 
     return (0);
 }
 
-int GetSendReqData(int *deviceNo, int *ip2macNo)
+//最大max個まとめて取り出す（BufThreadからのみ呼ぶ）
+int GetSendReqData(IP2MAC *ip2mac[], int max)
 {
     SEND_REQ_DATA *d;
-    int status;
-
-    if (SendReq.top == NULL)
-    {
-        return (-1);
-    }
+    int n;
 
-    if ((status = pthread_mutex_lock(&SendReq.mutex)) != 0)
-    {
-        DebugPrintf("pthread_mutex_lock:%s\n", strerror(status));
-        return (-1);
-    }
-    d = SendReq.top;
-    SendReq.top = d->next;
-    if (SendReq.top == NULL)
+    for (n = 0; n < max; n++)
     {
-        SendReq.bottom = NULL;
-    }
-    else
-    {
-        SendReq.top->before = NULL;
+        d = &SendReq.slot[SendReq.tail & (SEND_REQ_SIZE - 1)];
+        if (__atomic_load_n(&d->seq, __ATOMIC_ACQUIRE) != SendReq.tail + 1)
+        {
+            break;
+        }
+        ip2mac[n] = d->ip2mac;
+        __atomic_store_n(&d->seq, SendReq.tail + SEND_REQ_SIZE, __ATOMIC_RELEASE);
+        SendReq.tail++;
     }
-    pthread_mutex_unlock(&SendReq.mutex);
 
-    *deviceNo = d->deviceNo;
-    *ip2macNo = d->ip2macNo;
+    return (n);
+}
 
-    DebugPrintf("GetSendReqData:[%d] %d\n", *deviceNo, *ip2macNo);
+static int SendReqEmpty()
+{
+    SEND_REQ_DATA *d;
 
-    return (0);
+    d = &SendReq.slot[SendReq.tail & (SEND_REQ_SIZE - 1)];
+    return (__atomic_load_n(&d->seq, __ATOMIC_ACQUIRE) != SendReq.tail + 1);
 }
 
 int BufferSend()
 {
-    struct timeval now;
-    struct timespec timeout;
-    int deviceNo, ip2macNo;
-    int status;
+    struct pollfd target;
+    IP2MAC *ip2mac[SEND_REQ_BATCH];
+    int i, n, epoch;
+    u_int64_t val;
 
-    while (EndFlag == 0)
+    target.fd = SendReq.efd;
+    target.events = POLLIN;
+
+    //送り出すときにNAPTの表をロックを取らずに読むので、転送スレッドと同じく待ち合わせに加わる
+    if ((epoch = EpochRegister()) == -1)
     {
-        gettimeofday(&now, NULL);
-        timeout.tv_sec = now.tv_sec + 1;
-        timeout.tv_nsec = now.tv_usec * 1000;
+        return (-1);
+    }
 
-        pthread_mutex_lock(&SendReq.mutex);
-        if ((status = pthread_cond_timedwait(&SendReq.cond, &SendReq.mutex, &timeout)) != 0)
+    while (EndFlag == 0)
+    {
+        if ((n = GetSendReqData(ip2mac, SEND_REQ_BATCH)) > 0)
         {
-            DebugPrintf("pthread_cond_timedwait:%s\n", strerror(status));
+            for (i = 0; i < n; i++)
+            {
+                //送る前にビットを落とし、この後に入ったパケットは次の要求で送る
+                __atomic_store_n(&ip2mac[i]->sendReq, 0, __ATOMIC_RELEASE);
+                BufferSendOne(ip2mac[i]->deviceNo, ip2mac[i]);
+            }
+            TxQueueFlushDirty(&BufTxDirty);
+            EpochQuiescent(epoch);
+            continue;
         }
-        pthread_mutex_unlock(&SendReq.mutex);
 
-        while (1)
+        //要求がなければeventfdで待つ（タイムアウトなし）
+        __atomic_store_n(&SendReq.sleeping, 1, __ATOMIC_SEQ_CST);
+        if (SendReqEmpty() && EndFlag == 0)
         {
-            if (GetSendReqData(&deviceNo, &ip2macNo) == -1)
+            EpochOffline(epoch);
+            if (poll(&target, 1, -1) == -1 && errno != EINTR)
             {
-                break;
+                DebugPerror("poll");
             }
-            BufferSendOne(deviceNo, &Ip2Macs[deviceNo].data[ip2macNo]);
+            read(SendReq.efd, &val, sizeof(val));
+            EpochOnline(epoch);
         }
+        __atomic_store_n(&SendReq.sleeping, 0, __ATOMIC_RELAXED);
     }
 
+    EpochOffline(epoch);
     DebugPrintf("BufferSend:end\n");
 
     return (0);
 }
+
+int BufferSendStat(FILE *fp)
+{
+    char name[80];
+    int i;
+
+    for (i = 0; i < DeviceNum; i++)
+    {
+        snprintf(name, sizeof(name), "%s(buf)", Device[i].name);
+        TxQueueStat(&BufTxQ[i], name, fp);
+    }
+    fprintf(fp, "sendreq:overflow=%lu\n", SendReq.overflow);
+    fprintf(fp, "arp:request=%lu probe=%lu failed=%lu unreachable drops=%lu\n", ArpStat.request, ArpStat.probe, ArpStat.failed, NeighDrops);
+    if (SendDataSojourn != 0)
+    {
+        fprintf(fp, "senddata:sojourn drops=%lu\n", SendDataAqmDrops);
+    }
+
+    return (0);
+}
@@ -1,6 +1,14 @@
+IP2MAC *Ip2MacGet(int deviceNo,int no);
+int Ip2MacRead(IP2MAC *ip2mac,unsigned char hwaddr[6]);
+int Ip2MacReadSeq(IP2MAC *ip2mac,unsigned char hwaddr[6],u_int32_t *seqp);
+void Ip2MacTouch(IP2MAC *ip2mac);
+int Ip2MacReclaim();
 IP2MAC *Ip2MacSearch(int deviceNo,in_addr_t addr,unsigned char *hwaddr);
 IP2MAC *Ip2Mac(int deviceNo,in_addr_t addr,unsigned char *hwaddr);
 int BufferSendOne(int deviceNo,IP2MAC *ip2mac);
-int AppendSendReqData(int deviceNo,int ip2macNo);
-int GetSendReqData(int *deviceNo,int *ip2macNo);
+int SendReqInit(int useTxRing);
+void SendReqWakeup();
+int AppendSendReqData(IP2MAC *ip2mac);
+int GetSendReqData(IP2MAC *ip2mac[],int max);
 int BufferSend();
+int BufferSendStat(FILE *fp);
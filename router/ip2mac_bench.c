@@ -0,0 +1,103 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include "base.h"
+#include "ip2mac.h"
+#include "timer.h"
+
+// このファイルでは近隣の表（ip2mac.c）に 10〜100k の宛先を入れ、転送スレッドと同じロックを取らない検索の時間を測る
+// 宛先は /8 の中の乱数で、ARPを受け取ったときと同じようにMACアドレス付きで入れる（ARPリクエストは送らない）
+// make bench で作って動かす
+// 引数: [seed]
+
+#define BENCH_ADDRS (1 << 20) //検索する宛先の並び（入れた宛先から乱数で選ぶ）
+#define BENCH_LOOKUPS (1 << 25) //1つの宛先数で検索する回数
+
+static double Now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+// 宛先数ごとにデバイスを分け、前の測定で入れたものが混ざらないようにする
+static int Bench(int deviceNo, int num, in_addr_t *addr)
+{
+    in_addr_t *neigh;
+    IP2MAC *ip2mac;
+    u_char hwaddr[6];
+    unsigned long hit;
+    double t;
+    int i;
+
+    if ((neigh = (in_addr_t *)malloc(num * sizeof(in_addr_t))) == NULL)
+    {
+        perror("malloc");
+        return (-1);
+    }
+    hwaddr[0] = 0x02;
+    for (i = 0; i < num; i++)
+    {
+        neigh[i] = htonl(0x0A000000 | ((rand() ^ (rand() << 12)) & 0x00FFFFFF));
+        memcpy(&hwaddr[2], &neigh[i], 4);
+        if (Ip2MacSearch(deviceNo, neigh[i], hwaddr) == NULL)
+        {
+            fprintf(stderr, "Ip2MacSearch:error\n");
+            free(neigh);
+            return (-1);
+        }
+    }
+    for (i = 0; i < BENCH_ADDRS; i++)
+    {
+        addr[i] = neigh[rand() % num];
+    }
+
+    hit = 0;
+    t = Now();
+    for (i = 0; i < BENCH_LOOKUPS; i++)
+    {
+        ip2mac = Ip2MacSearch(deviceNo, addr[i & (BENCH_ADDRS - 1)], NULL);
+        hit += ip2mac != NULL && ip2mac->flag == FLAG_OK;
+    }
+    t = Now() - t;
+    printf("%7d neighbors: %6.1f ns/lookup %6.1f Mlookups/s hit %.1f%%\n",
+           num, t * 1e9 / BENCH_LOOKUPS, BENCH_LOOKUPS / t / 1e6, hit * 100.0 / BENCH_LOOKUPS);
+    free(neigh);
+
+    return (0);
+}
+
+int main(int argc, char *argv[])
+{
+    static int num[] = {10, 100, 1000, 10000, 100000};
+    in_addr_t *addr;
+    unsigned int seed;
+    int i;
+
+    seed = argc > 1 ? atoi(argv[1]) : time(NULL);
+    printf("seed:%u\n", seed);
+    srand(seed);
+
+    TimerInit();
+    if ((addr = (in_addr_t *)malloc(BENCH_ADDRS * sizeof(in_addr_t))) == NULL)
+    {
+        perror("malloc");
+        return (1);
+    }
+    for (i = 0; i < sizeof(num) / sizeof(num[0]); i++)
+    {
+        if (Bench(i, num[i], addr) == -1)
+        {
+            return (1);
+        }
+    }
+    free(addr);
+
+    return (0);
+}
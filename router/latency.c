@@ -0,0 +1,114 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include "base.h"
+#include "latency.h"
+
+// このファイルでは転送遅延のヒストグラムを扱う
+// 区間は2のべき乗ごとに LAT_SUB_BITS ビットで等分する（値が大きくても相対誤差は一定）
+// 転送スレッドごとに持つのでロックは取らない。表示するときに足し合わせる
+
+#define LAT_SUB (1 << LAT_SUB_BITS)
+
+static int LatencyBucket(u_int64_t ns)
+{
+    int e, b;
+
+    if (ns < LAT_SUB)
+    {
+        return ((int)ns);
+    }
+    e = 63 - __builtin_clzll(ns);
+    b = (e - LAT_SUB_BITS + 1) * LAT_SUB + (int)((ns >> (e - LAT_SUB_BITS)) & (LAT_SUB - 1));
+
+    return (b < LAT_BUCKET_NUM ? b : LAT_BUCKET_NUM - 1);
+}
+
+// 区間の下限
+static u_int64_t LatencyLow(int b)
+{
+    int e;
+
+    if (b < LAT_SUB)
+    {
+        return (b);
+    }
+    e = b / LAT_SUB + LAT_SUB_BITS - 1;
+
+    return ((u_int64_t)(LAT_SUB + b % LAT_SUB) << (e - LAT_SUB_BITS));
+}
+
+void LatencyAdd(LAT_HIST *h, u_int64_t ns)
+{
+    h->count[LatencyBucket(ns)]++;
+    h->total++;
+    if (ns > h->max)
+    {
+        h->max = ns;
+    }
+}
+
+void LatencyMerge(LAT_HIST *dst, LAT_HIST *src)
+{
+    int b;
+
+    for (b = 0; b < LAT_BUCKET_NUM; b++)
+    {
+        dst->count[b] += src->count[b];
+    }
+    dst->total += src->total;
+    if (src->max > dst->max)
+    {
+        dst->max = src->max;
+    }
+}
+
+// p（0〜1）の位置の値を返す（区間の中央の値、maxを超えない）
+u_int64_t LatencyPercentile(LAT_HIST *h, double p)
+{
+    unsigned long rank, sum;
+    u_int64_t v;
+    int b;
+
+    if (h->total == 0)
+    {
+        return (0);
+    }
+    rank = (unsigned long)(p * h->total);
+    if (rank >= h->total)
+    {
+        rank = h->total - 1;
+    }
+    sum = 0;
+    for (b = 0; b < LAT_BUCKET_NUM; b++)
+    {
+        sum += h->count[b];
+        if (sum > rank)
+        {
+            break;
+        }
+    }
+    if (b >= LAT_BUCKET_NUM - 1)
+    {
+        return (h->max);
+    }
+    v = (LatencyLow(b) + LatencyLow(b + 1)) / 2;
+
+    return (v < h->max ? v : h->max);
+}
+
+int LatencyStat(LAT_HIST *h, char *name, FILE *fp)
+{
+    if (h->total == 0)
+    {
+        fprintf(fp, "latency:%s no samples\n", name);
+        return (0);
+    }
+    fprintf(fp, "latency:%s %lu packets p50=%.1fus p99=%.1fus p999=%.1fus max=%.1fus\n",
+            name, h->total, LatencyPercentile(h, 0.5) / 1e3, LatencyPercentile(h, 0.99) / 1e3,
+            LatencyPercentile(h, 0.999) / 1e3, h->max / 1e3);
+
+    return (0);
+}
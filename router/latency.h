@@ -0,0 +1,6 @@
+#define LAT_SUB_BITS 3 //2のべき乗の区間を分ける数（2^3=8、誤差は1/8以内）
+
+void LatencyAdd(LAT_HIST *h,u_int64_t ns);
+void LatencyMerge(LAT_HIST *dst,LAT_HIST *src);
+u_int64_t LatencyPercentile(LAT_HIST *h,double p);
+int LatencyStat(LAT_HIST *h,char *name,FILE *fp);
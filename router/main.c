@@ -1,7 +1,8 @@
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <poll.h>
 #include <errno.h>
 #include <signal.h>
 #include <stdarg.h>
@@ -10,27 +11,220 @@
 #include <netinet/if_ether.h>
 #include <netinet/ip.h>
 #include <netinet/ip_icmp.h>
+#include <linux/if_packet.h>
 #include <pthread.h>
-#include "netutil.h"
+#include <sched.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include "base.h"
+#include "netutil.h"
 #include "ip2mac.h"
 #include "sendBuf.h"
+#include "route.h"
+#include "timer.h"
+#include "pool.h"
+#include "txQueue.h"
+#include "epoch.h"
+#include "hdrRewrite.h"
+#include "xsk.h"
+#include "latency.h"
+#include "flowCache.h"
+#include "policy.h"
+#include "acl.h"
+#include "nat.h"
+#include "police.h"
+#include "sched.h"
+#include "codel.h"
+#include "../common/cksum.h"
+#include "../common/uring.h"
 
 // ディスクリプタの構造体
 typedef struct
 {
-    char *Device1;    // 送信元デバイス
-    char *Device2;    // 送信先デバイス
+    char *DeviceName[DEVICE_MAX]; // 使うデバイス
+    int DeviceNum;                // デバイスの数
     int DebugOut;     // debag Option
     char *NextRouter; // 送信先ルータアドレス
+    char *RouteFile;  // 経路ファイル
+    int StatOut;      // 統計情報を出力する
+    int RxRing;       // TPACKET_V3の受信リングを使う
+    int RxBlockSize;  // 受信リングのブロックの大きさ
+    int RxTimeout;    // 受信リングのブロックを渡すまでの時間(ms)
+    int TxRing;       // sendmmsgの代わりにPACKET_TX_RINGで送る
+    int RxBatch;      // recvmmsgで一度に受信する数
+    int Workers;      // 転送スレッドの数
+    int Uring;        // io_uringで受信・送信する
+    int Xdp;          // AF_XDPで受信・送信する
+    int BusyPoll;     // 転送スレッドは待たずに受信を見て回る
+    int Cpus[WORKER_MAX]; // 転送スレッドを固定するCPU
+    int CpuNum;
+    int FlowCache;    // フローキャッシュのエントリ数（0なら使わない）
+    char *PolicyFile; // ポリシーファイル
+    char *AclFile;    // ACLファイル
+    char *NatDevice;  // NAPTの外側のデバイス
+    int NatMax;       // NAPTの変換エントリの数
+    char *PoliceFile; // ポリサーファイル
+    char *SchedFile;  // 送信スケジューラの設定ファイル
+    int Aqm;          // 近隣の解決を待つキューを滞留時間で捨てる
 } PARAM;
-PARAM Param = {"eth1", "eth2", 0, "192.168.0.254"};
+PARAM Param = {{"eth1", "eth2"}, 2, 0, "192.168.0.254", NULL, 0, 0, RX_RING_BLOCK_SIZE, RX_RING_TIMEOUT_MS, 0, RX_BATCH_DEFAULT, 1, 0, 0, 0, {0}, 0, FLOW_CACHE_SIZE, NULL, NULL, NULL, NAT_ENTRY_DEFAULT, NULL, NULL, 0};
+
+struct in_addr NextRouter; // 上位ルータアドレス（-gに複数書いたときは1つ目）
+
+extern int NhGroupNum; // ECMPのグループの数
+extern int NatDeviceNo; // NAPTの外側のデバイス（-1ならNAPTしない）
+extern unsigned long NeighDrops; // 近隣を解決できずに捨てたパケットの数
 
-struct in_addr NextRouter; // 上位ルータアドレス
+FIB Fib; // 経路表
 
-DEVICE Device[2]; // 2つのネットワークデバイスのディスクリプタを保持する
+WORKER Workers[WORKER_MAX]; // 転送スレッド
+
+DEVICE Device[DEVICE_MAX]; // ネットワークデバイスのディスクリプタを保持する
+int DeviceNum;             // デバイスの数
 
 int EndFlag = 0; // 終了フラグ
+volatile sig_atomic_t ReloadFlag = 0; // SIGHUPで経路ファイル・ポリシーファイル・ACLファイル・ポリサーファイルを読み直す
+int EndFd = -1;  // 終了を知らせるeventfd（すべてのスレッドのepollに登録する）
+
+void ParseCommandLine(int argc, char *argv[], PARAM *param)
+{
+    char *p;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "dg:r:p:a:n:L:Q:C:sRb:t:TB:w:UXP:F:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'd':
+            param->DebugOut = 1;
+            break;
+        case 'g':
+            // デフォルト経路の上位ルータ
+            param->NextRouter = optarg;
+            break;
+        case 'r':
+            // 経路ファイル
+            param->RouteFile = optarg;
+            break;
+        case 'p':
+            // ポリシーファイル（送信元・プロトコル・ポート・DSCPで経路表か次ホップを選ぶ）
+            param->PolicyFile = optarg;
+            break;
+        case 'a':
+            // ACLファイル（一致したルールでpermit/denyを決め、denyなら転送しない）
+            param->AclFile = optarg;
+            break;
+        case 'n':
+            // NAPT（このデバイスへ出ていくパケットの送信元をデバイスのアドレスに変換する、,の後は変換エントリの数）
+            param->NatDevice = optarg;
+            if ((p = strchr(optarg, ',')) != NULL)
+            {
+                *p = '\0';
+                param->NatMax = atoi(p + 1);
+            }
+            if (param->NatMax < 1 || param->NatMax > NAT_ENTRY_LIMIT)
+            {
+                fprintf(stderr, "nat entries must be 1..%d\n", NAT_ENTRY_LIMIT);
+                _exit(1);
+            }
+            break;
+        case 'L':
+            // ポリサーファイル（受信デバイス・送信元プレフィックスごとにsrTCM/trTCMで色を付け、redは捨てる）
+            param->PoliceFile = optarg;
+            break;
+        case 'Q':
+            // 送信スケジューラの設定ファイル（送信デバイスごとにDSCPでクラスのキューに分け、完全優先とDRRで送る）
+            param->SchedFile = optarg;
+            break;
+        case 'C':
+            // CoDelのtarget（ms、,の後はinterval）を決め、近隣の解決を待つキューもintervalより古いものを捨てる
+            // 送信スケジューラのクラスにかけるかどうかはsched-fileのcodel/fqで決める
+            if (CodelParam(atof(optarg), (p = strchr(optarg, ',')) != NULL ? atof(p + 1) : CODEL_INTERVAL_NS / 1e6) == -1)
+            {
+                fprintf(stderr, "codel: target must be > 0 and <= interval\n");
+                _exit(1);
+            }
+            param->Aqm = 1;
+            break;
+        case 's':
+            // 起動時と終了時に統計情報を出力する
+            param->StatOut = 1;
+            break;
+        case 'R':
+            // read()の代わりに受信リングを使う
+            param->RxRing = 1;
+            break;
+        case 'b':
+            // 受信リングのブロックの大きさ（ページサイズの倍数）
+            param->RxBlockSize = atoi(optarg);
+            break;
+        case 't':
+            param->RxTimeout = atoi(optarg);
+            break;
+        case 'T':
+            // 送信リングを使う（使えなければsendmmsg）
+            param->TxRing = 1;
+            break;
+        case 'B':
+            // 受信リングを使わないときにrecvmmsgで一度に受信する数
+            param->RxBatch = atoi(optarg);
+            break;
+        case 'w':
+            // 転送スレッドの数（PACKET_FANOUTでフローごとに振り分ける）
+            param->Workers = atoi(optarg);
+            if (param->Workers < 1 || param->Workers > WORKER_MAX)
+            {
+                fprintf(stderr, "workers must be 1..%d\n", WORKER_MAX);
+                _exit(1);
+            }
+            break;
+        case 'U':
+            // io_uringのmultishot受信とまとめた送信を使う（使えなければepoll）
+            param->Uring = 1;
+            break;
+        case 'X':
+            // 自分宛てのフレームをXDPでAF_XDPソケットに渡す（転送スレッドkはキューkを受け持つ。使えなければ通常の受信）
+            param->Xdp = 1;
+            break;
+        case 'P':
+            // busy-poll（転送スレッドkを k 番目のCPUに固定し、待たずに受信を見て回る）
+            param->BusyPoll = 1;
+            for (p = strtok(optarg, ","); p != NULL && param->CpuNum < WORKER_MAX; p = strtok(NULL, ","))
+            {
+                param->Cpus[param->CpuNum++] = atoi(p);
+            }
+            if (param->CpuNum == 0)
+            {
+                fprintf(stderr, "-P needs a cpu list (e.g. -P 2,3)\n");
+                _exit(1);
+            }
+            break;
+        case 'F':
+            // 転送スレッドごとのフローキャッシュのエントリ数（0なら毎回経路表と近隣表を引く）
+            param->FlowCache = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-d] [-s] [-g next-router[,next-router...]] [-r route-file] [-p policy-file] [-a acl-file] [-n nat-device[,entries]] [-L police-file] [-Q sched-file] [-C target-ms[,interval-ms]] [-X | -U | -R [-b block-size] [-t timeout-ms] | -B batch] [-T] [-w workers] [-P cpu,...] [-F flow-entries] [device ...]\n", argv[0]);
+            _exit(1);
+        }
+    }
+
+    // 残りの引数はすべてデバイス名（なければ eth1 eth2）
+    if (argc - optind > DEVICE_MAX)
+    {
+        fprintf(stderr, "devices must be 1..%d\n", DEVICE_MAX);
+        _exit(1);
+    }
+    if (argc - optind > 0)
+    {
+        for (param->DeviceNum = 0; optind < argc; optind++)
+        {
+            param->DeviceName[param->DeviceNum++] = argv[optind];
+        }
+    }
+}
 
 int DebugPrintf(char *fmt, ...)
 {
@@ -56,58 +250,23 @@ int DebugPerror(char *msg)
 	return(0);
 }
 
-int SendIcmpTimeExceeded(int deviceNo, struct ether_header *eh, struct iphdr *iphdr, u_char *data, int size)
+// 受け取ったパケットの送信元へICMPエラーを返す（受け取ったデバイスの送信キューに入れる）
+int SendIcmpError(WORKER *w, int deviceNo, u_char *data, int size, int type, int code)
 {
-    struct ether_header reh;
-    struct iphdr rih;
-    struct icmp icmp;
-    __u_char *ipptr;
-    __u_char *ptr, buf[1500];
+    u_char buf[ICMP_ERROR_MAX];
     int len;
 
-    // イーサヘッダのdhost/shostに引数イーサヘッダのdhost/shostをコピー
-    memcpy(reh.ether_dhost, eh->ether_shost, 6);
-    memcpy(reh.ether_shost, Device[deviceNo].hwaddr, 6);
-    reh.ether_type = htons(ETHERTYPE_IP); // データタイプをIPアドレスに指定
-
-    rih.version = 4;                               // Ipv4
-    rih.ihl = 20 / 4;                              // headerの長さ（32bit)
-    rih.tos = 0;                                   // サービスの種類　通常は0
-    rih.tot_len = htons(sizeof(struct icmp) + 64); // データのサイズ（icmpのサイズ+63bit）
-    rih.id = 0;                                    // 識別子
-    rih.frag_off = 0;                              // offset 通常は０
-    rih.ttl = 64;                                  // time to live
-    rih.protocol = IPPROTO_ICMP;                   // ICmp set
-    rih.check = 0;                                 // checksum
-    rih.saddr = Device[deviceNo].addr.s_addr;      // 送信元IP
-    rih.daddr = iphdr->saddr;                      // 宛先IP（前のIPヘッダから取得）
-
-    rih.check = checksum((__u_char *)&rih, sizeof(struct iphdr)); // sumcheckをする
-
-    icmp.icmp_type = ICMP_TIME_EXCEEDED;
-    icmp.icmp_code = ICMP_TIMXCEED_INTRANS;
-    icmp.icmp_cksum = 0;
-    icmp.icmp_void = 0;
-
-    ipptr = data + sizeof(struct ether_header);
-    icmp.icmp_cksum = checksum2((__u_char *)&icmp, 8, ipptr, 64);
-
-    ptr = buf;
-    memcpy(ptr, &reh, sizeof(struct ether_header));
-    ptr += sizeof(struct iphdr);
-    memcpy(ptr, &icmp, 8);
-    ptr += 8;
-
-    memcpy(ptr, ipptr, 64);
-    ptr += 64;
-    len = ptr - buf;
-
-    DebugPrintf("write:sendIcmpTimeExceeded:[%d]%dbytest\n", deviceNo, len);
-    write(Device[deviceNo].soc, buf, len);
+    if ((len = IcmpErrorBuild(buf, data, size, Device[deviceNo].hwaddr, Device[deviceNo].addr.s_addr, type, code)) == 0)
+    {
+        return (-1);
+    }
+
+    DebugPrintf("write:SendIcmpError:[%d]%d/%d %dbytes\n", deviceNo, type, code, len);
+    TxQueueSend(&w->txQueue[deviceNo], buf, len);
     return (0);
 }
 
-int AnalyzePacket(int deviceNo, __u_char *data, int size)
+int AnalyzePacket(WORKER *w, int deviceNo, __u_char *data, int size)
 {
     __u_char *ptr;
     int lest;
@@ -128,8 +287,7 @@ int AnalyzePacket(int deviceNo, __u_char *data, int size)
     // ポインタを勧め、取得したデータ部データサイズを縮小する
     eh = (struct ether_header *)ptr;
     ptr += sizeof(struct ether_header);
-
-    lest = sizeof(struct ether_header);
+    lest -= sizeof(struct ether_header);
 
     // deviceNo==dhostが一致するか調べる
     if (memcmp(&eh->ether_dhost, Device[deviceNo].hwaddr, 6) != 0)
@@ -167,8 +325,19 @@ int AnalyzePacket(int deviceNo, __u_char *data, int size)
     else if (ntohs(eh->ether_type) == ETHERTYPE_IP)
     {
         struct iphdr *iphdr;
-        u_char option[1500];
+        u_char *option;
         int optionLen;
+        NEXTHOP *nh;
+        IP2MAC *ip2mac;
+        FLOW_ENTRY *fe;
+        POLICY *policy;
+        ACL *acl;
+        POLICE_SET *ps;
+        in_addr_t target;
+        u_int32_t routeGen, seq, hash, key[POLICY_FIELDS];
+        int rule;
+        u_int64_t start;
+        char buf2[80];
 
         if (lest < sizeof(struct iphdr))
         {
@@ -179,18 +348,16 @@ int AnalyzePacket(int deviceNo, __u_char *data, int size)
         ptr += sizeof(struct iphdr);
         lest -= sizeof(struct iphdr);
 
+        // オプションはコピーせず、パケットの中をそのまま指す
         optionLen = iphdr->ihl * 4 - sizeof(struct iphdr);
-        if (optionLen > 0)
+        if (optionLen < 0 || optionLen > lest)
         {
-            if (optionLen >= 1500)
-            {
-                DebugPrintf("[%d]:IP optionLen(%d):too big\n", deviceNo, optionLen);
-                return (-1);
-            }
-            memcpy(option, ptr, optionLen);
-            ptr += optionLen;
-            lest -= optionLen;
+            DebugPrintf("[%d]:IP optionLen(%d):bad\n", deviceNo, optionLen);
+            return (-1);
         }
+        option = ptr;
+        ptr += optionLen;
+        lest -= optionLen;
 
         if (checkIPchecksum(iphdr, option, optionLen) == 0)
         {
@@ -199,136 +366,727 @@ int AnalyzePacket(int deviceNo, __u_char *data, int size)
             return (-1);
         }
 
-        if (iphdr->ttl - 1 == 0)
+        // ACLで破棄するものは、ICMPも返さずに捨てる
+        if ((acl = AclGet()) != NULL)
         {
-            DebugPrintf("[%d]:iphdr->ttl==0 error\n", deviceNo);
-            SendIcmpTimeExceeded(deviceNo, eh, iphdr, data, size);
+            PolicyKey(iphdr, ptr, lest, key);
+            if (AclCheck(acl, w->no, key) == ACL_DENY)
+            {
+                DebugPrintf("[%d]:%s acl deny\n", deviceNo, in_addr_t2str(iphdr->saddr, buf, sizeof(buf)));
+                return (-1);
+            }
+        }
+
+        // 帯域を超えたもの（red）も黙って捨てる
+        if ((ps = PoliceGet()) != NULL && PolicePacket(ps, w->cycles, deviceNo, iphdr) == POLICE_RED)
+        {
+            DebugPrintf("[%d]:%s police drop\n", deviceNo, in_addr_t2str(iphdr->saddr, buf, sizeof(buf)));
             return (-1);
         }
 
-        // ここまでは理解
-        tno = (!deviceNo);
+        // 外側のデバイスのアドレス宛てで変換エントリがあれば、宛先を内側に戻してから経路を引く
+        if (deviceNo == NatDeviceNo && iphdr->daddr == Device[deviceNo].addr.s_addr && NatInbound(iphdr, ptr, lest) == 1)
+        {
+            DebugPrintf("[%d]:nat in %s\n", deviceNo, in_addr_t2str(iphdr->daddr, buf, sizeof(buf)));
+        }
 
-        // iphdr->daddr が目的地のネットワークセグメントに属しているかどうかを確認します。
-        // これは、送信先IP アドレスが Device[tno].subnet と Device[tno].netmask によって指定されるネットワークセグメントに属しているかどうかを確認しています。
-        if ((iphdr->daddr & Device[tno].netmask.s_addr) == Device[tno].subnet.s_addr)
+        if (iphdr->ttl <= 1)
         {
-            // 属していた場合
-            IP2MAC *ip2mac;
+            DebugPrintf("[%d]:iphdr->ttl==0 error\n", deviceNo);
+            SendIcmpError(w, deviceNo, data, size, ICMP_TIME_EXCEEDED, ICMP_EXC_TTL);
+            return (-1);
+        }
 
-            // IP アドレス (iphdr->daddr) および送信先のネットワークセグメントへの情報を表示
-            DebugPrintf("[%d]:%s to TargetSegment\n", deviceNo, in_addr_t2str(iphdr->daddr, buf, sizeof(buf)));
+        start = Param.StatOut ? CpuCycles() : 0;
+        // 宛先がフローキャッシュにあれば、経路表と近隣表を引かずにイーサヘッダを書き換える
+        routeGen = RouteGen();
+        hash = __atomic_load_n(&NhGroupNum, __ATOMIC_ACQUIRE) > 0 ? IpFlowHash(iphdr, ptr, lest) : 0;
+        // ポリシーがあれば先に分類する（世代を読んだ後に読むので、差し替えの途中で作ったエントリは使われない）
+        // 宛先の変換とDSCPの付け直しの後の値で分類するので、ACLで作ったキーは使わずに作り直す
+        rule = -1;
+        if ((policy = PolicyGet()) != NULL)
+        {
+            PolicyKey(iphdr, ptr, lest, key);
+            rule = PolicyMatch(policy, key);
+        }
+        if ((fe = FlowCacheLookup(&w->flow, iphdr->daddr, hash, rule + 1, routeGen)) != NULL)
+        {
+            tno = fe->deviceNo;
+            if (tno == NatDeviceNo && deviceNo != NatDeviceNo && NatOutbound(iphdr, ptr, lest) == -1)
+            {
+                DebugPrintf("[%d]:nat out:error\n", deviceNo);
+                return (-1);
+            }
+            memcpy(eh, fe->mac, 12);
+            Ip2MacTouch(fe->ip2mac);
+        }
+        else
+        {
+            // 経路表から最長一致で送信先デバイスと次ホップを決める（ポリシーに一致すればその経路表か次ホップ）
+            if ((nh = rule == -1 ? RouteLookup(&Fib, iphdr->daddr) : PolicyRoute(policy, rule, &Fib, iphdr->daddr)) == NULL)
+            {
+                DebugPrintf("[%d]:%s no route\n", deviceNo, in_addr_t2str(iphdr->daddr, buf, sizeof(buf)));
+                return (-1);
+            }
+            // ECMPの経路ならフローのハッシュでメンバーを選ぶ
+            nh = NextHopSelect(nh, hash);
+            tno = nh->deviceNo;
 
-            // 送信先 IP アドレスが、デバイスの自身の IP アドレス (Device[tno].addr.s_addr) と一致しているかどうかを確認します。
-            if (iphdr->daddr == Device[tno].addr.s_addr)
+            if (nh->gateway == 0)
             {
-                // 送信先 IP アドレスが自身の IP アドレスと一致している場合、デバッグ情報を表示して（DebugPrintf）
-                // return (1) で処理を終了します。これは、送信先が自身である場合に特定の処理（ここでは return (1)）を行うための分岐です
-                DebugPrintf("[%d]:recv:myaddr\n", deviceNo);
-                return (1);
+                // 直結のセグメント宛
+                DebugPrintf("[%d]:%s to TargetSegment\n", deviceNo, in_addr_t2str(iphdr->daddr, buf, sizeof(buf)));
+
+                // 送信先が自身のアドレスの場合は転送しない
+                if (iphdr->daddr == Device[tno].addr.s_addr)
+                {
+                    DebugPrintf("[%d]:recv:myaddr\n", deviceNo);
+                    return (1);
+                }
+                target = iphdr->daddr;
+            }
+            else
+            {
+                // ゲートウェイ経由
+                DebugPrintf("[%d]:%s to NextRouter %s\n", deviceNo, in_addr_t2str(iphdr->daddr, buf, sizeof(buf)), in_addr_t2str(nh->gateway, buf2, sizeof(buf2)));
+                target = nh->gateway;
             }
 
-            // FLAG_NG(エラー)かip2mac->sd.dno != 0（送信中）である場合にエラー処理を行う
-            ip2mac = Ip2Mac(tno, iphdr->daddr, NULL);
-            if (ip2mac->flag == FLAG_NG || ip2mac->sd.dno != 0)
+            // FLAG_NG(解決中)かip2mac->sd.dno != 0（送信中）である場合は送信待ちに入れる
+            if ((ip2mac = Ip2Mac(tno, target, NULL)) == NULL)
             {
-                DebugPrintf("[%d]:Ip2Mac:error or sending\n", deviceNo);
-                AppendSendData(ip2mac, 1, iphdr->daddr, data, size);
                 return (-1);
             }
+            // MACアドレスは他のスレッドが書き換えることがあるので、そろった値をコピーして使う
+            if (Ip2MacReadSeq(ip2mac, hwaddr, &seq) != FLAG_OK || ip2mac->sd.dno != 0)
+            {
+                // 解決できなかった宛先は、問い合わせ直さずにすぐ捨てて送信元へ知らせる
+                if (__atomic_load_n(&ip2mac->state, __ATOMIC_RELAXED) == NEIGH_FAILED)
+                {
+                    DebugPrintf("[%d]:%s neighbor failed\n", deviceNo, in_addr_t2str(target, buf, sizeof(buf)));
+                    SendIcmpError(w, deviceNo, data, size, ICMP_DEST_UNREACH, ICMP_HOST_UNREACH);
+                    __atomic_add_fetch(&NeighDrops, 1, __ATOMIC_RELAXED);
+                    return (-1);
+                }
+                // 送信元の変換は送り出すときに BufferSendOne で行う（送れずに捨てたものには変換エントリを作らない）
+                DebugPrintf("[%d]:Ip2Mac:incomplete or sending\n", deviceNo);
+                AppendSendData(ip2mac, tno, deviceNo, target, data, size);
+                if (ip2mac->flag == FLAG_OK)
+                {
+                    // 送信中に追加したパケットを取り残さないよう要求を出す（入れ済みなら何もしない）
+                    AppendSendReqData(ip2mac);
+                }
+                return (-1);
+            }
+
+            // 外側のデバイスへ出ていくなら送信元を変換する（送ると決まってから行い、ICMPエラーは変換前のものに返す）
+            if (tno == NatDeviceNo && deviceNo != NatDeviceNo && NatOutbound(iphdr, ptr, lest) == -1)
+            {
+                DebugPrintf("[%d]:nat out:error\n", deviceNo);
+                return (-1);
+            }
+
+            // write ether_header to MAC add and now device add
+            memcpy(eh->ether_dhost, hwaddr, 6);
+            memcpy(eh->ether_shost, Device[tno].hwaddr, 6);
+            FlowCacheInsert(&w->flow, iphdr->daddr, hash, rule + 1, routeGen, tno, ip2mac, seq, hwaddr, Device[tno].hwaddr);
+        }
+        // ttl -1（チェックサムは差分だけ直す）
+        IpDecTtl(iphdr);
+
+        // 送信キューに入れ、wakeupの終わりにまとめて送る（スケジューラがあればクラスのキューに入れる）
+        if (w->sched != NULL)
+        {
+            SchedEnqueue(w->sched, tno, data, size, iphdr->tos, w->cycles);
+        }
+        else
+        {
+            TxQueueSend(&w->txQueue[tno], data, size);
+        }
+        if (w->rxStamp != 0 && w->latNum < LAT_PEND_MAX)
+        {
+            w->latPend[w->latNum++] = w->rxStamp;
+        }
+        if (start != 0)
+        {
+            if (fe != NULL)
+            {
+                w->flow.hitCycles += CpuCycles() - start;
+            }
             else
             {
-                // エラーが発生しなかった場合、ip2mac->hwaddr から MAC アドレスを取得し、それを hwaddr にコピーします。
-                memcpy(hwaddr, ip2mac->hwaddr, 6);
+                w->flow.missCycles += CpuCycles() - start;
+                w->flow.missTimed++;
             }
         }
+    }
+
+    return (0);
+}
+
+// 1つのデバイスの受信キューを読み切る
+// edge-triggeredなので空にするまで読まないと次の通知が来ない（recvmmsgが一杯にならなければ空になっている）
+// 1つのデバイスが他を待たせないよう RX_DRAIN_BUDGET 個で打ち切り、残っていれば1を返す
+int RouterDrain(WORKER *w, int i)
+{
+    int count, j, n, size;
+    u_char *data;
+
+    count = 0;
+    w->rxStamp = 0;
+    w->cycles = CpuCycles();
+    if (w->xsk[i].umem != NULL)
+    {
+        // AF_XDPのrxリングのフレームをUMEMの中のまま処理する
+        for (; count < RX_DRAIN_BUDGET; count++)
+        {
+            if ((size = XskRxNext(&w->xsk[i], &data)) <= 0)
+            {
+                break;
+            }
+            w->packets++;
+            w->bytes += size;
+            AnalyzePacket(w, i, data, size);
+        }
+        if (count >= RX_DRAIN_BUDGET)
+        {
+            return (1);
+        }
+        // ブロードキャスト（ARP要求など）はXDP_PASSでパケットソケットに届くので続けて読む
+    }
+
+    if (w->rxRing[i].map != NULL)
+    {
+        // 受信リングにたまっているフレームをその場で処理する
+        for (count = 0; count < RX_DRAIN_BUDGET; count++)
+        {
+            if ((size = RxRingNext(&w->rxRing[i], &data)) <= 0)
+            {
+                return (0);
+            }
+            w->packets++;
+            w->bytes += size;
+            if (Param.StatOut)
+            {
+                w->rxStamp = w->rxRing[i].stamp;
+            }
+            AnalyzePacket(w, i, data, size);
+        }
+        return (1);
+    }
+
+    for (; count < RX_DRAIN_BUDGET; count += n)
+    {
+        // 最大rxBatch.max個まとめて受信して処理する
+        if ((n = RxBatchRecv(w->soc[i], &w->rxBatch)) <= 0)
+        {
+            // EAGAINなら空、EINTRなら残っているかもしれない
+            return (n < 0 && errno == EINTR);
+        }
+        w->calls++;
+        for (j = 0; j < n; j++)
+        {
+            if ((size = w->rxBatch.msg[j].msg_len) == 0)
+            {
+                continue;
+            }
+            w->packets++;
+            w->bytes += size;
+            w->rxStamp = RxBatchStamp(&w->rxBatch, j);
+            // APIかIPか判別し、アドレスの確認を行って送信先を決め、送信する。
+            AnalyzePacket(w, i, w->rxBatch.iov[j].iov_base, size);
+        }
+        if (n < w->rxBatch.max)
+        {
+            return (0);
+        }
+    }
+
+    return (1);
+}
+
+// このwakeupで転送したフレームの遅延（カーネルの受信時刻から送信キューを送り出すまで）を記録する
+void RouterLatency(WORKER *w)
+{
+    struct timespec now;
+    u_int64_t t;
+    int k;
+
+    if (w->latNum == 0)
+    {
+        return;
+    }
+    clock_gettime(CLOCK_REALTIME, &now);
+    t = (u_int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+    for (k = 0; k < w->latNum; k++)
+    {
+        LatencyAdd(&w->lat, t > w->latPend[k] ? t - w->latPend[k] : 0);
+    }
+    w->latNum = 0;
+}
+
+// busy-pollで空振りが続いたら、少しずつ長くpauseしてハイパースレッドやメモリを譲る
+void RouterBackoff(WORKER *w)
+{
+    unsigned long n, k;
+
+    if (w->idle < BUSY_IDLE_SPIN)
+    {
+        return;
+    }
+    n = (w->idle - BUSY_IDLE_SPIN) >> 6;
+    n = 1UL << (n < BUSY_PAUSE_SHIFT_MAX ? n : BUSY_PAUSE_SHIFT_MAX);
+    for (k = 0; k < n; k++)
+    {
+        CPU_RELAX();
+    }
+}
+
+// 転送スレッドの処理
+// 共有の表（近隣表・経路表）はロックを取らずに読むので、epollで待つ間は待ち合わせから外しておく
+// epollは受信できるデバイスだけを返すので、デバイスが増えても1回のwakeupで全部を見て回らない
+// 終了はEndFdで起こされるので、タイムアウトで見に行く必要はない
+// busy-pollのときは待たずに全部のデバイスを見て回り、BUSY_IDLE_BLOCK 回続けて空ならepollで待つ
+int Router(WORKER *w)
+{
+    struct epoll_event events[DEVICE_MAX + 1];
+    unsigned long packets;
+    u_int32_t ready;
+    int nready, e, i, timeout;
+
+    while (EndFlag == 0)
+    {
+        if (Param.BusyPoll && w->idle < BUSY_IDLE_BLOCK)
+        {
+            // 1周ごとに区切りを通る（待たないのでオフラインにはしない）
+            EpochQuiescent(w->epoch);
+            RouterBackoff(w);
+            w->spins++;
+            ready = (1U << DeviceNum) - 1;
+            w->rxMore = 0;
+        }
         else
         {
-            // 目的地と現在のアドレスが一致していなかった場合
-            IP2MAC *ip2mac;
+            // 読み残しがあれば待たない、送り残しがあれば少しだけ待って送り直す
+            timeout = w->rxMore ? 0 : (w->txDirty.num > 0 || (w->sched != NULL && w->sched->busy) ? 1 : -1);
+            EpochOffline(w->epoch);
+            nready = epoll_wait(w->epfd, events, DEVICE_MAX + 1, timeout);
+            EpochOnline(w->epoch);
 
-            DebugPrintf("[%d]:%s to NextRouter\n", deviceNo, in_addr_t2str(iphdr->daddr, buf, sizeof(buf)));
-            // 次のルータのアドレスに書き変える
-            ip2mac = Ip2Mac(tno, NextRouter.s_addr, NULL);
-            if (ip2mac->flag == FLAG_NG || ip2mac->sd.dno != 0)
+            if (nready == -1)
             {
-                // エラーの処理
-                DebugPrintf("[%d]:Ip2Mac:error or sending\n", deviceNo);
-                AppendSendData(ip2mac, 1, NextRouter.s_addr, data, size);
-                return (-1);
+                if (errno != EINTR)
+                {
+                    DebugPerror("epoll_wait");
+                }
+                nready = 0;
             }
-            else
+            // 通知のあったデバイスと、前回読み残したデバイス（data.u32はデバイスの番号）
+            ready = w->rxMore;
+            w->rxMore = 0;
+            for (e = 0; e < nready; e++)
             {
-                // write hsaddr to MAC addres
-                memcpy(hwaddr, ip2mac->hwaddr, 6);
+                if (events[e].data.u32 < DEVICE_MAX)
+                {
+                    ready |= 1U << events[e].data.u32;
+                }
             }
         }
+        packets = w->packets;
+        while (ready)
+        {
+            i = __builtin_ctz(ready);
+            ready &= ready - 1;
+            if (RouterDrain(w, i))
+            {
+                w->rxMore |= 1U << i;
+            }
+        }
+        if (w->packets != packets)
+        {
+            w->wakeups++;
+            w->idle = 0;
+        }
+        else
+        {
+            w->idle++;
+        }
+
+        // このwakeupで転送したフレームをまとめて送る（送信待ちのあるキューだけ）
+        if (w->sched != NULL)
+        {
+            SchedDrain(w->sched, w->txQueue);
+        }
+        TxQueueFlushDirty(&w->txDirty);
+        RouterLatency(w);
+    }
+    EpochOffline(w->epoch);
+
+    return (0);
+}
+
+// io_uringの完了ごとに呼ばれる（tagは受信・送信ともデバイスの番号）
+void RouterUringEvent(void *arg, int type, int tag, u_char *data, int res)
+{
+    WORKER *w = (WORKER *)arg;
+
+    switch (type)
+    {
+    case URING_RECV:
+        w->packets++;
+        w->bytes += res;
+        AnalyzePacket(w, tag, data, res);
+        break;
+    case URING_SEND:
+        TxQueueUringDone(&w->txQueue[tag], res);
+        break;
+    }
+}
+
+// io_uringを使う転送スレッドの処理
+// デバイスごとのmultishot受信とEndFdのpollを登録しておき、io_uring_enter 1回で
+// 前回までに積んだ送信を渡すのと、次の完了を待つのを同時に行う
+int RouterUring(WORKER *w)
+{
+    int i;
+
+    for (i = 0; i < DeviceNum; i++)
+    {
+        if (UringRecv(w->uring, w->soc[i], i) == -1)
+        {
+            return (-1);
+        }
+    }
+    UringPoll(w->uring, EndFd, DEVICE_MAX);
 
-        // write ether_header to MAC add and now device add
-        memcpy(eh->ether_dhost, hwaddr, 6);
-        memcpy(eh->ether_shost, Device[tno].hwaddr, 6);
-        // ttl -1
-        iphdr->ttl--;
-        // sumcheck reset
-        iphdr->check = 0;
-        // sumcheck;
-        iphdr->check = checksum2((u_char *)iphdr, sizeof(struct iphdr), option, optionLen);
+    while (EndFlag == 0)
+    {
+        EpochOffline(w->epoch);
+        UringWait(w->uring, 1);
+        EpochOnline(w->epoch);
 
-        write(Device[tno].soc, data, size);
+        w->cycles = CpuCycles();
+        if (UringRun(w->uring, RouterUringEvent, w) > 0)
+        {
+            w->wakeups++;
+        }
+        if (w->sched != NULL)
+        {
+            SchedDrain(w->sched, w->txQueue);
+        }
     }
+    // 積み残した送信を渡しておく
+    UringWait(w->uring, 0);
+    EpochOffline(w->epoch);
 
     return (0);
 }
 
-int Router()
+void *RouterThread(void *arg)
 {
-    // network intarfaces descripta set by pollfd
-    struct pollfd targets[2];
-    int nready, i, size;
-    u_char buf[2048];
+    WORKER *w = (WORKER *)arg;
 
-    // target deviceにイベントフラグを追加
-    targets[0].fd = Device[0].soc;
-    targets[0].events = POLLIN | POLLERR;
-    targets[1].fd = Device[1].soc;
-    targets[1].events = POLLIN | POLLERR;
+    if (w->uring != NULL)
+    {
+        RouterUring(w);
+    }
+    else
+    {
+        Router(w);
+    }
+
+    return (NULL);
+}
+
+// メインスレッドの処理（時計の更新、期限切れの処理、解放待ちのエントリの回収、経路ファイルの読み直し）
+// timerfdでtickごとに起き、EndFdで終了する
+int Housekeeping()
+{
+    struct epoll_event ev, events[2];
+    int epfd, tfd, nready, e;
+    u_int64_t val;
+
+    if ((tfd = TimerFdOpen()) == -1)
+    {
+        return (-1);
+    }
+    if ((epfd = epoll_create1(0)) == -1)
+    {
+        DebugPerror("epoll_create1");
+        close(tfd);
+        return (-1);
+    }
+    ev.events = EPOLLIN;
+    ev.data.fd = tfd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, tfd, &ev);
+    ev.data.fd = EndFd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, EndFd, &ev);
 
     while (EndFlag == 0)
     {
-        // pollのイベントの回数を数える
-        switch (nready = poll(targets, 2, 100))
+        if ((nready = epoll_wait(epfd, events, 2, -1)) == -1)
         {
-        //-1回（エラーの場合）
-        case -1:
             if (errno != EINTR)
             {
-                DebugPerror("poll");
+                DebugPerror("epoll_wait");
             }
-            break;
-        case 0:
-            // 0回
-            break;
-        default:
-            // ターゲットのふらぐを見て出力する
-            for (i = 0; i < 2; i++)
+            continue;
+        }
+        for (e = 0; e < nready; e++)
+        {
+            if (events[e].data.fd == tfd && read(tfd, &val, sizeof(val)) == sizeof(val))
             {
-                if (targets[i].revents & (POLLIN | POLLERR))
-                {
-                    if ((size = read(Device[i].soc, buf, sizeof(buf))) <= 0)
-                    {
-                        // 読み込めていなかった場合はエラーを出力
-                        DebugPerror("read");
-                    }
-                    else
-                    {
-                        // APIかIPか判別し、アドレスの確認を行って送信先を決め、送信する。
-                        AnalyzePacket(i, buf, size);
-                    }
-                }
+                ClockUpdate();
+                TimerRun();
+                Ip2MacReclaim();
+                PolicyReclaim();
+                AclReclaim();
+                NatReclaim();
+                PoliceReclaim();
+            }
+        }
+        if (ReloadFlag)
+        {
+            // 経路の追加と入れ替えだけを行う（ECMPの経路はメンバーだけを入れ替える）
+            // ポリシーは経路表を作ってから丸ごと差し替える
+            ReloadFlag = 0;
+            if (Param.RouteFile != NULL)
+            {
+                RouteLoadFile(&Fib, Param.RouteFile);
+            }
+            if (Param.PolicyFile != NULL)
+            {
+                PolicyLoadFile(&Fib, Param.PolicyFile);
+            }
+            if (Param.StatOut)
+            {
+                RouteStat(&Fib, stderr);
+                PolicyStat(stderr);
+                AclStat(stderr);
+                PoliceStat(stderr);
+            }
+            if (Param.AclFile != NULL)
+            {
+                AclLoadFile(Param.AclFile, Param.Workers);
+            }
+            if (Param.PoliceFile != NULL)
+            {
+                PoliceLoadFile(Param.PoliceFile);
             }
-            break;
         }
     }
+    close(epfd);
+    close(tfd);
+
+    return (0);
+}
+
+// 受信したパケット数と、1パケットあたりのCPU時間を出力する
+int PrintRxStat(FILE *fp, struct timespec *start)
+{
+    struct timespec end;
+    struct rusage ru;
+    double sec, cpu;
+    unsigned int packets, drops;
+    unsigned long total, bytes, wakeups, calls, spins;
+    static LAT_HIST lat;
+    char name[80];
+    int i, k;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    getrusage(RUSAGE_SELF, &ru);
+    sec = (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+    cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+
+    total = bytes = wakeups = calls = spins = 0;
+    memset(&lat, 0, sizeof(lat));
+    for (k = 0; k < Param.Workers; k++)
+    {
+        total += Workers[k].packets;
+        bytes += Workers[k].bytes;
+        wakeups += Workers[k].wakeups;
+        calls += Workers[k].calls;
+        spins += Workers[k].spins;
+        LatencyMerge(&lat, &Workers[k].lat);
+    }
+
+    fprintf(fp, "rx:%s %lu packets %lu bytes in %.1fs (%.0f pps), %.2f packets/wakeup\n",
+            Param.Xdp ? "xdp" : (Param.Uring ? "io_uring" : (Param.RxRing ? "ring" : "recvmmsg")), total, bytes, sec, total / sec,
+            wakeups ? (double)total / wakeups : 0.0);
+    if (!Param.RxRing && !Param.Uring)
+    {
+        fprintf(fp, "rx:batch %d, %lu recvmmsg, %.2f packets/recvmmsg (fill %.1f%%)\n",
+                Param.RxBatch, calls, calls ? (double)total / calls : 0.0,
+                calls ? 100.0 * total / calls / Param.RxBatch : 0.0);
+    }
+    fprintf(fp, "rx:cpu %.3fs, %.0f ns/packet\n", cpu, total ? cpu * 1e9 / total : 0.0);
+    if (Param.BusyPoll)
+    {
+        fprintf(fp, "rx:busy-poll %lu spins, %.2f%% with packets\n", spins, spins ? 100.0 * wakeups / spins : 0.0);
+    }
+    // カーネルの受信時刻がわかるのはrecvmmsgと受信リングだけ
+    LatencyStat(&lat, Param.BusyPoll ? "busy-poll" : "epoll", fp);
+    for (k = 0; k < Param.Workers; k++)
+    {
+        if (Param.Workers > 1)
+        {
+            fprintf(fp, "rx:worker[%d] %lu packets (%.1f%%)\n", k, Workers[k].packets, total ? 100.0 * Workers[k].packets / total : 0.0);
+        }
+        snprintf(name, sizeof(name), "worker[%d]", k);
+        FlowCacheStat(&Workers[k].flow, name, fp);
+        if (Workers[k].uring != NULL)
+        {
+            UringStat(Workers[k].uring, name, fp);
+        }
+        for (i = 0; i < DeviceNum; i++)
+        {
+            if (Workers[k].rxRing[i].map != NULL && RxRingStat(Workers[k].soc[i], &packets, &drops) == 0)
+            {
+                fprintf(fp, "rx:worker[%d][%d] ring packets=%u drops=%u\n", k, i, packets, drops);
+            }
+            snprintf(name, sizeof(name), "%s/%d", Device[i].name, k);
+            if (Workers[k].xsk[i].umem != NULL)
+            {
+                XskStat(&Workers[k].xsk[i], name, fp);
+            }
+            TxQueueStat(&Workers[k].txQueue[i], name, fp);
+            if (Workers[k].sched != NULL)
+            {
+                SchedStat(Workers[k].sched, i, name, fp);
+            }
+        }
+    }
+    AclStat(fp);
+    NatStat(fp);
+    PoliceStat(fp);
+
+    return (0);
+}
+
+// 転送スレッドのソケット・受信バッファ・送信キューを作る
+// 複数のときはデバイスごとにPACKET_FANOUTのグループに入れ、カーネルがフローのハッシュで振り分ける
+// 受信ソケットはedge-triggeredでepollに登録し、data.u32にデバイスの番号を入れておく
+int InitWorker(WORKER *w, int no)
+{
+    struct epoll_event ev;
+    int i, ignore;
+
+    w->no = no;
+    if (Param.Uring && (w->uring = UringOpen(URING_ENTRIES, URING_RX_BUF_NUM, URING_TX_BUF_NUM, URING_BUF_SIZE)) == NULL)
+    {
+        if (no > 0)
+        {
+            return (-1);
+        }
+        DebugPrintf("io_uring not available, use epoll\n");
+        Param.Uring = 0;
+    }
+    if ((w->epfd = epoll_create1(0)) == -1)
+    {
+        DebugPerror("epoll_create1");
+        return (-1);
+    }
+    for (i = 0; i < DeviceNum; i++)
+    {
+        if ((w->soc[i] = InitRawSocket(Device[i].name, 0, 0)) == -1)
+        {
+            DebugPrintf("InitRawSocket:error:%s\n", Device[i].name);
+            return (-1);
+        }
+        if (w->uring != NULL || Param.Xdp)
+        {
+            // 自分たちが送ったフレームを受信バッファに入れないようにする（入っても宛先MACで捨てる）
+            ignore = 1;
+            setsockopt(w->soc[i], SOL_PACKET, PACKET_IGNORE_OUTGOING, &ignore, sizeof(ignore));
+        }
+        else if (Param.RxRing)
+        {
+            if (InitRxRing(w->soc[i], &w->rxRing[i], Param.RxBlockSize, RX_RING_BLOCK_NUM, Param.RxTimeout) == -1)
+            {
+                DebugPrintf("InitRxRing:error:%s\n", Device[i].name);
+                return (-1);
+            }
+        }
+        if (Param.StatOut && w->uring == NULL && !Param.RxRing)
+        {
+            // 遅延を測るためにカーネルの受信時刻を受け取る（受信リングはフレームのヘッダに入っている）
+            EnableRxStamp(w->soc[i]);
+        }
+        if (Param.BusyPoll)
+        {
+            SetBusyPoll(w->soc[i], BUSY_POLL_USEC, RX_DRAIN_BUDGET);
+        }
+        if (Param.Workers > 1)
+        {
+            if (JoinFanout(w->soc[i], (getpid() + i) & 0xFFFF, PACKET_FANOUT_HASH) == -1)
+            {
+                DebugPrintf("JoinFanout:error:%s\n", Device[i].name);
+                return (-1);
+            }
+        }
+        if (TxQueueInit(&w->txQueue[i], Device[i].name, w->soc[i], Param.TxRing, &w->txDirty) == -1)
+        {
+            DebugPrintf("TxQueueInit:error:%s\n", Device[i].name);
+            return (-1);
+        }
+        if (w->uring != NULL)
+        {
+            TxQueueUseUring(&w->txQueue[i], w->uring, i);
+        }
+        ev.events = EPOLLIN | EPOLLERR | EPOLLET;
+        ev.data.u32 = i;
+        if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->soc[i], &ev) == -1)
+        {
+            DebugPerror("epoll_ctl");
+            return (-1);
+        }
+        if (Param.Xdp)
+        {
+            // 転送スレッドnoはデバイスの受信キューnoのAF_XDPソケットを持つ（パケットソケットと同じ番号で登録する）
+            if (XskOpen(&w->xsk[i], i, Device[i].name, no) == -1)
+            {
+                DebugPrintf("XskOpen:error:%s queue %d\n", Device[i].name, no);
+                return (-1);
+            }
+            TxQueueUseXsk(&w->txQueue[i], &w->xsk[i]);
+            if (Param.BusyPoll)
+            {
+                SetBusyPoll(w->xsk[i].fd, BUSY_POLL_USEC, RX_DRAIN_BUDGET);
+            }
+            if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->xsk[i].fd, &ev) == -1)
+            {
+                DebugPerror("epoll_ctl");
+                return (-1);
+            }
+        }
+    }
+    // 終了の通知は読まずに残し、どのスレッドも起きるようにlevel-triggeredで登録する
+    ev.events = EPOLLIN;
+    ev.data.u32 = DEVICE_MAX;
+    if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, EndFd, &ev) == -1)
+    {
+        DebugPerror("epoll_ctl");
+        return (-1);
+    }
+    if (w->uring == NULL && !Param.RxRing && InitRxBatch(&w->rxBatch, Param.RxBatch) == -1)
+    {
+        DebugPrintf("InitRxBatch:error:%d\n", Param.RxBatch);
+        return (-1);
+    }
+    if (FlowCacheInit(&w->flow, Param.FlowCache) == -1)
+    {
+        return (-1);
+    }
+    if (Param.SchedFile != NULL && (w->sched = SchedInit(DeviceNum)) == NULL)
+    {
+        return (-1);
+    }
+    if ((w->epoch = EpochRegister()) == -1)
+    {
+        return (-1);
+    }
+    // スレッドが動き出すまでは待ち合わせを止めないようにする
+    EpochOffline(w->epoch);
 
     return (0);
 }
@@ -349,6 +1107,103 @@ int DisableIpForward()
     return (0);
 }
 
+// 上位ルータが属するデバイスを探す（見つからなければ最後のデバイス）
+int GatewayDeviceNo(in_addr_t gateway)
+{
+    int i;
+
+    for (i = 0; i < DeviceNum; i++)
+    {
+        if ((gateway & Device[i].netmask.s_addr) == Device[i].subnet.s_addr)
+        {
+            return (i);
+        }
+    }
+
+    return (DeviceNum - 1);
+}
+
+// 直結セグメント、デフォルト経路、経路ファイルから経路表を作る
+// -g にカンマで区切って複数の上位ルータを書くと、デフォルト経路はECMPになる
+int InitRoute()
+{
+    int i, num, deviceNo[NH_GROUP_MEMBER_MAX];
+    in_addr_t gateway[NH_GROUP_MEMBER_MAX];
+    char list[256], *p, *save;
+    struct in_addr addr;
+
+    if (RouteInit(&Fib, RT_TBL8_MAX_DEFAULT) == -1)
+    {
+        DebugPrintf("RouteInit:error\n");
+        return (-1);
+    }
+
+    for (i = 0; i < DeviceNum; i++)
+    {
+        RouteAdd(&Fib, Device[i].subnet.s_addr, __builtin_popcount(Device[i].netmask.s_addr), i, 0);
+    }
+    snprintf(list, sizeof(list), "%s", Param.NextRouter);
+    num = 0;
+    for (p = strtok_r(list, ",", &save); p != NULL && num < NH_GROUP_MEMBER_MAX; p = strtok_r(NULL, ",", &save))
+    {
+        if (inet_aton(p, &addr) == 0)
+        {
+            DebugPrintf("bad next router %s\n", p);
+            return (-1);
+        }
+        gateway[num] = addr.s_addr;
+        deviceNo[num++] = GatewayDeviceNo(addr.s_addr);
+    }
+    if (num > 0 && RouteAddGroup(&Fib, 0, 0, num, deviceNo, gateway) == -1)
+    {
+        return (-1);
+    }
+
+    if (Param.RouteFile != NULL)
+    {
+        if (RouteLoadFile(&Fib, Param.RouteFile) == -1)
+        {
+            DebugPrintf("RouteLoadFile:error:%s\n", Param.RouteFile);
+            return (-1);
+        }
+    }
+
+    if (Param.PolicyFile != NULL)
+    {
+        if (PolicyLoadFile(&Fib, Param.PolicyFile) == -1)
+        {
+            DebugPrintf("PolicyLoadFile:error:%s\n", Param.PolicyFile);
+            return (-1);
+        }
+    }
+
+    if (Param.StatOut)
+    {
+        RouteStat(&Fib, stderr);
+        PolicyStat(stderr);
+    }
+
+    if (Param.AclFile != NULL)
+    {
+        if (AclLoadFile(Param.AclFile, Param.Workers) == -1)
+        {
+            DebugPrintf("AclLoadFile:error:%s\n", Param.AclFile);
+            return (-1);
+        }
+    }
+
+    if (Param.PoliceFile != NULL)
+    {
+        if (PoliceLoadFile(Param.PoliceFile) == -1)
+        {
+            DebugPrintf("PoliceLoadFile:error:%s\n", Param.PoliceFile);
+            return (-1);
+        }
+    }
+
+    return (0);
+}
+
 // 送信街データをバックグラウンドで並列処理させる
 void *BufThread(void *arg)
 {
@@ -357,9 +1212,17 @@ void *BufThread(void *arg)
     return (NULL);
 }
 
+void ReloadSignal(int sig)
+{
+    ReloadFlag = 1;
+}
+
 void EndSignal(int sig)
 {
+    u_int64_t one = 1;
+
     EndFlag = 1;
+    write(EndFd, &one, sizeof(one));
 }
 
 pthread_t BufTid;
@@ -368,44 +1231,106 @@ int main(int argc, char *argv[], char *envp[])
 {
     char buf[80];
     pthread_attr_t attr;
-    int status;
+    int status, i, k;
+    struct timespec start;
+    cpu_set_t cpus;
+    long ncpu;
+
+    ParseCommandLine(argc, argv, &Param);
+    DeviceNum = Param.DeviceNum;
 
-    inet_aton(Param.NextRouter, &NextRouter);                                      // 上位ルータのIPアドレスを文字列からざstruct in_addr型に変換する
+    snprintf(buf, sizeof(buf), "%.*s", (int)strcspn(Param.NextRouter, ","), Param.NextRouter);
+    inet_aton(buf, &NextRouter);                                                   // 上位ルータのIPアドレスを文字列からざstruct in_addr型に変換する
     DebugPrintf("NextRouter=%s\n", my_inet_ntoa_r(&NextRouter, buf, sizeof(buf))); // 出力
 
-    // DeviceのMac add, IP addr, subnet,maskがエラーであった場合
-    if (GetDeviceInfo(Param.Device1, Device[0].hwaddr, &Device[0].addr, &Device[0].subnet, &Device[0].netmask) == -1)
+    for (i = 0; i < DeviceNum; i++)
     {
-        DebugPrintf("GetDeviceInfo:error:%s\n", Param.Device1);
+        Device[i].name = Param.DeviceName[i];
+        // DeviceのMac add, IP addr, subnet,maskがエラーであった場合
+        if (GetDeviceInfo(Device[i].name, Device[i].hwaddr, &Device[i].addr, &Device[i].subnet, &Device[i].netmask) == -1)
+        {
+            DebugPrintf("GetDeviceInfo:error:%s\n", Device[i].name);
+            return (-1);
+        }
+
+        // 通信がうまく行った場合アドレスやサブネットが出力される
+        DebugPrintf("%s OK\n", Device[i].name);
+        DebugPrintf("addr=%s\n", my_inet_ntoa_r(&Device[i].addr, buf, sizeof(buf)));
+        DebugPrintf("subnet=%s\n", my_inet_ntoa_r(&Device[i].subnet, buf, sizeof(buf)));
+        DebugPrintf("netmask=%s\n", my_inet_ntoa_r(&Device[i].netmask, buf, sizeof(buf)));
+    }
+
+    if (Param.Xdp)
+    {
+        // XDPはio_uringや受信リングより優先する
+        for (i = 0; i < DeviceNum; i++)
+        {
+            if (XdpAttach(i, Device[i].name, Device[i].hwaddr) == -1)
+            {
+                DebugPrintf("XDP not available, use packet sockets\n");
+                while (--i >= 0)
+                {
+                    XdpDetach(i);
+                }
+                Param.Xdp = 0;
+                break;
+            }
+        }
+        if (Param.Xdp)
+        {
+            Param.Uring = Param.RxRing = 0;
+        }
+    }
+    if ((EndFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+    {
+        DebugPerror("eventfd");
         return (-1);
     }
-    if ((Device[0].soc = InitRawSocket(Param.Device1, 0, 0)) == -1)
+    if (Param.Aqm)
+    {
+        SendDataAqm(CodelInterval());
+    }
+    if (Param.SchedFile != NULL && SchedLoadFile(Param.SchedFile) == -1)
     {
-        // インターフェイスエラー
-        DebugPrintf("InitRawSocket:error:%s\n", Param.Device1);
+        DebugPrintf("SchedLoadFile:error:%s\n", Param.SchedFile);
         return (-1);
     }
+    for (k = 0; k < Param.Workers; k++)
+    {
+        if (InitWorker(&Workers[k], k) == -1)
+        {
+            return (-1);
+        }
+    }
+    // ARP要求とBufThreadの送信には1つ目の転送スレッドのソケットを使う
+    for (i = 0; i < DeviceNum; i++)
+    {
+        Device[i].soc = Workers[0].soc[i];
+    }
+    if (Param.RxRing)
+    {
+        DebugPrintf("rx ring:block=%d x %d timeout=%dms\n", Param.RxBlockSize, RX_RING_BLOCK_NUM, Param.RxTimeout);
+    }
+    DebugPrintf("workers=%d\n", Param.Workers);
 
-    // 通信がうまく行った場合アドレスやサブネットが出力される
-    DebugPrintf("%s OK\n", Param.Device1);
-    DebugPrintf("addr=%s\n", my_inet_ntoa_r(&Device[0].addr, buf, sizeof(buf)));
-    DebugPrintf("subnet=%s\n", my_inet_ntoa_r(&Device[0].subnet, buf, sizeof(buf)));
-    DebugPrintf("netmask=%s\n", my_inet_ntoa_r(&Device[0].netmask, buf, sizeof(buf)));
-
-    if (GetDeviceInfo(Param.Device2, Device[1].hwaddr, &Device[1].addr, &Device[1].subnet, &Device[1].netmask) == -1)
+    if (InitRoute() == -1)
     {
-        DebugPrintf("GetDeviceInfo:error:%s\n", Param.Device2);
         return (-1);
     }
-    if ((Device[1].soc = InitRawSocket(Param.Device2, 0, 0)) == -1)
+    TimerInit();
+    PoolInit(POOL_INIT_NUM);
+    if (Param.NatDevice != NULL)
+    {
+        if ((i = RouteDeviceNo(Param.NatDevice)) == -1 || NatInit(i, Param.NatMax) == -1)
+        {
+            fprintf(stderr, "nat:%s:cannot init\n", Param.NatDevice);
+            return (-1);
+        }
+    }
+    if (SendReqInit(Param.TxRing) == -1)
     {
-        DebugPrintf("InitRawSocket:error:%s\n", Param.Device1);
         return (-1);
     }
-    DebugPrintf("%s OK\n", Param.Device2);
-    DebugPrintf("addr=%s\n", my_inet_ntoa_r(&Device[1].addr, buf, sizeof(buf)));
-    DebugPrintf("subnet=%s\n", my_inet_ntoa_r(&Device[1].subnet, buf, sizeof(buf)));
-    DebugPrintf("netmask=%s\n", my_inet_ntoa_r(&Device[1].netmask, buf, sizeof(buf)));
 
     // カーネルを止める
     DisableIpForward();
@@ -420,19 +1345,71 @@ int main(int argc, char *argv[], char *envp[])
     signal(SIGINT, EndSignal);
     signal(SIGTERM, EndSignal);
     signal(SIGQUIT, EndSignal);
+    signal(SIGHUP, ReloadSignal);
 
     signal(SIGPIPE, SIG_IGN);
     signal(SIGTTIN, SIG_IGN);
     signal(SIGTTOU, SIG_IGN);
 
     DebugPrintf("router start\n");
-    Router(); // ルータを呼び出して処理を開始する
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    // 転送スレッドの起動（複数のときはフローが同じコアに留まるようにCPUに固定する、-Pなら指定のCPUに固定する）
+    ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    for (k = 0; k < Param.Workers; k++)
+    {
+        if ((status = pthread_create(&Workers[k].tid, &attr, RouterThread, &Workers[k])) != 0)
+        {
+            DebugPrintf("pthread_create:%s\n", strerror(status));
+            return (-1);
+        }
+        if (Param.CpuNum > 0 || (Param.Workers > 1 && ncpu > 0))
+        {
+            CPU_ZERO(&cpus);
+            CPU_SET(Param.CpuNum > 0 ? Param.Cpus[k % Param.CpuNum] : k % ncpu, &cpus);
+            if ((status = pthread_setaffinity_np(Workers[k].tid, sizeof(cpus), &cpus)) != 0)
+            {
+                DebugPrintf("pthread_setaffinity_np:%s\n", strerror(status));
+            }
+        }
+    }
+    // 終了するまで時計とタイマーを進める（timerfdが作れなければ転送スレッドも止める）
+    if (Housekeeping() == -1)
+    {
+        EndSignal(SIGTERM);
+    }
+    for (k = 0; k < Param.Workers; k++)
+    {
+        pthread_join(Workers[k].tid, NULL);
+    }
     DebugPrintf("router end\n");
-    // 処理街バッファのスレッドを終了
+    // 処理街バッファのスレッドを起こして終了させる
+    SendReqWakeup();
     pthread_join(BufTid, NULL);
 
-    close(Device[0].soc);
-    close(Device[1].soc);
+    if (Param.StatOut)
+    {
+        PrintRxStat(stderr, &start);
+        BufferSendStat(stderr);
+        PoolStat(stderr);
+    }
+
+    for (k = 0; k < Param.Workers; k++)
+    {
+        for (i = 0; i < DeviceNum; i++)
+        {
+            XskClose(&Workers[k].xsk[i]);
+            close(Workers[k].soc[i]);
+        }
+        close(Workers[k].epfd);
+    }
+    if (Param.Xdp)
+    {
+        for (i = 0; i < DeviceNum; i++)
+        {
+            XdpDetach(i);
+        }
+    }
+    close(EndFd);
 
     return (0);
 }
@@ -0,0 +1,665 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <net/ethernet.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
+#include <netinet/ip_icmp.h>
+#include <pthread.h>
+#include "base.h"
+#include "netutil.h"
+#include "nat.h"
+#include "timer.h"
+#include "epoch.h"
+#include "hdrRewrite.h"
+#include "../common/cksum.h"
+
+extern int DebugPrintf(char *fmt, ...);
+extern int DebugPerror(char *msg);
+
+extern DEVICE Device[DEVICE_MAX];
+
+// このファイルでは外側のデバイスへ出ていくパケットの送信元を、そのデバイスのアドレスとポートに変換するNAPTを扱う
+// 変換エントリは起動時に決めた数だけ確保し、それ以上は作らない（メモリの上限が決まる）
+// 外向きは(proto, 内側のアドレス・ポート, 相手のアドレス・ポート)、内向きは(proto, 外側のポート, 相手のアドレス・ポート)で
+// それぞれハッシュ表を引くので、1パケットあたりの処理はエントリ数によらない
+// 外側のポートは相手ごとに使い分けるので、外側のアドレスが1つでもポートの数より多くの変換を持てる
+// ハッシュ表とエントリの扱いは近隣表と同じで、転送スレッドはロックを取らずに読み、追加と削除だけ mutex を取る
+// 外したエントリは待ち合わせの後に空きに戻すので、転送スレッドは EpochQuiescent までエントリを使ってよい
+// チェックサムは書き換えた値の差分だけで直し、ペイロードは足し直さない
+// 外側から来たICMPエラーは、中に入っている元のパケットも内側のアドレス・ポートに戻す（RFC 5508）
+// 断片は先頭以外にポートがなく、再構成もしないので変換せずに捨てる（untranslatableとは別に数える）
+
+#define NAT_OUT 0 //内側から引く表
+#define NAT_IN 1 //外側から引く表
+
+int NatDeviceNo = -1; // 外側のデバイス（-1ならNAPTしない）
+
+struct
+{
+    NAT_ENTRY *entry; //変換エントリ（max個まとめて確保する）
+    int max;
+    int no; //一度でも使ったエントリ数
+    int *freeNo; //空きエントリの番号
+    int freeNum;
+    int *retireNo; //表から外して待ち合わせ中のエントリの番号
+    int retireNum;
+    u_int32_t *slot[2]; //ハッシュ表（エントリ番号+1、0は空き、maxの2倍以上）
+    u_int32_t mask;
+    int count; //使用中のエントリ数
+    u_int32_t removeSeq; //ハッシュ表を詰め直している間は奇数（NatIndexRemove で進める）
+    unsigned long created, expired, full, noPort, drops, frags, icmpErrors;
+    pthread_mutex_t mutex;
+} Nat = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+
+static u_int32_t NatMix(u_int32_t h)
+{
+    h ^= h >> 16;
+    h *= 0x7FEB352D;
+    h ^= h >> 15;
+    h *= 0x846CA68B;
+    return (h ^ (h >> 16));
+}
+
+//アドレスは上位のビットしか変わらないことが多いので、1つずつ混ぜてから次を足す
+static u_int32_t NatHash(int t, NAT_ENTRY *key)
+{
+    u_int32_t h;
+
+    h = NatMix((t == NAT_OUT ? key->inAddr : 0) ^ key->proto);
+    h = NatMix(h ^ key->remAddr);
+    return (NatMix(h ^ (((u_int32_t)(t == NAT_OUT ? key->inPort : key->extPort) << 16) | key->remPort)));
+}
+
+static int NatKeyEqual(int t, NAT_ENTRY *e, NAT_ENTRY *key)
+{
+    if (e->proto != key->proto || e->remAddr != key->remAddr || e->remPort != key->remPort)
+    {
+        return (0);
+    }
+    if (t == NAT_OUT)
+    {
+        return (e->inAddr == key->inAddr && e->inPort == key->inPort);
+    }
+
+    return (e->extPort == key->extPort);
+}
+
+//ハッシュ表の位置を返す（見つからなければ空きの位置、ロックを取った状態で呼ぶ）
+static u_int32_t NatIndexSearch(int t, NAT_ENTRY *key)
+{
+    u_int32_t i, no;
+
+    for (i = NatHash(t, key) & Nat.mask;; i = (i + 1) & Nat.mask)
+    {
+        no = Nat.slot[t][i];
+        if (no == 0 || NatKeyEqual(t, &Nat.entry[no - 1], key))
+        {
+            return (i);
+        }
+    }
+}
+
+//ロックを取らずに探す
+//削除で詰め直している最中は見落とすことがあるので、見つからなければ NatFind で確かめる
+static NAT_ENTRY *NatLookup(int t, NAT_ENTRY *key)
+{
+    NAT_ENTRY *e;
+    u_int32_t i, n, no;
+
+    for (i = NatHash(t, key) & Nat.mask, n = 0; n <= Nat.mask; i = (i + 1) & Nat.mask, n++)
+    {
+        if ((no = __atomic_load_n(&Nat.slot[t][i], __ATOMIC_ACQUIRE)) == 0)
+        {
+            break;
+        }
+        e = &Nat.entry[no - 1];
+        if (NatKeyEqual(t, e, key) && __atomic_load_n(&e->flag, __ATOMIC_RELAXED) != FLAG_FREE)
+        {
+            return (e);
+        }
+    }
+
+    return (NULL);
+}
+
+//ロックを取らずに探す
+//見つからなくても、探している間に詰め直しがなければ（removeSeqが同じで偶数なら）ないと決めてよい
+//外から来る知らないパケット（スキャンや期限切れの後の応答）で転送スレッドが mutex を取り合わないようにする
+//詰め直しが続いて決められないときだけロックを取って探し直す
+static NAT_ENTRY *NatFind(int t, NAT_ENTRY *key)
+{
+    NAT_ENTRY *e;
+    u_int32_t no, seq;
+    int try;
+
+    for (try = 0; try < NAT_FIND_TRY; try++)
+    {
+        seq = __atomic_load_n(&Nat.removeSeq, __ATOMIC_ACQUIRE);
+        if ((e = NatLookup(t, key)) != NULL)
+        {
+            return (e);
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (!(seq & 1) && __atomic_load_n(&Nat.removeSeq, __ATOMIC_RELAXED) == seq)
+        {
+            return (NULL);
+        }
+    }
+    pthread_mutex_lock(&Nat.mutex);
+    no = Nat.slot[t][NatIndexSearch(t, key)];
+    pthread_mutex_unlock(&Nat.mutex);
+
+    return (no != 0 ? &Nat.entry[no - 1] : NULL);
+}
+
+//線形探索のハッシュ表から消し、後ろに続くエントリを詰め直す
+static void NatIndexRemove(int t, u_int32_t i)
+{
+    u_int32_t j, k;
+
+    // ロックを取らずに探しているスレッドに、詰め直していることを知らせる
+    __atomic_store_n(&Nat.removeSeq, Nat.removeSeq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    j = i;
+    while (1)
+    {
+        j = (j + 1) & Nat.mask;
+        if (Nat.slot[t][j] == 0)
+        {
+            break;
+        }
+        k = NatHash(t, &Nat.entry[Nat.slot[t][j] - 1]) & Nat.mask;
+        if ((i <= j) ? (i < k && k <= j) : (i < k || k <= j))
+        {
+            continue;
+        }
+        __atomic_store_n(&Nat.slot[t][i], Nat.slot[t][j], __ATOMIC_RELEASE);
+        i = j;
+    }
+    __atomic_store_n(&Nat.slot[t][i], 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&Nat.removeSeq, Nat.removeSeq + 1, __ATOMIC_RELEASE);
+}
+
+//期限までの秒数（TCPは状態で変える）
+static time_t NatTimeout(NAT_ENTRY *e)
+{
+    if (e->proto == IPPROTO_TCP)
+    {
+        return (e->state == NAT_TCP_EST ? NAT_TCP_TIMEOUT_SEC : NAT_TCP_TRANS_TIMEOUT_SEC);
+    }
+    if (e->proto == IPPROTO_UDP)
+    {
+        return (NAT_UDP_TIMEOUT_SEC);
+    }
+
+    return (NAT_ICMP_TIMEOUT_SEC);
+}
+
+//表から外す（ロックを取った状態で呼ぶ）
+static void NatFree(NAT_ENTRY *e)
+{
+    __atomic_store_n(&e->flag, FLAG_FREE, __ATOMIC_RELAXED);
+    NatIndexRemove(NAT_OUT, NatIndexSearch(NAT_OUT, e));
+    NatIndexRemove(NAT_IN, NatIndexSearch(NAT_IN, e));
+    e->retire = EpochRetire();
+    Nat.retireNo[Nat.retireNum++] = e - Nat.entry;
+    Nat.count--;
+}
+
+//タイマーホイールから呼ばれる
+//lastTime はパケットごとに更新するだけなので、ここで期限を確かめて延長されていれば入れ直す
+static void NatExpire(TIMER *timer)
+{
+    NAT_ENTRY *e;
+    time_t expire;
+
+    e = (NAT_ENTRY *)((char *)timer - offsetof(NAT_ENTRY, timer));
+
+    pthread_mutex_lock(&Nat.mutex);
+    expire = e->lastTime + NatTimeout(e) + 1;
+    if (NowSec >= expire)
+    {
+        NatFree(e);
+        Nat.expired++;
+        pthread_mutex_unlock(&Nat.mutex);
+        return;
+    }
+    TimerAdd(timer, (expire - NowSec) * 1000);
+    pthread_mutex_unlock(&Nat.mutex);
+}
+
+//待ち合わせの済んだエントリを空きに戻す（メインスレッドからtickごとに呼ぶ）
+int NatReclaim()
+{
+    int i, n, count;
+
+    if (NatDeviceNo == -1)
+    {
+        return (0);
+    }
+    count = 0;
+    pthread_mutex_lock(&Nat.mutex);
+    for (i = n = 0; i < Nat.retireNum; i++)
+    {
+        if (!EpochPassed(Nat.entry[Nat.retireNo[i]].retire))
+        {
+            Nat.retireNo[n++] = Nat.retireNo[i];
+            continue;
+        }
+        Nat.freeNo[Nat.freeNum++] = Nat.retireNo[i];
+        count++;
+    }
+    Nat.retireNum = n;
+    pthread_mutex_unlock(&Nat.mutex);
+
+    return (count);
+}
+
+//外側のポートを決めてエントリを作る（ロックを取った状態で呼ぶ）
+//ポートは内側のアドレス・ポートから決めた位置から探すので、空いていれば相手が変わっても同じポートになる
+static NAT_ENTRY *NatCreate(NAT_ENTRY *key)
+{
+    NAT_ENTRY *e, k;
+    u_int32_t start, range;
+    int no, try;
+
+    if (Nat.freeNum > 0)
+    {
+        no = Nat.freeNo[--Nat.freeNum];
+    }
+    else if (Nat.no < Nat.max)
+    {
+        no = Nat.no++;
+    }
+    else
+    {
+        Nat.full++;
+        return (NULL);
+    }
+
+    k = *key;
+    k.remAddr = k.remPort = 0;
+    start = NatHash(NAT_OUT, &k);
+    range = NAT_PORT_MAX - NAT_PORT_MIN + 1;
+    k = *key;
+    for (try = 0; try < NAT_PORT_TRY; try++)
+    {
+        k.extPort = htons(NAT_PORT_MIN + (start + try) % range);
+        if (Nat.slot[NAT_IN][NatIndexSearch(NAT_IN, &k)] == 0)
+        {
+            break;
+        }
+    }
+    if (try == NAT_PORT_TRY)
+    {
+        Nat.freeNo[Nat.freeNum++] = no;
+        Nat.noPort++;
+        return (NULL);
+    }
+
+    //まだ表に入っていないので、そのまま書き換えてよい
+    e = &Nat.entry[no];
+    e->proto = k.proto;
+    e->state = NAT_TCP_SYN;
+    e->inAddr = k.inAddr;
+    e->inPort = k.inPort;
+    e->extPort = k.extPort;
+    e->remAddr = k.remAddr;
+    e->remPort = k.remPort;
+    e->lastTime = NowSec;
+    e->flag = FLAG_OK;
+    e->timer.func = NatExpire;
+    TimerAdd(&e->timer, (NatTimeout(e) + 1) * 1000);
+
+    __atomic_store_n(&Nat.slot[NAT_OUT][NatIndexSearch(NAT_OUT, e)], no + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&Nat.slot[NAT_IN][NatIndexSearch(NAT_IN, e)], no + 1, __ATOMIC_RELEASE);
+    Nat.count++;
+    Nat.created++;
+
+    return (e);
+}
+
+//パケットからキーを取り出し、書き換えるポート（ICMPはid）とチェックサムの位置を返す
+//変換できないもの（断片、TCP/UDP/ICMP echo以外）は-1
+static int NatParse(struct iphdr *iphdr, u_char *l4, int l4len, int t, NAT_ENTRY *key, u_int16_t **port, u_int16_t **check)
+{
+    struct tcphdr *th;
+    struct udphdr *uh;
+    struct icmphdr *icmp;
+    u_int16_t *sport, *dport;
+
+    if (iphdr->frag_off & htons(IP_MF | IP_OFFMASK))
+    {
+        return (-1);
+    }
+    memset(key, 0, sizeof(NAT_ENTRY));
+    key->proto = iphdr->protocol;
+    if (iphdr->protocol == IPPROTO_TCP && l4len >= sizeof(struct tcphdr))
+    {
+        th = (struct tcphdr *)l4;
+        sport = &th->source;
+        dport = &th->dest;
+        *check = &th->check;
+    }
+    else if (iphdr->protocol == IPPROTO_UDP && l4len >= sizeof(struct udphdr))
+    {
+        uh = (struct udphdr *)l4;
+        sport = &uh->source;
+        dport = &uh->dest;
+        *check = &uh->check;
+    }
+    else if (iphdr->protocol == IPPROTO_ICMP && l4len >= 8)
+    {
+        // echoのidを両方向のポートとして扱う
+        icmp = (struct icmphdr *)l4;
+        if (icmp->type != (t == NAT_OUT ? ICMP_ECHO : ICMP_ECHOREPLY))
+        {
+            return (-1);
+        }
+        sport = dport = &icmp->un.echo.id;
+        *check = &icmp->checksum;
+    }
+    else
+    {
+        return (-1);
+    }
+
+    if (t == NAT_OUT)
+    {
+        key->inAddr = iphdr->saddr;
+        key->inPort = *sport;
+        key->remAddr = iphdr->daddr;
+        key->remPort = iphdr->protocol == IPPROTO_ICMP ? 0 : *dport;
+        *port = sport;
+    }
+    else
+    {
+        key->extPort = *dport;
+        key->remAddr = iphdr->saddr;
+        key->remPort = iphdr->protocol == IPPROTO_ICMP ? 0 : *sport;
+        *port = dport;
+    }
+
+    return (0);
+}
+
+//使われているエントリの期限を延ばし、TCPの状態を進める
+//状態が変わるのは1つの接続で高々2回なので、そのときだけロックを取る（FINの後は期限を縮める）
+static void NatTouch(NAT_ENTRY *e, u_char *l4, int t)
+{
+    struct tcphdr *th;
+    time_t now;
+    int state;
+
+    now = NowSec;
+    if (e->lastTime != now)
+    {
+        __atomic_store_n(&e->lastTime, now, __ATOMIC_RELAXED);
+    }
+    if (e->proto != IPPROTO_TCP || e->state == NAT_TCP_FIN)
+    {
+        return;
+    }
+    th = (struct tcphdr *)l4;
+    if (th->fin || th->rst)
+    {
+        state = NAT_TCP_FIN;
+    }
+    else if (t == NAT_IN && e->state == NAT_TCP_SYN)
+    {
+        state = NAT_TCP_EST;
+    }
+    else
+    {
+        return;
+    }
+    pthread_mutex_lock(&Nat.mutex);
+    if (e->flag == FLAG_OK && e->state != NAT_TCP_FIN)
+    {
+        e->state = state;
+        if (state == NAT_TCP_FIN)
+        {
+            TimerAdd(&e->timer, (NAT_TCP_TRANS_TIMEOUT_SEC + 1) * 1000);
+        }
+    }
+    pthread_mutex_unlock(&Nat.mutex);
+}
+
+//外側のデバイスへ出ていくパケットの送信元を変換する（変換できなければ-1で、捨てる）
+int NatOutbound(struct iphdr *iphdr, u_char *l4, int l4len)
+{
+    NAT_ENTRY key, *e;
+    u_int16_t *port, *check;
+    u_int32_t no;
+    int udp;
+
+    if (iphdr->frag_off & htons(IP_MF | IP_OFFMASK))
+    {
+        __atomic_add_fetch(&Nat.frags, 1, __ATOMIC_RELAXED);
+        return (-1);
+    }
+    if (NatParse(iphdr, l4, l4len, NAT_OUT, &key, &port, &check) == -1)
+    {
+        __atomic_add_fetch(&Nat.drops, 1, __ATOMIC_RELAXED);
+        return (-1);
+    }
+    if ((e = NatLookup(NAT_OUT, &key)) == NULL)
+    {
+        // 他のスレッドが先に作っていればそれを使う
+        pthread_mutex_lock(&Nat.mutex);
+        no = Nat.slot[NAT_OUT][NatIndexSearch(NAT_OUT, &key)];
+        e = no != 0 ? &Nat.entry[no - 1] : NatCreate(&key);
+        pthread_mutex_unlock(&Nat.mutex);
+        if (e == NULL)
+        {
+            return (-1);
+        }
+    }
+    NatTouch(e, l4, NAT_OUT);
+
+    if (iphdr->protocol == IPPROTO_ICMP)
+    {
+        // ICMPのチェックサムは疑似ヘッダを含まない
+        *check = CksumAdjust16(*check, *port, e->extPort);
+        *port = e->extPort;
+        IpRewriteAddr(iphdr, &iphdr->saddr, Device[NatDeviceNo].addr.s_addr, NULL, 0);
+        return (0);
+    }
+    udp = iphdr->protocol == IPPROTO_UDP;
+    L4RewritePort(port, e->extPort, check, udp);
+    IpRewriteAddr(iphdr, &iphdr->saddr, Device[NatDeviceNo].addr.s_addr, check, udp);
+
+    return (0);
+}
+
+//外側から来たICMPエラーを、中に入っている元のパケット（外向きに変換した後のもの）のエントリで内側に戻す（RFC 5508）
+//元のパケットは送信元が外側のアドレス・ポートなので、それを内側のものに、外側の宛先も内側のアドレスにする
+//元のパケットはL4の先頭8バイトしかないこともあるので、TCPのチェックサムは入っているときだけ直す
+//中をいくつも書き換えるので、ICMPのチェックサムは差分ではなく足し直す（エラーは小さく、数も少ない）
+static int NatInboundError(struct iphdr *iphdr, u_char *l4, int l4len)
+{
+    struct icmphdr *icmp, *inIcmp;
+    struct iphdr *inner;
+    struct tcphdr *th;
+    struct udphdr *uh;
+    u_char *inL4;
+    NAT_ENTRY key, *e;
+    u_int16_t *port, *check;
+    int ihl, inLen, udp;
+
+    if (l4len < 8 + sizeof(struct iphdr))
+    {
+        return (0);
+    }
+    icmp = (struct icmphdr *)l4;
+    inner = (struct iphdr *)(l4 + 8);
+    ihl = inner->ihl * 4;
+    inLen = l4len - 8 - ihl;
+    if (ihl < sizeof(struct iphdr) || inLen < 8 || inner->saddr != Device[NatDeviceNo].addr.s_addr || (inner->frag_off & htons(IP_OFFMASK)))
+    {
+        return (0);
+    }
+    inL4 = (u_char *)inner + ihl;
+
+    memset(&key, 0, sizeof(NAT_ENTRY));
+    key.proto = inner->protocol;
+    key.remAddr = inner->daddr;
+    check = NULL;
+    if (inner->protocol == IPPROTO_TCP)
+    {
+        th = (struct tcphdr *)inL4;
+        port = &th->source;
+        key.remPort = th->dest;
+        if (inLen >= offsetof(struct tcphdr, check) + sizeof(th->check))
+        {
+            check = &th->check;
+        }
+    }
+    else if (inner->protocol == IPPROTO_UDP)
+    {
+        uh = (struct udphdr *)inL4;
+        port = &uh->source;
+        key.remPort = uh->dest;
+        check = &uh->check;
+    }
+    else if (inner->protocol == IPPROTO_ICMP && ((struct icmphdr *)inL4)->type == ICMP_ECHO)
+    {
+        inIcmp = (struct icmphdr *)inL4;
+        port = &inIcmp->un.echo.id;
+        check = &inIcmp->checksum;
+    }
+    else
+    {
+        return (0);
+    }
+    key.extPort = *port;
+    if ((e = NatFind(NAT_IN, &key)) == NULL)
+    {
+        return (0);
+    }
+
+    if (inner->protocol == IPPROTO_ICMP)
+    {
+        *check = CksumAdjust16(*check, *port, e->inPort);
+        *port = e->inPort;
+        IpRewriteAddr(inner, &inner->saddr, e->inAddr, NULL, 0);
+    }
+    else
+    {
+        udp = inner->protocol == IPPROTO_UDP;
+        L4RewritePort(port, e->inPort, check, udp);
+        IpRewriteAddr(inner, &inner->saddr, e->inAddr, check, udp);
+    }
+    IpRewriteAddr(iphdr, &iphdr->daddr, e->inAddr, NULL, 0);
+    icmp->checksum = 0;
+    icmp->checksum = checksum(l4, l4len);
+    __atomic_add_fetch(&Nat.icmpErrors, 1, __ATOMIC_RELAXED);
+
+    return (1);
+}
+
+//外側のデバイスのアドレス宛のパケットの宛先を内側に戻す（変換したら1、エントリがなければ0）
+int NatInbound(struct iphdr *iphdr, u_char *l4, int l4len)
+{
+    NAT_ENTRY key, *e;
+    u_int16_t *port, *check;
+    int udp;
+
+    // Ethernetの詰め物をICMPのチェックサムに含めないよう、IPヘッダの長さで切る
+    if (l4len > ntohs(iphdr->tot_len) - iphdr->ihl * 4)
+    {
+        l4len = ntohs(iphdr->tot_len) - iphdr->ihl * 4;
+    }
+    if (iphdr->protocol == IPPROTO_ICMP && l4len >= 8 && !(iphdr->frag_off & htons(IP_MF | IP_OFFMASK)))
+    {
+        switch (((struct icmphdr *)l4)->type)
+        {
+        case ICMP_DEST_UNREACH:
+        case ICMP_SOURCE_QUENCH:
+        case ICMP_TIME_EXCEEDED:
+        case ICMP_PARAMETERPROB:
+            return (NatInboundError(iphdr, l4, l4len));
+        }
+    }
+    if (NatParse(iphdr, l4, l4len, NAT_IN, &key, &port, &check) == -1)
+    {
+        return (0);
+    }
+    if ((e = NatFind(NAT_IN, &key)) == NULL)
+    {
+        return (0);
+    }
+    NatTouch(e, l4, NAT_IN);
+
+    if (iphdr->protocol == IPPROTO_ICMP)
+    {
+        *check = CksumAdjust16(*check, *port, e->inPort);
+        *port = e->inPort;
+        IpRewriteAddr(iphdr, &iphdr->daddr, e->inAddr, NULL, 0);
+        return (1);
+    }
+    udp = iphdr->protocol == IPPROTO_UDP;
+    L4RewritePort(port, e->inPort, check, udp);
+    IpRewriteAddr(iphdr, &iphdr->daddr, e->inAddr, check, udp);
+
+    return (1);
+}
+
+//変換エントリとハッシュ表を確保する（ハッシュ表はmaxの2倍以上の2のべき乗）
+int NatInit(int deviceNo, int max)
+{
+    u_int32_t size;
+
+    if (max < 1 || max > NAT_ENTRY_LIMIT)
+    {
+        DebugPrintf("NatInit:bad max %d\n", max);
+        return (-1);
+    }
+    for (size = 1; size < (u_int32_t)max * 2; size <<= 1)
+        ;
+    Nat.entry = (NAT_ENTRY *)calloc(max, sizeof(NAT_ENTRY));
+    Nat.freeNo = (int *)malloc(max * sizeof(int));
+    Nat.retireNo = (int *)malloc(max * sizeof(int));
+    Nat.slot[NAT_OUT] = (u_int32_t *)calloc(size, sizeof(u_int32_t));
+    Nat.slot[NAT_IN] = (u_int32_t *)calloc(size, sizeof(u_int32_t));
+    if (Nat.entry == NULL || Nat.freeNo == NULL || Nat.retireNo == NULL || Nat.slot[NAT_OUT] == NULL || Nat.slot[NAT_IN] == NULL)
+    {
+        DebugPrintf("NatInit:calloc:%s\n", strerror(errno));
+        free(Nat.entry);
+        free(Nat.freeNo);
+        free(Nat.retireNo);
+        free(Nat.slot[NAT_OUT]);
+        free(Nat.slot[NAT_IN]);
+        return (-1);
+    }
+    Nat.max = max;
+    Nat.mask = size - 1;
+    NatDeviceNo = deviceNo;
+
+    return (0);
+}
+
+int NatStat(FILE *fp)
+{
+    size_t mem;
+
+    if (NatDeviceNo == -1)
+    {
+        return (0);
+    }
+    mem = (size_t)Nat.max * (sizeof(NAT_ENTRY) + 2 * sizeof(int)) + 2 * (size_t)(Nat.mask + 1) * sizeof(u_int32_t);
+    pthread_mutex_lock(&Nat.mutex);
+    fprintf(fp, "nat:%s %d/%d entries (%zuMB), created=%lu expired=%lu full=%lu noport=%lu untranslatable=%lu fragments=%lu icmperrors=%lu\n",
+            Device[NatDeviceNo].name, Nat.count, Nat.max, mem >> 20, Nat.created, Nat.expired, Nat.full, Nat.noPort, Nat.drops, Nat.frags, Nat.icmpErrors);
+    pthread_mutex_unlock(&Nat.mutex);
+
+    return (0);
+}
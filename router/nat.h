@@ -0,0 +1,21 @@
+#define NAT_ENTRY_DEFAULT 65536 //変換エントリの数（既定値）
+#define NAT_ENTRY_LIMIT (1 << 22) //変換エントリの最大数
+#define NAT_PORT_MIN 1024 //外側で使うポートの範囲
+#define NAT_PORT_MAX 65535
+#define NAT_PORT_TRY 64 //空きポートを探す回数
+#define NAT_FIND_TRY 4 //ロックを取らずに探し直す回数（詰め直しと重なったとき）
+
+#define NAT_TCP_TIMEOUT_SEC 7440 //確立したTCP（RFC 5382）
+#define NAT_TCP_TRANS_TIMEOUT_SEC 240 //確立前・FIN/RSTの後のTCP
+#define NAT_UDP_TIMEOUT_SEC 300 //UDP（RFC 4787）
+#define NAT_ICMP_TIMEOUT_SEC 60 //ICMP echo
+
+#define NAT_TCP_SYN 0 //外向きのパケットしか見ていない
+#define NAT_TCP_EST 1 //内向きのパケットも見た
+#define NAT_TCP_FIN 2 //FINかRSTを見た
+
+int NatInit(int deviceNo,int max);
+int NatOutbound(struct iphdr *iphdr,unsigned char *l4,int l4len);
+int NatInbound(struct iphdr *iphdr,unsigned char *l4,int l4len);
+int NatReclaim();
+int NatStat(FILE *fp);
@@ -0,0 +1,162 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#include <pthread.h>
+#include "base.h"
+#include "nat.h"
+#include "timer.h"
+
+// このファイルではNAPT（nat.c）に指定した数の変換を作り、メモリ使用量と1パケットあたりの時間を測る
+// 内側のアドレス・ポートと相手を乱数にしたUDPで、作る、外向き（エントリあり）、内向き（エントリあり）、
+// 内向き（エントリなし、スキャンや期限切れの後の応答）を順に測る
+// 変換の表は作り直せないので、1回の実行で1つの数だけ測る（make bench で 100k と 1M を測る）
+// 引数: [entries] [seed]
+
+#define BENCH_PASS 4 //エントリのあるパケットを通す回数
+#define BENCH_PKT 28 //IPヘッダ+UDPヘッダ
+
+extern DEVICE Device[DEVICE_MAX];
+
+static double Now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+static u_int32_t Rand32()
+{
+    return ((u_int32_t)rand() ^ ((u_int32_t)rand() << 16));
+}
+
+static void MakeUdp(u_char *pkt, in_addr_t saddr, u_int16_t sport, in_addr_t daddr, u_int16_t dport)
+{
+    struct iphdr *iphdr;
+    struct udphdr *uh;
+
+    memset(pkt, 0, BENCH_PKT);
+    iphdr = (struct iphdr *)pkt;
+    iphdr->version = 4;
+    iphdr->ihl = 5;
+    iphdr->ttl = 64;
+    iphdr->protocol = IPPROTO_UDP;
+    iphdr->tot_len = htons(BENCH_PKT);
+    iphdr->saddr = saddr;
+    iphdr->daddr = daddr;
+    uh = (struct udphdr *)(pkt + sizeof(struct iphdr));
+    uh->source = sport;
+    uh->dest = dport;
+    uh->len = htons(sizeof(struct udphdr));
+    uh->check = 0x1234;
+}
+
+// 1パケットあたりの時間（ns）、パケットは書き換わるのでコピーしてから渡す
+static double Run(u_char *pkt, int num, int out, int *ok)
+{
+    u_char buf[BENCH_PKT];
+    double t;
+    int p, i, k;
+
+    *ok = 0;
+    t = Now();
+    for (p = 0; p < BENCH_PASS; p++)
+    {
+        for (i = 0; i < num; i++)
+        {
+            // 表のどこを引くかが続かないよう、飛び飛びに選ぶ
+            k = (u_int32_t)(i * 2654435761U) % num;
+            memcpy(buf, pkt + (size_t)k * BENCH_PKT, BENCH_PKT);
+            if (out)
+            {
+                *ok += NatOutbound((struct iphdr *)buf, buf + sizeof(struct iphdr), BENCH_PKT - sizeof(struct iphdr)) == 0;
+            }
+            else
+            {
+                *ok += NatInbound((struct iphdr *)buf, buf + sizeof(struct iphdr), BENCH_PKT - sizeof(struct iphdr));
+            }
+        }
+    }
+
+    return ((Now() - t) * 1e9 / ((double)BENCH_PASS * num));
+}
+
+int main(int argc, char *argv[])
+{
+    u_char *out, *in, *miss, buf[BENCH_PKT];
+    struct iphdr *iphdr;
+    struct udphdr *uh;
+    in_addr_t ext;
+    unsigned int seed;
+    double t;
+    int num, i, ok;
+
+    num = argc > 1 ? atoi(argv[1]) : 100000;
+    seed = argc > 2 ? atoi(argv[2]) : time(NULL);
+    printf("seed:%u\n", seed);
+    srand(seed);
+
+    TimerInit();
+    ext = htonl(0xC0000201);
+    Device[0].name = "bench";
+    Device[0].addr.s_addr = ext;
+    if (NatInit(0, num) == -1)
+    {
+        fprintf(stderr, "NatInit:error\n");
+        return (1);
+    }
+    out = (u_char *)malloc((size_t)num * BENCH_PKT);
+    in = (u_char *)malloc((size_t)num * BENCH_PKT);
+    miss = (u_char *)malloc((size_t)num * BENCH_PKT);
+    if (out == NULL || in == NULL || miss == NULL)
+    {
+        perror("malloc");
+        return (1);
+    }
+
+    // 内側は10.0.0.0/8、相手は乱数のアドレスとポート
+    for (i = 0; i < num; i++)
+    {
+        MakeUdp(out + (size_t)i * BENCH_PKT, htonl(0x0A000000 | (Rand32() & 0xFFFFFF)), htons(1024 + rand() % 64512),
+                htonl(Rand32()), htons(1 + rand() % 65535));
+    }
+    // 作る（外へ出る最初のパケット）、外向きの変換結果から返りのパケットを作る
+    ok = 0;
+    t = Now();
+    for (i = 0; i < num; i++)
+    {
+        memcpy(buf, out + (size_t)i * BENCH_PKT, BENCH_PKT);
+        if (NatOutbound((struct iphdr *)buf, buf + sizeof(struct iphdr), BENCH_PKT - sizeof(struct iphdr)) == 0)
+        {
+            ok++;
+        }
+        iphdr = (struct iphdr *)buf;
+        uh = (struct udphdr *)(buf + sizeof(struct iphdr));
+        MakeUdp(in + (size_t)i * BENCH_PKT, iphdr->daddr, uh->dest, ext, uh->source);
+        // 同じ相手から変換に使わないポート（NAT_PORT_MINより下）へ
+        MakeUdp(miss + (size_t)i * BENCH_PKT, iphdr->daddr, uh->dest, ext, htons(rand() % NAT_PORT_MIN));
+    }
+    t = Now() - t;
+    printf("create:%d/%d entries %.1f ns/packet\n", ok, num, t * 1e9 / num);
+    NatStat(stdout);
+
+    t = Run(out, num, 1, &ok);
+    printf("outbound:%.1f ns/packet (%d translated)\n", t, ok);
+    t = Run(in, num, 0, &ok);
+    printf("inbound:%.1f ns/packet (%d translated)\n", t, ok);
+    t = Run(miss, num, 0, &ok);
+    printf("inbound miss:%.1f ns/packet (%d translated)\n", t, ok);
+
+    free(out);
+    free(in);
+    free(miss);
+
+    return (0);
+}
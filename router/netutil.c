@@ -1,14 +1,28 @@
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <linux/if.h>
 #include <net/ethernet.h>
 #include <netinet/ip.h>
-#include <netpacket/packet.h>
+#include <netinet/ip_icmp.h>
 #include <netinet/if_ether.h>
+#include <linux/if_packet.h>
+#include <time.h>
+#include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "base.h"
+#include "netutil.h"
+#include "timer.h"
+#include "../common/cksum.h"
 
 extern int DebugPrintf(char *fmt, ...);
 extern int DebugPerror(char *msg);
@@ -127,6 +141,304 @@ int InitRawSocket(char *device, int promiscFlag, int ipOnly)
     return (soc);
 }
 
+// InitRawSocketで作ったソケットにTPACKET_V3の受信リングを付ける
+// カーネルがblockSizeごとのブロックにフレームを詰め、ブロックが一杯になるか timeoutMs たつとユーザ側に渡す
+// read()のようにフレームごとのシステムコールとコピーがなくなる
+int InitRxRing(int soc, RX_RING *ring, int blockSize, int blockNum, int timeoutMs)
+{
+    struct tpacket_req3 req;
+    int ver;
+
+    ver = TPACKET_V3;
+    if (setsockopt(soc, SOL_PACKET, PACKET_VERSION, &ver, sizeof(ver)) < 0)
+    {
+        DebugPerror("setsockopt:PACKET_VERSION");
+        return (-1);
+    }
+
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = blockSize;
+    req.tp_block_nr = blockNum;
+    req.tp_frame_size = RX_RING_FRAME_SIZE;
+    req.tp_frame_nr = (blockSize / RX_RING_FRAME_SIZE) * blockNum;
+    req.tp_retire_blk_tov = timeoutMs;
+    if (setsockopt(soc, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0)
+    {
+        DebugPerror("setsockopt:PACKET_RX_RING");
+        return (-1);
+    }
+
+    memset(ring, 0, sizeof(RX_RING));
+    ring->mapSize = (size_t)blockSize * blockNum;
+    ring->map = mmap(NULL, ring->mapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED, soc, 0);
+    if (ring->map == MAP_FAILED)
+    {
+        // MAP_LOCKEDはRLIMIT_MEMLOCKで失敗することがある
+        ring->map = mmap(NULL, ring->mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, soc, 0);
+    }
+    if (ring->map == MAP_FAILED)
+    {
+        DebugPerror("mmap");
+        ring->map = NULL;
+        return (-1);
+    }
+    ring->blockSize = blockSize;
+    ring->blockNum = blockNum;
+
+    return (0);
+}
+
+// 受信リングから次のフレームを取り出し、サイズを返す（なければ0）
+// 返したフレームは次に呼ぶまで有効で、ブロックを読み終えたところでカーネルに返す
+int RxRingNext(RX_RING *ring, __u_char **data)
+{
+    struct tpacket_block_desc *bd;
+    struct tpacket3_hdr *hdr;
+    struct sockaddr_ll *sll;
+
+    while (1)
+    {
+        bd = (struct tpacket_block_desc *)(ring->map + (size_t)ring->cur * ring->blockSize);
+        if (ring->pkt == NULL)
+        {
+            if (!(__atomic_load_n(&bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER))
+            {
+                return (0);
+            }
+            ring->pkt = (__u_char *)bd + bd->hdr.bh1.offset_to_first_pkt;
+            ring->left = bd->hdr.bh1.num_pkts;
+        }
+        if (ring->left == 0)
+        {
+            // ブロックを読み終えたのでカーネルに返して次へ
+            __atomic_store_n(&bd->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+            ring->cur = (ring->cur + 1) % ring->blockNum;
+            ring->pkt = NULL;
+            continue;
+        }
+
+        hdr = (struct tpacket3_hdr *)ring->pkt;
+        ring->pkt += hdr->tp_next_offset;
+        ring->left--;
+
+        // 自分が送信したフレームは読み飛ばす
+        sll = (struct sockaddr_ll *)((__u_char *)hdr + TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+        if (sll->sll_pkttype == PACKET_OUTGOING)
+        {
+            continue;
+        }
+
+        *data = (__u_char *)hdr + hdr->tp_mac;
+        ring->stamp = (u_int64_t)hdr->tp_sec * 1000000000 + hdr->tp_nsec;
+        return (hdr->tp_snaplen);
+    }
+}
+
+// カーネル側の受信数とドロップ数を取得する（取得するとカーネル側の値は0に戻る）
+int RxRingStat(int soc, unsigned int *packets, unsigned int *drops)
+{
+    struct tpacket_stats_v3 st;
+    socklen_t len;
+
+    len = sizeof(st);
+    if (getsockopt(soc, SOL_PACKET, PACKET_STATISTICS, &st, &len) < 0)
+    {
+        DebugPerror("getsockopt:PACKET_STATISTICS");
+        return (-1);
+    }
+    *packets = st.tp_packets;
+    *drops = st.tp_drops;
+
+    return (0);
+}
+
+// 同じidで入ったソケットにカーネルがフレームを振り分ける（HASHならフローごとに同じソケットへ）
+int JoinFanout(int soc, int id, int mode)
+{
+    int arg;
+
+    arg = (id & 0xFFFF) | (mode << 16);
+    if (setsockopt(soc, SOL_PACKET, PACKET_FANOUT, &arg, sizeof(arg)) < 0)
+    {
+        DebugPerror("setsockopt:PACKET_FANOUT");
+        return (-1);
+    }
+
+    return (0);
+}
+
+int InitRxBatch(RX_BATCH *b, int max)
+{
+    int i;
+
+    if (max < 1 || max > RX_BATCH_MAX)
+    {
+        DebugPrintf("InitRxBatch:bad batch size %d\n", max);
+        return (-1);
+    }
+    b->max = max;
+    b->buf = (__u_char *)malloc((size_t)max * PKT_BUF_SIZE);
+    b->msg = (struct mmsghdr *)calloc(max, sizeof(struct mmsghdr));
+    b->iov = (struct iovec *)calloc(max, sizeof(struct iovec));
+    b->from = (struct sockaddr_ll *)calloc(max, sizeof(struct sockaddr_ll));
+    b->ctrl = (__u_char *)calloc(max, RX_CTRL_SIZE);
+    if (b->buf == NULL || b->msg == NULL || b->iov == NULL || b->from == NULL || b->ctrl == NULL)
+    {
+        DebugPerror("malloc");
+        return (-1);
+    }
+    for (i = 0; i < max; i++)
+    {
+        b->iov[i].iov_base = b->buf + (size_t)i * PKT_BUF_SIZE;
+        b->iov[i].iov_len = PKT_BUF_SIZE;
+        b->msg[i].msg_hdr.msg_iov = &b->iov[i];
+        b->msg[i].msg_hdr.msg_iovlen = 1;
+        b->msg[i].msg_hdr.msg_name = &b->from[i];
+        b->msg[i].msg_hdr.msg_control = b->ctrl + (size_t)i * RX_CTRL_SIZE;
+    }
+
+    return (0);
+}
+
+// たまっているフレームを最大 b->max 個まとめて受信し、受信数を返す（待たない）
+// i番目のフレームは b->iov[i].iov_base に b->msg[i].msg_len バイト入る
+// 自分が送信したフレームは msg_len を0にして返す
+int RxBatchRecv(int soc, RX_BATCH *b)
+{
+    int i, n;
+
+    for (i = 0; i < b->max; i++)
+    {
+        b->msg[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_ll);
+        b->msg[i].msg_hdr.msg_controllen = RX_CTRL_SIZE;
+    }
+    if ((n = recvmmsg(soc, b->msg, b->max, MSG_DONTWAIT, NULL)) < 0)
+    {
+        if (errno != EAGAIN && errno != EINTR)
+        {
+            DebugPerror("recvmmsg");
+        }
+        return (-1);
+    }
+    for (i = 0; i < n; i++)
+    {
+        if (b->from[i].sll_pkttype == PACKET_OUTGOING)
+        {
+            b->msg[i].msg_len = 0;
+        }
+    }
+
+    return (n);
+}
+
+// i番目のフレームの受信時刻（ns、CLOCK_REALTIME）を返す（EnableRxStampしていなければ0）
+u_int64_t RxBatchStamp(RX_BATCH *b, int i)
+{
+    struct cmsghdr *cmsg;
+    struct timespec ts;
+
+    for (cmsg = CMSG_FIRSTHDR(&b->msg[i].msg_hdr); cmsg != NULL; cmsg = CMSG_NXTHDR(&b->msg[i].msg_hdr, cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS)
+        {
+            memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+            return ((u_int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+        }
+    }
+
+    return (0);
+}
+
+// 5-tuple（TCP/UDP/SCTP以外と断片はアドレスとプロトコルだけ）からフローのハッシュを求める
+// 同じフローは同じ値になるので、ECMPで振り分けても順番が入れ替わらない
+u_int32_t IpFlowHash(struct iphdr *iphdr, __u_char *l4, int l4len)
+{
+    u_int32_t h, ports;
+
+    ports = 0;
+    if ((iphdr->protocol == IPPROTO_TCP || iphdr->protocol == IPPROTO_UDP || iphdr->protocol == IPPROTO_SCTP) &&
+        !(iphdr->frag_off & htons(IP_MF | IP_OFFMASK)) && l4len >= 4)
+    {
+        memcpy(&ports, l4, 4);
+    }
+    h = iphdr->saddr;
+    h = ((h ^ (h >> 16)) * 0x85EBCA6B) ^ iphdr->daddr;
+    h = ((h ^ (h >> 13)) * 0xC2B2AE35) ^ ports;
+    h = ((h ^ (h >> 16)) * 0x85EBCA6B) ^ iphdr->protocol;
+    h ^= h >> 13;
+    h *= 0xC2B2AE35;
+    return (h ^ (h >> 16));
+}
+
+// 処理にかかったサイクル数を測るためのカウンタ（x86以外はns）
+u_int64_t CpuCycles()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return (__rdtsc());
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((u_int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+#endif
+}
+
+// CpuCyclesの1秒あたりのカウント数（最初に呼んだときに1回だけ測る、転送スレッドを起こす前に呼んでおく）
+double CpuHz()
+{
+    static double hz;
+    struct timespec t0, t1, req = {0, 50000000};
+    u_int64_t c0, c1;
+
+    if (hz != 0)
+    {
+        return (hz);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    c0 = CpuCycles();
+    nanosleep(&req, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    c1 = CpuCycles();
+    hz = (c1 - c0) / ((t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9);
+    DebugPrintf("CpuHz:%.0f cycles/s\n", hz);
+
+    return (hz);
+}
+
+// 受信したフレームにカーネルの受信時刻を付ける（recvmmsgの制御メッセージで受け取る）
+int EnableRxStamp(int soc)
+{
+    int on = 1;
+
+    if (setsockopt(soc, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) < 0)
+    {
+        DebugPerror("setsockopt:SO_TIMESTAMPNS");
+        return (-1);
+    }
+
+    return (0);
+}
+
+// 受信で待つ代わりにデバイスのキューをusecマイクロ秒までbusy-pollするようにする
+// SO_PREFER_BUSY_POLLはカーネルの割り込み処理よりbusy-pollを優先させる（古いカーネルにはない）
+int SetBusyPoll(int soc, int usec, int budget)
+{
+    int on = 1;
+
+    if (setsockopt(soc, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec)) < 0)
+    {
+        DebugPerror("setsockopt:SO_BUSY_POLL");
+        return (-1);
+    }
+    if (setsockopt(soc, SOL_SOCKET, SO_PREFER_BUSY_POLL, &on, sizeof(on)) < 0 ||
+        setsockopt(soc, SOL_SOCKET, SO_BUSY_POLL_BUDGET, &budget, sizeof(budget)) < 0)
+    {
+        DebugPerror("setsockopt:SO_PREFER_BUSY_POLL");
+    }
+
+    return (0);
+}
+
 int GetDeviceInfo(char *device, __u_char hwaddr[6], struct in_addr *uaddr, struct in_addr *subnet, struct in_addr *mask)
 {
     struct ifreq ifreq;
@@ -260,98 +572,6 @@ int PrintEtherHeader(struct ether_header *eh, FILE *fp)
     return (0);
 }
 
-u_int16_t checksum(__u_char *data, int len)
-{
-    register u_int32_t sum;
-    register u_int16_t *ptr;
-    register int c;
-
-    sum = 0;
-    ptr = (u_int16_t *)data;
-
-    for (c = len; c > 1; c -= 2)
-    {
-        sum += (*ptr);
-        if (sum & 0x80000000)
-        {
-            sum = (sum & 0xFFFF) + (sum >> 16);
-        }
-        ptr++;
-    }
-    if (c == 1)
-    {
-        u_int16_t val;
-        val = 0;
-        memcpy(&val, ptr, sizeof(u_int8_t));
-        sum += val;
-    }
-
-    while (sum >> 16)
-    {
-        sum = (sum & 0xFFFF) + (sum >> 16);
-    }
-
-    return (~sum);
-}
-
-u_int16_t checksum2(__u_char *data1, int len1, __u_char *data2, int len2)
-{
-    register u_int32_t sum;
-    register u_int16_t *ptr;
-    register int c;
-
-    sum = 0;
-    ptr = (u_int16_t *)data1;
-    for (c = len1; c > 1; c -= 2)
-    {
-        sum += (*ptr);
-        if (sum & 0x80000000)
-        {
-            sum = (sum & 0xFFFF) + (sum >> 16);
-        }
-        ptr++;
-    }
-    if (c == 1)
-    {
-        u_int16_t val;
-        val = ((*ptr) << 8) + (*data2);
-        sum += val;
-        if (sum & 0x80000000)
-        {
-            sum = (sum & 0xFFFF) + (sum >> 16);
-        }
-        ptr = (u_int16_t *)(data2 + 1);
-        len2--;
-    }
-    else
-    {
-        ptr = (u_int16_t *)data2;
-    }
-    for (c = len2; c > 1; c -= 2)
-    {
-        sum += (*ptr);
-        if (sum & 0x80000000)
-        {
-            sum = (sum & 0xFFFF) + (sum >> 16);
-        }
-        ptr++;
-    }
-    if (c == 1)
-    {
-        u_int16_t val;
-        val = 0;
-        memcpy(&val, ptr, sizeof(u_int8_t));
-        sum += val;
-    }
-
-    while (sum >> 16)
-    {
-        sum = (sum & 0xFFFF) + (sum >> 16);
-    }
-
-    return (~sum);
-}
-
 int checkIPchecksum(struct iphdr *iphdr, __u_char *option, int optionLen)
 {
     struct iphdr iptmp;
@@ -463,3 +683,95 @@ int SendArpRequestB(int Soc, in_addr_t target_ip, __u_char target_mac[6], in_add
 
     return (0);
 }
+
+static u_int64_t IcmpErrorTat; //次に送ってよい時刻（us）
+
+//ICMPエラーを送ってよいか（RFC 1812の流量制限、全体で ICMP_ERROR_RATE 個/秒、ICMP_ERROR_BURST 個まではまとめて送れる）
+//複数の転送スレッドとメインスレッドから呼ぶので、ロックを取らずにCASで進める
+static int IcmpErrorAllow()
+{
+    u_int64_t now, tat, next;
+
+    now = NowMs * 1000;
+    tat = __atomic_load_n(&IcmpErrorTat, __ATOMIC_RELAXED);
+    do
+    {
+        if (tat > now + (ICMP_ERROR_BURST - 1) * (1000000 / ICMP_ERROR_RATE))
+        {
+            return (0);
+        }
+        next = (tat > now ? tat : now) + 1000000 / ICMP_ERROR_RATE;
+    } while (!__atomic_compare_exchange_n(&IcmpErrorTat, &tat, next, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    return (1);
+}
+
+// 受け取ったフレーム data への ICMP エラーを buf（ICMP_ERROR_MAX バイト）に作り、長さを返す
+// 宛先MACアドレスは受け取ったフレームの送信元、送信元は hwaddr/addr（受け取ったデバイス）
+// 返してはいけないもの（2つ目以降の断片、ICMPエラー、送信元がブロードキャストなど）と流量制限を超えたときは0
+int IcmpErrorBuild(__u_char *buf, __u_char *data, int size, __u_char hwaddr[6], in_addr_t addr, int type, int code)
+{
+    struct ether_header *eh, *reh;
+    struct iphdr *iphdr, *rih;
+    struct icmphdr *icmp, *oicmp;
+    int hlen, quote;
+
+    if (size < sizeof(struct ether_header) + sizeof(struct iphdr))
+    {
+        return (0);
+    }
+    eh = (struct ether_header *)data;
+    iphdr = (struct iphdr *)(data + sizeof(struct ether_header));
+    hlen = iphdr->ihl * 4;
+
+    if ((ntohs(iphdr->frag_off) & IP_OFFMASK) != 0 || iphdr->saddr == INADDR_ANY || IN_MULTICAST(ntohl(iphdr->saddr)) ||
+        iphdr->saddr == INADDR_BROADCAST || (eh->ether_shost[0] & 1))
+    {
+        return (0);
+    }
+    if (iphdr->protocol == IPPROTO_ICMP && size >= sizeof(struct ether_header) + hlen + 1)
+    {
+        oicmp = (struct icmphdr *)((__u_char *)iphdr + hlen);
+        if (oicmp->type == ICMP_DEST_UNREACH || oicmp->type == ICMP_SOURCE_QUENCH || oicmp->type == ICMP_REDIRECT ||
+            oicmp->type == ICMP_TIME_EXCEEDED || oicmp->type == ICMP_PARAMETERPROB)
+        {
+            return (0);
+        }
+    }
+    if (!IcmpErrorAllow())
+    {
+        return (0);
+    }
+
+    // 元のIPヘッダと、少なくともその後ろの8バイトを入れる
+    quote = (hlen + 8 > ICMP_ERROR_QUOTE) ? hlen + 8 : ICMP_ERROR_QUOTE;
+    if (quote > size - (int)sizeof(struct ether_header))
+    {
+        quote = size - sizeof(struct ether_header);
+    }
+
+    reh = (struct ether_header *)buf;
+    memcpy(reh->ether_dhost, eh->ether_shost, 6);
+    memcpy(reh->ether_shost, hwaddr, 6);
+    reh->ether_type = htons(ETHERTYPE_IP);
+
+    rih = (struct iphdr *)(buf + sizeof(struct ether_header));
+    memset(rih, 0, sizeof(struct iphdr));
+    rih->version = 4;
+    rih->ihl = sizeof(struct iphdr) / 4;
+    rih->tot_len = htons(sizeof(struct iphdr) + sizeof(struct icmphdr) + quote);
+    rih->ttl = 64;
+    rih->protocol = IPPROTO_ICMP;
+    rih->saddr = addr;
+    rih->daddr = iphdr->saddr;
+    rih->check = checksum((__u_char *)rih, sizeof(struct iphdr));
+
+    icmp = (struct icmphdr *)(rih + 1);
+    memset(icmp, 0, sizeof(struct icmphdr));
+    icmp->type = type;
+    icmp->code = code;
+    memcpy(icmp + 1, iphdr, quote);
+    icmp->checksum = checksum((__u_char *)icmp, sizeof(struct icmphdr) + quote);
+
+    return (sizeof(struct ether_header) + sizeof(struct iphdr) + sizeof(struct icmphdr) + quote);
+}
@@ -1,10 +1,55 @@
+#define RX_RING_FRAME_SIZE 2048
+#define RX_RING_BLOCK_SIZE (1<<18) //受信リングのブロックの大きさ（既定値）
+#define RX_RING_BLOCK_NUM 16 //受信リングのブロック数
+#define RX_RING_TIMEOUT_MS 10 //ブロックを渡すまでの時間（既定値）
+#define RX_BATCH_DEFAULT 32 //recvmmsgで一度に受信する数（既定値）
+#define RX_BATCH_MAX 1024
+#define RX_DRAIN_BUDGET 256 //1回のwakeupで1つのデバイスから受信するフレーム数の上限
+#define RX_CTRL_SIZE 64 //recvmmsgの制御メッセージの大きさ（受信時刻1つ分）
+
+#define BUSY_POLL_USEC 50 //SO_BUSY_POLLでデバイスのキューを見て回る時間
+#define BUSY_IDLE_SPIN 1024 //busy-pollで空振りがこの回数続いたらpauseを入れ始める
+#define BUSY_IDLE_BLOCK 65536 //busy-pollで空振りがこの回数続いたらepollで待つ
+#define BUSY_PAUSE_SHIFT_MAX 10 //1周に入れるpauseの数の上限（2のべき乗）
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CPU_RELAX() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define CPU_RELAX() __asm__ __volatile__("yield" ::: "memory")
+#else
+#define CPU_RELAX() __asm__ __volatile__("" ::: "memory")
+#endif
+
+#define ICMP_ERROR_QUOTE 64 //ICMPエラーに入れる元のIPパケットの長さ
+#define ICMP_ERROR_MAX 128 //ICMPエラーのフレームの最大長（イーサ+IP+ICMP+元のパケット）
+#define ICMP_ERROR_RATE 100 //1秒あたりに送るICMPエラーの数
+#define ICMP_ERROR_BURST 50 //まとめて送れるICMPエラーの数
+
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+#ifndef SO_BUSY_POLL_BUDGET
+#define SO_BUSY_POLL_BUDGET 70
+#endif
+
 char *my_ether_ntoa_r(__u_char *hwaddr,char *buf,socklen_t size);
 char *my_inet_ntoa_r(struct in_addr *addr,char *buf,socklen_t size);
 char *in_addr_t2str(in_addr_t addr,char *buf,socklen_t size);
 int GetDeviceInfo(char *device,__u_char hwaddr[6],struct in_addr *uaddr,struct in_addr *subnet,struct in_addr *mask);
 int PrintEtherHeader(struct ether_header *eh,FILE *fp);
 int InitRawSocket(char *device,int promiscFlag,int ipOnly);
-u_int16_t checksum(unsigned char *data,int len);
-u_int16_t checksum2(unsigned char *data1,int len1,unsigned char *data2,int len2);
+int InitRxRing(int soc,RX_RING *ring,int blockSize,int blockNum,int timeoutMs);
+int RxRingNext(RX_RING *ring,unsigned char **data);
+int RxRingStat(int soc,unsigned int *packets,unsigned int *drops);
+int JoinFanout(int soc,int id,int mode);
+int InitRxBatch(RX_BATCH *b,int max);
+int RxBatchRecv(int soc,RX_BATCH *b);
+u_int64_t RxBatchStamp(RX_BATCH *b,int i);
+u_int32_t IpFlowHash(struct iphdr *iphdr,unsigned char *l4,int l4len);
+u_int64_t CpuCycles();
+double CpuHz();
+int EnableRxStamp(int soc);
+int SetBusyPoll(int soc,int usec,int budget);
 int checkIPchecksum(struct iphdr *iphdr,unsigned char *option,int optionLen);
 int SendArpRequestB(int soc,in_addr_t target_ip,unsigned char target_mac[6],in_addr_t my_ip,unsigned char my_mac[6]);
+int IcmpErrorBuild(unsigned char *buf,unsigned char *data,int size,unsigned char hwaddr[6],in_addr_t addr,int type,int code);
@@ -0,0 +1,511 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/if_ether.h>
+#include <netinet/ip.h>
+#include <pthread.h>
+#include "base.h"
+#include "netutil.h"
+#include "police.h"
+#include "route.h"
+#include "epoch.h"
+#include "hdrRewrite.h"
+
+extern int DebugPrintf(char *fmt, ...);
+extern int DebugPerror(char *msg);
+
+// このファイルでは受信デバイスごと・送信元プレフィックスごとのポリサー（srTCM/trTCM）を扱う
+// 時間で満ちるバケツは「トークンがなくなる仮想時刻」t0で持つ。時刻nowのトークンは (now - t0) / cost（深さで頭打ち）で、
+// Bバイト使うときは t0 を max(t0, now - depth) + B * cost にするだけなので、CAS 1回で更新できる
+// srTCMの超過バケツは認定バケツからあふれた分でしか満ちないので、トークンの量をそのまま持つ
+// 時刻は転送スレッドが受信を始めたときに読んだTSCを使い、パケットごとには読まない
+// 受信デバイスにもプレフィックスにもポリサーがなければ、ポインタと配列を1つずつ見るだけで終わる
+// 設定は読み直すと丸ごと差し替え、古いものは待ち合わせの後に解放する（カウンタも0から数え直す）
+
+static POLICE_SET *PoliceCur; // 使っている設定（なければNULL）
+static POLICE_SET *PoliceOld; // 解放待ちの設定
+POLICE_SET *PoliceGet()
+{
+    return (__atomic_load_n(&PoliceCur, __ATOMIC_ACQUIRE));
+}
+
+// Bバイト分のトークンがあれば使って1、なければ何もせず0
+static int PoliceBucket(u_int64_t *t0, u_int64_t now, u_int64_t depth, u_int64_t need)
+{
+    u_int64_t old, eff;
+
+    old = __atomic_load_n(t0, __ATOMIC_RELAXED);
+    do
+    {
+        eff = old > now - depth ? old : now - depth;
+        if (eff + need > now)
+        {
+            return (0);
+        }
+    } while (!__atomic_compare_exchange_n(t0, &old, eff + need, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    return (1);
+}
+
+// srTCM: 認定バケツからあふれたトークンは超過バケツに入る
+static int PoliceSrTcm(POLICER *p, u_int64_t now, u_int64_t need)
+{
+    u_int64_t old, eff, next, over;
+    int green;
+
+    old = __atomic_load_n(&p->tc, __ATOMIC_RELAXED);
+    do
+    {
+        eff = old > now - p->cDepth ? old : now - p->cDepth;
+        over = eff - old;
+        green = eff + need <= now;
+        if (!green && over == 0)
+        {
+            break;
+        }
+        next = green ? eff + need : eff;
+    } while (!__atomic_compare_exchange_n(&p->tc, &old, next, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    if (over > 0)
+    {
+        // あふれた分だけ超過バケツに足す（超過バケツは時間では満ちないので、トークンの量で持つ）
+        old = __atomic_load_n(&p->te, __ATOMIC_RELAXED);
+        do
+        {
+            next = old + over < p->eDepth ? old + over : p->eDepth;
+        } while (next != old && !__atomic_compare_exchange_n(&p->te, &old, next, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    }
+    if (green)
+    {
+        return (POLICE_GREEN);
+    }
+
+    old = __atomic_load_n(&p->te, __ATOMIC_RELAXED);
+    do
+    {
+        if (old < need)
+        {
+            return (POLICE_RED);
+        }
+    } while (!__atomic_compare_exchange_n(&p->te, &old, old - need, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    return (POLICE_YELLOW);
+}
+
+// trTCM: ピークを超えればred、ピーク以内で認定を超えればyellow
+static int PoliceTrTcm(POLICER *p, u_int64_t now, u_int32_t bytes)
+{
+    if (!PoliceBucket(&p->te, now, p->eDepth, bytes * p->eCost >> (POLICE_FRAC - POLICE_SHIFT)))
+    {
+        return (POLICE_RED);
+    }
+
+    return (PoliceBucket(&p->tc, now, p->cDepth, bytes * p->cCost >> (POLICE_FRAC - POLICE_SHIFT)) ? POLICE_GREEN : POLICE_YELLOW);
+}
+
+static int PoliceMeter(POLICER *p, u_int64_t now, u_int32_t bytes)
+{
+    int color;
+
+    if (p->type == POLICE_SRTCM)
+    {
+        color = PoliceSrTcm(p, now, bytes * p->cCost >> (POLICE_FRAC - POLICE_SHIFT));
+    }
+    else
+    {
+        color = PoliceTrTcm(p, now, bytes);
+    }
+    __atomic_add_fetch(color == POLICE_GREEN ? &p->green : (color == POLICE_YELLOW ? &p->yellow : &p->red), 1, __ATOMIC_RELAXED);
+
+    return (color);
+}
+
+// 受信したIPパケットに受信デバイスと送信元プレフィックスのポリサーをかけ、色を返す（redなら捨てる）
+// yellowで付け直すDSCPがあれば、ここでTOSを書き換える
+int PolicePacket(POLICE_SET *ps, u_int64_t cycles, int deviceNo, struct iphdr *iphdr)
+{
+    POLICER *p[2], *mark;
+    u_int32_t addr, *base;
+    u_int64_t now;
+    int n, half, k, num, color, c;
+
+    num = 0;
+    if (ps->device[deviceNo] != -1)
+    {
+        p[num++] = &ps->policer[ps->device[deviceNo]];
+    }
+    if (ps->boundNum > 0)
+    {
+        addr = ntohl(iphdr->saddr);
+        base = ps->bound;
+        for (n = ps->boundNum; n > 1; n -= half)
+        {
+            half = n / 2;
+            base += (base[half] <= addr) ? half : 0;
+        }
+        if ((k = ps->prefix[base - ps->bound]) != -1)
+        {
+            p[num++] = &ps->policer[k];
+        }
+    }
+    if (num == 0)
+    {
+        return (POLICE_GREEN);
+    }
+
+    now = ((cycles > ps->base ? cycles - ps->base : 0) << POLICE_SHIFT) + POLICE_OFFSET;
+    color = POLICE_GREEN;
+    mark = NULL;
+    for (k = 0; k < num && color != POLICE_RED; k++)
+    {
+        c = PoliceMeter(p[k], now, ntohs(iphdr->tot_len));
+        if (c == POLICE_YELLOW && p[k]->dscp != -1)
+        {
+            mark = p[k];
+        }
+        color = c > color ? c : color;
+    }
+    if (color == POLICE_YELLOW && mark != NULL && (iphdr->tos >> 2) != mark->dscp)
+    {
+        IpSetTos(iphdr, (mark->dscp << 2) | (iphdr->tos & 3));
+        __atomic_add_fetch(&mark->marked, 1, __ATOMIC_RELAXED);
+    }
+
+    return (color);
+}
+
+// 10m, 1.5g などのビット/秒（burstはバイト）を読む
+static double PoliceValue(char *s)
+{
+    char *p;
+    double v;
+
+    if (s == NULL)
+    {
+        return (-1);
+    }
+    v = strtod(s, &p);
+    switch (*p)
+    {
+    case 'k':
+    case 'K':
+        v *= 1e3;
+        p++;
+        break;
+    case 'm':
+    case 'M':
+        v *= 1e6;
+        p++;
+        break;
+    case 'g':
+    case 'G':
+        v *= 1e9;
+        p++;
+        break;
+    }
+
+    return (*p == '\0' && v > 0 ? v : -1);
+}
+
+// rateビット/秒の1バイトあたりの仮想時間と、burstバイトのバケツの深さ
+static int PoliceRate(double rate, double burst, u_int64_t *cost, u_int64_t *depth)
+{
+    double c;
+
+    if (rate <= 0 || burst <= 0)
+    {
+        return (-1);
+    }
+    c = CpuHz() * 8 / rate * (1 << POLICE_SHIFT);
+    // 64KBのパケットでも bytes * cost が64bitに収まる速さまで
+    if (c >= (1 << (64 - 16 - POLICE_FRAC + POLICE_SHIFT)) || burst * c >= POLICE_OFFSET)
+    {
+        return (-1);
+    }
+    *cost = c * (1 << (POLICE_FRAC - POLICE_SHIFT));
+    *depth = burst * c;
+
+    return (0);
+}
+
+// 1行に1つ（同じデバイス・プレフィックスを2回書いたら後のものを使う）
+// (dev device | from prefix/len) srtcm cir cbs ebs [dscp n]
+// (dev device | from prefix/len) trtcm cir cbs pir pbs [dscp n]
+static int PoliceParse(char *line, POLICER *p, int *deviceNo, u_int32_t *lo, u_int32_t *hi)
+{
+    char *tok[10], *save, *s;
+    struct in_addr addr;
+    int n, i, depth;
+
+    for (n = 0, s = strtok_r(line, " \t\r\n", &save); s != NULL; s = strtok_r(NULL, " \t\r\n", &save))
+    {
+        if (n == 10)
+        {
+            return (-1);
+        }
+        tok[n++] = s;
+    }
+    if (n < 6)
+    {
+        return (-1);
+    }
+    memset(p, 0, sizeof(POLICER));
+    snprintf(p->name, sizeof(p->name), "%s %s", tok[0], tok[1]);
+    *deviceNo = -1;
+    if (strcmp(tok[0], "dev") == 0)
+    {
+        if ((*deviceNo = RouteDeviceNo(tok[1])) == -1)
+        {
+            return (-1);
+        }
+    }
+    else if (strcmp(tok[0], "from") == 0)
+    {
+        depth = 32;
+        if ((s = strchr(tok[1], '/')) != NULL)
+        {
+            *s = '\0';
+            depth = atoi(s + 1);
+        }
+        if (inet_aton(tok[1], &addr) == 0 || depth < 0 || depth > 32)
+        {
+            return (-1);
+        }
+        *lo = ntohl(addr.s_addr) & (depth == 0 ? 0 : 0xFFFFFFFF << (32 - depth));
+        *hi = *lo | (depth == 32 ? 0 : 0xFFFFFFFF >> depth);
+    }
+    else
+    {
+        return (-1);
+    }
+
+    p->dscp = -1;
+    if (strcmp(tok[2], "srtcm") == 0)
+    {
+        // 超過バケツも認定と同じ速さで満ちる
+        p->type = POLICE_SRTCM;
+        if (PoliceRate(PoliceValue(tok[3]), PoliceValue(tok[4]), &p->cCost, &p->cDepth) == -1 ||
+            PoliceRate(PoliceValue(tok[3]), PoliceValue(tok[5]), &p->eCost, &p->eDepth) == -1)
+        {
+            return (-1);
+        }
+        i = 6;
+    }
+    else if (strcmp(tok[2], "trtcm") == 0)
+    {
+        p->type = POLICE_TRTCM;
+        if (n < 7 || PoliceRate(PoliceValue(tok[3]), PoliceValue(tok[4]), &p->cCost, &p->cDepth) == -1 ||
+            PoliceRate(PoliceValue(tok[5]), PoliceValue(tok[6]), &p->eCost, &p->eDepth) == -1 || p->eCost > p->cCost)
+        {
+            return (-1);
+        }
+        i = 7;
+    }
+    else
+    {
+        return (-1);
+    }
+    if (i < n)
+    {
+        // 残りは "dscp n" だけ
+        if (n != i + 2 || strcmp(tok[i], "dscp") != 0 || (p->dscp = atoi(tok[i + 1])) < 0 || p->dscp > 63)
+        {
+            return (-1);
+        }
+    }
+
+    return (0);
+}
+
+static int PoliceCompare(const void *a, const void *b)
+{
+    u_int32_t x = *(const u_int32_t *)a, y = *(const u_int32_t *)b;
+
+    return (x < y ? -1 : x > y);
+}
+
+static void PoliceFree(POLICE_SET *ps)
+{
+    free(ps->policer);
+    free(ps->bound);
+    free(ps->prefix);
+    free(ps);
+}
+
+// プレフィックスを送信元アドレスの区間に分け、区間ごとに最も長いプレフィックスのポリサーを決める
+// 同じプレフィックスが2回あれば後の行のものを使う（<=で上書きする）
+static int PolicePrefix(POLICE_SET *ps, u_int32_t *lo, u_int32_t *hi, int *no, int num)
+{
+    int i, j, n, best;
+    u_int64_t width;
+
+    if ((ps->bound = (u_int32_t *)malloc((2 * num + 1) * sizeof(u_int32_t))) == NULL ||
+        (ps->prefix = (int *)malloc((2 * num + 1) * sizeof(int))) == NULL)
+    {
+        DebugPerror("malloc");
+        return (-1);
+    }
+    n = 0;
+    ps->bound[n++] = 0;
+    for (i = 0; i < num; i++)
+    {
+        ps->bound[n++] = lo[i];
+        if (hi[i] != 0xFFFFFFFF)
+        {
+            ps->bound[n++] = hi[i] + 1;
+        }
+    }
+    qsort(ps->bound, n, sizeof(u_int32_t), PoliceCompare);
+    for (i = 1, ps->boundNum = 1; i < n; i++)
+    {
+        if (ps->bound[i] != ps->bound[ps->boundNum - 1])
+        {
+            ps->bound[ps->boundNum++] = ps->bound[i];
+        }
+    }
+    for (i = 0; i < ps->boundNum; i++)
+    {
+        best = -1;
+        width = 0;
+        for (j = 0; j < num; j++)
+        {
+            if (lo[j] <= ps->bound[i] && ps->bound[i] <= hi[j] && (best == -1 || (u_int64_t)hi[j] - lo[j] <= width))
+            {
+                best = j;
+                width = (u_int64_t)hi[j] - lo[j];
+            }
+        }
+        ps->prefix[i] = best == -1 ? -1 : no[best];
+    }
+
+    return (0);
+}
+
+// ポリサーファイルを読んで設定を作り直し、差し替える（メインスレッドから呼ぶ）
+// 1行でも読めなければファイル全体を使わず、今の設定のまま-1を返す
+int PoliceLoadFile(char *fname)
+{
+    FILE *fp;
+    char line[256], *p;
+    POLICE_SET *ps, *old;
+    u_int32_t lo[POLICE_MAX], hi[POLICE_MAX];
+    int no[POLICE_MAX], deviceNo, prefixNum, lineNo, i;
+
+    if ((fp = fopen(fname, "r")) == NULL)
+    {
+        DebugPerror("fopen");
+        return (-1);
+    }
+    if ((ps = (POLICE_SET *)calloc(1, sizeof(POLICE_SET))) == NULL ||
+        (ps->policer = (POLICER *)aligned_alloc(64, POLICE_MAX * sizeof(POLICER))) == NULL)
+    {
+        DebugPerror("calloc");
+        free(ps);
+        fclose(fp);
+        return (-1);
+    }
+    for (i = 0; i < DEVICE_MAX; i++)
+    {
+        ps->device[i] = -1;
+    }
+    prefixNum = 0;
+    lineNo = 0;
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        lineNo++;
+        if ((p = strchr(line, '#')) != NULL)
+        {
+            *p = '\0';
+        }
+        if (strspn(line, " \t\r\n") == strlen(line))
+        {
+            continue;
+        }
+        if (ps->num >= POLICE_MAX || PoliceParse(line, &ps->policer[ps->num], &deviceNo, &lo[prefixNum], &hi[prefixNum]) == -1)
+        {
+            fprintf(stderr, "%s:%d:%s\n", fname, lineNo, ps->num >= POLICE_MAX ? "too many policers" : "bad policer");
+            fclose(fp);
+            PoliceFree(ps);
+            return (-1);
+        }
+        if (deviceNo != -1)
+        {
+            ps->device[deviceNo] = ps->num;
+        }
+        else
+        {
+            no[prefixNum++] = ps->num;
+        }
+        ps->num++;
+    }
+    fclose(fp);
+    if (prefixNum > 0 && PolicePrefix(ps, lo, hi, no, prefixNum) == -1)
+    {
+        PoliceFree(ps);
+        return (-1);
+    }
+    // どのバケツも満杯で始める（srTCMの超過バケツは最初のパケットで認定バケツからあふれた分で満ちる）
+    ps->base = CpuCycles();
+    for (i = 0; i < ps->num; i++)
+    {
+        ps->policer[i].tc = ps->policer[i].te = 0;
+    }
+
+    old = PoliceCur;
+    __atomic_store_n(&PoliceCur, ps, __ATOMIC_RELEASE);
+    if (old != NULL)
+    {
+        old->retire = EpochRetire();
+        old->next = PoliceOld;
+        PoliceOld = old;
+    }
+    DebugPrintf("PoliceLoadFile:%s %d policers (%d prefixes, %d intervals)\n", fname, ps->num, prefixNum, ps->boundNum);
+
+    return (ps->num);
+}
+
+// 待ち合わせの済んだ古い設定を解放する（メインスレッドからtickごとに呼ぶ）
+int PoliceReclaim()
+{
+    POLICE_SET **pp, *ps;
+    int count;
+
+    count = 0;
+    for (pp = &PoliceOld; *pp != NULL;)
+    {
+        ps = *pp;
+        if (!EpochPassed(ps->retire))
+        {
+            pp = &ps->next;
+            continue;
+        }
+        *pp = ps->next;
+        PoliceFree(ps);
+        count++;
+    }
+
+    return (count);
+}
+
+int PoliceStat(FILE *fp)
+{
+    POLICER *p;
+    int i;
+
+    if (PoliceCur == NULL)
+    {
+        return (0);
+    }
+    for (i = 0; i < PoliceCur->num; i++)
+    {
+        p = &PoliceCur->policer[i];
+        fprintf(fp, "police:%s %s green=%lu yellow=%lu red=%lu marked=%lu\n",
+                p->name, p->type == POLICE_SRTCM ? "srtcm" : "trtcm", p->green, p->yellow, p->red, p->marked);
+    }
+
+    return (0);
+}
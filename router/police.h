@@ -0,0 +1,17 @@
+#define POLICE_SRTCM 1
+#define POLICE_TRTCM 2
+
+#define POLICE_GREEN 0
+#define POLICE_YELLOW 1
+#define POLICE_RED 2
+
+#define POLICE_MAX 4096 //ポリサーの最大数
+#define POLICE_SHIFT 4 //仮想時刻の単位（1/16サイクル）
+#define POLICE_FRAC 24 //1バイトあたりの仮想時間の小数部のビット数
+#define POLICE_OFFSET (1ULL << 44) //仮想時刻の始まり（どのバケツも満杯で始まるように、深さの上限より後にする）
+
+POLICE_SET *PoliceGet();
+int PolicePacket(POLICE_SET *ps,u_int64_t cycles,int deviceNo,struct iphdr *iphdr);
+int PoliceLoadFile(char *fname);
+int PoliceReclaim();
+int PoliceStat(FILE *fp);
@@ -0,0 +1,496 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <pthread.h>
+#include "base.h"
+#include "policy.h"
+#include "route.h"
+#include "epoch.h"
+
+extern int DebugPrintf(char *fmt, ...);
+extern int DebugPerror(char *msg);
+
+extern NEXTHOP NextHops[RT_NEXTHOP_MAX];
+
+// このファイルでは送信元・宛先・プロトコル・ポート・DSCPで経路表か次ホップを選ぶポリシールーティングを扱う
+// ルールはファイルの上から順に優先し、読み込んだところでビットベクタの分類器に作り直す（ACLも同じ分類器を使う）
+// 1パケットあたりの処理はフィールドごとの二分探索と、要約のビット列をANDして見つけた語だけのANDで、
+// ルールを1つずつ比べないのでルールが増えてもほとんど遅くならない
+// 転送スレッドはロックを取らずに読むので、読み直したときは差し替えて、古いものは待ち合わせの後に解放する
+
+static u_int32_t PolicyFieldMax[POLICY_FIELDS] = {0xFFFFFFFF, 0xFFFFFFFF, 0xFF, 0xFFFF, 0xFFFF, 0x3F};
+
+static POLICY *PolicyCur; // 使っている分類器（ルールがなければNULL）
+static POLICY *PolicyOld; // 解放待ちの分類器
+
+static int PolicyCompare(const void *a, const void *b)
+{
+    u_int32_t x = *(const u_int32_t *)a, y = *(const u_int32_t *)b;
+
+    return (x < y ? -1 : x > y);
+}
+
+void PolicyFree(POLICY *p)
+{
+    int f;
+
+    for (f = 0; f < POLICY_FIELDS; f++)
+    {
+        free(p->field[f].bound);
+        free(p->field[f].bits);
+        free(p->field[f].sum);
+    }
+    free(p->rule);
+    free(p);
+}
+
+// ルールの配列から分類器を作る（ruleは分類器の中にコピーする）
+POLICY *PolicyBuild(POLICY_RULE *rule, int num)
+{
+    POLICY *p;
+    u_int32_t *pt, v;
+    u_int64_t *bits;
+    int f, i, n, r;
+
+    if ((p = (POLICY *)calloc(1, sizeof(POLICY))) == NULL)
+    {
+        DebugPerror("calloc");
+        return (NULL);
+    }
+    p->ruleNum = num;
+    p->words = (num + 63) / 64;
+    p->sumWords = (p->words + 63) / 64;
+    if ((p->rule = (POLICY_RULE *)malloc((num > 0 ? num : 1) * sizeof(POLICY_RULE))) == NULL ||
+        (pt = (u_int32_t *)malloc((2 * num + 1) * sizeof(u_int32_t))) == NULL)
+    {
+        DebugPerror("malloc");
+        PolicyFree(p);
+        return (NULL);
+    }
+    memcpy(p->rule, rule, num * sizeof(POLICY_RULE));
+
+    for (f = 0; f < POLICY_FIELDS; f++)
+    {
+        // ルールの範囲の端で値を区間に分ける（区間の中ではどのルールに一致するかが変わらない）
+        n = 0;
+        pt[n++] = 0;
+        for (r = 0; r < num; r++)
+        {
+            pt[n++] = rule[r].lo[f];
+            if (rule[r].hi[f] < PolicyFieldMax[f])
+            {
+                pt[n++] = rule[r].hi[f] + 1;
+            }
+        }
+        qsort(pt, n, sizeof(u_int32_t), PolicyCompare);
+        for (i = 1, p->field[f].num = 1; i < n; i++)
+        {
+            if (pt[i] != pt[p->field[f].num - 1])
+            {
+                pt[p->field[f].num++] = pt[i];
+            }
+        }
+        p->field[f].bound = (u_int32_t *)malloc(p->field[f].num * sizeof(u_int32_t));
+        p->field[f].bits = (u_int64_t *)calloc((size_t)p->field[f].num * p->words + 1, sizeof(u_int64_t));
+        p->field[f].sum = (u_int64_t *)calloc((size_t)p->field[f].num * p->sumWords + 1, sizeof(u_int64_t));
+        if (p->field[f].bound == NULL || p->field[f].bits == NULL || p->field[f].sum == NULL)
+        {
+            DebugPerror("malloc");
+            free(pt);
+            PolicyFree(p);
+            return (NULL);
+        }
+        memcpy(p->field[f].bound, pt, p->field[f].num * sizeof(u_int32_t));
+        // ルールごとに、loの区間からhiまでの区間にビットを立てる（loは必ずboundのどれかになっている）
+        for (r = 0; r < num; r++)
+        {
+            v = rule[r].lo[f];
+            i = (u_int32_t *)bsearch(&v, p->field[f].bound, p->field[f].num, sizeof(u_int32_t), PolicyCompare) - p->field[f].bound;
+            for (; i < p->field[f].num && p->field[f].bound[i] <= rule[r].hi[f]; i++)
+            {
+                bits = &p->field[f].bits[(size_t)i * p->words];
+                bits[r / 64] |= 1ULL << (r % 64);
+                p->field[f].sum[(size_t)i * p->sumWords + r / 4096] |= 1ULL << (r / 64 % 64);
+            }
+        }
+    }
+    free(pt);
+
+    return (p);
+}
+
+POLICY *PolicyGet()
+{
+    return (__atomic_load_n(&PolicyCur, __ATOMIC_ACQUIRE));
+}
+
+// パケットから分類に使う値を取り出す（ポートはTCP/UDPの断片でないものだけ、それ以外は0）
+void PolicyKey(struct iphdr *iphdr, u_char *l4, int l4len, u_int32_t key[POLICY_FIELDS])
+{
+    key[POLICY_SRC] = ntohl(iphdr->saddr);
+    key[POLICY_DST] = ntohl(iphdr->daddr);
+    key[POLICY_PROTO] = iphdr->protocol;
+    key[POLICY_SPORT] = key[POLICY_DPORT] = 0;
+    if ((iphdr->protocol == IPPROTO_TCP || iphdr->protocol == IPPROTO_UDP) && !(iphdr->frag_off & htons(IP_MF | IP_OFFMASK)) && l4len >= 4)
+    {
+        key[POLICY_SPORT] = ntohs(*(u_int16_t *)l4);
+        key[POLICY_DPORT] = ntohs(*(u_int16_t *)(l4 + 2));
+    }
+    key[POLICY_DSCP] = iphdr->tos >> 2;
+}
+
+// 一致した最初のルールの番号を返す（なければ-1）
+int PolicyMatch(POLICY *p, u_int32_t key[POLICY_FIELDS])
+{
+    u_int64_t *v[POLICY_FIELDS], *s[POLICY_FIELDS], x, y;
+    u_int32_t *base;
+    int f, lo, n, half, w, i;
+
+    for (f = 0; f < POLICY_FIELDS; f++)
+    {
+        // key以下で最大のboundを探す（分岐の予測が外れないよう、比べた結果で足すだけにする）
+        base = p->field[f].bound;
+        for (n = p->field[f].num; n > 1; n -= half)
+        {
+            half = n / 2;
+            base += (base[half] <= key[f]) ? half : 0;
+        }
+        lo = base - p->field[f].bound;
+        v[f] = &p->field[f].bits[(size_t)lo * p->words];
+        s[f] = &p->field[f].sum[(size_t)lo * p->sumWords];
+    }
+    // 要約で全フィールドに0でない語があるところだけ、ビット列をANDする
+    for (i = 0; i < p->sumWords; i++)
+    {
+        for (x = s[0][i] & s[1][i] & s[2][i] & s[3][i] & s[4][i] & s[5][i]; x != 0; x &= x - 1)
+        {
+            w = i * 64 + __builtin_ctzll(x);
+            y = v[0][w] & v[1][w] & v[2][w] & v[3][w] & v[4][w] & v[5][w];
+            if (y != 0)
+            {
+                return (w * 64 + __builtin_ctzll(y));
+            }
+        }
+    }
+
+    return (-1);
+}
+
+// ルールnoの行き先を引く（経路表に経路がなければメインの経路表で引き直す）
+NEXTHOP *PolicyRoute(POLICY *p, int no, FIB *mainFib, in_addr_t daddr)
+{
+    POLICY_RULE *r;
+    FIB *fib;
+    NEXTHOP *nh;
+
+    r = &p->rule[no];
+    if (r->table == -1)
+    {
+        return (&NextHops[r->nhNo]);
+    }
+    if ((fib = RouteTable(mainFib, r->table)) != NULL && (nh = RouteLookup(fib, daddr)) != NULL)
+    {
+        return (nh);
+    }
+
+    return (RouteLookup(mainFib, daddr));
+}
+
+// "lo-hi" か "n" か "any" を読む
+static int PolicyRange(char *s, u_int32_t max, u_int32_t *lo, u_int32_t *hi)
+{
+    char *p;
+
+    if (s == NULL)
+    {
+        return (-1);
+    }
+    if (strcmp(s, "any") == 0)
+    {
+        *lo = 0;
+        *hi = max;
+        return (0);
+    }
+    *lo = *hi = strtoul(s, &p, 0);
+    if (*p == '-')
+    {
+        *hi = strtoul(p + 1, &p, 0);
+    }
+    if (*p != '\0' || *lo > *hi || *hi > max)
+    {
+        return (-1);
+    }
+
+    return (0);
+}
+
+void PolicyRuleInit(POLICY_RULE *r)
+{
+    int f;
+
+    for (f = 0; f < POLICY_FIELDS; f++)
+    {
+        r->lo[f] = 0;
+        r->hi[f] = PolicyFieldMax[f];
+    }
+    r->table = -2;
+    r->nhNo = -1;
+    r->action = 0;
+}
+
+// 一致の条件を1つ読む（1:読んだ、0:条件ではない、-1:誤り）
+// from prefix/len | to prefix/len | proto tcp|udp|icmp|lo-hi | sport lo-hi | dport lo-hi | dscp lo-hi
+int PolicyParseMatch(char *tok, char *arg, POLICY_RULE *r)
+{
+    struct in_addr addr;
+    char *p;
+    int f, depth;
+
+    if (strcmp(tok, "from") == 0 || strcmp(tok, "to") == 0)
+    {
+        f = tok[0] == 'f' ? POLICY_SRC : POLICY_DST;
+        depth = 32;
+        if ((p = strchr(arg, '/')) != NULL)
+        {
+            *p = '\0';
+            depth = atoi(p + 1);
+        }
+        if (inet_aton(arg, &addr) == 0 || depth < 0 || depth > 32)
+        {
+            return (-1);
+        }
+        r->lo[f] = ntohl(addr.s_addr) & (depth == 0 ? 0 : 0xFFFFFFFF << (32 - depth));
+        r->hi[f] = r->lo[f] | (depth == 32 ? 0 : 0xFFFFFFFF >> depth);
+    }
+    else if (strcmp(tok, "proto") == 0)
+    {
+        if (strcmp(arg, "tcp") == 0)
+        {
+            r->lo[POLICY_PROTO] = r->hi[POLICY_PROTO] = IPPROTO_TCP;
+        }
+        else if (strcmp(arg, "udp") == 0)
+        {
+            r->lo[POLICY_PROTO] = r->hi[POLICY_PROTO] = IPPROTO_UDP;
+        }
+        else if (strcmp(arg, "icmp") == 0)
+        {
+            r->lo[POLICY_PROTO] = r->hi[POLICY_PROTO] = IPPROTO_ICMP;
+        }
+        else if (PolicyRange(arg, PolicyFieldMax[POLICY_PROTO], &r->lo[POLICY_PROTO], &r->hi[POLICY_PROTO]) == -1)
+        {
+            return (-1);
+        }
+    }
+    else if (strcmp(tok, "sport") == 0 || strcmp(tok, "dport") == 0 || strcmp(tok, "dscp") == 0)
+    {
+        f = tok[0] == 's' ? POLICY_SPORT : (tok[1] == 'p' ? POLICY_DPORT : POLICY_DSCP);
+        if (PolicyRange(arg, PolicyFieldMax[f], &r->lo[f], &r->hi[f]) == -1)
+        {
+            return (-1);
+        }
+    }
+    else
+    {
+        return (0);
+    }
+
+    return (1);
+}
+
+// 1行に1ルール（上ほど優先）
+// [一致の条件 ...] (table n | nexthop device gateway)
+static int PolicyParse(FIB *mainFib, char *line, POLICY_RULE *r)
+{
+    char *tok, *arg, *save, *p;
+    struct in_addr addr;
+    int ret, deviceNo;
+
+    PolicyRuleInit(r);
+    for (tok = strtok_r(line, " \t\r\n", &save); tok != NULL; tok = strtok_r(NULL, " \t\r\n", &save))
+    {
+        arg = strtok_r(NULL, " \t\r\n", &save);
+        if (arg == NULL)
+        {
+            return (-1);
+        }
+        if ((ret = PolicyParseMatch(tok, arg, r)) == -1)
+        {
+            return (-1);
+        }
+        else if (ret == 1)
+        {
+            continue;
+        }
+        else if (strcmp(tok, "table") == 0)
+        {
+            r->table = atoi(arg);
+            if (RouteTable(mainFib, r->table) == NULL)
+            {
+                return (-1);
+            }
+        }
+        else if (strcmp(tok, "nexthop") == 0)
+        {
+            if ((deviceNo = RouteDeviceNo(arg)) == -1 || (p = strtok_r(NULL, " \t\r\n", &save)) == NULL || inet_aton(p, &addr) == 0)
+            {
+                return (-1);
+            }
+            if ((r->nhNo = NextHopAdd(deviceNo, addr.s_addr)) == -1)
+            {
+                return (-1);
+            }
+            r->table = -1;
+        }
+        else
+        {
+            return (-1);
+        }
+    }
+
+    return (r->table == -2 ? -1 : 0);
+}
+
+// 読みかけのルールが持っている次ホップの参照を返す
+static void PolicyRuleRelease(POLICY_RULE *rule, int num)
+{
+    int i;
+
+    for (i = 0; i < num; i++)
+    {
+        if (rule[i].table == -1)
+        {
+            NextHopRelease(rule[i].nhNo);
+        }
+    }
+}
+
+// ポリシーファイルを読んで分類器を作り直し、差し替える（メインスレッドから呼ぶ）
+// 1行でも読めなければファイル全体を使わず、今のポリシーのまま-1を返す
+int PolicyLoadFile(FIB *mainFib, char *fname)
+{
+    FILE *fp;
+    char line[256], *p;
+    POLICY_RULE *rule;
+    POLICY *pol, *old;
+    int num, lineNo;
+
+    if ((fp = fopen(fname, "r")) == NULL)
+    {
+        DebugPerror("fopen");
+        return (-1);
+    }
+    if ((rule = (POLICY_RULE *)malloc(POLICY_RULE_MAX * sizeof(POLICY_RULE))) == NULL)
+    {
+        DebugPerror("malloc");
+        fclose(fp);
+        return (-1);
+    }
+    num = 0;
+    lineNo = 0;
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        lineNo++;
+        if ((p = strchr(line, '#')) != NULL)
+        {
+            *p = '\0';
+        }
+        if (strspn(line, " \t\r\n") == strlen(line))
+        {
+            continue;
+        }
+        if (num >= POLICY_RULE_MAX || PolicyParse(mainFib, line, &rule[num]) == -1)
+        {
+            fprintf(stderr, "%s:%d:%s\n", fname, lineNo, num >= POLICY_RULE_MAX ? "too many policies" : "bad policy");
+            if (num < POLICY_RULE_MAX && rule[num].nhNo != -1)
+            {
+                NextHopRelease(rule[num].nhNo);
+            }
+            PolicyRuleRelease(rule, num);
+            fclose(fp);
+            free(rule);
+            return (-1);
+        }
+        num++;
+    }
+    fclose(fp);
+
+    pol = NULL;
+    if (num > 0 && (pol = PolicyBuild(rule, num)) == NULL)
+    {
+        PolicyRuleRelease(rule, num);
+        free(rule);
+        return (-1);
+    }
+    free(rule);
+
+    // 差し替えて、前の分類器は待ち合わせの後に解放する（次ホップの参照もそのときに返す）
+    old = PolicyCur;
+    __atomic_store_n(&PolicyCur, pol, __ATOMIC_RELEASE);
+    RouteGenBump();
+    if (old != NULL)
+    {
+        old->retire = EpochRetire();
+        old->next = PolicyOld;
+        PolicyOld = old;
+    }
+    DebugPrintf("PolicyLoadFile:%s %d rules\n", fname, num);
+
+    return (num);
+}
+
+// 待ち合わせの済んだ古い分類器を解放する（メインスレッドからtickごとに呼ぶ）
+int PolicyReclaim()
+{
+    POLICY **pp, *p;
+    int count;
+
+    count = 0;
+    for (pp = &PolicyOld; *pp != NULL;)
+    {
+        p = *pp;
+        if (!EpochPassed(p->retire))
+        {
+            pp = &p->next;
+            continue;
+        }
+        *pp = p->next;
+        PolicyRuleRelease(p->rule, p->ruleNum);
+        PolicyFree(p);
+        count++;
+    }
+
+    return (count);
+}
+
+// 分類器の大きさを出力する（ACLからも使う）
+int PolicyPrint(POLICY *p, char *name, FILE *fp)
+{
+    size_t mem;
+    int f;
+
+    mem = p->ruleNum * sizeof(POLICY_RULE);
+    fprintf(fp, "%s:%d rules, intervals", name, p->ruleNum);
+    for (f = 0; f < POLICY_FIELDS; f++)
+    {
+        fprintf(fp, " %d", p->field[f].num);
+        mem += p->field[f].num * (sizeof(u_int32_t) + (p->words + p->sumWords) * sizeof(u_int64_t));
+    }
+    fprintf(fp, ", %zuKB\n", mem / 1024);
+
+    return (0);
+}
+
+int PolicyStat(FILE *fp)
+{
+    if (PolicyCur == NULL)
+    {
+        return (0);
+    }
+
+    return (PolicyPrint(PolicyCur, "policy", fp));
+}
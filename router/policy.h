@@ -0,0 +1,21 @@
+#define POLICY_RULE_MAX 65536 //ポリシールールの最大数
+
+#define POLICY_SRC 0
+#define POLICY_DST 1
+#define POLICY_PROTO 2
+#define POLICY_SPORT 3
+#define POLICY_DPORT 4
+#define POLICY_DSCP 5
+
+POLICY *PolicyBuild(POLICY_RULE *rule,int num);
+void PolicyFree(POLICY *p);
+POLICY *PolicyGet();
+void PolicyKey(struct iphdr *iphdr,unsigned char *l4,int l4len,u_int32_t key[POLICY_FIELDS]);
+void PolicyRuleInit(POLICY_RULE *r);
+int PolicyParseMatch(char *tok,char *arg,POLICY_RULE *r);
+int PolicyMatch(POLICY *p,u_int32_t key[POLICY_FIELDS]);
+NEXTHOP *PolicyRoute(POLICY *p,int no,FIB *mainFib,in_addr_t daddr);
+int PolicyLoadFile(FIB *mainFib,char *fname);
+int PolicyReclaim();
+int PolicyPrint(POLICY *p,char *name,FILE *fp);
+int PolicyStat(FILE *fp);
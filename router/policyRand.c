@@ -0,0 +1,155 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <pthread.h>
+#include "base.h"
+#include "policy.h"
+#include "route.h"
+#include "acl.h"
+#include "policyRand.h"
+
+// このファイルでは分類器の突き合わせ（policy_test）と測定（policy_bench）で使う、乱数のルールと検索キーを作る
+// 比べる基準として、ルールを上から1つずつ比べる素直な検索も置く
+
+static u_int32_t PolicyRandMax[POLICY_FIELDS] = {0xFFFFFFFF, 0xFFFFFFFF, 0xFF, 0xFFFF, 0xFFFF, 0x3F};
+
+static u_int32_t Rand32()
+{
+    return ((u_int32_t)rand() ^ ((u_int32_t)rand() << 16));
+}
+
+// プレフィックスの範囲にする（depthは0〜32）
+static void PolicyRandPrefix(POLICY_RULE *r, int f, int depth)
+{
+    u_int32_t mask;
+
+    mask = depth == 0 ? 0 : 0xFFFFFFFF << (32 - depth);
+    r->lo[f] = Rand32() & mask;
+    r->hi[f] = r->lo[f] | ~mask;
+}
+
+// ポート・DSCPは「なし」「1つ」「範囲」を混ぜる
+static void PolicyRandRange(POLICY_RULE *r, int f)
+{
+    u_int32_t a, b;
+
+    switch (rand() % 3)
+    {
+    case 0:
+        break;
+    case 1:
+        r->lo[f] = r->hi[f] = Rand32() % (PolicyRandMax[f] + 1);
+        break;
+    default:
+        a = Rand32() % (PolicyRandMax[f] + 1);
+        b = Rand32() % (PolicyRandMax[f] + 1);
+        r->lo[f] = a < b ? a : b;
+        r->hi[f] = a < b ? b : a;
+        break;
+    }
+}
+
+// ポリシールーティングらしいルール（送信元のプレフィックスとポート・DSCPで選ぶ）を作る
+// 全部anyのルールがあるとその後ろを調べなくなるので、送信元は必ずプレフィックスにする
+void PolicyRandRule(POLICY_RULE *r, int no)
+{
+    PolicyRuleInit(r);
+    PolicyRandPrefix(r, POLICY_SRC, 8 + rand() % 25);
+    if (rand() % 4 == 0)
+    {
+        PolicyRandPrefix(r, POLICY_DST, 8 + rand() % 25);
+    }
+    switch (rand() % 3)
+    {
+    case 0:
+        r->lo[POLICY_PROTO] = r->hi[POLICY_PROTO] = IPPROTO_TCP;
+        break;
+    case 1:
+        r->lo[POLICY_PROTO] = r->hi[POLICY_PROTO] = IPPROTO_UDP;
+        break;
+    }
+    PolicyRandRange(r, POLICY_SPORT);
+    PolicyRandRange(r, POLICY_DPORT);
+    PolicyRandRange(r, POLICY_DSCP);
+    r->table = no % RT_TABLE_MAX;
+}
+
+// ACLらしいルール（送信元・宛先とも/24より長いプレフィックスに、TCPかUDPの宛先ポート1つ）を作る
+// 最後に全部anyのdenyを置いて、どれにも一致しないパケットを捨てる形を試す
+void PolicyRandAclRule(POLICY_RULE *r, int no, int num)
+{
+    PolicyRuleInit(r);
+    r->action = ACL_DENY;
+    if (no == num - 1)
+    {
+        return;
+    }
+    PolicyRandPrefix(r, POLICY_SRC, 24 + rand() % 9);
+    PolicyRandPrefix(r, POLICY_DST, 24 + rand() % 9);
+    r->lo[POLICY_PROTO] = r->hi[POLICY_PROTO] = rand() % 2 ? IPPROTO_TCP : IPPROTO_UDP;
+    r->lo[POLICY_DPORT] = r->hi[POLICY_DPORT] = rand() % 1024;
+    r->action = rand() % 4 ? ACL_PERMIT : ACL_DENY;
+}
+
+// 検索キーを作る
+// 半分はルールを1つ選んでその範囲の中（端も多めに選ぶ）、残りはルールの範囲の端の前後か乱数
+void PolicyRandKey(POLICY_RULE *rule, int num, u_int32_t key[POLICY_FIELDS])
+{
+    POLICY_RULE *r;
+    u_int32_t w;
+    int f, in;
+
+    r = &rule[rand() % num];
+    in = rand() % 2;
+    for (f = 0; f < POLICY_FIELDS; f++)
+    {
+        if (!in)
+        {
+            r = &rule[rand() % num];
+        }
+        w = r->hi[f] - r->lo[f];
+        switch (rand() % 4)
+        {
+        case 0:
+            key[f] = r->lo[f] - (in ? 0 : 1);
+            break;
+        case 1:
+            key[f] = r->hi[f] + (in ? 0 : 1);
+            break;
+        case 2:
+            key[f] = r->lo[f] + (w == 0xFFFFFFFF ? Rand32() : Rand32() % (w + 1));
+            break;
+        default:
+            key[f] = in ? r->lo[f] + (w == 0xFFFFFFFF ? Rand32() : Rand32() % (w + 1)) : Rand32();
+            break;
+        }
+        key[f] &= PolicyRandMax[f];
+    }
+}
+
+// 一致した最初のルールの番号を、ルールを上から1つずつ比べて求める（なければ-1）
+int PolicyLinear(POLICY_RULE *rule, int num, u_int32_t key[POLICY_FIELDS])
+{
+    int i, f;
+
+    for (i = 0; i < num; i++)
+    {
+        for (f = 0; f < POLICY_FIELDS; f++)
+        {
+            if (key[f] < rule[i].lo[f] || key[f] > rule[i].hi[f])
+            {
+                break;
+            }
+        }
+        if (f == POLICY_FIELDS)
+        {
+            return (i);
+        }
+    }
+
+    return (-1);
+}
@@ -0,0 +1,4 @@
+void PolicyRandRule(POLICY_RULE *r,int no);
+void PolicyRandAclRule(POLICY_RULE *r,int no,int num);
+void PolicyRandKey(POLICY_RULE *rule,int num,u_int32_t key[POLICY_FIELDS]);
+int PolicyLinear(POLICY_RULE *rule,int num,u_int32_t key[POLICY_FIELDS]);
@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <pthread.h>
+#include "base.h"
+#include "policy.h"
+#include "policyRand.h"
+
+// このファイルではポリシーの分類器（PolicyMatch）の1回の検索時間を、ルールを上から比べる検索と並べて測る
+// ポリシーらしい1000ルールと、ACLらしい10000ルール（最後は全部anyのdeny）を測る
+// make bench で作って動かす
+// 引数: [seed]
+
+#define BENCH_KEYS (1 << 16) //検索するキーの数（乱数で作って繰り返し使う）
+#define BENCH_LOOKUPS (1 << 20) //分類器で検索する回数
+#define BENCH_LINEAR_LOOKUPS (1 << 16) //上から比べる検索の回数（遅いので少なくする）
+
+static double Now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+static int Bench(char *name, int num, int acl, u_int32_t (*key)[POLICY_FIELDS])
+{
+    POLICY_RULE *rule;
+    POLICY *p;
+    volatile int sink;
+    double t, tm, tl;
+    int i, s;
+
+    if ((rule = (POLICY_RULE *)malloc(num * sizeof(POLICY_RULE))) == NULL)
+    {
+        perror("malloc");
+        return (-1);
+    }
+    for (i = 0; i < num; i++)
+    {
+        if (acl)
+        {
+            PolicyRandAclRule(&rule[i], i, num);
+        }
+        else
+        {
+            PolicyRandRule(&rule[i], i);
+        }
+    }
+    t = Now();
+    if ((p = PolicyBuild(rule, num)) == NULL)
+    {
+        fprintf(stderr, "PolicyBuild:error\n");
+        free(rule);
+        return (-1);
+    }
+    t = Now() - t;
+    for (i = 0; i < BENCH_KEYS; i++)
+    {
+        PolicyRandKey(rule, num, key[i]);
+    }
+
+    s = 0;
+    tm = Now();
+    for (i = 0; i < BENCH_LOOKUPS; i++)
+    {
+        s += PolicyMatch(p, key[i & (BENCH_KEYS - 1)]);
+    }
+    tm = Now() - tm;
+    tl = Now();
+    for (i = 0; i < BENCH_LINEAR_LOOKUPS; i++)
+    {
+        s += PolicyLinear(rule, num, key[i & (BENCH_KEYS - 1)]);
+    }
+    tl = Now() - tl;
+    sink = s;
+    (void)sink;
+
+    printf("== %s build %.1fms\n", name, t * 1e3);
+    PolicyPrint(p, name, stdout);
+    printf("%s:%.1f ns/lookup, linear %.1f ns/lookup\n",
+           name, tm * 1e9 / BENCH_LOOKUPS, tl * 1e9 / BENCH_LINEAR_LOOKUPS);
+    PolicyFree(p);
+    free(rule);
+
+    return (0);
+}
+
+int main(int argc, char *argv[])
+{
+    u_int32_t (*key)[POLICY_FIELDS];
+    unsigned int seed;
+
+    seed = argc > 1 ? atoi(argv[1]) : time(NULL);
+    printf("seed:%u\n", seed);
+    srand(seed);
+
+    if ((key = malloc(BENCH_KEYS * sizeof(*key))) == NULL)
+    {
+        perror("malloc");
+        return (1);
+    }
+    if (Bench("policy", 1000, 0, key) == -1 || Bench("acl", 10000, 1, key) == -1)
+    {
+        return (1);
+    }
+    free(key);
+
+    return (0);
+}
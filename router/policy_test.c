@@ -0,0 +1,169 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <pthread.h>
+#include "base.h"
+#include "policy.h"
+#include "acl.h"
+#include "policyRand.h"
+
+// このファイルではビットベクタの分類器（PolicyMatch）を、ルールを上から比べる検索（PolicyLinear）と突き合わせる
+// ルールの数は64の倍数の前後と、要約のビット列が2語になる数（4096より多い）を含める
+// ACLは10000ルールまでをファイルに書いて AclLoadFile で読み、AclCheck の許可・破棄も突き合わせる
+// make test で作って動かす（食い違いがあれば1で終わる）
+// 引数: [seed]
+
+#define TEST_KEYS 20000 //1つのルール数で調べるキーの数
+
+static int TestPolicy(int num)
+{
+    POLICY_RULE *rule;
+    POLICY *p;
+    u_int32_t key[POLICY_FIELDS];
+    int i, got, want, err, hit;
+
+    if ((rule = (POLICY_RULE *)malloc(num * sizeof(POLICY_RULE))) == NULL)
+    {
+        perror("malloc");
+        return (1);
+    }
+    for (i = 0; i < num; i++)
+    {
+        PolicyRandRule(&rule[i], i);
+    }
+    if ((p = PolicyBuild(rule, num)) == NULL)
+    {
+        fprintf(stderr, "PolicyBuild:error num=%d\n", num);
+        free(rule);
+        return (1);
+    }
+
+    err = hit = 0;
+    for (i = 0; i < TEST_KEYS; i++)
+    {
+        PolicyRandKey(rule, num, key);
+        if ((got = PolicyMatch(p, key)) != (want = PolicyLinear(rule, num, key)))
+        {
+            fprintf(stderr, "NG:policy num=%d key=%08x %08x %u %u %u %u %d!=%d\n",
+                    num, key[0], key[1], key[2], key[3], key[4], key[5], got, want);
+            err++;
+        }
+        hit += want != -1;
+    }
+    printf("policy:%d rules, %d keys (%d matched), %d errors\n", num, TEST_KEYS, hit, err);
+    PolicyFree(p);
+    free(rule);
+
+    return (err);
+}
+
+// プレフィックスを "a.b.c.d/len" で書く
+static char *TestPrefix(u_int32_t lo, u_int32_t hi, char *buf, int size)
+{
+    struct in_addr addr;
+
+    addr.s_addr = htonl(lo);
+    snprintf(buf, size, "%s/%d", inet_ntoa(addr), 32 - __builtin_popcount(lo ^ hi));
+    return (buf);
+}
+
+static int TestAcl(int num)
+{
+    POLICY_RULE *rule;
+    ACL *acl;
+    FILE *fp;
+    char fname[] = "/tmp/acl_testXXXXXX", src[32], dst[32];
+    u_int32_t key[POLICY_FIELDS];
+    int i, fd, no, got, want, err, hit;
+
+    if ((rule = (POLICY_RULE *)malloc(num * sizeof(POLICY_RULE))) == NULL)
+    {
+        perror("malloc");
+        return (1);
+    }
+    if ((fd = mkstemp(fname)) == -1 || (fp = fdopen(fd, "w")) == NULL)
+    {
+        perror("mkstemp");
+        free(rule);
+        return (1);
+    }
+    for (i = 0; i < num; i++)
+    {
+        PolicyRandAclRule(&rule[i], i, num);
+        fprintf(fp, "%s", rule[i].action == ACL_PERMIT ? "permit" : "deny");
+        if (i != num - 1)
+        {
+            fprintf(fp, " from %s to %s proto %u dport %u",
+                    TestPrefix(rule[i].lo[POLICY_SRC], rule[i].hi[POLICY_SRC], src, sizeof(src)),
+                    TestPrefix(rule[i].lo[POLICY_DST], rule[i].hi[POLICY_DST], dst, sizeof(dst)),
+                    rule[i].lo[POLICY_PROTO], rule[i].lo[POLICY_DPORT]);
+        }
+        fprintf(fp, "\n");
+    }
+    fclose(fp);
+    no = AclLoadFile(fname, 1);
+    unlink(fname);
+    if (no != num || (acl = AclGet()) == NULL)
+    {
+        fprintf(stderr, "AclLoadFile:error num=%d loaded=%d\n", num, no);
+        free(rule);
+        return (1);
+    }
+
+    err = hit = 0;
+    for (i = 0; i < TEST_KEYS; i++)
+    {
+        PolicyRandKey(rule, num, key);
+        got = AclCheck(acl, 0, key);
+        no = PolicyLinear(rule, num, key);
+        want = no == -1 ? ACL_PERMIT : rule[no].action;
+        if (got != want)
+        {
+            fprintf(stderr, "NG:acl num=%d key=%08x %08x %u %u %u %u rule=%d %d!=%d\n",
+                    num, key[0], key[1], key[2], key[3], key[4], key[5], no, got, want);
+            err++;
+        }
+        hit += no != num - 1;
+    }
+    printf("acl:%d rules, %d keys (%d before the last rule), %d errors\n", num, TEST_KEYS, hit, err);
+    free(rule);
+
+    return (err);
+}
+
+int main(int argc, char *argv[])
+{
+    static int num[] = {1, 2, 63, 64, 65, 127, 128, 1000, 4095, 4096, 4097, 5000};
+    static int aclNum[] = {1, 100, 10000};
+    unsigned int seed;
+    int i, err;
+
+    seed = argc > 1 ? atoi(argv[1]) : time(NULL);
+    printf("seed:%u\n", seed);
+    srand(seed);
+
+    err = 0;
+    for (i = 0; i < sizeof(num) / sizeof(num[0]); i++)
+    {
+        err += TestPolicy(num[i]);
+    }
+    for (i = 0; i < sizeof(aclNum) / sizeof(aclNum[0]); i++)
+    {
+        err += TestAcl(aclNum[i]);
+    }
+    if (err != 0)
+    {
+        printf("NG\n");
+        return (1);
+    }
+    printf("OK\n");
+
+    return (0);
+}
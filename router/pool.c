@@ -0,0 +1,217 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include "base.h"
+#include "pool.h"
+
+extern int DebugPrintf(char *fmt, ...);
+
+// このファイルでは送信待ちパケット用の固定長バッファのプールを扱う
+// DATA_BUF とデータ領域を1つのキャッシュライン境界にそろえたかたまりにし、
+// スレッドごとのキャッシュから出し入れする。足りない・余ったときだけ共有の空きリストとまとめてやりとりする
+
+#define POOL_ALIGN 64
+#define POOL_HDR_SIZE ((sizeof(DATA_BUF) + POOL_ALIGN - 1) / POOL_ALIGN * POOL_ALIGN)
+#define POOL_ELEM_SIZE (POOL_HDR_SIZE + PKT_BUF_SIZE)
+#define POOL_CHUNK 256     // 空きがないときに一度に確保する数
+#define POOL_CACHE_MAX 64  // スレッドごとのキャッシュの大きさ
+#define POOL_BATCH 32      // 共有の空きリストとやりとりする数
+
+typedef struct _pool_cache_
+{
+    struct _pool_cache_ *next;
+    DATA_BUF *buf[POOL_CACHE_MAX];
+    int num;
+    unsigned long alloc;  // 取り出した回数
+    unsigned long free;   // 返した回数
+    unsigned long refill; // 共有リストから補充した回数
+    unsigned long flush;  // 共有リストへ戻した回数
+} POOL_CACHE;
+
+struct
+{
+    DATA_BUF *freeTop; // 共有の空きリスト（DATA_BUF.nextでつなぐ）
+    int freeNum;
+    int total;        // 確保したバッファの数
+    int chunkNum;     // ヒープから確保した回数
+    unsigned long fail;
+    POOL_CACHE *caches; // 統計用にすべてのスレッドのキャッシュをつなぐ
+    pthread_mutex_t mutex;
+    pthread_key_t key;
+} Pool = {NULL, 0, 0, 0, 0, NULL, PTHREAD_MUTEX_INITIALIZER};
+
+static __thread POOL_CACHE *Cache;
+
+// ロックを取った状態で呼ぶ
+static int PoolGrow(int num)
+{
+    u_char *chunk;
+    DATA_BUF *d;
+    int i;
+
+    if (posix_memalign((void **)&chunk, POOL_ALIGN, (size_t)num * POOL_ELEM_SIZE) != 0)
+    {
+        DebugPrintf("PoolGrow:posix_memalign error\n");
+        return (-1);
+    }
+    for (i = 0; i < num; i++)
+    {
+        d = (DATA_BUF *)(chunk + (size_t)i * POOL_ELEM_SIZE);
+        d->data = (u_char *)d + POOL_HDR_SIZE;
+        d->next = Pool.freeTop;
+        Pool.freeTop = d;
+    }
+    Pool.freeNum += num;
+    Pool.total += num;
+    Pool.chunkNum++;
+
+    return (0);
+}
+
+// スレッド終了時にキャッシュの中身を共有リストへ戻す
+static void PoolThreadExit(void *arg)
+{
+    POOL_CACHE *c = (POOL_CACHE *)arg;
+
+    pthread_mutex_lock(&Pool.mutex);
+    while (c->num > 0)
+    {
+        c->buf[--c->num]->next = Pool.freeTop;
+        Pool.freeTop = c->buf[c->num];
+        Pool.freeNum++;
+    }
+    pthread_mutex_unlock(&Pool.mutex);
+}
+
+// 起動時にnum個確保しておき、定常状態ではヒープを使わないようにする
+int PoolInit(int num)
+{
+    int status;
+
+    pthread_key_create(&Pool.key, PoolThreadExit);
+
+    pthread_mutex_lock(&Pool.mutex);
+    status = PoolGrow(num);
+    pthread_mutex_unlock(&Pool.mutex);
+
+    return (status);
+}
+
+static POOL_CACHE *PoolCache()
+{
+    if (Cache == NULL)
+    {
+        if ((Cache = (POOL_CACHE *)calloc(1, sizeof(POOL_CACHE))) == NULL)
+        {
+            return (NULL);
+        }
+        pthread_setspecific(Pool.key, Cache);
+        pthread_mutex_lock(&Pool.mutex);
+        Cache->next = Pool.caches;
+        Pool.caches = Cache;
+        pthread_mutex_unlock(&Pool.mutex);
+    }
+
+    return (Cache);
+}
+
+DATA_BUF *PoolAlloc()
+{
+    POOL_CACHE *c;
+    DATA_BUF *d;
+
+    if ((c = PoolCache()) == NULL)
+    {
+        return (NULL);
+    }
+
+    if (c->num == 0)
+    {
+        pthread_mutex_lock(&Pool.mutex);
+        if (Pool.freeNum < POOL_BATCH)
+        {
+            PoolGrow(POOL_CHUNK);
+        }
+        while (c->num < POOL_BATCH && Pool.freeTop != NULL)
+        {
+            c->buf[c->num++] = Pool.freeTop;
+            Pool.freeTop = Pool.freeTop->next;
+            Pool.freeNum--;
+        }
+        c->refill++;
+        if (c->num == 0)
+        {
+            Pool.fail++;
+            pthread_mutex_unlock(&Pool.mutex);
+            return (NULL);
+        }
+        pthread_mutex_unlock(&Pool.mutex);
+    }
+
+    d = c->buf[--c->num];
+    d->next = d->before = NULL;
+    c->alloc++;
+
+    return (d);
+}
+
+// 別のスレッドが確保したバッファもそのまま自分のキャッシュに返してよい
+void PoolFree(DATA_BUF *d)
+{
+    POOL_CACHE *c;
+
+    if ((c = PoolCache()) == NULL)
+    {
+        pthread_mutex_lock(&Pool.mutex);
+        d->next = Pool.freeTop;
+        Pool.freeTop = d;
+        Pool.freeNum++;
+        pthread_mutex_unlock(&Pool.mutex);
+        return;
+    }
+
+    if (c->num == POOL_CACHE_MAX)
+    {
+        pthread_mutex_lock(&Pool.mutex);
+        while (c->num > POOL_CACHE_MAX - POOL_BATCH)
+        {
+            c->buf[--c->num]->next = Pool.freeTop;
+            Pool.freeTop = c->buf[c->num];
+            Pool.freeNum++;
+        }
+        c->flush++;
+        pthread_mutex_unlock(&Pool.mutex);
+    }
+    c->buf[c->num++] = d;
+    c->free++;
+}
+
+int PoolStat(FILE *fp)
+{
+    POOL_CACHE *c;
+    unsigned long alloc, free, refill, flush;
+    int cached;
+
+    alloc = free = refill = flush = 0;
+    cached = 0;
+
+    pthread_mutex_lock(&Pool.mutex);
+    for (c = Pool.caches; c != NULL; c = c->next)
+    {
+        alloc += c->alloc;
+        free += c->free;
+        refill += c->refill;
+        flush += c->flush;
+        cached += c->num;
+    }
+    fprintf(fp, "pool:%d buffers(%d bytes) in %d chunks, free=%d cached=%d inuse=%d\n",
+            Pool.total, (int)POOL_ELEM_SIZE, Pool.chunkNum, Pool.freeNum, cached, Pool.total - Pool.freeNum - cached);
+    fprintf(fp, "pool:alloc=%lu free=%lu refill=%lu flush=%lu fail=%lu\n", alloc, free, refill, flush, Pool.fail);
+    pthread_mutex_unlock(&Pool.mutex);
+
+    return (0);
+}
@@ -0,0 +1,6 @@
+#define POOL_INIT_NUM 1024 //起動時に確保するパケットバッファの数
+
+int PoolInit(int num);
+DATA_BUF *PoolAlloc();
+void PoolFree(DATA_BUF *d);
+int PoolStat(FILE *fp);
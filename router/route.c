@@ -0,0 +1,947 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include "base.h"
+#include "route.h"
+#include "epoch.h"
+
+extern int DebugPrintf(char *fmt, ...);
+extern int DebugPerror(char *msg);
+extern char *in_addr_t2str(in_addr_t addr, char *buf, socklen_t size);
+
+extern DEVICE Device[DEVICE_MAX];
+extern int DeviceNum;
+
+// このファイルでは最長一致(longest prefix match)の経路表を扱う
+// DIR-24-8方式: 上位24ビットで tbl24 を引き、/25以上の経路があるところだけ tbl8 のグループを引く
+// どんなに経路が増えても検索は最大2回のメモリ参照で終わる
+
+// エントリの構成 [有効:1][tbl8:1][プレフィックス長:6][次ホップ番号 or グループ番号:24]
+#define RT_VALID 0x80000000
+#define RT_EXT 0x40000000
+#define RT_DEPTH_SHIFT 24
+#define RT_DEPTH_MASK 0x3F
+#define RT_VAL_MASK 0x00FFFFFF
+
+#define RT_ENTRY(depth, val) (RT_VALID | ((u_int32_t)(depth) << RT_DEPTH_SHIFT) | (val))
+#define RT_DEPTH(e) (((e) >> RT_DEPTH_SHIFT) & RT_DEPTH_MASK)
+
+#define RT_TBL24_SIZE (1 << 24)
+#define RT_TBL8_GROUP 256
+
+NEXTHOP NextHops[RT_NEXTHOP_MAX]; // 次ホップの表（番号は経路表のエントリに入る）
+int NextHopNum = 0;
+
+// ECMPグループ（転送スレッドが読んでいるかもしれないので解放せず、エポックを過ぎてから使い回す）
+NH_GROUP *NhGroups[RT_GROUP_MAX];
+int NhGroupNum = 0; // 0でなければ転送スレッドはフローのハッシュを求める
+static int NhGroupFree[RT_GROUP_MAX]; // 使われなくなったグループの番号
+static int NhGroupFreeNum = 0;
+
+FIB *RouteTables[RT_TABLE_MAX]; // 番号つきの経路表（0はメインの経路表、ポリシーで選ぶ）
+
+u_int32_t RouteGeneration = 0; // 経路を追加・削除するたびに増やす（フローキャッシュの無効化に使う）
+
+static u_int32_t RouteMask(int depth)
+{
+    if (depth == 0)
+    {
+        return (0);
+    }
+    return (0xFFFFFFFF << (32 - depth));
+}
+
+static u_int32_t RouteHash(u_int32_t prefix, int depth)
+{
+    u_int32_t h;
+
+    h = prefix ^ depth;
+    h ^= h >> 16;
+    h *= 0x85EBCA6B;
+    h ^= h >> 13;
+    h *= 0xC2B2AE35;
+    return (h ^ (h >> 16));
+}
+
+// 空いている次ホップの番号を返す
+// 参照がなくなっても転送スレッドがまだ読んでいるかもしれないので、外したエポックを過ぎたものだけ使い回す
+static int NextHopSlot()
+{
+    int i;
+
+    for (i = 0; i < NextHopNum; i++)
+    {
+        if (NextHops[i].refCnt == 0 && EpochPassed(NextHops[i].retire))
+        {
+            return (i);
+        }
+    }
+    if (NextHopNum >= RT_NEXTHOP_MAX)
+    {
+        return (-1);
+    }
+
+    return (NextHopNum++);
+}
+
+int NextHopAdd(int deviceNo, in_addr_t gateway)
+{
+    int i;
+
+    // 同じ次ホップがあれば共有する
+    for (i = 0; i < NextHopNum; i++)
+    {
+        if (NextHops[i].refCnt > 0 && NextHops[i].group == -1 && NextHops[i].deviceNo == deviceNo && NextHops[i].gateway == gateway)
+        {
+            NextHops[i].refCnt++;
+            return (i);
+        }
+    }
+    if ((i = NextHopSlot()) == -1)
+    {
+        DebugPrintf("NextHopAdd:too many nexthops\n");
+        return (-1);
+    }
+    NextHops[i].deviceNo = deviceNo;
+    NextHops[i].gateway = gateway;
+    NextHops[i].refCnt = 1;
+    NextHops[i].group = -1;
+
+    return (i);
+}
+
+void NextHopRelease(int nhNo)
+{
+    NH_GROUP *g;
+    int i;
+
+    if (nhNo >= 0 && nhNo < NextHopNum && NextHops[nhNo].refCnt > 0)
+    {
+        NextHops[nhNo].refCnt--;
+        if (NextHops[nhNo].refCnt == 0)
+        {
+            NextHops[nhNo].retire = EpochRetire();
+        }
+        if (NextHops[nhNo].refCnt == 0 && NextHops[nhNo].group != -1)
+        {
+            // グループを使う経路がなくなったらメンバーを手放し、グループは空きに戻す
+            g = NhGroups[NextHops[nhNo].group];
+            for (i = 0; i < g->memberNum; i++)
+            {
+                NextHopRelease(g->member[i]);
+            }
+            g->memberNum = 0;
+            g->retire = NextHops[nhNo].retire;
+            NhGroupFree[NhGroupFreeNum++] = NextHops[nhNo].group;
+        }
+    }
+}
+
+// メンバーの一覧をそろえ、bucketを振り直す
+// 残ったメンバーのbucketはそのままにし、外れたメンバーのbucketと、均等より多く持っているメンバーの余りだけを
+// 足りないメンバーに移す（1つ外しても、そのメンバーに流れていたフロー以外は行き先が変わらない）
+static int NextHopGroupSet(NH_GROUP *g, int num, int deviceNo[], in_addr_t gateway[])
+{
+    int member[NH_GROUP_MEMBER_MAX], count[NH_GROUP_MEMBER_MAX], target[NH_GROUP_MEMBER_MAX];
+    int i, j, b, k, nh, moved;
+
+    if (num < 1 || num > NH_GROUP_MEMBER_MAX)
+    {
+        DebugPrintf("NextHopGroupSet:bad member count %d\n", num);
+        return (-1);
+    }
+    for (i = 0; i < num; i++)
+    {
+        if ((member[i] = NextHopAdd(deviceNo[i], gateway[i])) == -1)
+        {
+            while (--i >= 0)
+            {
+                NextHopRelease(member[i]);
+            }
+            return (-1);
+        }
+        count[i] = 0;
+        target[i] = NH_GROUP_BUCKETS / num + (i < NH_GROUP_BUCKETS % num);
+    }
+
+    // 今のbucketの持ち主を数える（外れるメンバーのbucketは数えない）
+    for (b = 0; b < NH_GROUP_BUCKETS && g->memberNum > 0; b++)
+    {
+        for (i = 0; i < num; i++)
+        {
+            if (g->bucket[b] == member[i])
+            {
+                count[i]++;
+                break;
+            }
+        }
+    }
+    moved = 0;
+    j = 0;
+    for (b = 0; b < NH_GROUP_BUCKETS; b++)
+    {
+        nh = g->memberNum > 0 ? g->bucket[b] : -1;
+        for (i = 0; i < num; i++)
+        {
+            if (nh == member[i])
+            {
+                break;
+            }
+        }
+        if (i < num && count[i] <= target[i])
+        {
+            continue;
+        }
+        if (i < num)
+        {
+            count[i]--;
+        }
+        // 足りないメンバーに渡す
+        for (k = 0; k < num && count[j] >= target[j]; k++)
+        {
+            j = (j + 1) % num;
+        }
+        count[j]++;
+        __atomic_store_n(&g->bucket[b], member[j], __ATOMIC_RELAXED);
+        moved++;
+    }
+
+    // 前のメンバーを手放す（同じ次ホップは上の NextHopAdd で参照を増やしてあるので残る）
+    for (i = 0; i < g->memberNum; i++)
+    {
+        NextHopRelease(g->member[i]);
+    }
+    memcpy(g->member, member, num * sizeof(int));
+    g->memberNum = num;
+    DebugPrintf("NextHopGroupSet:%d members, %d buckets moved\n", num, moved);
+
+    return (moved);
+}
+
+// ECMPグループを作り、グループを指す次ホップの番号を返す
+int NextHopGroupAdd(int num, int deviceNo[], in_addr_t gateway[])
+{
+    NH_GROUP *g;
+    int nhNo, grpNo, i;
+
+    // 空きに戻したグループのうち、エポックを過ぎたものを使う
+    for (i = 0; i < NhGroupFreeNum; i++)
+    {
+        if (EpochPassed(NhGroups[NhGroupFree[i]]->retire))
+        {
+            break;
+        }
+    }
+    if (i < NhGroupFreeNum)
+    {
+        grpNo = NhGroupFree[i];
+        g = NhGroups[grpNo];
+        if (NextHopGroupSet(g, num, deviceNo, gateway) == -1)
+        {
+            return (-1);
+        }
+        NhGroupFree[i] = NhGroupFree[--NhGroupFreeNum];
+    }
+    else
+    {
+        if (NhGroupNum >= RT_GROUP_MAX)
+        {
+            DebugPrintf("NextHopGroupAdd:too many groups\n");
+            return (-1);
+        }
+        if ((g = (NH_GROUP *)calloc(1, sizeof(NH_GROUP))) == NULL)
+        {
+            DebugPerror("calloc");
+            return (-1);
+        }
+        if (NextHopGroupSet(g, num, deviceNo, gateway) == -1)
+        {
+            free(g);
+            return (-1);
+        }
+        grpNo = NhGroupNum;
+    }
+    // グループの次ホップは共有しないので、NextHopAddの検索に引っかからない番号を使う
+    if ((nhNo = NextHopSlot()) == -1)
+    {
+        DebugPrintf("NextHopGroupAdd:too many nexthops\n");
+        while (--g->memberNum >= 0)
+        {
+            NextHopRelease(g->member[g->memberNum]);
+        }
+        g->memberNum = 0;
+        if (grpNo == NhGroupNum)
+        {
+            free(g);
+        }
+        else
+        {
+            NhGroupFree[NhGroupFreeNum++] = grpNo;
+        }
+        return (-1);
+    }
+    NextHops[nhNo].deviceNo = -1;
+    NextHops[nhNo].gateway = 0;
+    NextHops[nhNo].refCnt = 1;
+    NextHops[nhNo].group = grpNo;
+    if (grpNo == NhGroupNum)
+    {
+        NhGroups[NhGroupNum] = g;
+        __atomic_store_n(&NhGroupNum, NhGroupNum + 1, __ATOMIC_RELEASE);
+    }
+
+    return (nhNo);
+}
+
+// 経路を入れたままグループのメンバーを入れ替える（経路表の世代は呼んだ側で進める）
+int NextHopGroupUpdate(int nhNo, int num, int deviceNo[], in_addr_t gateway[])
+{
+    if (NextHops[nhNo].group == -1)
+    {
+        return (-1);
+    }
+    return (NextHopGroupSet(NhGroups[NextHops[nhNo].group], num, deviceNo, gateway));
+}
+
+// グループならフローのハッシュでメンバーを選ぶ（転送スレッドから呼ぶ）
+NEXTHOP *NextHopSelect(NEXTHOP *nh, u_int32_t hash)
+{
+    if (nh->group == -1)
+    {
+        return (nh);
+    }
+    return (&NextHops[__atomic_load_n(&NhGroups[nh->group]->bucket[hash % NH_GROUP_BUCKETS], __ATOMIC_RELAXED)]);
+}
+
+int RouteInit(FIB *fib, u_int32_t tbl8Max)
+{
+    memset(fib, 0, sizeof(FIB));
+
+    // callocは大きな領域をmmapで確保するので、実際に触ったページ分しかメモリを使わない
+    if ((fib->tbl24 = (u_int32_t *)calloc(RT_TBL24_SIZE, sizeof(u_int32_t))) == NULL)
+    {
+        DebugPerror("calloc");
+        return (-1);
+    }
+    if ((fib->tbl8 = (u_int32_t *)calloc((size_t)tbl8Max * RT_TBL8_GROUP, sizeof(u_int32_t))) == NULL)
+    {
+        DebugPerror("calloc");
+        free(fib->tbl24);
+        return (-1);
+    }
+    if ((fib->tbl8Free = (u_int32_t *)malloc(tbl8Max * sizeof(u_int32_t))) == NULL)
+    {
+        DebugPerror("malloc");
+        free(fib->tbl24);
+        free(fib->tbl8);
+        return (-1);
+    }
+    if ((fib->tbl8Retire = (u_int64_t *)calloc(tbl8Max, sizeof(u_int64_t))) == NULL)
+    {
+        DebugPerror("calloc");
+        free(fib->tbl24);
+        free(fib->tbl8);
+        free(fib->tbl8Free);
+        return (-1);
+    }
+    fib->tbl8Max = tbl8Max;
+
+    fib->ruleSize = 1024;
+    if ((fib->rules = (ROUTE_RULE *)malloc(fib->ruleSize * sizeof(ROUTE_RULE))) == NULL)
+    {
+        DebugPerror("malloc");
+        free(fib->tbl24);
+        free(fib->tbl8);
+        free(fib->tbl8Free);
+        free(fib->tbl8Retire);
+        return (-1);
+    }
+    memset(fib->rules, 0xFF, fib->ruleSize * sizeof(ROUTE_RULE));
+
+    return (0);
+}
+
+// 経路のハッシュ表を検索する（見つからなければ空きスロットを返す）
+static ROUTE_RULE *RouteRuleSearch(FIB *fib, u_int32_t prefix, int depth)
+{
+    u_int32_t i, mask;
+    ROUTE_RULE *r;
+
+    mask = fib->ruleSize - 1;
+    for (i = RouteHash(prefix, depth) & mask;; i = (i + 1) & mask)
+    {
+        r = &fib->rules[i];
+        if (r->depth == -1 || (r->prefix == prefix && r->depth == depth))
+        {
+            return (r);
+        }
+    }
+}
+
+static int RouteRuleGrow(FIB *fib)
+{
+    ROUTE_RULE *old, *r;
+    u_int32_t oldSize, i;
+
+    old = fib->rules;
+    oldSize = fib->ruleSize;
+
+    fib->ruleSize = oldSize * 2;
+    if ((fib->rules = (ROUTE_RULE *)malloc(fib->ruleSize * sizeof(ROUTE_RULE))) == NULL)
+    {
+        DebugPerror("malloc");
+        fib->rules = old;
+        fib->ruleSize = oldSize;
+        return (-1);
+    }
+    memset(fib->rules, 0xFF, fib->ruleSize * sizeof(ROUTE_RULE));
+
+    for (i = 0; i < oldSize; i++)
+    {
+        if (old[i].depth != -1)
+        {
+            r = RouteRuleSearch(fib, old[i].prefix, old[i].depth);
+            *r = old[i];
+        }
+    }
+    free(old);
+
+    return (0);
+}
+
+// 線形探索のハッシュ表から削除し、後ろに続くエントリを詰め直す
+static void RouteRuleRemove(FIB *fib, ROUTE_RULE *r)
+{
+    u_int32_t i, j, k, mask;
+
+    mask = fib->ruleSize - 1;
+    i = r - fib->rules;
+    j = i;
+    while (1)
+    {
+        j = (j + 1) & mask;
+        if (fib->rules[j].depth == -1)
+        {
+            break;
+        }
+        k = RouteHash(fib->rules[j].prefix, fib->rules[j].depth) & mask;
+        // k が (i, j] の範囲にあれば動かせない
+        if ((i <= j) ? (i < k && k <= j) : (i < k || k <= j))
+        {
+            continue;
+        }
+        fib->rules[i] = fib->rules[j];
+        i = j;
+    }
+    fib->rules[i].depth = -1;
+}
+
+// 解放したグループは転送スレッドがまだ読んでいるかもしれないので、エポックを過ぎたものだけ使い回す
+static int RouteTbl8Alloc(FIB *fib)
+{
+    u_int32_t i, g;
+
+    for (i = 0; i < fib->tbl8FreeNum; i++)
+    {
+        g = fib->tbl8Free[i];
+        if (EpochPassed(fib->tbl8Retire[g]))
+        {
+            fib->tbl8Free[i] = fib->tbl8Free[--fib->tbl8FreeNum];
+            return (g);
+        }
+    }
+    if (fib->tbl8Num >= fib->tbl8Max)
+    {
+        DebugPrintf("RouteTbl8Alloc:tbl8 full(%u groups)\n", fib->tbl8Max);
+        return (-1);
+    }
+    return (fib->tbl8Num++);
+}
+
+// 長いプレフィックスのエントリを上書きしないように入れる
+static void RouteEntrySet(u_int32_t *e, int depth, u_int32_t ent, int matchDepth)
+{
+    if (matchDepth == -1)
+    {
+        if (!(*e & RT_VALID) || RT_DEPTH(*e) <= depth)
+        {
+            *e = ent;
+        }
+    }
+    else
+    {
+        if ((*e & RT_VALID) && RT_DEPTH(*e) == matchDepth)
+        {
+            *e = ent;
+        }
+    }
+}
+
+// ip/depth の範囲を ent に書き換える
+// matchDepth==-1 なら追加（より短い経路のエントリだけ上書き）、それ以外は長さ matchDepth のエントリだけ置き換える
+static int RouteSetRange(FIB *fib, u_int32_t ip, int depth, u_int32_t ent, int matchDepth)
+{
+    u_int32_t i, j, idx, num, e, *grp;
+    int g;
+
+    if (depth <= 24)
+    {
+        idx = ip >> 8;
+        num = 1 << (24 - depth);
+        for (i = idx; i < idx + num; i++)
+        {
+            e = fib->tbl24[i];
+            if (e & RT_EXT)
+            {
+                grp = &fib->tbl8[(e & RT_VAL_MASK) * RT_TBL8_GROUP];
+                for (j = 0; j < RT_TBL8_GROUP; j++)
+                {
+                    RouteEntrySet(&grp[j], depth, ent, matchDepth);
+                }
+            }
+            else
+            {
+                RouteEntrySet(&fib->tbl24[i], depth, ent, matchDepth);
+            }
+        }
+        return (0);
+    }
+
+    idx = ip >> 8;
+    e = fib->tbl24[idx];
+    if (!(e & RT_EXT))
+    {
+        if (matchDepth != -1)
+        {
+            return (0);
+        }
+        if ((g = RouteTbl8Alloc(fib)) == -1)
+        {
+            return (-1);
+        }
+        grp = &fib->tbl8[g * RT_TBL8_GROUP];
+        for (j = 0; j < RT_TBL8_GROUP; j++)
+        {
+            grp[j] = e;
+        }
+        // グループを埋めてから公開する
+        __atomic_store_n(&fib->tbl24[idx], RT_VALID | RT_EXT | g, __ATOMIC_RELEASE);
+    }
+    else
+    {
+        g = e & RT_VAL_MASK;
+        grp = &fib->tbl8[g * RT_TBL8_GROUP];
+    }
+
+    num = 1 << (32 - depth);
+    for (j = ip & 0xFF; j < (ip & 0xFF) + num; j++)
+    {
+        RouteEntrySet(&grp[j], depth, ent, matchDepth);
+    }
+
+    // 削除でグループ全体が/24以下の経路だけになったら tbl24 に戻す
+    if (matchDepth != -1)
+    {
+        for (j = 1; j < RT_TBL8_GROUP; j++)
+        {
+            if (grp[j] != grp[0])
+            {
+                return (0);
+            }
+        }
+        if (!(grp[0] & RT_VALID) || RT_DEPTH(grp[0]) <= 24)
+        {
+            __atomic_store_n(&fib->tbl24[idx], grp[0], __ATOMIC_RELEASE);
+            fib->tbl8Retire[g] = EpochRetire();
+            fib->tbl8Free[fib->tbl8FreeNum++] = g;
+        }
+    }
+
+    return (0);
+}
+
+// 次ホップnhNoの経路を入れる（失敗したときnhNoの参照は呼んだ側で返す）
+static int RouteInstall(FIB *fib, u_int32_t ip, int depth, int nhNo)
+{
+    ROUTE_RULE *r;
+
+    if ((fib->ruleNum + 1) * 2 > fib->ruleSize)
+    {
+        if (RouteRuleGrow(fib) == -1)
+        {
+            return (-1);
+        }
+    }
+    if (RouteSetRange(fib, ip, depth, RT_ENTRY(depth, nhNo), -1) == -1)
+    {
+        return (-1);
+    }
+
+    r = RouteRuleSearch(fib, ip, depth);
+    if (r->depth == -1)
+    {
+        r->prefix = ip;
+        r->depth = depth;
+        fib->ruleNum++;
+    }
+    else
+    {
+        // 同じプレフィックスは次ホップを入れ替える
+        NextHopRelease(r->nhNo);
+    }
+    r->nhNo = nhNo;
+    RouteGenBump();
+
+    return (0);
+}
+
+// prefixはネットワークバイトオーダ
+int RouteAdd(FIB *fib, in_addr_t prefix, int depth, int deviceNo, in_addr_t gateway)
+{
+    int nhNo;
+
+    if (depth < 0 || depth > 32)
+    {
+        DebugPrintf("RouteAdd:bad depth %d\n", depth);
+        return (-1);
+    }
+    if ((nhNo = NextHopAdd(deviceNo, gateway)) == -1)
+    {
+        return (-1);
+    }
+    if (RouteInstall(fib, ntohl(prefix) & RouteMask(depth), depth, nhNo) == -1)
+    {
+        NextHopRelease(nhNo);
+        return (-1);
+    }
+
+    return (0);
+}
+
+// 複数の次ホップ（ECMP）の経路を入れる
+// 同じプレフィックスがすでにECMPの経路なら、グループのメンバーだけを入れ替えて変わらないフローの行き先を保つ
+int RouteAddGroup(FIB *fib, in_addr_t prefix, int depth, int num, int deviceNo[], in_addr_t gateway[])
+{
+    ROUTE_RULE *r;
+    u_int32_t ip;
+    int nhNo;
+
+    if (num == 1)
+    {
+        return (RouteAdd(fib, prefix, depth, deviceNo[0], gateway[0]));
+    }
+    if (depth < 0 || depth > 32)
+    {
+        DebugPrintf("RouteAddGroup:bad depth %d\n", depth);
+        return (-1);
+    }
+    ip = ntohl(prefix) & RouteMask(depth);
+
+    r = RouteRuleSearch(fib, ip, depth);
+    if (r->depth != -1 && NextHops[r->nhNo].group != -1)
+    {
+        if (NextHopGroupUpdate(r->nhNo, num, deviceNo, gateway) == -1)
+        {
+            return (-1);
+        }
+        RouteGenBump();
+        return (0);
+    }
+    if ((nhNo = NextHopGroupAdd(num, deviceNo, gateway)) == -1)
+    {
+        return (-1);
+    }
+    if (RouteInstall(fib, ip, depth, nhNo) == -1)
+    {
+        NextHopRelease(nhNo);
+        return (-1);
+    }
+
+    return (0);
+}
+
+int RouteDelete(FIB *fib, in_addr_t prefix, int depth)
+{
+    ROUTE_RULE *r, *sub;
+    u_int32_t ip, ent;
+    int l;
+
+    if (depth < 0 || depth > 32)
+    {
+        return (-1);
+    }
+    ip = ntohl(prefix) & RouteMask(depth);
+
+    r = RouteRuleSearch(fib, ip, depth);
+    if (r->depth == -1)
+    {
+        return (-1);
+    }
+
+    // 代わりに使う、より短いプレフィックスの経路を探す
+    ent = 0;
+    for (l = depth - 1; l >= 0; l--)
+    {
+        sub = RouteRuleSearch(fib, ip & RouteMask(l), l);
+        if (sub->depth != -1)
+        {
+            ent = RT_ENTRY(l, sub->nhNo);
+            break;
+        }
+    }
+
+    RouteSetRange(fib, ip, depth, ent, depth);
+
+    NextHopRelease(r->nhNo);
+    RouteRuleRemove(fib, r);
+    fib->ruleNum--;
+    RouteGenBump();
+
+    return (0);
+}
+
+// 経路の世代（経路を引く前に読んでおき、フローキャッシュに入れる）
+// どの経路表・ポリシーが変わっても進める
+u_int32_t RouteGen()
+{
+    return (__atomic_load_n(&RouteGeneration, __ATOMIC_ACQUIRE));
+}
+
+void RouteGenBump()
+{
+    __atomic_add_fetch(&RouteGeneration, 1, __ATOMIC_RELEASE);
+}
+
+NEXTHOP *RouteLookup(FIB *fib, in_addr_t addr)
+{
+    u_int32_t ip, e;
+
+    ip = ntohl(addr);
+    e = __atomic_load_n(&fib->tbl24[ip >> 8], __ATOMIC_ACQUIRE);
+    if (e & RT_EXT)
+    {
+        e = fib->tbl8[(e & RT_VAL_MASK) * RT_TBL8_GROUP + (ip & 0xFF)];
+    }
+    if (!(e & RT_VALID))
+    {
+        return (NULL);
+    }
+
+    return (&NextHops[e & RT_VAL_MASK]);
+}
+
+// デバイス名からデバイス番号を求める
+int RouteDeviceNo(char *name)
+{
+    int i;
+
+    for (i = 0; i < DeviceNum; i++)
+    {
+        if (Device[i].name != NULL && strcmp(Device[i].name, name) == 0)
+        {
+            return (i);
+        }
+    }
+
+    return (-1);
+}
+
+// 番号noの経路表を返す（なければ作る、0はメインの経路表）
+FIB *RouteTable(FIB *mainFib, int no)
+{
+    FIB *fib;
+
+    if (no < 0 || no >= RT_TABLE_MAX)
+    {
+        DebugPrintf("RouteTable:bad table %d\n", no);
+        return (NULL);
+    }
+    if (no == 0)
+    {
+        return (mainFib);
+    }
+    if (RouteTables[no] == NULL)
+    {
+        // 経路表は転送スレッドが読んでいるかもしれないので、一度作ったら解放しない
+        if ((fib = (FIB *)malloc(sizeof(FIB))) == NULL)
+        {
+            DebugPerror("malloc");
+            return (NULL);
+        }
+        if (RouteInit(fib, RT_TBL8_MAX_TABLE) == -1)
+        {
+            free(fib);
+            return (NULL);
+        }
+        __atomic_store_n(&RouteTables[no], fib, __ATOMIC_RELEASE);
+    }
+
+    return (RouteTables[no]);
+}
+
+// 経路ファイルの各行を読む（applyが0なら読めるかだけを調べ、経路表には触らない）
+// 読めない行があれば-1を返す、applyが1なら経路を入れて経路数を返す
+static int RouteLoadLines(FIB *mainFib, FILE *fp, char *fname, int apply)
+{
+    char line[1024], *pfx, *dev, *gw, *p, *save;
+    struct in_addr addr, gateway;
+    FIB *fib;
+    int n, no, depth, lineNo, count;
+    int deviceNo[NH_GROUP_MEMBER_MAX];
+    in_addr_t gateways[NH_GROUP_MEMBER_MAX];
+
+    lineNo = 0;
+    count = 0;
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        lineNo++;
+        if ((p = strchr(line, '#')) != NULL)
+        {
+            *p = '\0';
+        }
+        if ((pfx = strtok_r(line, " \t\r\n", &save)) == NULL)
+        {
+            continue;
+        }
+        fib = mainFib;
+        if (strcmp(pfx, "table") == 0)
+        {
+            // 調べるときは経路表を作らない（作った経路表は解放できない）
+            if ((p = strtok_r(NULL, " \t\r\n", &save)) == NULL || (no = atoi(p)) < 0 || no >= RT_TABLE_MAX ||
+                (apply && (fib = RouteTable(mainFib, no)) == NULL) || (pfx = strtok_r(NULL, " \t\r\n", &save)) == NULL)
+            {
+                fprintf(stderr, "%s:%d:bad table\n", fname, lineNo);
+                return (-1);
+            }
+        }
+        if ((dev = strtok_r(NULL, " \t\r\n", &save)) == NULL)
+        {
+            fprintf(stderr, "%s:%d:no device\n", fname, lineNo);
+            return (-1);
+        }
+
+        if (strcmp(pfx, "default") == 0)
+        {
+            addr.s_addr = 0;
+            depth = 0;
+        }
+        else
+        {
+            depth = 32;
+            if ((p = strchr(pfx, '/')) != NULL)
+            {
+                *p = '\0';
+                depth = atoi(p + 1);
+            }
+            if (inet_aton(pfx, &addr) == 0 || depth < 0 || depth > 32)
+            {
+                fprintf(stderr, "%s:%d:bad prefix\n", fname, lineNo);
+                return (-1);
+            }
+        }
+        // device gateway の組を読む（1つ目はgatewayを省略できる）
+        n = 0;
+        for (; dev != NULL; dev = strtok_r(NULL, " \t\r\n", &save))
+        {
+            gw = strtok_r(NULL, " \t\r\n", &save);
+            if (n >= NH_GROUP_MEMBER_MAX || (deviceNo[n] = RouteDeviceNo(dev)) == -1)
+            {
+                fprintf(stderr, "%s:%d:unknown device %s\n", fname, lineNo, dev);
+                return (-1);
+            }
+            gateway.s_addr = 0;
+            if ((gw == NULL && n > 0) || (gw != NULL && inet_aton(gw, &gateway) == 0))
+            {
+                fprintf(stderr, "%s:%d:bad gateway\n", fname, lineNo);
+                return (-1);
+            }
+            gateways[n++] = gateway.s_addr;
+            if (gw == NULL)
+            {
+                break;
+            }
+        }
+
+        if (apply && RouteAddGroup(fib, addr.s_addr, depth, n, deviceNo, gateways) == -1)
+        {
+            fprintf(stderr, "%s:%d:RouteAdd error\n", fname, lineNo);
+            return (-1);
+        }
+        count++;
+    }
+
+    return (count);
+}
+
+// 1行に1経路 "[table n] prefix/len device [gateway [device gateway ...]]"  prefixに default と書くと 0.0.0.0/0
+// device gateway を複数並べるとECMPの経路になる、table n を付けるとポリシーで選ぶ経路表に入れる
+// 1行でも読めなければ経路を1つも入れずに-1を返す（先にファイル全体を調べてから入れる）
+// 入れている途中でRouteAddが失敗したら（tbl8が足りないなど）そこで止めて-1を返す
+int RouteLoadFile(FIB *mainFib, char *fname)
+{
+    FILE *fp;
+    int count;
+
+    if ((fp = fopen(fname, "r")) == NULL)
+    {
+        DebugPerror("fopen");
+        return (-1);
+    }
+    if (RouteLoadLines(mainFib, fp, fname, 0) == -1)
+    {
+        fclose(fp);
+        return (-1);
+    }
+    rewind(fp);
+    count = RouteLoadLines(mainFib, fp, fname, 1);
+    fclose(fp);
+    if (count == -1)
+    {
+        return (-1);
+    }
+
+    DebugPrintf("RouteLoadFile:%s %d routes\n", fname, count);
+
+    return (count);
+}
+
+// 経路数とメモリ使用量を出力する
+int RouteStat(FIB *fib, FILE *fp)
+{
+    size_t tbl24, tbl8, rules;
+    char buf[80];
+    int i, m, b, n;
+
+    tbl24 = (size_t)RT_TBL24_SIZE * sizeof(u_int32_t);
+    tbl8 = (size_t)(fib->tbl8Num - fib->tbl8FreeNum) * RT_TBL8_GROUP * sizeof(u_int32_t);
+    rules = (size_t)fib->ruleSize * sizeof(ROUTE_RULE);
+
+    fprintf(fp, "route:%u routes, %d nexthops, %d ecmp groups, tbl8 %u/%u groups\n",
+            fib->ruleNum, NextHopNum, NhGroupNum - NhGroupFreeNum, fib->tbl8Num - fib->tbl8FreeNum, fib->tbl8Max);
+    for (i = 0; i < NhGroupNum; i++)
+    {
+        if (NhGroups[i]->memberNum == 0)
+        {
+            continue;
+        }
+        fprintf(fp, "route:ecmp group[%d]", i);
+        for (m = 0; m < NhGroups[i]->memberNum; m++)
+        {
+            for (b = n = 0; b < NH_GROUP_BUCKETS; b++)
+            {
+                n += NhGroups[i]->bucket[b] == NhGroups[i]->member[m];
+            }
+            fprintf(fp, " %s=%d", in_addr_t2str(NextHops[NhGroups[i]->member[m]].gateway, buf, sizeof(buf)), n);
+        }
+        fprintf(fp, " buckets\n");
+    }
+    fprintf(fp, "route:memory tbl24=%zuKB tbl8=%zuKB rules=%zuKB total=%zuKB\n",
+            tbl24 / 1024, tbl8 / 1024, rules / 1024, (tbl24 + tbl8 + rules) / 1024);
+
+    return (0);
+}
@@ -0,0 +1,22 @@
+#define RT_NEXTHOP_MAX 4096
+#define RT_TBL8_MAX_DEFAULT 65536
+#define RT_GROUP_MAX 1024 //ECMPグループの最大数
+#define RT_TABLE_MAX 256 //経路表の数（0がメイン）
+#define RT_TBL8_MAX_TABLE 4096 //メイン以外の経路表のtbl8のグループ数
+
+int NextHopAdd(int deviceNo,in_addr_t gateway);
+void NextHopRelease(int nhNo);
+int NextHopGroupAdd(int num,int deviceNo[],in_addr_t gateway[]);
+int NextHopGroupUpdate(int nhNo,int num,int deviceNo[],in_addr_t gateway[]);
+NEXTHOP *NextHopSelect(NEXTHOP *nh,u_int32_t hash);
+int RouteInit(FIB *fib,u_int32_t tbl8Max);
+int RouteAdd(FIB *fib,in_addr_t prefix,int depth,int deviceNo,in_addr_t gateway);
+int RouteAddGroup(FIB *fib,in_addr_t prefix,int depth,int num,int deviceNo[],in_addr_t gateway[]);
+int RouteDelete(FIB *fib,in_addr_t prefix,int depth);
+NEXTHOP *RouteLookup(FIB *fib,in_addr_t addr);
+u_int32_t RouteGen();
+void RouteGenBump();
+int RouteDeviceNo(char *name);
+FIB *RouteTable(FIB *mainFib,int no);
+int RouteLoadFile(FIB *mainFib,char *fname);
+int RouteStat(FIB *fib,FILE *fp);
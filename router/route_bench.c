@@ -0,0 +1,154 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include "base.h"
+#include "route.h"
+
+// このファイルでは経路表（route.c）に 10k/100k/1M の経路を入れ、メモリ使用量と1秒あたりの検索数を測る
+// プレフィックス長はインターネットの経路表に近い割合（/24が半分強、/25以上は少し）で乱数から作る
+// make bench で作って動かす
+// 引数: [seed]
+
+#define BENCH_GATEWAYS 16 //次ホップの数
+#define BENCH_ADDRS (1 << 20) //検索する宛先の数（半分は入れた経路の中、半分は乱数）
+#define BENCH_LOOKUPS (1 << 26) //1つの経路数で検索する回数
+
+static u_int32_t Rand32()
+{
+    return ((u_int32_t)rand() ^ ((u_int32_t)rand() << 16));
+}
+
+// プレフィックス長を選ぶ
+static int BenchDepth()
+{
+    int r;
+
+    r = rand() % 100;
+    if (r < 1)
+    {
+        return (8 + rand() % 8);
+    }
+    if (r < 41)
+    {
+        return (16 + rand() % 8);
+    }
+    if (r < 97)
+    {
+        return (24);
+    }
+    return (25 + rand() % 8);
+}
+
+static double Now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+static void BenchFree(FIB *fib)
+{
+    free(fib->tbl24);
+    free(fib->tbl8);
+    free(fib->tbl8Free);
+    free(fib->tbl8Retire);
+    free(fib->rules);
+}
+
+static int Bench(int num, in_addr_t *addr)
+{
+    FIB fib;
+    NEXTHOP *nh;
+    u_int32_t *prefix, *mask;
+    unsigned long hit;
+    double t;
+    int i, k, depth, err;
+
+    prefix = (u_int32_t *)malloc(num * sizeof(u_int32_t));
+    mask = (u_int32_t *)malloc(num * sizeof(u_int32_t));
+    if (prefix == NULL || mask == NULL || RouteInit(&fib, RT_TBL8_MAX_DEFAULT) == -1)
+    {
+        fprintf(stderr, "Bench:init error\n");
+        return (-1);
+    }
+
+    err = 0;
+    t = Now();
+    for (i = 0; i < num; i++)
+    {
+        prefix[i] = Rand32();
+        depth = BenchDepth();
+        mask[i] = 0xFFFFFFFF << (32 - depth);
+        if (RouteAdd(&fib, htonl(prefix[i]), depth, 0, htonl(0x0A000001 + i % BENCH_GATEWAYS)) == -1)
+        {
+            err++;
+        }
+    }
+    t = Now() - t;
+    // 検索する宛先の半分は、入れた経路から1つ選んでその中の乱数にする
+    for (i = 0; i < BENCH_ADDRS; i++)
+    {
+        if (i % 2 == 0)
+        {
+            k = rand() % num;
+            addr[i] = htonl((prefix[k] & mask[k]) | (Rand32() & ~mask[k]));
+        }
+        else
+        {
+            addr[i] = htonl(Rand32());
+        }
+    }
+    printf("== %d prefixes (%d failed) add %.2fs\n", num, err, t);
+    RouteStat(&fib, stdout);
+
+    hit = 0;
+    t = Now();
+    for (i = 0; i < BENCH_LOOKUPS; i++)
+    {
+        nh = RouteLookup(&fib, addr[i & (BENCH_ADDRS - 1)]);
+        hit += nh != NULL;
+    }
+    t = Now() - t;
+    printf("lookup:%.1f Mlookups/s %.1f ns/lookup hit %.1f%%\n",
+           BENCH_LOOKUPS / t / 1e6, t * 1e9 / BENCH_LOOKUPS, hit * 100.0 / BENCH_LOOKUPS);
+
+    BenchFree(&fib);
+    free(prefix);
+    free(mask);
+
+    return (0);
+}
+
+int main(int argc, char *argv[])
+{
+    static int num[] = {10000, 100000, 1000000};
+    in_addr_t *addr;
+    unsigned int seed;
+    int i;
+
+    seed = argc > 1 ? atoi(argv[1]) : time(NULL);
+    printf("seed:%u\n", seed);
+    srand(seed);
+
+    if ((addr = (in_addr_t *)malloc(BENCH_ADDRS * sizeof(in_addr_t))) == NULL)
+    {
+        perror("malloc");
+        return (1);
+    }
+    for (i = 0; i < sizeof(num) / sizeof(num[0]); i++)
+    {
+        if (Bench(num[i], addr) == -1)
+        {
+            return (1);
+        }
+    }
+    free(addr);
+
+    return (0);
+}
@@ -0,0 +1,604 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/if_ether.h>
+#include <netinet/ip.h>
+#include <pthread.h>
+#include "base.h"
+#include "netutil.h"
+#include "sched.h"
+#include "txQueue.h"
+#include "latency.h"
+#include "codel.h"
+
+extern int DebugPrintf(char *fmt, ...);
+extern int DebugPerror(char *msg);
+
+// このファイルでは送信デバイスごとのクラスキュー（DSCPで選ぶ）と、完全優先＋DRRのスケジューラを扱う
+// 転送したフレームはクラスのキューにコピーしておき、wakeupの終わりに優先度の順で送信キューに渡す
+// 送信キューにbatchたまるごとに送り、送れなくなったら残りはキューに置いたまま次のwakeupで送る
+// 送れなかったフレームは送信キューに残ってクラスを追い越せないので、混んでいる間はbatchを小さくする
+// codelのクラスはキューにCoDelをかけ、fqのクラスはフローごとのキューに分けてそれぞれにCoDelをかける（FQ-CoDel）
+// CoDelで捨てるフレームがECN対応ならCEにして送る
+// キューとプールは転送スレッドごとに持つのでロックは取らない。設定は起動時に読むだけで差し替えない
+
+typedef struct
+{
+    char name[16];
+    int prio;    // 1なら完全優先（ファイルに書いた順に先に送る）
+    int quantum; // DRRで1巡に送れるバイト数
+    int limit;   // キューに入れられるフレーム数
+    int aqm;     // SCHED_AQM_NONE / SCHED_CODEL / SCHED_FQ_CODEL
+} SCHED_CLASS;
+
+static char *SchedAqmName[] = {"", "/codel", "/fq_codel"};
+
+static SCHED_CLASS SchedClass[SCHED_CLASS_MAX];
+static int SchedClassNum;
+static int SchedDscp[64];        // DSCPごとのクラス
+static u_int32_t SchedPrioMask;  // 完全優先のクラス（ビット、番号の小さいほうが先）
+static double SchedNsPerCycle;   // キューにいた時間をnsにする
+
+// "46,34-38,default" を読み、DSCPごとのクラスを決める
+static int SchedParseDscp(char *list, int c, int *deflt)
+{
+    char *s, *save, *p;
+    int lo, hi, d;
+
+    for (s = strtok_r(list, ",", &save); s != NULL; s = strtok_r(NULL, ",", &save))
+    {
+        if (strcmp(s, "default") == 0)
+        {
+            *deflt = c;
+            continue;
+        }
+        lo = hi = strtol(s, &p, 10);
+        if (*p == '-')
+        {
+            hi = strtol(p + 1, &p, 10);
+        }
+        if (*p != '\0' || lo < 0 || hi > 63 || lo > hi)
+        {
+            return (-1);
+        }
+        for (d = lo; d <= hi; d++)
+        {
+            SchedDscp[d] = c;
+        }
+    }
+
+    return (0);
+}
+
+// class NAME (prio | weight N) [limit N] [codel | fq] dscp (N[-M] | default)[,...]
+static int SchedParse(char *line, int c, int *deflt)
+{
+    char *tok[12], *save, *s;
+    SCHED_CLASS *k = &SchedClass[c];
+    int n, i, weight;
+
+    for (n = 0, s = strtok_r(line, " \t\r\n", &save); s != NULL; s = strtok_r(NULL, " \t\r\n", &save))
+    {
+        if (n == 12)
+        {
+            return (-1);
+        }
+        tok[n++] = s;
+    }
+    if (n < 3 || strcmp(tok[0], "class") != 0)
+    {
+        return (-1);
+    }
+    snprintf(k->name, sizeof(k->name), "%s", tok[1]);
+    k->prio = 0;
+    k->quantum = SCHED_QUANTUM;
+    k->limit = SCHED_LIMIT_DEFAULT;
+    k->aqm = SCHED_AQM_NONE;
+    for (i = 2; i < n; i++)
+    {
+        if (strcmp(tok[i], "prio") == 0)
+        {
+            k->prio = 1;
+            continue;
+        }
+        if (strcmp(tok[i], "codel") == 0 || strcmp(tok[i], "fq") == 0)
+        {
+            k->aqm = tok[i][0] == 'c' ? SCHED_CODEL : SCHED_FQ_CODEL;
+            continue;
+        }
+        if (i + 1 >= n)
+        {
+            return (-1);
+        }
+        if (strcmp(tok[i], "weight") == 0)
+        {
+            if ((weight = atoi(tok[++i])) < 1 || weight > 1000)
+            {
+                return (-1);
+            }
+            k->quantum = weight * SCHED_QUANTUM;
+        }
+        else if (strcmp(tok[i], "limit") == 0)
+        {
+            if ((k->limit = atoi(tok[++i])) < 1 || k->limit > SCHED_POOL_MAX)
+            {
+                return (-1);
+            }
+        }
+        else if (strcmp(tok[i], "dscp") == 0)
+        {
+            if (SchedParseDscp(tok[++i], c, deflt) == -1)
+            {
+                return (-1);
+            }
+        }
+        else
+        {
+            return (-1);
+        }
+    }
+
+    return (0);
+}
+
+// スケジューラの設定を読む（転送スレッドを作る前に1回だけ呼ぶ）
+// どのクラスにも書かれていないDSCPは "default" と書いたクラス（なければ最後のクラス）に入れる
+int SchedLoadFile(char *fname)
+{
+    FILE *fp;
+    char line[256], *p;
+    int lineNo, d, deflt;
+
+    if ((fp = fopen(fname, "r")) == NULL)
+    {
+        DebugPerror("fopen");
+        return (-1);
+    }
+    for (d = 0; d < 64; d++)
+    {
+        SchedDscp[d] = -1;
+    }
+    deflt = -1;
+    SchedClassNum = 0;
+    lineNo = 0;
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        lineNo++;
+        if ((p = strchr(line, '#')) != NULL)
+        {
+            *p = '\0';
+        }
+        if (strspn(line, " \t\r\n") == strlen(line))
+        {
+            continue;
+        }
+        if (SchedClassNum == SCHED_CLASS_MAX)
+        {
+            fprintf(stderr, "%s:%d:too many classes (max %d)\n", fname, lineNo, SCHED_CLASS_MAX);
+            fclose(fp);
+            SchedClassNum = 0;
+            return (-1);
+        }
+        // 1行でも読めなければ起動しない（クラスが抜けたまま動かさない）
+        if (SchedParse(line, SchedClassNum, &deflt) == -1)
+        {
+            fprintf(stderr, "%s:%d:bad class\n", fname, lineNo);
+            fclose(fp);
+            SchedClassNum = 0;
+            return (-1);
+        }
+        SchedClassNum++;
+    }
+    fclose(fp);
+    if (SchedClassNum == 0)
+    {
+        DebugPrintf("SchedLoadFile:%s no classes\n", fname);
+        return (-1);
+    }
+    if (deflt == -1)
+    {
+        deflt = SchedClassNum - 1;
+    }
+    for (d = 0; d < 64; d++)
+    {
+        if (SchedDscp[d] == -1)
+        {
+            SchedDscp[d] = deflt;
+        }
+    }
+    SchedPrioMask = 0;
+    for (d = 0; d < SchedClassNum; d++)
+    {
+        if (SchedClass[d].prio)
+        {
+            SchedPrioMask |= 1U << d;
+        }
+        DebugPrintf("SchedLoadFile:class %d %s %s%s quantum=%d limit=%d\n", d, SchedClass[d].name,
+                    SchedClass[d].prio ? "prio" : "drr", SchedAqmName[SchedClass[d].aqm], SchedClass[d].quantum, SchedClass[d].limit);
+    }
+    SchedNsPerCycle = 1e9 / CpuHz();
+
+    return (SchedClassNum);
+}
+
+// 作りかけのスケジューラを放す（callocしたのでまだ作っていないフローキューはNULL）
+static void SchedRelease(SCHED *s, int deviceNum)
+{
+    int i, c;
+
+    for (i = 0; i < deviceNum; i++)
+    {
+        for (c = 0; c < SchedClassNum; c++)
+        {
+            free(s->port[i].q[c].flow);
+        }
+    }
+    free(s->pkt);
+    free(s);
+}
+
+// 転送スレッドのスケジューラを作る（プールはキューを全部満たせる数、ただしSCHED_POOL_MAXまで）
+SCHED *SchedInit(int deviceNum)
+{
+    SCHED *s;
+    SCHED_QUEUE *q;
+    long num;
+    int i, c, f, flows;
+
+    for (i = 0, num = 0; i < SchedClassNum; i++)
+    {
+        num += SchedClass[i].limit;
+    }
+    num *= deviceNum;
+    if (num > SCHED_POOL_MAX)
+    {
+        num = SCHED_POOL_MAX;
+    }
+    if ((s = (SCHED *)calloc(1, sizeof(SCHED))) == NULL || (s->pkt = (SCHED_PKT *)malloc(num * sizeof(SCHED_PKT))) == NULL)
+    {
+        DebugPerror("malloc");
+        free(s);
+        return (NULL);
+    }
+    for (i = 0; i < num; i++)
+    {
+        s->pkt[i].next = i + 1 < num ? i + 1 : -1;
+    }
+    s->free = 0;
+    for (i = 0; i < deviceNum; i++)
+    {
+        s->port[i].batch = TX_BATCH;
+        for (c = 0; c < SchedClassNum; c++)
+        {
+            q = &s->port[i].q[c];
+            flows = SchedClass[c].aqm == SCHED_FQ_CODEL ? SCHED_FLOWS : 1;
+            if ((q->flow = (SCHED_FLOW *)calloc(flows, sizeof(SCHED_FLOW))) == NULL)
+            {
+                DebugPerror("calloc");
+                SchedRelease(s, deviceNum);
+                return (NULL);
+            }
+            for (f = 0; f < flows; f++)
+            {
+                q->flow[f].next = -1;
+            }
+            q->newHead = q->newTail = q->oldHead = q->oldTail = -1;
+        }
+    }
+
+    return (s);
+}
+
+// フローキューをnew/oldリストの末尾に付ける
+static void SchedFlowAppend(SCHED_QUEUE *q, int f, int list)
+{
+    int *head = list == 1 ? &q->newHead : &q->oldHead, *tail = list == 1 ? &q->newTail : &q->oldTail;
+
+    q->flow[f].next = -1;
+    q->flow[f].list = list;
+    if (*tail == -1)
+    {
+        *head = f;
+    }
+    else
+    {
+        q->flow[*tail].next = f;
+    }
+    *tail = f;
+}
+
+// リストの先頭のフローキューを外す
+static void SchedFlowPop(SCHED_QUEUE *q, int list)
+{
+    int *head = list == 1 ? &q->newHead : &q->oldHead, *tail = list == 1 ? &q->newTail : &q->oldTail;
+
+    q->flow[*head].list = 0;
+    if ((*head = q->flow[*head].next) == -1)
+    {
+        *tail = -1;
+    }
+}
+
+// フローキューの先頭のフレームを外す（戻り値はフレームの番号）
+static int SchedFlowTake(SCHED *s, SCHED_PORT *port, SCHED_QUEUE *q, SCHED_FLOW *f)
+{
+    int k;
+
+    k = f->head;
+    f->head = s->pkt[k].next;
+    f->num--;
+    f->qbytes -= s->pkt[k].len;
+    q->num--;
+    q->qbytes -= s->pkt[k].len;
+    port->backlog--;
+
+    return (k);
+}
+
+static void SchedFree(SCHED *s, int k)
+{
+    s->pkt[k].next = s->free;
+    s->free = k;
+}
+
+// フレームをTOSのDSCPで選んだクラスのキュー（FQ-CoDelならフローのハッシュで選んだフローキュー）にコピーする
+// クラスが一杯なら、FQ-CoDelは一番たまっているフローの先頭を捨てて入れ、それ以外は入れずに捨てる
+int SchedEnqueue(SCHED *s, int deviceNo, u_char *data, int size, int tos, u_int64_t cycles)
+{
+    SCHED_PORT *port = &s->port[deviceNo];
+    SCHED_QUEUE *q;
+    SCHED_FLOW *f;
+    SCHED_PKT *pkt;
+    struct iphdr *iphdr;
+    int c, k, i, fat, hlen;
+
+    c = SchedDscp[tos >> 2];
+    q = &port->q[c];
+    if (size > PKT_BUF_SIZE)
+    {
+        q->drops++;
+        return (-1);
+    }
+    if (q->num >= SchedClass[c].limit || s->free == -1)
+    {
+        if (SchedClass[c].aqm != SCHED_FQ_CODEL || q->num == 0)
+        {
+            q->drops++;
+            return (-1);
+        }
+        for (i = 1, fat = 0; i < SCHED_FLOWS; i++)
+        {
+            fat = q->flow[i].qbytes > q->flow[fat].qbytes ? i : fat;
+        }
+        SchedFree(s, SchedFlowTake(s, port, q, &q->flow[fat]));
+        q->drops++;
+    }
+    f = &q->flow[0];
+    if (SchedClass[c].aqm == SCHED_FQ_CODEL)
+    {
+        iphdr = (struct iphdr *)(data + sizeof(struct ether_header));
+        hlen = sizeof(struct ether_header) + iphdr->ihl * 4;
+        // ECMPと同じハッシュなので、かけ直して上位ビットを使う
+        f = &q->flow[(IpFlowHash(iphdr, data + hlen, size - hlen) * 0x9E3779B9U) >> (32 - SCHED_FLOW_BITS)];
+    }
+    k = s->free;
+    pkt = &s->pkt[k];
+    s->free = pkt->next;
+    memcpy(pkt->data, data, size);
+    pkt->len = size;
+    pkt->stamp = cycles;
+    pkt->next = -1;
+    if (f->num == 0)
+    {
+        f->head = k;
+    }
+    else
+    {
+        s->pkt[f->tail].next = k;
+    }
+    f->tail = k;
+    f->num++;
+    f->qbytes += size;
+    if (f->list == 0)
+    {
+        // 新しいフローはnewリストから先に送る
+        f->deficit = CODEL_MTU;
+        SchedFlowAppend(q, f - q->flow, 1);
+    }
+    if (!(port->ready & (1U << c)))
+    {
+        port->ready |= 1U << c;
+        if (!SchedClass[c].prio)
+        {
+            q->deficit = SchedClass[c].quantum;
+            port->active[(port->activeHead + port->activeNum++) & (SCHED_CLASS_MAX - 1)] = c;
+        }
+    }
+    q->num++;
+    q->qbytes += size;
+    q->enq++;
+    port->backlog++;
+    s->busy |= 1U << deviceNo;
+
+    return (0);
+}
+
+// 次に送るクラスを選ぶ（完全優先のクラスにあればそれ、なければDRRの先頭）
+static int SchedNext(SCHED_PORT *port)
+{
+    SCHED_QUEUE *q;
+    int c;
+
+    if (port->ready & SchedPrioMask)
+    {
+        return (__builtin_ctz(port->ready & SchedPrioMask));
+    }
+    for (;;)
+    {
+        c = port->active[port->activeHead];
+        q = &port->q[c];
+        if (q->deficit > 0)
+        {
+            return (c);
+        }
+        // 今回の分を使い切ったので足して末尾に回す
+        q->deficit += SchedClass[c].quantum;
+        port->activeHead = (port->activeHead + 1) & (SCHED_CLASS_MAX - 1);
+        port->active[(port->activeHead + port->activeNum - 1) & (SCHED_CLASS_MAX - 1)] = c;
+    }
+}
+
+// クラスから次に送るフレームを取り出す（RFC 8290のnew/oldリストのDRR、CoDelで捨てたものは飛ばす）
+// 送るものがなければ-1
+static int SchedPop(SCHED *s, SCHED_PORT *port, int c, u_int64_t now)
+{
+    SCHED_QUEUE *q = &port->q[c];
+    SCHED_FLOW *f;
+    SCHED_PKT *pkt;
+    int list, k;
+
+    for (;;)
+    {
+        if (q->newHead != -1)
+        {
+            list = 1;
+            f = &q->flow[q->newHead];
+        }
+        else if (q->oldHead != -1)
+        {
+            list = 2;
+            f = &q->flow[q->oldHead];
+        }
+        else
+        {
+            return (-1);
+        }
+        if (f->deficit <= 0)
+        {
+            f->deficit += CODEL_MTU;
+            SchedFlowPop(q, list);
+            SchedFlowAppend(q, f - q->flow, 2);
+            continue;
+        }
+        if (f->num == 0)
+        {
+            // 空になったnewのフローはoldの末尾に回し、oldのフローは外す
+            SchedFlowPop(q, list);
+            if (list == 1)
+            {
+                SchedFlowAppend(q, f - q->flow, 2);
+            }
+            CodelReset(&f->codel);
+            continue;
+        }
+        k = SchedFlowTake(s, port, q, f);
+        pkt = &s->pkt[k];
+        if (SchedClass[c].aqm != SCHED_AQM_NONE &&
+            CodelDrop(&f->codel, now * SchedNsPerCycle, (now - pkt->stamp) * SchedNsPerCycle, f->qbytes))
+        {
+            if (!CodelMark((struct iphdr *)(pkt->data + sizeof(struct ether_header))))
+            {
+                q->aqmDrops++;
+                SchedFree(s, k);
+                continue;
+            }
+            q->marks++;
+        }
+        f->deficit -= pkt->len;
+        return (k);
+    }
+}
+
+// キューにあるフレームを優先度の順に送信キューに渡す（wakeupの終わりに呼ぶ）
+// 送信キューにbatchたまるごとに送り、カーネルが受け取らなくなったら残りは次に回す
+int SchedDrain(SCHED *s, TX_QUEUE *txq)
+{
+    SCHED_PORT *port;
+    SCHED_QUEUE *q;
+    SCHED_PKT *pkt;
+    TX_QUEUE *tq;
+    u_int32_t busy;
+    u_int64_t now;
+    int i, c, k, count;
+
+    count = 0;
+    now = CpuCycles();
+    for (busy = s->busy; busy; busy &= busy - 1)
+    {
+        i = __builtin_ctz(busy);
+        port = &s->port[i];
+        tq = &txq[i];
+        if (tq->num > 0 && TxQueueFlush(tq) == -1 && tq->num > 0)
+        {
+            // 前に渡した分がまだ送れていない
+            port->batch = port->batch > 1 ? port->batch / 2 : 1;
+            continue;
+        }
+        while (port->backlog > 0)
+        {
+            if (tq->num >= port->batch)
+            {
+                TxQueueFlush(tq);
+                if (tq->num > 0)
+                {
+                    port->batch = port->batch > 1 ? port->batch / 2 : 1;
+                    break;
+                }
+                port->batch = port->batch < TX_BATCH ? port->batch * 2 : TX_BATCH;
+            }
+            c = SchedNext(port);
+            q = &port->q[c];
+            if ((k = SchedPop(s, port, c, now)) != -1)
+            {
+                pkt = &s->pkt[k];
+                q->deficit -= pkt->len;
+                LatencyAdd(&q->delay, (u_int64_t)((now > pkt->stamp ? now - pkt->stamp : 0) * SchedNsPerCycle));
+                q->sent++;
+                q->bytes += pkt->len;
+                TxQueueSend(tq, pkt->data, pkt->len);
+                SchedFree(s, k);
+                count++;
+            }
+            if (q->num == 0)
+            {
+                port->ready &= ~(1U << c);
+                if (!SchedClass[c].prio)
+                {
+                    // 空になったDRRのクラスは外す（また入ったときにquantumから始める）
+                    port->activeHead = (port->activeHead + 1) & (SCHED_CLASS_MAX - 1);
+                    port->activeNum--;
+                }
+            }
+        }
+        if (port->backlog == 0)
+        {
+            s->busy &= ~(1U << i);
+        }
+    }
+
+    return (count);
+}
+
+int SchedStat(SCHED *s, int deviceNo, char *name, FILE *fp)
+{
+    SCHED_QUEUE *q;
+    int c;
+
+    for (c = 0; c < SchedClassNum; c++)
+    {
+        q = &s->port[deviceNo].q[c];
+        if (q->enq == 0 && q->drops == 0)
+        {
+            continue;
+        }
+        fprintf(fp, "sched:%s %s %s%s enq=%lu sent=%lu bytes=%lu drops=%lu codel=%lu marked=%lu backlog=%d delay p50=%.1fus p99=%.1fus max=%.1fus\n",
+                name, SchedClass[c].name, SchedClass[c].prio ? "prio" : "drr", SchedAqmName[SchedClass[c].aqm],
+                q->enq, q->sent, q->bytes, q->drops, q->aqmDrops, q->marks, q->num,
+                LatencyPercentile(&q->delay, 0.5) / 1e3, LatencyPercentile(&q->delay, 0.99) / 1e3, q->delay.max / 1e3);
+    }
+
+    return (0);
+}
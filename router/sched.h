@@ -0,0 +1,15 @@
+#define SCHED_QUANTUM 1514 //DRRのweight 1あたりの1巡で送れるバイト数
+#define SCHED_LIMIT_DEFAULT 1024 //クラスごとのキューの長さ（フレーム数）
+#define SCHED_POOL_MAX 65536 //転送スレッドごとのフレームのプールの上限
+#define SCHED_FLOW_BITS 6
+#define SCHED_FLOWS (1 << SCHED_FLOW_BITS) //FQ-CoDelのクラスごとのフローキューの数
+
+#define SCHED_AQM_NONE 0
+#define SCHED_CODEL 1 //クラスのキューにCoDelをかける
+#define SCHED_FQ_CODEL 2 //フローごとのキューに分けて、それぞれにCoDelをかける
+
+int SchedLoadFile(char *fname);
+SCHED *SchedInit(int deviceNum);
+int SchedEnqueue(SCHED *s,int deviceNo,unsigned char *data,int size,int tos,u_int64_t cycles);
+int SchedDrain(SCHED *s,TX_QUEUE *txq);
+int SchedStat(SCHED *s,int deviceNo,char *name,FILE *fp);
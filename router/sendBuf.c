@@ -1,23 +1,57 @@
 #include    <stdio.h>
 #include    <stdlib.h>
 #include    <string.h>
+#include    <time.h>
 #include    <errno.h>
 #include    <sys/socket.h>
 #include    <net/ethernet.h>
 #include    <netinet/in.h>
 #include    <netinet/ip.h>
 #include    <pthread.h>
-#include	"netutil.h"
 #include	"base.h"
+#include	"netutil.h"
 #include	"ip2mac.h"
+#include	"timer.h"
+#include	"pool.h"
 
 extern int	DebugPrintf(char *fmt,...);
 extern int	DebugPerror(char *msg);
 
 #define	MAX_BUCKET_SIZE	(1024*1024)
 
+/* 近隣の解決を待つ間はキューから送り出されないので、CoDelの代わりに滞留時間で先頭から捨てる */
+u_int64_t	SendDataSojourn=0;	/* これより長く（TSC）待ったものは捨てる（0なら捨てない） */
+unsigned long	SendDataAqmDrops;
+
+int SendDataAqm(u_int64_t ns)
+{
+	SendDataSojourn=ns*CpuHz()/1e9;
+	return(0);
+}
+
+/* 滞留時間を超えたものを先頭から捨てる（mutexを取ってから呼ぶ） */
+static void DropStaleSendData(SEND_DATA *sd,u_int64_t now)
+{
+DATA_BUF	*d;
+
+	while((d=sd->top)!=NULL&&now-d->stamp>SendDataSojourn){
+		sd->top=d->next;
+		if(sd->top==NULL){
+			sd->bottom=NULL;
+		}
+		else{
+			sd->top->before=NULL;
+		}
+		sd->dno--;
+		sd->inBucketSize-=d->size;
+		__atomic_add_fetch(&SendDataAqmDrops,1,__ATOMIC_RELAXED);
+		PoolFree(d);
+	}
+}
 
-int AppendSendData(IP2MAC *ip2mac,int deviceNo,in_addr_t addr,u_char *data,int size)
+
+/* rxDeviceNoは受け取ったデバイス（解決できなかったときにそこへICMPを返す） */
+int AppendSendData(IP2MAC *ip2mac,int deviceNo,int rxDeviceNo,in_addr_t addr,u_char *data,int size)
 {
 SEND_DATA	*sd=&ip2mac->sd;
 DATA_BUF	*d;
@@ -29,28 +63,28 @@ char	buf[80];
 		return(-1);
 	}
 
-	d=(DATA_BUF *)malloc(sizeof(DATA_BUF));
-	if(d==NULL){
-		DebugPerror("malloc");
+	if(size>PKT_BUF_SIZE){
+		DebugPrintf("AppendSendData:too big(%d)\n",size);
 		return(-1);
 	}
-	d->data=(u_char *)malloc(size);
-	if(d->data==NULL){
-		DebugPerror("malloc");
-		free(d);
+	if((d=PoolAlloc())==NULL){
+		DebugPrintf("AppendSendData:PoolAlloc error\n");
 		return(-1);
 	}
-	d->next=d->before=NULL;
-	d->t=time(NULL);
+	d->t=NowSec;
+	d->deviceNo=rxDeviceNo;
+	d->stamp=CpuCycles();
 	d->size=size;
 	memcpy(d->data,data,size);
 
 	if((status=pthread_mutex_lock(&sd->mutex))!=0){
 		DebugPrintf("AppendSendData:pthread_mutex_lock:%s\n",strerror(status));
-		free(d->data);
-		free(d);
+		PoolFree(d);
 		return(-1);
 	}
+	if(SendDataSojourn!=0){
+		DropStaleSendData(sd,d->stamp);
+	}
 	if(sd->bottom==NULL){
 		sd->top=sd->bottom=d;
 	}
@@ -68,7 +102,8 @@ char	buf[80];
 	return(0);
 }
 
-int GetSendData(IP2MAC *ip2mac,int *size,u_char **data)
+/* 取り出したバッファは送信後にPoolFreeで返す */
+int GetSendData(IP2MAC *ip2mac,DATA_BUF **data)
 {
 SEND_DATA	*sd=&ip2mac->sd;
 DATA_BUF	*d;
@@ -83,7 +118,13 @@ char	buf[80];
 		DebugPrintf("pthread_mutex_lock:%s\n",strerror(status));
 		return(-1);
 	}
-	d=sd->top;
+	if(SendDataSojourn!=0){
+		DropStaleSendData(sd,CpuCycles());
+	}
+	if((d=sd->top)==NULL){
+		pthread_mutex_unlock(&sd->mutex);
+		return(-1);
+	}
 	sd->top=d->next;
 	if(sd->top==NULL){
 		sd->bottom=NULL;
@@ -96,20 +137,52 @@ char	buf[80];
 
 	pthread_mutex_unlock(&sd->mutex);
 
-	*size=d->size;
-	*data=d->data;
-
-	free(d);
+	*data=d;
 
-	DebugPrintf("GetSendData:[%d] %s %dbytes\n",ip2mac->deviceNo,in_addr_t2str(ip2mac->addr,buf,sizeof(buf)),*size);
+	DebugPrintf("GetSendData:[%d] %s %dbytes\n",ip2mac->deviceNo,in_addr_t2str(ip2mac->addr,buf,sizeof(buf)),d->size);
 
 	return(0);
 }
 
+/* limitより前に入ったデータを先頭から捨て、残った先頭の時刻を返す（空なら0） */
+time_t ExpireSendData(IP2MAC *ip2mac,time_t limit)
+{
+SEND_DATA	*sd=&ip2mac->sd;
+DATA_BUF	*d;
+time_t	head;
+int	status;
+
+	if(sd->top==NULL){
+		return(0);
+	}
+
+	if((status=pthread_mutex_lock(&sd->mutex))!=0){
+		DebugPrintf("pthread_mutex_lock:%s\n",strerror(status));
+		return(0);
+	}
+	while((d=sd->top)!=NULL&&d->t<limit){
+		sd->top=d->next;
+		if(sd->top==NULL){
+			sd->bottom=NULL;
+		}
+		else{
+			sd->top->before=NULL;
+		}
+		sd->dno--;
+		sd->inBucketSize-=d->size;
+		DebugPrintf("ExpireSendData:[%d] %dbytes\n",ip2mac->deviceNo,d->size);
+		PoolFree(d);
+	}
+	head=(sd->top!=NULL)?sd->top->t:0;
+	pthread_mutex_unlock(&sd->mutex);
+
+	return(head);
+}
+
 int FreeSendData(IP2MAC *ip2mac)
 {
 SEND_DATA	*sd=&ip2mac->sd;
-DATA_BUF	*ptr;
+DATA_BUF	*ptr,*next;
 int	status;
 char	buf[80];
 
@@ -122,12 +195,15 @@ char	buf[80];
 		return(-1);
 	}
 
-	for(ptr=sd->top;ptr!=NULL;ptr=ptr->next){
+	for(ptr=sd->top;ptr!=NULL;ptr=next){
 		DebugPrintf("FreeSendData:%s %lu\n",in_addr_t2str(ip2mac->addr,buf,sizeof(buf)),sd->inBucketSize);
-		free(ptr->data);
+		next=ptr->next;
+		PoolFree(ptr);
 	}
 
 	sd->top=sd->bottom=NULL;
+	sd->dno=0;
+	sd->inBucketSize=0;
 
 	pthread_mutex_unlock(&sd->mutex);
 
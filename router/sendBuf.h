@@ -1,4 +1,6 @@
-int AppendSendData(IP2MAC *ip2mac,int deviceNo,in_addr_t addr,unsigned char *data,int size);
-int GetSendData(IP2MAC *ip2mac,int *size,unsigned char **data);
+int AppendSendData(IP2MAC *ip2mac,int deviceNo,int rxDeviceNo,in_addr_t addr,unsigned char *data,int size);
+int GetSendData(IP2MAC *ip2mac,DATA_BUF **data);
+time_t ExpireSendData(IP2MAC *ip2mac,time_t limit);
 int FreeSendData(IP2MAC *ip2mac);
+int SendDataAqm(u_int64_t ns);
 int BufferSend();
\ No newline at end of file
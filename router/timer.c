@@ -0,0 +1,204 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <sys/timerfd.h>
+#include "base.h"
+#include "timer.h"
+
+extern int DebugPrintf(char *fmt, ...);
+extern int DebugPerror(char *msg);
+
+// このファイルでは階層型タイマーホイールと粗い時計を扱う
+// 時計はイベントループで1回だけ更新し、パケットごとの処理では NowMs/NowSec を読むだけにする
+
+#define TIMER_LEVEL 4 // 64^4 tick = 約19日まで
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOT (1 << TIMER_SLOT_BITS)
+#define TIMER_SLOT_MASK (TIMER_SLOT - 1)
+
+volatile u_int64_t NowMs; // 単調増加する時計（ミリ秒）
+volatile time_t NowSec;   // 同じ時計の秒
+
+struct
+{
+    TIMER slot[TIMER_LEVEL][TIMER_SLOT]; // 各スロットのリストの先頭（番兵）
+    u_int64_t tick;                      // 処理済みのtick
+    pthread_mutex_t mutex;
+} Wheel;
+
+void ClockUpdate()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    NowMs = (u_int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    NowSec = ts.tv_sec;
+}
+
+int TimerInit()
+{
+    int l, i;
+
+    ClockUpdate();
+    for (l = 0; l < TIMER_LEVEL; l++)
+    {
+        for (i = 0; i < TIMER_SLOT; i++)
+        {
+            Wheel.slot[l][i].next = Wheel.slot[l][i].before = &Wheel.slot[l][i];
+        }
+    }
+    Wheel.tick = NowMs / TIMER_TICK_MS;
+    pthread_mutex_init(&Wheel.mutex, NULL);
+
+    return (0);
+}
+
+// TIMER_TICK_MSごとに読めるようになるtimerfdを作る（イベントループのepollに登録する）
+int TimerFdOpen()
+{
+    struct itimerspec its;
+    int fd;
+
+    if ((fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) == -1)
+    {
+        DebugPerror("timerfd_create");
+        return (-1);
+    }
+    its.it_interval.tv_sec = TIMER_TICK_MS / 1000;
+    its.it_interval.tv_nsec = (TIMER_TICK_MS % 1000) * 1000000L;
+    its.it_value = its.it_interval;
+    if (timerfd_settime(fd, 0, &its, NULL) == -1)
+    {
+        DebugPerror("timerfd_settime");
+        close(fd);
+        return (-1);
+    }
+
+    return (fd);
+}
+
+// 残りtick数からレベルとスロットを決めてつなぐ（ロックを取った状態で呼ぶ）
+static void TimerLink(TIMER *timer)
+{
+    u_int64_t diff;
+    TIMER *head;
+    int l;
+
+    diff = timer->expire - Wheel.tick;
+    for (l = 0; l < TIMER_LEVEL - 1; l++)
+    {
+        if (diff < ((u_int64_t)1 << (TIMER_SLOT_BITS * (l + 1))))
+        {
+            break;
+        }
+    }
+    head = &Wheel.slot[l][(timer->expire >> (TIMER_SLOT_BITS * l)) & TIMER_SLOT_MASK];
+
+    timer->before = head->before;
+    timer->next = head;
+    head->before->next = timer;
+    head->before = timer;
+}
+
+static void TimerUnlink(TIMER *timer)
+{
+    timer->before->next = timer->next;
+    timer->next->before = timer->before;
+    timer->next = timer->before = NULL;
+}
+
+// ms後に timer->func を呼ぶ（登録済みなら期限を付け替える）約19日まで
+void TimerAdd(TIMER *timer, u_int64_t ms)
+{
+    pthread_mutex_lock(&Wheel.mutex);
+    if (timer->armed)
+    {
+        TimerUnlink(timer);
+    }
+    timer->expire = Wheel.tick + (ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    if (timer->expire <= Wheel.tick)
+    {
+        timer->expire = Wheel.tick + 1;
+    }
+    timer->armed = 1;
+    TimerLink(timer);
+    pthread_mutex_unlock(&Wheel.mutex);
+}
+
+void TimerDel(TIMER *timer)
+{
+    pthread_mutex_lock(&Wheel.mutex);
+    if (timer->armed)
+    {
+        TimerUnlink(timer);
+        timer->armed = 0;
+    }
+    pthread_mutex_unlock(&Wheel.mutex);
+}
+
+// 上位レベルのスロットの中身を下位レベルに配り直す
+static void TimerCascade(int l)
+{
+    TIMER *head, *timer;
+
+    head = &Wheel.slot[l][(Wheel.tick >> (TIMER_SLOT_BITS * l)) & TIMER_SLOT_MASK];
+    while ((timer = head->next) != head)
+    {
+        TimerUnlink(timer);
+        TimerLink(timer);
+    }
+}
+
+// 現在時刻までtickを進め、期限の来たタイマーの関数を呼ぶ（イベントループから呼ぶ）
+int TimerRun()
+{
+    TIMER *head, *timer, expired;
+    u_int64_t now;
+    int l, count;
+
+    now = NowMs / TIMER_TICK_MS;
+    count = 0;
+
+    pthread_mutex_lock(&Wheel.mutex);
+    while (Wheel.tick < now)
+    {
+        Wheel.tick++;
+        for (l = 1; l < TIMER_LEVEL; l++)
+        {
+            if ((Wheel.tick >> (TIMER_SLOT_BITS * (l - 1))) & TIMER_SLOT_MASK)
+            {
+                break;
+            }
+            TimerCascade(l);
+        }
+
+        // コールバックの中で TimerAdd できるよう、取り出してからロックを外して呼ぶ
+        // 呼ぶまでは armed のままにして、他のスレッドの TimerAdd/TimerDel で外せるようにする
+        expired.next = expired.before = &expired;
+        head = &Wheel.slot[0][Wheel.tick & TIMER_SLOT_MASK];
+        while ((timer = head->next) != head)
+        {
+            TimerUnlink(timer);
+            timer->before = expired.before;
+            timer->next = &expired;
+            expired.before->next = timer;
+            expired.before = timer;
+        }
+        while ((timer = expired.next) != &expired)
+        {
+            TimerUnlink(timer);
+            timer->armed = 0;
+            pthread_mutex_unlock(&Wheel.mutex);
+            timer->func(timer);
+            count++;
+            pthread_mutex_lock(&Wheel.mutex);
+        }
+    }
+    pthread_mutex_unlock(&Wheel.mutex);
+
+    return (count);
+}
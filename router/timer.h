@@ -0,0 +1,11 @@
+#define TIMER_TICK_MS 100 //タイマーホイールの1tick
+
+extern volatile u_int64_t NowMs;
+extern volatile time_t NowSec;
+
+void ClockUpdate();
+int TimerInit();
+int TimerFdOpen();
+void TimerAdd(TIMER *timer,u_int64_t ms);
+void TimerDel(TIMER *timer);
+int TimerRun();
@@ -0,0 +1,396 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <linux/if.h>
+#include <linux/if_packet.h>
+#include <net/ethernet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include "base.h"
+#include "txQueue.h"
+#include "xsk.h"
+#include "../common/uring.h"
+
+extern int DebugPrintf(char *fmt, ...);
+extern int DebugPerror(char *msg);
+
+// このファイルではデバイスごとの送信キューを扱う
+// 転送するフレームをためておき、pollのwakeupごと（または一杯になったとき）にまとめて送信する
+// TX_RINGが使えればフレームをリングに書いてsend()1回で、使えなければsendmmsg()1回で送る
+
+#define TX_RING_DATA_OFFSET (TPACKET2_HDRLEN - sizeof(struct sockaddr_ll))
+
+// 送信専用のソケットにTPACKET_V2の送信リングを付ける
+static int TxRingInit(TX_QUEUE *q, char *device)
+{
+    struct ifreq ifreq;
+    struct sockaddr_ll sa;
+    struct tpacket_req req;
+    int ver;
+
+    // プロトコル0で作ると受信はしない
+    if ((q->soc = socket(PF_PACKET, SOCK_RAW, 0)) < 0)
+    {
+        DebugPerror("socket");
+        return (-1);
+    }
+    ver = TPACKET_V2;
+    if (setsockopt(q->soc, SOL_PACKET, PACKET_VERSION, &ver, sizeof(ver)) < 0)
+    {
+        DebugPerror("setsockopt:PACKET_VERSION");
+        close(q->soc);
+        return (-1);
+    }
+
+    memset(&req, 0, sizeof(req));
+    req.tp_frame_size = TX_RING_FRAME_SIZE;
+    req.tp_frame_nr = TX_RING_FRAME_NUM;
+    req.tp_block_size = getpagesize() > TX_RING_FRAME_SIZE ? getpagesize() : TX_RING_FRAME_SIZE;
+    req.tp_block_nr = TX_RING_FRAME_NUM / (req.tp_block_size / TX_RING_FRAME_SIZE);
+    if (setsockopt(q->soc, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req)) < 0)
+    {
+        DebugPerror("setsockopt:PACKET_TX_RING");
+        close(q->soc);
+        return (-1);
+    }
+    q->mapSize = (size_t)req.tp_block_size * req.tp_block_nr;
+    if ((q->map = mmap(NULL, q->mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, q->soc, 0)) == MAP_FAILED)
+    {
+        DebugPerror("mmap");
+        q->map = NULL;
+        close(q->soc);
+        return (-1);
+    }
+    q->frameNum = TX_RING_FRAME_NUM;
+
+    memset(&ifreq, 0, sizeof(struct ifreq));
+    strncpy(ifreq.ifr_name, device, sizeof(ifreq.ifr_name) - 1);
+    if (ioctl(q->soc, SIOCGIFINDEX, &ifreq) < 0)
+    {
+        DebugPerror("ioctl");
+        munmap(q->map, q->mapSize);
+        q->map = NULL;
+        close(q->soc);
+        return (-1);
+    }
+    memset(&sa, 0, sizeof(sa));
+    sa.sll_family = PF_PACKET;
+    sa.sll_protocol = 0;
+    sa.sll_ifindex = ifreq.ifr_ifindex;
+    if (bind(q->soc, (struct sockaddr *)&sa, sizeof(sa)) < 0)
+    {
+        DebugPerror("bind");
+        munmap(q->map, q->mapSize);
+        q->map = NULL;
+        close(q->soc);
+        return (-1);
+    }
+    q->ring = 1;
+
+    return (0);
+}
+
+// useRingならTX_RING、使えなければ soc に sendmmsg で送る
+// dirtyを渡すと、送信待ちができたときにその一覧に載せる（TxQueueFlushDirtyでまとめて送る）
+int TxQueueInit(TX_QUEUE *q, char *device, int soc, int useRing, TX_DIRTY *dirty)
+{
+    int i, ignore;
+
+    memset(q, 0, sizeof(TX_QUEUE));
+    q->dirty = dirty;
+    if (useRing)
+    {
+        if (TxRingInit(q, device) == 0)
+        {
+            // 別ソケットで送ったフレームが受信ソケットに戻ってこないようにする（古いカーネルでは失敗してよい）
+            ignore = 1;
+            setsockopt(soc, SOL_PACKET, PACKET_IGNORE_OUTGOING, &ignore, sizeof(ignore));
+            return (0);
+        }
+        DebugPrintf("TxQueueInit:%s:TX_RING not available, use sendmmsg\n", device);
+    }
+
+    q->soc = soc;
+    q->buf = (u_char *)malloc((size_t)TX_BATCH * PKT_BUF_SIZE);
+    q->msg = (struct mmsghdr *)calloc(TX_BATCH, sizeof(struct mmsghdr));
+    q->iov = (struct iovec *)calloc(TX_BATCH, sizeof(struct iovec));
+    if (q->buf == NULL || q->msg == NULL || q->iov == NULL)
+    {
+        DebugPerror("malloc");
+        free(q->buf);
+        free(q->msg);
+        free(q->iov);
+        return (-1);
+    }
+    for (i = 0; i < TX_BATCH; i++)
+    {
+        q->iov[i].iov_base = q->buf + (size_t)i * PKT_BUF_SIZE;
+        q->msg[i].msg_hdr.msg_iov = &q->iov[i];
+        q->msg[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    return (0);
+}
+
+static int TxRingFlush(TX_QUEUE *q)
+{
+    ssize_t n;
+
+    if (q->num == 0)
+    {
+        return (0);
+    }
+    q->calls++;
+    if ((n = send(q->soc, NULL, 0, MSG_DONTWAIT)) < 0)
+    {
+        if (errno == EAGAIN || errno == ENOBUFS)
+        {
+            // 送れなかったフレームはリングに残り、次のflushで送られる
+            q->again++;
+            return (-1);
+        }
+        DebugPerror("send");
+        return (-1);
+    }
+    // send()はリングから送ったバイト数を返す
+    q->sent += q->num;
+    q->bytes += n;
+    q->flushes++;
+    q->num = 0;
+
+    return (0);
+}
+
+static int TxMmsgFlush(TX_QUEUE *q)
+{
+    int n, i;
+
+    if (q->num == 0)
+    {
+        return (0);
+    }
+    while (q->head < q->num)
+    {
+        q->calls++;
+        if ((n = sendmmsg(q->soc, &q->msg[q->head], q->num - q->head, MSG_DONTWAIT)) < 0)
+        {
+            if (errno == EAGAIN || errno == ENOBUFS)
+            {
+                q->again++;
+                return (-1);
+            }
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            // 先頭のフレームが送れないので捨てて続ける
+            DebugPerror("sendmmsg");
+            q->dropped++;
+            q->head++;
+            continue;
+        }
+        for (i = q->head; i < q->head + n; i++)
+        {
+            if (q->msg[i].msg_len != q->iov[i].iov_len)
+            {
+                DebugPrintf("TxQueueFlush:short write %u/%zu\n", q->msg[i].msg_len, q->iov[i].iov_len);
+                q->dropped++;
+                continue;
+            }
+            q->sent++;
+            q->bytes += q->msg[i].msg_len;
+        }
+        q->head += n;
+    }
+    q->flushes++;
+    q->head = q->num = 0;
+
+    return (0);
+}
+
+int TxQueueFlush(TX_QUEUE *q)
+{
+    if (q->xsk != NULL)
+    {
+        if (q->num > 0)
+        {
+            q->calls++;
+            q->flushes++;
+        }
+        q->num = 0;
+        return (XskFlush(q->xsk));
+    }
+    if (q->ring)
+    {
+        return (TxRingFlush(q));
+    }
+    return (TxMmsgFlush(q));
+}
+
+// 送信をio_uringのSQEにする（イベントループのio_uring_enterでまとめて渡され、完了はtag付きで届く）
+void TxQueueUseUring(TX_QUEUE *q, URING *uring, int tag)
+{
+    q->uring = uring;
+    q->tag = tag;
+}
+
+// 送信をAF_XDPソケットのtxリングにする（flushでカーネルに知らせる）
+void TxQueueUseXsk(TX_QUEUE *q, XSK *xsk)
+{
+    q->xsk = xsk;
+}
+
+// io_uringの送信の完了を数える
+void TxQueueUringDone(TX_QUEUE *q, int res)
+{
+    if (res < 0)
+    {
+        q->dropped++;
+        return;
+    }
+    q->sent++;
+    q->bytes += res;
+}
+
+// 一覧に載っている送信キューだけをflushする（デバイスの数によらない）
+// 送り切れなかったキューは一覧に残し、次のflushで送る
+int TxQueueFlushDirty(TX_DIRTY *d)
+{
+    int i, n;
+
+    for (i = n = 0; i < d->num; i++)
+    {
+        TxQueueFlush(d->q[i]);
+        if (d->q[i]->num > 0)
+        {
+            d->q[n++] = d->q[i];
+        }
+        else
+        {
+            d->q[i]->listed = 0;
+        }
+    }
+    d->num = n;
+
+    return (0);
+}
+
+static void TxQueueMark(TX_QUEUE *q)
+{
+    if (q->dirty != NULL && !q->listed)
+    {
+        q->listed = 1;
+        q->dirty->q[q->dirty->num++] = q;
+    }
+}
+
+// フレームをキューに入れる（dataはコピーするので呼び出し側で再利用してよい）
+int TxQueueSend(TX_QUEUE *q, u_char *data, int size)
+{
+    struct tpacket2_hdr *hdr;
+    int i;
+
+    if (size > PKT_BUF_SIZE || size > TX_RING_FRAME_SIZE - (int)TX_RING_DATA_OFFSET)
+    {
+        DebugPrintf("TxQueueSend:too big(%d)\n", size);
+        q->dropped++;
+        return (-1);
+    }
+
+    if (q->xsk != NULL)
+    {
+        if (XskSend(q->xsk, data, size) == -1)
+        {
+            q->dropped++;
+            return (-1);
+        }
+        q->sent++;
+        q->bytes += size;
+        q->num++;
+        TxQueueMark(q);
+        return (0);
+    }
+
+    if (q->uring != NULL)
+    {
+        if (UringSend(q->uring, q->soc, data, size, q->tag) == -1)
+        {
+            q->dropped++;
+            return (-1);
+        }
+        return (0);
+    }
+
+    if (q->ring)
+    {
+        hdr = (struct tpacket2_hdr *)(q->map + (size_t)q->cur * TX_RING_FRAME_SIZE);
+        if (__atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE) & (TP_STATUS_SEND_REQUEST | TP_STATUS_SENDING))
+        {
+            // リングが一杯なので送ってから空きを待たずに確かめる
+            TxRingFlush(q);
+            if (__atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE) & (TP_STATUS_SEND_REQUEST | TP_STATUS_SENDING))
+            {
+                q->dropped++;
+                return (-1);
+            }
+        }
+        if (hdr->tp_status & TP_STATUS_WRONG_FORMAT)
+        {
+            // 前回このフレームに入れたものは送られなかった
+            q->sent--;
+            q->dropped++;
+        }
+        memcpy((u_char *)hdr + TX_RING_DATA_OFFSET, data, size);
+        hdr->tp_len = size;
+        __atomic_store_n(&hdr->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+        q->cur = (q->cur + 1) % q->frameNum;
+        TxQueueMark(q);
+        if (++q->num >= TX_BATCH)
+        {
+            TxRingFlush(q);
+        }
+        return (0);
+    }
+
+    if (q->num == TX_BATCH)
+    {
+        if (TxMmsgFlush(q) == -1)
+        {
+            if (q->head == 0)
+            {
+                q->dropped++;
+                return (-1);
+            }
+            // 送れた分を詰める
+            for (i = q->head; i < q->num; i++)
+            {
+                memcpy(q->iov[i - q->head].iov_base, q->iov[i].iov_base, q->iov[i].iov_len);
+                q->iov[i - q->head].iov_len = q->iov[i].iov_len;
+            }
+            q->num -= q->head;
+            q->head = 0;
+        }
+    }
+    memcpy(q->iov[q->num].iov_base, data, size);
+    q->iov[q->num].iov_len = size;
+    q->num++;
+    TxQueueMark(q);
+
+    return (0);
+}
+
+int TxQueueStat(TX_QUEUE *q, char *name, FILE *fp)
+{
+    fprintf(fp, "tx:%s %s sent=%lu bytes=%lu dropped=%lu eagain=%lu flushes=%lu syscalls=%lu (%.2f frames/syscall)\n",
+            name, q->xsk != NULL ? "xdp" : (q->uring != NULL ? "io_uring" : (q->ring ? "ring" : "sendmmsg")), q->sent, q->bytes, q->dropped, q->again, q->flushes, q->calls,
+            q->calls ? (double)q->sent / q->calls : 0.0);
+
+    return (0);
+}
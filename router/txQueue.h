@@ -0,0 +1,11 @@
+#define TX_RING_FRAME_SIZE 2048
+#define TX_RING_FRAME_NUM 256 //送信リングのフレーム数
+
+int TxQueueInit(TX_QUEUE *q,char *device,int soc,int useRing,TX_DIRTY *dirty);
+int TxQueueSend(TX_QUEUE *q,unsigned char *data,int size);
+int TxQueueFlush(TX_QUEUE *q);
+int TxQueueFlushDirty(TX_DIRTY *d);
+void TxQueueUseUring(TX_QUEUE *q,struct _uring_ *uring,int tag);
+void TxQueueUringDone(TX_QUEUE *q,int res);
+void TxQueueUseXsk(TX_QUEUE *q,XSK *xsk);
+int TxQueueStat(TX_QUEUE *q,char *name,FILE *fp);
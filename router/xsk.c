@@ -0,0 +1,500 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#include <pthread.h>
+#include "base.h"
+#include "xsk.h"
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+extern int DebugPrintf(char *fmt, ...);
+extern int DebugPerror(char *msg);
+
+// このファイルではAF_XDPでの受信・送信を扱う
+// デバイスに小さなXDPプログラムを付け、宛先MACが自分のフレームだけをXSKMAPでAF_XDPソケットへ渡す（それ以外はカーネルへ）
+// 受信したフレームはUMEMの中をそのままAnalyzePacketに渡し、処理が終わったらfillリングへ返す
+// 送信はUMEMの空きフレームにコピーしてtxリングに書き、wakeupの終わりにまとめてカーネルに知らせる
+// ネイティブのXDPとゼロコピーが使えなければ、汎用XDP（SKBモード）とコピーモードにする（vethではコピーモード）
+
+// デバイスごとのXDPプログラム
+struct
+{
+    int map; //XSKMAP（キューの番号→AF_XDPソケット）
+    int prog;
+    int link; //閉じるとプログラムが外れる
+} Xdp[DEVICE_MAX];
+
+static int Bpf(int cmd, union bpf_attr *attr)
+{
+    return (syscall(__NR_bpf, cmd, attr, sizeof(union bpf_attr)));
+}
+
+static struct bpf_insn XdpInsn(u_int8_t code, u_int8_t dst, u_int8_t src, int16_t off, int32_t imm)
+{
+    struct bpf_insn insn;
+
+    insn.code = code;
+    insn.dst_reg = dst;
+    insn.src_reg = src;
+    insn.off = off;
+    insn.imm = imm;
+
+    return (insn);
+}
+
+// 宛先MACが hwaddr のフレームを受信キューの番号でXSKMAPへリダイレクトし、それ以外はXDP_PASSにする
+// （libbpfを使わないので命令を直接並べる。ジャンプ先は次の命令からの相対位置）
+static int XdpLoad(int map, u_char hwaddr[6])
+{
+    struct bpf_insn insn[18];
+    union bpf_attr attr;
+    u_int32_t lo;
+    u_int16_t hi;
+    char log[4096];
+    int n, fd;
+
+    memcpy(&lo, hwaddr, 4);
+    memcpy(&hi, hwaddr + 4, 2);
+
+    n = 0;
+    insn[n++] = XdpInsn(BPF_ALU64 | BPF_MOV | BPF_X, 6, 1, 0, 0);                                   // r6 = ctx
+    insn[n++] = XdpInsn(BPF_LDX | BPF_MEM | BPF_W, 2, 1, offsetof(struct xdp_md, data), 0);         // r2 = data
+    insn[n++] = XdpInsn(BPF_LDX | BPF_MEM | BPF_W, 3, 1, offsetof(struct xdp_md, data_end), 0);     // r3 = data_end
+    insn[n++] = XdpInsn(BPF_ALU64 | BPF_MOV | BPF_X, 4, 2, 0, 0);                                   // r4 = data + 6
+    insn[n++] = XdpInsn(BPF_ALU64 | BPF_ADD | BPF_K, 4, 0, 0, 6);
+    insn[n++] = XdpInsn(BPF_JMP | BPF_JGT | BPF_X, 4, 3, 10, 0);                                    // 短ければpass
+    insn[n++] = XdpInsn(BPF_LDX | BPF_MEM | BPF_W, 4, 2, 0, 0);                                     // 宛先MACの前4バイト
+    insn[n++] = XdpInsn(BPF_JMP32 | BPF_JNE | BPF_K, 4, 0, 8, (int32_t)lo);
+    insn[n++] = XdpInsn(BPF_LDX | BPF_MEM | BPF_H, 4, 2, 4, 0);                                     // 後ろ2バイト
+    insn[n++] = XdpInsn(BPF_JMP32 | BPF_JNE | BPF_K, 4, 0, 6, hi);
+    insn[n++] = XdpInsn(BPF_LDX | BPF_MEM | BPF_W, 2, 6, offsetof(struct xdp_md, rx_queue_index), 0); // r2 = 受信キュー
+    insn[n++] = XdpInsn(BPF_LD | BPF_DW | BPF_IMM, 1, BPF_PSEUDO_MAP_FD, 0, map);                   // r1 = XSKMAP
+    insn[n++] = XdpInsn(0, 0, 0, 0, 0);
+    insn[n++] = XdpInsn(BPF_ALU64 | BPF_MOV | BPF_K, 3, 0, 0, XDP_PASS);                            // ソケットがなければpass
+    insn[n++] = XdpInsn(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map);
+    insn[n++] = XdpInsn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+    insn[n++] = XdpInsn(BPF_ALU64 | BPF_MOV | BPF_K, 0, 0, 0, XDP_PASS);                            // pass:
+    insn[n++] = XdpInsn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.expected_attach_type = BPF_XDP;
+    attr.insns = (u_int64_t)(unsigned long)insn;
+    attr.insn_cnt = n;
+    attr.license = (u_int64_t)(unsigned long)"GPL";
+    attr.log_buf = (u_int64_t)(unsigned long)log;
+    attr.log_size = sizeof(log);
+    attr.log_level = 1;
+    log[0] = '\0';
+    if ((fd = Bpf(BPF_PROG_LOAD, &attr)) < 0)
+    {
+        DebugPerror("bpf:BPF_PROG_LOAD");
+        DebugPrintf("%s\n", log);
+        return (-1);
+    }
+
+    return (fd);
+}
+
+// デバイスにXDPプログラムを付ける（ネイティブを試し、だめなら汎用XDP）
+int XdpAttach(int deviceNo, char *device, u_char hwaddr[6])
+{
+    union bpf_attr attr;
+    int ifindex;
+
+    Xdp[deviceNo].map = Xdp[deviceNo].prog = Xdp[deviceNo].link = -1;
+    if ((ifindex = if_nametoindex(device)) == 0)
+    {
+        DebugPerror("if_nametoindex");
+        return (-1);
+    }
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = BPF_MAP_TYPE_XSKMAP;
+    attr.key_size = sizeof(u_int32_t);
+    attr.value_size = sizeof(u_int32_t);
+    attr.max_entries = XSK_QUEUE_MAX;
+    if ((Xdp[deviceNo].map = Bpf(BPF_MAP_CREATE, &attr)) < 0)
+    {
+        DebugPerror("bpf:BPF_MAP_CREATE");
+        return (-1);
+    }
+    if ((Xdp[deviceNo].prog = XdpLoad(Xdp[deviceNo].map, hwaddr)) == -1)
+    {
+        XdpDetach(deviceNo);
+        return (-1);
+    }
+
+    memset(&attr, 0, sizeof(attr));
+    attr.link_create.prog_fd = Xdp[deviceNo].prog;
+    attr.link_create.target_ifindex = ifindex;
+    attr.link_create.attach_type = BPF_XDP;
+    attr.link_create.flags = XDP_FLAGS_DRV_MODE;
+    if ((Xdp[deviceNo].link = Bpf(BPF_LINK_CREATE, &attr)) < 0)
+    {
+        attr.link_create.flags = XDP_FLAGS_SKB_MODE;
+        if ((Xdp[deviceNo].link = Bpf(BPF_LINK_CREATE, &attr)) < 0)
+        {
+            DebugPerror("bpf:BPF_LINK_CREATE");
+            XdpDetach(deviceNo);
+            return (-1);
+        }
+        DebugPrintf("XdpAttach:%s:generic XDP\n", device);
+    }
+    else
+    {
+        DebugPrintf("XdpAttach:%s:native XDP\n", device);
+    }
+
+    return (0);
+}
+
+void XdpDetach(int deviceNo)
+{
+    if (Xdp[deviceNo].link >= 0)
+    {
+        close(Xdp[deviceNo].link);
+    }
+    if (Xdp[deviceNo].prog >= 0)
+    {
+        close(Xdp[deviceNo].prog);
+    }
+    if (Xdp[deviceNo].map >= 0)
+    {
+        close(Xdp[deviceNo].map);
+    }
+    Xdp[deviceNo].map = Xdp[deviceNo].prog = Xdp[deviceNo].link = -1;
+}
+
+static int XskRingMap(XSK *xsk, XSK_RING *ring, struct xdp_ring_offset *off, size_t descSize, off_t pgoff)
+{
+    ring->size = XSK_RING_SIZE;
+    ring->mask = XSK_RING_SIZE - 1;
+    ring->mapSize = off->desc + XSK_RING_SIZE * descSize;
+    if ((ring->map = mmap(NULL, ring->mapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, xsk->fd, pgoff)) == MAP_FAILED)
+    {
+        DebugPerror("mmap:xsk ring");
+        ring->map = NULL;
+        return (-1);
+    }
+    ring->producer = (u_int32_t *)((char *)ring->map + off->producer);
+    ring->consumer = (u_int32_t *)((char *)ring->map + off->consumer);
+    ring->flags = (u_int32_t *)((char *)ring->map + off->flags);
+    ring->desc = (char *)ring->map + off->desc;
+
+    return (0);
+}
+
+void XskClose(XSK *xsk)
+{
+    XSK_RING *rings[4];
+    int i;
+
+    if (xsk->umem == NULL)
+    {
+        return;
+    }
+    rings[0] = &xsk->fill;
+    rings[1] = &xsk->comp;
+    rings[2] = &xsk->rx;
+    rings[3] = &xsk->tx;
+    for (i = 0; i < 4; i++)
+    {
+        if (rings[i]->map != NULL)
+        {
+            munmap(rings[i]->map, rings[i]->mapSize);
+        }
+    }
+    if (xsk->fd >= 0)
+    {
+        close(xsk->fd);
+    }
+    munmap(xsk->umem, xsk->umemSize);
+    free(xsk->txFrame);
+    memset(xsk, 0, sizeof(XSK));
+}
+
+// deviceの受信キューqueueにAF_XDPソケットを作り、XSKMAPに登録する（XdpAttachの後に呼ぶ）
+int XskOpen(XSK *xsk, int deviceNo, char *device, int queue)
+{
+    struct xdp_umem_reg reg;
+    struct xdp_mmap_offsets off;
+    struct sockaddr_xdp sxdp;
+    union bpf_attr attr;
+    socklen_t len;
+    u_int64_t *fill;
+    u_int32_t key, val;
+    int i, size;
+
+    memset(xsk, 0, sizeof(XSK));
+    xsk->fd = -1;
+    xsk->umemSize = (size_t)XSK_FRAME_NUM * XSK_FRAME_SIZE;
+    if ((xsk->umem = mmap(NULL, xsk->umemSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+    {
+        DebugPerror("mmap:umem");
+        xsk->umem = NULL;
+        return (-1);
+    }
+    if ((xsk->fd = socket(AF_XDP, SOCK_RAW, 0)) < 0)
+    {
+        DebugPerror("socket:AF_XDP");
+        XskClose(xsk);
+        return (-1);
+    }
+
+    memset(&reg, 0, sizeof(reg));
+    reg.addr = (u_int64_t)(unsigned long)xsk->umem;
+    reg.len = xsk->umemSize;
+    reg.chunk_size = XSK_FRAME_SIZE;
+    reg.headroom = 0;
+    size = XSK_RING_SIZE;
+    if (setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) < 0 ||
+        setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_FILL_RING, &size, sizeof(size)) < 0 ||
+        setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &size, sizeof(size)) < 0 ||
+        setsockopt(xsk->fd, SOL_XDP, XDP_RX_RING, &size, sizeof(size)) < 0 ||
+        setsockopt(xsk->fd, SOL_XDP, XDP_TX_RING, &size, sizeof(size)) < 0)
+    {
+        DebugPerror("setsockopt:SOL_XDP");
+        XskClose(xsk);
+        return (-1);
+    }
+    len = sizeof(off);
+    if (getsockopt(xsk->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &len) < 0)
+    {
+        DebugPerror("getsockopt:XDP_MMAP_OFFSETS");
+        XskClose(xsk);
+        return (-1);
+    }
+    if (XskRingMap(xsk, &xsk->fill, &off.fr, sizeof(u_int64_t), XDP_UMEM_PGOFF_FILL_RING) == -1 ||
+        XskRingMap(xsk, &xsk->comp, &off.cr, sizeof(u_int64_t), XDP_UMEM_PGOFF_COMPLETION_RING) == -1 ||
+        XskRingMap(xsk, &xsk->rx, &off.rx, sizeof(struct xdp_desc), XDP_PGOFF_RX_RING) == -1 ||
+        XskRingMap(xsk, &xsk->tx, &off.tx, sizeof(struct xdp_desc), XDP_PGOFF_TX_RING) == -1)
+    {
+        XskClose(xsk);
+        return (-1);
+    }
+
+    // 前半のフレームを受信用にfillリングへ、後半を送信用の空きにする
+    fill = (u_int64_t *)xsk->fill.desc;
+    for (i = 0; i < XSK_FRAME_NUM / 2 && i < XSK_RING_SIZE; i++)
+    {
+        fill[i] = (u_int64_t)i * XSK_FRAME_SIZE;
+    }
+    xsk->fill.cached = i;
+    __atomic_store_n(xsk->fill.producer, xsk->fill.cached, __ATOMIC_RELEASE);
+    if ((xsk->txFrame = (u_int64_t *)malloc(XSK_FRAME_NUM / 2 * sizeof(u_int64_t))) == NULL)
+    {
+        DebugPerror("malloc");
+        XskClose(xsk);
+        return (-1);
+    }
+    for (i = 0; i < XSK_FRAME_NUM / 2; i++)
+    {
+        xsk->txFrame[i] = (u_int64_t)(XSK_FRAME_NUM / 2 + i) * XSK_FRAME_SIZE;
+    }
+    xsk->txFrameNum = XSK_FRAME_NUM / 2;
+
+    memset(&sxdp, 0, sizeof(sxdp));
+    sxdp.sxdp_family = AF_XDP;
+    sxdp.sxdp_ifindex = if_nametoindex(device);
+    sxdp.sxdp_queue_id = queue;
+    sxdp.sxdp_flags = XDP_USE_NEED_WAKEUP | XDP_ZEROCOPY;
+    if (bind(xsk->fd, (struct sockaddr *)&sxdp, sizeof(sxdp)) == 0)
+    {
+        xsk->zeroCopy = 1;
+    }
+    else
+    {
+        sxdp.sxdp_flags = XDP_USE_NEED_WAKEUP | XDP_COPY;
+        if (bind(xsk->fd, (struct sockaddr *)&sxdp, sizeof(sxdp)) < 0)
+        {
+            DebugPerror("bind:AF_XDP");
+            XskClose(xsk);
+            return (-1);
+        }
+    }
+    DebugPrintf("XskOpen:%s queue %d:%s\n", device, queue, xsk->zeroCopy ? "zero-copy" : "copy");
+
+    key = queue;
+    val = xsk->fd;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = Xdp[deviceNo].map;
+    attr.key = (u_int64_t)(unsigned long)&key;
+    attr.value = (u_int64_t)(unsigned long)&val;
+    if (Bpf(BPF_MAP_UPDATE_ELEM, &attr) < 0)
+    {
+        DebugPerror("bpf:BPF_MAP_UPDATE_ELEM");
+        XskClose(xsk);
+        return (-1);
+    }
+
+    return (0);
+}
+
+// 前回取り出したフレームのrxリングの場所を返し、フレームはfillリングに戻す
+static void XskRxRelease(XSK *xsk)
+{
+    struct xdp_desc *desc;
+    u_int64_t *fill;
+    u_int32_t i;
+
+    if (xsk->rxTaken == 0)
+    {
+        return;
+    }
+    desc = (struct xdp_desc *)xsk->rx.desc;
+    fill = (u_int64_t *)xsk->fill.desc;
+    // 受信用のフレームの数はfillリングの大きさ以下なので、あふれることはない
+    for (i = 0; i < xsk->rxTaken; i++)
+    {
+        fill[(xsk->fill.cached + i) & xsk->fill.mask] = desc[(xsk->rx.cached + i) & xsk->rx.mask].addr & ~(u_int64_t)(XSK_FRAME_SIZE - 1);
+    }
+    xsk->fill.cached += xsk->rxTaken;
+    xsk->rx.cached += xsk->rxTaken;
+    __atomic_store_n(xsk->fill.producer, xsk->fill.cached, __ATOMIC_RELEASE);
+    __atomic_store_n(xsk->rx.consumer, xsk->rx.cached, __ATOMIC_RELEASE);
+    xsk->rxTaken = 0;
+
+    if (__atomic_load_n(xsk->fill.flags, __ATOMIC_ACQUIRE) & XDP_RING_NEED_WAKEUP)
+    {
+        xsk->kicks++;
+        recvfrom(xsk->fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+    }
+}
+
+// 次の受信フレームをUMEMの中を指したまま返す（なければ0）
+// dataは次にXskRxNextを呼ぶまで有効
+int XskRxNext(XSK *xsk, u_char **data)
+{
+    struct xdp_desc *desc;
+    u_int32_t avail;
+
+    if (xsk->rxLeft == 0)
+    {
+        XskRxRelease(xsk);
+        avail = __atomic_load_n(xsk->rx.producer, __ATOMIC_ACQUIRE) - xsk->rx.cached;
+        if (avail == 0)
+        {
+            return (0);
+        }
+        if (avail > XSK_BATCH)
+        {
+            avail = XSK_BATCH;
+        }
+        xsk->rxTaken = xsk->rxLeft = avail;
+    }
+    desc = &((struct xdp_desc *)xsk->rx.desc)[(xsk->rx.cached + xsk->rxTaken - xsk->rxLeft) & xsk->rx.mask];
+    xsk->rxLeft--;
+    *data = xsk->umem + desc->addr;
+
+    return (desc->len);
+}
+
+// 送信が終わったフレームを空きに戻す
+static void XskTxReap(XSK *xsk)
+{
+    u_int64_t *comp;
+    u_int32_t avail, i;
+
+    avail = __atomic_load_n(xsk->comp.producer, __ATOMIC_ACQUIRE) - xsk->comp.cached;
+    comp = (u_int64_t *)xsk->comp.desc;
+    for (i = 0; i < avail; i++)
+    {
+        xsk->txFrame[xsk->txFrameNum++] = comp[(xsk->comp.cached + i) & xsk->comp.mask];
+    }
+    xsk->comp.cached += avail;
+    __atomic_store_n(xsk->comp.consumer, xsk->comp.cached, __ATOMIC_RELEASE);
+}
+
+// フレームをUMEMの空きにコピーしてtxリングに書く（カーネルに知らせるのはXskFlush）
+int XskSend(XSK *xsk, u_char *data, int size)
+{
+    struct xdp_desc *desc;
+    u_int64_t addr;
+
+    if (size > XSK_FRAME_SIZE)
+    {
+        return (-1);
+    }
+    if (xsk->txFrameNum == 0)
+    {
+        XskFlush(xsk);
+        if (xsk->txFrameNum == 0)
+        {
+            return (-1);
+        }
+    }
+    if (xsk->tx.cached - __atomic_load_n(xsk->tx.consumer, __ATOMIC_ACQUIRE) >= xsk->tx.size)
+    {
+        XskFlush(xsk);
+        if (xsk->tx.cached - __atomic_load_n(xsk->tx.consumer, __ATOMIC_ACQUIRE) >= xsk->tx.size)
+        {
+            return (-1);
+        }
+    }
+    addr = xsk->txFrame[--xsk->txFrameNum];
+    memcpy(xsk->umem + addr, data, size);
+    desc = &((struct xdp_desc *)xsk->tx.desc)[xsk->tx.cached & xsk->tx.mask];
+    desc->addr = addr;
+    desc->len = size;
+    desc->options = 0;
+    xsk->tx.cached++;
+    xsk->txPending++;
+
+    return (0);
+}
+
+// txリングに書いたフレームをカーネルに知らせ、終わったフレームを回収する
+int XskFlush(XSK *xsk)
+{
+    if (xsk->txPending > 0)
+    {
+        __atomic_store_n(xsk->tx.producer, xsk->tx.cached, __ATOMIC_RELEASE);
+        xsk->txPending = 0;
+        // コピーモードでは送信はsendtoの中で行われるので、毎回起こす
+        if (!xsk->zeroCopy || (__atomic_load_n(xsk->tx.flags, __ATOMIC_ACQUIRE) & XDP_RING_NEED_WAKEUP))
+        {
+            xsk->kicks++;
+            if (sendto(xsk->fd, NULL, 0, MSG_DONTWAIT, NULL, 0) < 0 && errno != EAGAIN && errno != EBUSY && errno != ENOBUFS)
+            {
+                DebugPerror("sendto:AF_XDP");
+            }
+        }
+    }
+    XskTxReap(xsk);
+
+    return (0);
+}
+
+int XskStat(XSK *xsk, char *name, FILE *fp)
+{
+    struct xdp_statistics st;
+    socklen_t len;
+
+    len = sizeof(st);
+    memset(&st, 0, sizeof(st));
+    getsockopt(xsk->fd, SOL_XDP, XDP_STATISTICS, &st, &len);
+    fprintf(fp, "xsk:%s %s rx_dropped=%llu rx_ring_full=%llu fill_empty=%llu tx_invalid=%llu kicks=%lu\n",
+            name, xsk->zeroCopy ? "zero-copy" : "copy", (unsigned long long)st.rx_dropped, (unsigned long long)st.rx_ring_full,
+            (unsigned long long)st.rx_fill_ring_empty_descs, (unsigned long long)st.tx_invalid_descs, xsk->kicks);
+
+    return (0);
+}
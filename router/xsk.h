@@ -0,0 +1,14 @@
+#define XSK_FRAME_SIZE 2048 //UMEMのフレーム1つの大きさ（2のべき乗）
+#define XSK_FRAME_NUM 4096 //UMEMのフレーム数（半分を受信、半分を送信に使う）
+#define XSK_RING_SIZE 2048 //各リングのエントリ数
+#define XSK_BATCH 64 //rxリングから一度に取り出す数
+#define XSK_QUEUE_MAX 64 //XSKMAPに登録できるキューの数
+
+int XdpAttach(int deviceNo,char *device,unsigned char hwaddr[6]);
+void XdpDetach(int deviceNo);
+int XskOpen(XSK *xsk,int deviceNo,char *device,int queue);
+void XskClose(XSK *xsk);
+int XskRxNext(XSK *xsk,unsigned char **data);
+int XskSend(XSK *xsk,unsigned char *data,int size);
+int XskFlush(XSK *xsk);
+int XskStat(XSK *xsk,char *name,FILE *fp);